@@ -0,0 +1,152 @@
+//===- brig_allocator.h ---------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_ALLOCATOR_H
+#define BRIG_ALLOCATOR_H
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+// The allocator behind global memory, group segments and the stacks that
+// hold private segments. Freed memory is recycled rather than returned to
+// the system, so a workload that allocates the same buffers every
+// iteration stops mapping and faulting pages after the first.
+//
+// Small blocks come from 2 MiB slabs, one power of two size class per
+// slab, and go back on their class's free list. Large blocks are mapped
+// separately, rounded to pages, or to huge pages from HugePageSize up. When
+// they are freed they wait in a cache for an allocation of about the same
+// size. Huge-page-sized regions are mapped with MAP_HUGETLB when the system
+// has huge pages reserved, and are otherwise advised for transparent huge
+// pages.
+//
+// Setting the SIMPREFAULT environment variable makes fresh mappings fault
+// in all of their pages up front.
+class BrigAllocator {
+
+ public:
+
+  enum {
+    MinSmallSize = 16,
+    MaxSmallSize = 64 * 1024,
+    SlabSize = 2 * 1024 * 1024,
+    HugePageSize = 2 * 1024 * 1024,
+    // Freed large regions beyond this many bytes are unmapped.
+    MaxCachedBytes = 512 * 1024 * 1024
+  };
+
+  // Where the pages of large blocks go on a NUMA host.
+  enum Placement {
+    // On the node of the thread that first touches each page, so buffers
+    // that kernels initialize end up on their workers' nodes.
+    PlaceFirstTouch,
+    PlaceLocal,        // on one node, while it has free memory
+    PlaceInterleaved,  // page by page across every node
+    // In consecutive parts, one per node in node order, each in proportion
+    // to the node's usable processors, which is how BrigEngine splits the
+    // work-groups of a launch over the nodes.
+    PlacePartitioned
+  };
+
+  struct Stats {
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t recycled;      // allocations served from freed memory
+    uint64_t bytesInUse;    // after rounding to the size class or page
+    uint64_t bytesMapped;   // slabs plus live and cached large regions
+    uint64_t bytesCached;   // freed large regions kept for reuse
+    uint64_t hugeTLBBytes;  // part of bytesMapped backed by MAP_HUGETLB
+  };
+
+  // The process-wide allocator.
+  static BrigAllocator &get();
+
+  // Returns NULL if size is zero or the system is out of memory. Alignments
+  // up to the size class, or the page size for large blocks, are free. Pass
+  // hugePages = false for memory that is mostly never touched, like stacks,
+  // to map it with neither huge pages nor prefaulting.
+  void *allocate(size_t size, size_t align = MinSmallSize,
+                 bool hugePages = true);
+  void free(void *ptr);
+
+  // The usable size of a block from allocate.
+  size_t getSize(void *ptr);
+
+  Stats getStats();
+
+  // Places the pages of a block, moving those already touched. Small
+  // blocks share their pages, so they are left alone. Returns false for
+  // small blocks, unknown nodes, and when the system cannot place pages.
+  bool place(void *ptr, Placement placement, unsigned node = 0);
+
+  // Places a block like PlacePartitioned, but over the nodes of these
+  // processors, for an engine that only runs on them.
+  bool partition(void *ptr, const std::vector<unsigned> &cpus);
+
+  // The placement of new large blocks, except those allocated without
+  // huge pages. The SIMNUMA environment variable sets it to interleaved
+  // with "interleave", to partitioned with "partition", or to local on node
+  // N with "N". The default is first touch.
+  void setDefaultPlacement(Placement placement, unsigned node = 0);
+
+  void setPrefault(bool prefault);
+
+ private:
+
+  BrigAllocator();
+
+  // Do not define
+  BrigAllocator(const BrigAllocator &) /* = delete */;
+  BrigAllocator &operator=(const BrigAllocator &) /* = delete */;
+
+  enum { SmallClasses = 13 };
+
+  struct Region {
+    char *base;      // what was mapped
+    size_t length;
+    bool hugePages;  // as requested
+    bool hugeTLB;    // as mapped
+    bool placed;     // has a placement other than first touch
+  };
+
+  struct SizeClass {
+    void *freeList;
+    char *bump;      // the unused tail of the newest slab
+    char *end;
+  };
+
+  void *allocateSmall(unsigned sizeClass);
+  void *allocateLarge(size_t size, size_t align, bool hugePages);
+  bool mapRegion(size_t length, size_t align, bool hugePages, Region &region);
+  void unmapRegion(const Region &region);
+
+  pthread_mutex_t lock_;
+  bool prefault_;
+  Placement placement_;
+  unsigned placementNode_;
+  SizeClass classes_[SmallClasses];
+  // Large blocks in use, by address, and freed ones, by length.
+  std::map<void *, Region> large_;
+  std::multimap<size_t, Region> cache_;
+  Stats stats_;
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_ALLOCATOR_H
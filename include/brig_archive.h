@@ -0,0 +1,120 @@
+//===- brig_archive.h -----------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_ARCHIVE_H
+#define BRIG_ARCHIVE_H
+
+#include "llvm/ADT/StringRef.h"
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+class BrigReader;
+
+// A BRIG archive packs many BRIG object files into one file, together with
+// an index from kernel names to the members defining them. All offsets are
+// relative to the start of the archive. The layout is:
+//
+//   BrigArchiveHeader
+//   BrigArchiveMember[memberCount]
+//   BrigArchiveKernel[kernelCount], sorted by kernel name
+//   Name table of NUL terminated strings
+//   Member contents, each aligned to BrigArchiveHeader::Alignment
+struct BrigArchiveHeader {
+  enum { Version = 1, Alignment = 16 };
+  char magic[8];
+  uint32_t version;
+  uint32_t memberCount;
+  uint32_t kernelCount;
+  uint32_t namesOffset;
+  uint32_t namesSize;
+  uint32_t reserved;
+};
+
+struct BrigArchiveMember {
+  uint64_t offset;
+  uint64_t size;
+  uint32_t name;
+  uint32_t reserved;
+};
+
+struct BrigArchiveKernel {
+  uint32_t name;
+  uint32_t member;
+};
+
+extern const char BrigArchiveMagic[8];
+
+class BrigArchive {
+
+ public:
+
+  ~BrigArchive();
+
+  // Maps the archive at filename into memory. Only the header and the
+  // bounds of the tables are checked, so opening takes constant time.
+  static BrigArchive *open(const char *filename);
+  // Views an archive already in memory. The buffer must outlive the archive.
+  static BrigArchive *open(const char *buffer, size_t size);
+
+  static bool isArchive(const char *buffer, size_t size);
+
+  unsigned getNumMembers() const { return header_->memberCount; }
+  unsigned getNumKernels() const { return header_->kernelCount; }
+
+  const char *getMemberName(unsigned member) const;
+  const char *getKernelName(unsigned kernel) const;
+  unsigned getKernelMember(unsigned kernel) const;
+
+  // Returns the contents of a member, or an empty reference if the member is
+  // out of bounds.
+  llvm::StringRef getMember(unsigned member) const;
+
+  // Returns the index of the member defining the named kernel, or -1. The
+  // leading '&' of the kernel name is optional.
+  int findKernel(const char *name) const;
+
+  // Creates a reader viewing the member in place. The archive must outlive
+  // the reader.
+  BrigReader *createBrigReader(unsigned member) const;
+  BrigReader *createBrigKernelReader(const char *kernelName) const;
+
+ private:
+
+  BrigArchive(const char *buffer, size_t size, bool mapped) :
+    buffer_(buffer), size_(size), mapped_(mapped),
+    header_(reinterpret_cast<const BrigArchiveHeader *>(buffer)),
+    members_(reinterpret_cast<const BrigArchiveMember *>(header_ + 1)),
+    kernels_(reinterpret_cast<const BrigArchiveKernel *>(
+               members_ + header_->memberCount)),
+    names_(buffer + header_->namesOffset) {}
+
+  static bool isValid(const char *buffer, size_t size);
+  const char *getName(uint32_t offset) const;
+
+  // Do not define
+  BrigArchive(const BrigArchive &) /* = delete */;
+  BrigArchive &operator=(const BrigArchive &) /* = delete */;
+
+  const char *buffer_;
+  const size_t size_;
+  const bool mapped_;
+  const BrigArchiveHeader *header_;
+  const BrigArchiveMember *members_;
+  const BrigArchiveKernel *kernels_;
+  const char *names_;
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_ARCHIVE_H
@@ -0,0 +1,67 @@
+//===- brig_barrier.h -----------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_BARRIER_H
+#define BRIG_BARRIER_H
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+// A centralized sense-reversing barrier for the work-items of one
+// work-group. The last thread to arrive resets the count and flips the
+// generation, which is the sense the others wait on. Waiters spin on the
+// generation with pause for a bounded number of iterations, then sleep on
+// it with a futex. The barrier can be reused for any number of generations
+// without reinitialization. Each barrier fills a 64-byte cache line, so an
+// array of them allocated on a cache line boundary keeps concurrent
+// work-groups from contending for the same line.
+class WorkGroupBarrier {
+
+ public:
+
+  // Spinning only pays off when every thread of the group has a processor
+  // to itself. Pass spins = 0 when the threads are oversubscribed.
+  enum { DefaultSpins = 4096 };
+
+  WorkGroupBarrier() { init(1, 0); }
+
+  void init(uint32_t size, uint32_t spins);
+
+  void wait();
+
+  // Leaves the barrier for good: arrives at the current generation without
+  // waiting, and the generations after it no longer count this thread.
+  void drop();
+
+ private:
+
+  bool arrive(uint32_t generation);
+
+  // Do not define
+  WorkGroupBarrier(const WorkGroupBarrier &) /* = delete */;
+  WorkGroupBarrier &operator=(const WorkGroupBarrier &) /* = delete */;
+
+  uint32_t count_;
+  uint32_t generation_;
+  uint32_t sleepers_;
+  uint32_t size_;
+  uint32_t spins_;
+  // Threads that dropped out in the current generation. The last arrival
+  // takes them off the size.
+  uint32_t dropped_;
+  char padding_[64 - 6 * sizeof(uint32_t)];
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_BARRIER_H
@@ -36,6 +36,8 @@ class BrigControlBlock {
 
   inst_iterator begin() const {
     uint32_t ccode = getCCode();
+    if (S_.index)
+      return inst_iterator(S_.code + ccode, S_.code, &S_.index->instOffsets);
     return inst_iterator(S_.code + ccode);
   }
 
@@ -51,6 +53,7 @@ class BrigControlBlock {
 
   friend BrigControlBlock cb_begin(const BrigFunction &F);
   friend BrigControlBlock cb_end(const BrigFunction &F);
+  friend class BrigFunction;
 
   private:
   BrigControlBlock(const BrigSections &S, const dir_iterator it) :
@@ -14,6 +14,8 @@
 
 #include "llvm/ADT/ArrayRef.h"
 
+#include <pthread.h>
+
 namespace llvm {
 class Module;
 class Function;
@@ -23,21 +25,100 @@ class ExecutionEngine;
 namespace hsa {
 namespace brig {
 
+class BrigScheduler;
+
 class BrigEngine {
 
  public:
+  // How the native math instructions ncos, nsin, nlog2, nexp2, nrsqrt and
+  // nrcp are implemented. ExactNativeMath uses libm, and is kept for
+  // validation; FastNativeMath uses the runtime's fast kernels, and only
+  // applies to the JIT. SIMFASTMATH=1 selects FastNativeMath and
+  // SIMFASTMATH=0 ExactNativeMath for every engine.
+  enum NativeMath { ExactNativeMath, FastNativeMath };
+
   BrigEngine(BrigProgram &BP,
              bool forceInterpreter = false,
-             char optLevel = ' ');
+             char optLevel = ' ',
+             NativeMath nativeMath = ExactNativeMath);
 
   BrigEngine(llvm::Module *Mod,
              bool forceInterpreter = false,
-             char optLevel = ' ');
+             char optLevel = ' ',
+             NativeMath nativeMath = ExactNativeMath);
+
+  // Work-items are grouped into wavefronts of this many lanes, which must
+  // be a power of two no larger than 64. The default is 1, or the value of
+  // the SIMWAVESIZE environment variable. Returns false and keeps the old
+  // size if the size is invalid.
+  bool setWavefrontSize(uint32_t size);
+  uint32_t getWavefrontSize() const { return wavefrontSize_; }
+
+  // Runs the work-items on these processors, one pthread per processor
+  // where the work-groups allow. Consecutive work-groups go to consecutive
+  // processors, so each node runs its share of the NDRange in one piece.
+  // When the processors span several nodes, each pthread is pinned to
+  // those of its node; SIMPIN pins it to one processor instead, and
+  // SIMPIN=0 leaves it unpinned. The default is every processor the
+  // process may use, or SIMTHREADS unpinned pthreads. Ignored if empty.
+  void setCpus(const std::vector<unsigned> &cpus);
+  const std::vector<unsigned> &getCpus() const { return cpus_; }
+
+  // Runs each work-group only once the scheduler has given it processors,
+  // so that launches from other engines on the same processors interleave
+  // with this one's by weight. Without a scheduler, the default, a launch
+  // has the processors to itself.
+  void setScheduler(BrigScheduler *scheduler, uint32_t weight = 1);
 
-  void launch(llvm::Function *EntryFn,
+  // The group segment of a work-group holds the kernel's group variables
+  // followed by dynamicGroupSize bytes, and may not exceed this size.
+  enum { MaxGroupMemorySize = 64 * 1024 };
+
+  // Each argument is copied from where args points, which must hold as
+  // many bytes as the parameter takes. Returns false without running the
+  // kernel if its group segment is too large, or if the launch was
+  // cancelled.
+  bool launch(llvm::Function *EntryFn,
               llvm::ArrayRef<void *> args,
               uint32_t blockNum = 1,
-              uint32_t threadNum = 1);
+              uint32_t threadNum = 1,
+              size_t dynamicGroupSize = 0);
+
+  // One kernel of a batch. A kernel with a barrier starts only once every
+  // earlier kernel of the batch is done. Without one, a pthread moves on
+  // to it as soon as it has finished its own part of the kernel before.
+  struct Launch {
+    llvm::Function *EntryFn;
+    llvm::ArrayRef<void *> args;
+    uint32_t blockNum;
+    uint32_t threadNum;
+    size_t dynamicGroupSize;
+    bool barrier;
+
+    Launch(llvm::Function *EntryFn, llvm::ArrayRef<void *> args,
+           uint32_t blockNum = 1, uint32_t threadNum = 1,
+           size_t dynamicGroupSize = 0, bool barrier = true) :
+      EntryFn(EntryFn), args(args), blockNum(blockNum),
+      threadNum(threadNum), dynamicGroupSize(dynamicGroupSize),
+      barrier(barrier) {}
+  };
+
+  // Runs the kernels of a batch in order on one set of pthreads, created
+  // once for the whole batch. Returns false without running any kernel if
+  // one of their group segments is too large, and false once the batch has
+  // stopped if it was cancelled.
+  bool launch(llvm::ArrayRef<Launch> batch);
+
+  // Stops the launches running on the engine, from any thread. A
+  // work-item stops before its next work-group, or at its next yield point
+  // if the kernel was translated under SIMYIELD, so only the latter stops
+  // a kernel that never ends. Launches that start later return false
+  // without running until resume is called, so a launch that was about to
+  // start when cancel was called is stopped too.
+  void cancel();
+
+  // Lets launches run again after cancel.
+  void resume();
 
 
   ~BrigEngine();
@@ -46,9 +127,25 @@ class BrigEngine {
   llvm::ExecutionEngine *EE_;
   llvm::Module *M_;
   uint32_t numProcessors;
+  std::vector<unsigned> cpus_;
+  enum Pinning { PinNone, PinNodes, PinCpus };
+  Pinning pin_;
+  uint32_t wavefrontSize_;
+  BrigScheduler *scheduler_;
+  uint32_t weight_;
+  // The cancelled flag of each launch in progress, and whether the engine
+  // is cancelled until resume is called.
+  pthread_mutex_t launchesLock_;
+  std::vector<uint32_t *> launches_;
+  bool cancelled_;
+  // Group segment slabs, kept between launches.
+  char *groupArena_;
+  size_t groupArenaSize_;
 
+  static Pinning getPinning(const std::vector<unsigned> &cpus);
   void init(bool forceInterpreter = false,
-            char optLevel = ' ');
+            char optLevel = ' ',
+            NativeMath nativeMath = ExactNativeMath);
 };
 
 } // namespace brig
@@ -51,6 +51,9 @@ class BrigFunction {
 
   BrigControlBlock begin() const;
   BrigControlBlock end() const;
+  // Returns the control block of the label named name, including the
+  // leading '@', or end() if the function has no such label.
+  BrigControlBlock findLabel(const char *name) const;
 
   bool operator!=(const BrigFunction &other) const {
     return it_ != other.it_;
@@ -66,6 +69,7 @@ class BrigFunction {
   friend BrigSymbol local_end(const BrigFunction &F);
   friend BrigControlBlock cb_begin(const BrigFunction &F);
   friend BrigControlBlock cb_end(const BrigFunction &F);
+  friend class BrigModule;
 
   private:
   BrigFunction(const BrigSections &S, const dir_iterator it) :
@@ -0,0 +1,186 @@
+//===- brig_image.h -------------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_IMAGE_H
+#define BRIG_IMAGE_H
+
+#include <cstddef>
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+enum ImageGeometry {
+  Image1D,
+  Image2D,
+  Image3D,
+  Image1DArray,
+  Image1DBuffer,
+  Image2DArray
+};
+
+enum ImageChannelOrder {
+  ChannelR,
+  ChannelRG,
+  ChannelRGBA
+};
+
+enum ImageChannelType {
+  UnormInt8,
+  UnormInt16,
+  SnormInt8,
+  SnormInt16,
+  SignedInt8,
+  SignedInt16,
+  SignedInt32,
+  UnsignedInt8,
+  UnsignedInt16,
+  UnsignedInt32,
+  HalfFloat,
+  Float
+};
+
+enum SamplerFilter {
+  FilterNearest,
+  FilterLinear
+};
+
+enum SamplerAddressing {
+  AddressUndefined,
+  AddressClampToEdge,
+  AddressClampToBorder,
+  AddressRepeat,
+  AddressMirroredRepeat
+};
+
+class BrigSampler;
+
+// An image owns its texels, stored in tiles so that texels close in 2D or
+// 3D are close in memory. 2D images and the layers of 2D arrays use 8x8
+// tiles, 3D images 4x4x4 tiles, and the texels of a tile are in Morton
+// order. 1D images, buffers and the layers of 1D arrays are linear.
+//
+// Kernels see an image or sampler as the 64-bit handle returned by
+// getHandle(), passed like any other kernel argument.
+class BrigImage {
+
+ public:
+
+  // Copies a linear image into tiled storage. The pitches are in bytes;
+  // zero means tightly packed. For arrays, the layers are the height of a
+  // 1D array and the depth of a 2D array. Returns NULL if the geometry,
+  // format or sizes are invalid.
+  static BrigImage *create(ImageGeometry geometry,
+                           ImageChannelOrder order, ImageChannelType type,
+                           uint32_t width, uint32_t height, uint32_t depth,
+                           const void *linear = NULL,
+                           size_t rowPitch = 0, size_t slicePitch = 0);
+
+  ~BrigImage();
+
+  // Copies the texels back out in linear order.
+  void read(void *linear, size_t rowPitch = 0, size_t slicePitch = 0) const;
+
+  ImageGeometry getGeometry() const { return geometry_; }
+  ImageChannelOrder getOrder() const { return order_; }
+  ImageChannelType getType() const { return type_; }
+  uint32_t getWidth() const { return width_; }
+  uint32_t getHeight() const { return height_; }
+  uint32_t getDepth() const { return depth_; }
+  unsigned getChannels() const { return channels_; }
+  unsigned getTexelSize() const { return texelSize_; }
+
+  // Whether texels read as floats rather than as 32-bit integers.
+  bool isFloat() const;
+
+  // The instructions exchange texels as four 32-bit words holding floats
+  // for normalized and float formats, and integers otherwise. Missing
+  // channels read as 0, except alpha, which reads as 1.
+
+  // Reads the texel at integer coordinates. Out of bounds texels read as
+  // zero.
+  void load(int32_t x, int32_t y, int32_t z, uint32_t texel[4]) const;
+  // Converts and writes a texel, saturating to the channel type. Out of
+  // bounds writes are dropped.
+  void store(int32_t x, int32_t y, int32_t z, const uint32_t texel[4]);
+
+  // Reads through a sampler. Integer coordinates are unnormalized and never
+  // filtered.
+  void sample(const BrigSampler &sampler, float x, float y, float z,
+              uint32_t texel[4]) const;
+  void sample(const BrigSampler &sampler, int32_t x, int32_t y, int32_t z,
+              uint32_t texel[4]) const;
+
+  uint64_t getHandle() const { return uint64_t(uintptr_t(this)); }
+  static BrigImage *fromHandle(uint64_t handle) {
+    return (BrigImage *) uintptr_t(handle);
+  }
+
+ private:
+
+  BrigImage(ImageGeometry geometry, ImageChannelOrder order,
+            ImageChannelType type, uint32_t width, uint32_t height,
+            uint32_t depth);
+
+  // The texel at in-bounds integer coordinates.
+  char *getTexel(uint32_t x, uint32_t y, uint32_t z) const;
+  // The number of coordinates that address texels rather than layers.
+  unsigned getDims() const;
+
+  // Do not define
+  BrigImage(const BrigImage &) /* = delete */;
+  BrigImage &operator=(const BrigImage &) /* = delete */;
+
+  const ImageGeometry geometry_;
+  const ImageChannelOrder order_;
+  const ImageChannelType type_;
+  const uint32_t width_;
+  const uint32_t height_;
+  const uint32_t depth_;
+  unsigned channels_;
+  unsigned texelSize_;
+  // log2 of the tile edge in each dimension, 0 for linear dimensions.
+  unsigned tileBits_[3];
+  // Each coordinate's bits within a tile, spread to their Morton positions.
+  uint16_t spread_[3][8];
+  uint32_t tilesX_;
+  uint32_t tilesY_;
+  char *data_;
+};
+
+class BrigSampler {
+
+ public:
+
+  BrigSampler(bool normalized, SamplerFilter filter,
+              SamplerAddressing addressing) :
+    normalized_(normalized), filter_(filter), addressing_(addressing) {}
+
+  bool isNormalized() const { return normalized_; }
+  SamplerFilter getFilter() const { return filter_; }
+  SamplerAddressing getAddressing() const { return addressing_; }
+
+  uint64_t getHandle() const { return uint64_t(uintptr_t(this)); }
+  static const BrigSampler *fromHandle(uint64_t handle) {
+    return (const BrigSampler *) uintptr_t(handle);
+  }
+
+ private:
+
+  const bool normalized_;
+  const SamplerFilter filter_;
+  const SamplerAddressing addressing_;
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_IMAGE_H
@@ -18,9 +18,11 @@
 #include <tr1/memory>
 
 #include <string>
+#include <vector>
 
 namespace llvm {
 class DIContext;
+class Function;
 class Module;
 class Type;
 class StructType;
@@ -67,6 +69,45 @@ class GenLLVM {
   static std::string getLLVMString(const BrigModule &M,
                                    Callback cb = NULL,
                                    CallbackData cbd = NULL);
+
+  // Translates several modules into a single optimized LLVM module,
+  // resolving extern functions and variables across them. Functions from
+  // one module may be inlined into another. The result carries no debug
+  // information. Recently linked programs are cached by module contents, so
+  // linking the same modules again skips translation and optimization; every
+  // call still returns a program of its own, which the caller may change.
+  static BrigProgram linkLLVMModules(
+    const std::vector<const BrigModule *> &modules,
+    std::string *errMsg = NULL);
+
+  // The bytes of group segment variables a work-group of the module needs.
+  static uint64_t getGroupSegmentSize(const llvm::Module *M);
+
+  // A kernel reads its arguments in place from a kernarg segment that
+  // holds each of them at an offset aligned to its size. Returns the size
+  // of the segment for the kernel a trampoline runs, and the offset and
+  // size of each argument.
+  static uint64_t getKernargLayout(const llvm::Function *entry,
+                                   std::vector<uint64_t> &offsets,
+                                   std::vector<uint64_t> &sizes);
+
+  // Fuses kernels that run in order over the same NDRange into one kernel
+  // taking no arguments, for dispatches that would otherwise pass values
+  // between them through memory. args[i] holds the arguments of kernels[i],
+  // and each kernel is a trampoline of M. The arguments are folded into the
+  // fused kernel, and a value one kernel stores is forwarded to the loads of
+  // the same work-item in the kernels after it. Returns NULL, leaving M as it
+  // was, unless every kernel is free of barriers, cross-lane operations,
+  // atomics, images and group memory, and every global access provably
+  // touches either memory no other work-item touches or memory no kernel
+  // writes. The fused kernel must be compiled before it runs, and erased with
+  // eraseFusedKernel, or deleted with M, once no engine uses it.
+  static llvm::Function *fuseKernels(
+    llvm::Module *M,
+    const std::vector<llvm::Function *> &kernels,
+    const std::vector<std::vector<void *> > &args,
+    uint32_t NDRangeSize);
+  static void eraseFusedKernel(llvm::Function *F);
 };
 
 } // namespace brig
@@ -30,7 +30,24 @@ class BrigSymbol;
 
 class BrigModule {
   public:
-  BrigModule(const BrigReader &reader, llvm::raw_ostream *out = NULL) :
+
+  // How much checking the constructor performs on the BRIG sections.
+  // StructuralValidation only checks that sections, entries and the offsets
+  // between them stay in bounds and refer to entries of the right kind,
+  // which is enough to translate a module safely. FullValidation
+  // additionally checks every directive, instruction and operand against
+  // the specification. DefaultValidation is FullValidation, except that a
+  // module whose reader carries a matching validation stamp is only
+  // structurally validated.
+  enum ValidationLevel {
+    NoValidation,
+    StructuralValidation,
+    FullValidation,
+    DefaultValidation
+  };
+
+  BrigModule(const BrigReader &reader, llvm::raw_ostream *out = NULL,
+             ValidationLevel level = DefaultValidation) :
     S_(reader.getStrings().data(),
        reader.getDirectives().data(),
        reader.getCode().data(),
@@ -42,12 +59,45 @@ class BrigModule {
        reader.getOperands().size(),
        reader.getDebug().size()),
     out_(out),
-    valid_(validate()) {}
+    level_(level),
+    validationTime_(0),
+    valid_(runValidation(reader)) {
+    // Only index offsets that validation has checked.
+    if (valid_ && level_ != NoValidation) buildIndex();
+  }
 
   bool isValid() const { return valid_; }
 
+  // The level of validation actually performed by the constructor.
+  ValidationLevel getValidationLevel() const { return level_; }
+  // Time spent validating the module, in microseconds.
+  uint64_t getValidationTime() const { return validationTime_; }
+
+  static const char *getValidationLevelName(ValidationLevel level);
+
+  // Same as BrigReader::getChecksum() for the reader of this module.
+  uint32_t getChecksum() const { return S_.getChecksum(); }
+  size_t getSize() const {
+    return S_.directivesSize + S_.codeSize + S_.operandsSize + S_.stringsSize;
+  }
+  // Appends the directives, code, operands and strings sections, each
+  // preceded by its size, so that equal output means equal modules.
+  void appendContents(std::string &out) const {
+    const char *data[] = { S_.directives, S_.code, S_.operands, S_.strings };
+    const size_t size[] = {
+      S_.directivesSize, S_.codeSize, S_.operandsSize, S_.stringsSize
+    };
+    for (unsigned i = 0; i < 4; ++i) {
+      out.append((const char *) &size[i], sizeof(size[i]));
+      out.append(data[i], size[i]);
+    }
+  }
+
   BrigFunction begin() const;
   BrigFunction end() const;
+  // Returns the first function or kernel named name, including the leading
+  // '&', or end() if there is none.
+  BrigFunction findFunction(const char *name) const;
 
   BrigSymbol global_begin() const;
   BrigSymbol global_end() const;
@@ -63,7 +113,14 @@ class BrigModule {
              const char *filename, unsigned lineno,
              const char *cause) const;
 
+  // Do not define
+  BrigModule(const BrigModule &) /* = delete */;
+  BrigModule &operator=(const BrigModule &) /* = delete */;
+
+  bool runValidation(const BrigReader &reader);
+  void buildIndex();
   bool validate(void) const;
+  bool validateStructure(void) const;
   bool validateDirectives(void) const;
   bool validateCode(void) const;
   bool validateOperands(void) const;
@@ -283,6 +340,16 @@ class BrigModule {
   bool validatePack(const inst_iterator inst) const;
   bool validateUnpack(const inst_iterator inst) const;
 
+  bool validateStructure(const dir_iterator dir) const;
+  bool validateStructure(const inst_iterator inst) const;
+  bool validateStructure(const oper_iterator operand) const;
+  bool validateStructure(const dir_iterator dir,
+                         const BrigSectionIndex &index) const;
+  bool validateStructure(const inst_iterator inst,
+                         const BrigSectionIndex &index) const;
+  bool validateStructure(const oper_iterator operand,
+                         const BrigSectionIndex &index) const;
+
   bool validOrEnd(const dir_iterator dir) const;
   bool validate(const dir_iterator dir) const;
 
@@ -299,7 +366,10 @@ class BrigModule {
                             const BrigType16_t type) const;
   const BrigSections S_;
   llvm::raw_ostream *out_;
+  ValidationLevel level_;
+  uint64_t validationTime_;
   const bool valid_;
+  BrigSectionIndex index_;
 
   friend class BrigFunction;
   friend BrigSymbol global_begin(const BrigModule &mod);
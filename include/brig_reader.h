@@ -12,6 +12,9 @@
 
 #include "llvm/ADT/StringRef.h"
 
+// Not included in C++98
+#include <stdint.h>
+
 namespace llvm {
 namespace object {
 class ObjectFile;
@@ -30,6 +33,9 @@ class BrigReader {
   const llvm::StringRef operands_;
   const llvm::StringRef debug_;
   const llvm::StringRef strings_;
+  const llvm::StringRef stamp_;
+  // Backing store for sections that were stored compressed.
+  char *arena_;
 
  public:
 
@@ -39,6 +45,13 @@ class BrigReader {
   const llvm::StringRef &getDebug() const { return debug_; }
   const llvm::StringRef &getStrings() const { return strings_; }
 
+  // A producer that has already fully validated a module may record the
+  // module's checksum in a .brig_validated section. Returns true if such a
+  // stamp is present and still matches the contents of the module.
+  bool hasValidationStamp() const;
+  // FNV-1a checksum of the directives, code, operands and strings sections.
+  uint32_t getChecksum() const;
+
   ~BrigReader();
 
   static BrigReader *createBrigReader(const char *filename);
@@ -50,11 +63,18 @@ class BrigReader {
              llvm::StringRef code,
              llvm::StringRef operands,
              llvm::StringRef debug,
-             llvm::StringRef strings) :
+             llvm::StringRef strings,
+             llvm::StringRef stamp,
+             char *arena) :
     objFile_(objFile), directives_(directives), code_(code),
-    operands_(operands), debug_(debug), strings_(strings) {}
+    operands_(operands), debug_(debug), strings_(strings), stamp_(stamp),
+    arena_(arena) {}
 
   static BrigReader *createBrigReader(llvm::object::ObjectFile *objFile);
+
+  // Do not define
+  BrigReader(const BrigReader &) /* = delete */;
+  BrigReader &operator=(const BrigReader &) /* = delete */;
 };
 
 } // namespace brig
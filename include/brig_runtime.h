@@ -37,10 +37,37 @@ typedef uint64_t   b64;
 typedef uint64_t   u64;
 typedef  int64_t   s64;
 
-// typedef __half f16; // Not a real half yet.
 typedef float  f32;
 typedef double f64;
 
+// IEEE 754 half precision. Only the storage is half precision: values
+// convert to f32 for arithmetic, and results round back to the nearest half.
+// Rounding a sum, difference, product, quotient or square root of halves
+// computed in f32 gives the correctly rounded half, because f32 carries more
+// than twice as many significand bits. The conversions use the F16C
+// instructions when the processor has them.
+class f16 {
+ public:
+  f16() : bits_(0) {}
+  f16(f64 d) : bits_(fromDouble(d)) {}
+
+  operator f32() const { return toFloat(bits_); }
+
+  static f16 fromBits(b16 b) {
+    f16 h;
+    h.bits_ = b;
+    return h;
+  }
+  b16 getBits() const { return bits_; }
+
+  static f32 toFloat(b16 b);
+  static b16 fromFloat(f32 f);
+  static b16 fromDouble(f64 d);
+
+ private:
+  b16 bits_;
+};
+
 template<class B, unsigned L>
 class Vector {
  public:
@@ -102,13 +129,13 @@ declareVector(u8,  16);
 declareVector(s8,  16);
 declareVector(u16, 2);
 declareVector(s16, 2);
-// declareVector(f16, 2);
+declareVector(f16, 2);
 declareVector(u16, 4);
 declareVector(s16, 4);
-// declareVector(f16, 4);
+declareVector(f16, 4);
 declareVector(u16, 8);
 declareVector(s16, 8);
-// declareVector(f16, 8);
+declareVector(f16, 8);
 declareVector(u32, 2);
 declareVector(s32, 2);
 declareVector(f32, 2);
@@ -124,35 +151,56 @@ typedef u64x2 b128;
 #undef declareVector
 #undef vector
 
+namespace hsa {
+namespace brig {
+class Wavefront;
+class WorkGroupBarrier;
+}
+}
+
 struct ThreadInfo {
-  void **argsArray;
+  const char *kernarg;        // kernarg segment of the dispatch
   const uint32_t NDRangeSize; // number of work items
   const uint32_t workdim;     // number of work group dimensions
-  pthread_barrier_t *barrier; // Workgroup barrier
+  hsa::brig::WorkGroupBarrier *barrier; // Workgroup barrier
+  hsa::brig::Wavefront *wavefront; // Wavefront of this work-item
+  uint32_t wavefrontSize;     // lanes in a full wavefront
+  uint32_t laneId;            // lane within the wavefront
+  uint32_t lanePhase;         // cross-lane instructions executed so far
+  char *groupBase;            // group segment of the work-group
   uint32_t workGroupSize[3];  // work group dimensions
   uint32_t workItemAbsId[3];  // absolute identifier
+  void (*yield)(ThreadInfo *); // called at yield points, may be NULL
+  const uint32_t *yieldRequest; // yield is only called while it is set
   pthread_t tid;
 
   ThreadInfo(uint32_t NDRangeSize, uint32_t workdim,
              uint32_t workGroupSize[3], uint32_t workItemAbsId[3],
-             pthread_barrier_t *barrier,
-             void *const *args, size_t size) :
-    argsArray(new void*[size + 1]),
-    NDRangeSize(NDRangeSize), workdim(workdim), barrier(barrier) {
+             hsa::brig::WorkGroupBarrier *barrier,
+             const char *kernarg) :
+    kernarg(kernarg),
+    NDRangeSize(NDRangeSize), workdim(workdim), barrier(barrier),
+    wavefront(NULL), wavefrontSize(1), laneId(0), lanePhase(0),
+    groupBase(NULL), yield(NULL), yieldRequest(NULL) {
 
     for (unsigned i = 0; i < 3; ++i) {
       this->workGroupSize[i] = workGroupSize[i];
       this->workItemAbsId[i] = workItemAbsId[i];
     }
-
-    argsArray[0] = this;
-    for (unsigned i = 0; i < size; ++i)
-      argsArray[i + 1] = args[i];
   }
-
-  ~ThreadInfo() { delete[] argsArray; }
 };
 
+// Under SIMYIELD, the translator makes every function check this flag at
+// its entry and on each loop back edge, and call __brigYield while it is
+// set. It counts the requests pending anywhere in the process, so the
+// check is a single load and branch. While any request is pending, every
+// such work-item in the process takes the call at each yield point, though
+// __brigYield only reads the work-item's own yieldRequest before returning
+// to work-items that were not asked to yield. Requests last until the
+// work-items asked have stopped.
+extern "C" volatile uint32_t __brigYieldFlag;
+extern "C" void __brigYield(void);
+
 namespace hsa {
 namespace brig {
 
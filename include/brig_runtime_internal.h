@@ -12,6 +12,7 @@
 
 #include "brig_runtime.h"
 #include <cmath>
+#include <limits>
 #include <fenv.h>
 
 namespace hsa {
@@ -98,7 +99,7 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   D ## NARY(INST, u64)
 
 #define FloatInst(D,INST,NARY)                  \
-  /* D ## NARY(INST, f16) */                    \
+  D ## NARY(INST, f16)                          \
   D ## NARY(INST, f32)                          \
   D ## NARY(INST, f64)
 
@@ -143,8 +144,8 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   D ## NARY(INST, u16x2)                        \
   D ## NARY(INST, u16x4)                        \
   D ## NARY(INST, u32x2)                        \
-  /* D ## NARY(INST, f16x2) */                  \
-  /* D ## NARY(INST, f16x4) */                  \
+  D ## NARY(INST, f16x2)                        \
+  D ## NARY(INST, f16x4)                        \
   D ## NARY(INST, f32x2)
   
 #define PackInst(D)                             \
@@ -237,8 +238,8 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   D ## Unpack(f64, f64x2)
                                                                                     
 #define FloatVectorInst(D,INST,NARY)            \
-  /* NARY ## Vector(D, INST, f16x2) */          \
-  /* NARY ## Vector(D, INST, f16x4) */          \
+  NARY ## Vector(D, INST, f16x2)                \
+  NARY ## Vector(D, INST, f16x4)                \
   NARY ## Vector(D, INST, f32x2)
 
 #define UnaryVector(D,FUNC,TYPE)                \
@@ -265,17 +266,25 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   D ## ShuffleVector(INST, u16x2)               \
   D ## ShuffleVector(INST, u16x4)               \
   D ## ShuffleVector(INST, u32x2)               \
-  /* D ## ShuffleVector(INST, f16x2) */         \
-  /* D ## ShuffleVector(INST, f16x4) */         \
+  D ## ShuffleVector(INST, f16x2)               \
+  D ## ShuffleVector(INST, f16x4)               \
   D ## ShuffleVector(INST, f32x2)
 
-#define AtomicInst(D,INST,NARY)                 \
-  D ## Atomic ## NARY(INST, b32)                \
-  D ## Atomic ## NARY(INST, b64)                \
-  D ## Atomic ## NARY(INST, s32)                \
-  D ## Atomic ## NARY(INST, s64)                \
-  D ## Atomic ## NARY(INST, u32)                \
-  D ## Atomic ## NARY(INST, u64)
+// Atomics without a memory order suffix are acquire-release. The _rlx, _acq
+// and _rel forms implement the regular, acquire and release semantics.
+#define AtomicInst(D,INST,NARY)                                  \
+  AtomicOrderInst(D, INST, INST, NARY, __ATOMIC_ACQ_REL)         \
+  AtomicOrderInst(D, INST, INST ## _rlx, NARY, __ATOMIC_RELAXED) \
+  AtomicOrderInst(D, INST, INST ## _acq, NARY, __ATOMIC_ACQUIRE) \
+  AtomicOrderInst(D, INST, INST ## _rel, NARY, __ATOMIC_RELEASE)
+
+#define AtomicOrderInst(D,INST,NAME,NARY,ORDER) \
+  D ## Atomic ## NARY(INST, NAME, ORDER, b32)   \
+  D ## Atomic ## NARY(INST, NAME, ORDER, b64)   \
+  D ## Atomic ## NARY(INST, NAME, ORDER, s32)   \
+  D ## Atomic ## NARY(INST, NAME, ORDER, s64)   \
+  D ## Atomic ## NARY(INST, NAME, ORDER, u32)   \
+  D ## Atomic ## NARY(INST, NAME, ORDER, u64)
 
 #define CmpImpl(FUNC,PRED)                                      \
   template<class T> static T Cmp_ ## FUNC (T x, T y) {          \
@@ -296,7 +305,7 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   Cmp(define, FUNC, s64)                                \
   Cmp(define, FUNC, u32)                                \
   Cmp(define, FUNC, u64)                                \
-  /* Cmp(define, Cmp_ ## FUNC, f16) */                  \
+  FCmp(define, FUNC, f16)                               \
   FCmp(define, FUNC, f32)                               \
   FCmp(define, FUNC, f64)                               \
   PackedCmp(define, FUNC, u8x4, u8x4)                   \
@@ -317,9 +326,9 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   PackedCmp(define, FUNC, u32x2, s32x2)                 \
   PackedCmp(define, FUNC, u32x4, s32x4)                 \
   PackedCmp(define, FUNC, u64x2, s64x2)                 \
-  /*FPackedCmp(define, FUNC, u16x2, f16x2) */           \
-  /*FPackedCmp(define, FUNC, u16x4 f16x4) */            \
-  /*FPackedCmp(define, FUNC, u16x8, f16x8) */           \
+  FPackedCmp(define, FUNC, u16x2, f16x2)                \
+  FPackedCmp(define, FUNC, u16x4, f16x4)                \
+  FPackedCmp(define, FUNC, u16x8, f16x8)                \
   FPackedCmp(define, FUNC, u32x2, f32x2)                \
   FPackedCmp(define, FUNC, u32x4, f32x4)                \
   FPackedCmp(define, FUNC, u64x2, f64x2)
@@ -340,7 +349,7 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   D ## CmpRet(Cmp_ ## FUNC, u16, TYPE)          \
   D ## CmpRet(Cmp_ ## FUNC, u64, TYPE)          \
   D ## CmpRet(Cmp_ ## FUNC, u32, TYPE)          \
-  /* D ## CmpRet(Cmp_ ## FUNC, f16, TYPE) */    \
+  D ## CmpRet(Cmp_ ## FUNC, f16, TYPE)          \
   D ## CmpRet(Cmp_ ## FUNC, f32, TYPE)          \
   D ## CmpRet(Cmp_ ## FUNC, f64, TYPE)
 
@@ -412,12 +421,12 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   B ## Cvt(D, FUNC, ROUND, s64)
 
 #define FICvt(D,FUNC,ROUND)                     \
-  /* ICvt(D, FUNC, ROUND, f16) */               \
+  ICvt(D, FUNC, ROUND, f16)                     \
   ICvt(D, FUNC, ROUND, f32)                     \
   ICvt(D, FUNC, ROUND, f64)
   
 #define FICvtSat(D,FUNC,ROUND)                  \
-  /* ICvtSat(D, FUNC, ROUND, f16) */            \
+  ICvtSat(D, FUNC, ROUND, f16)                  \
   ICvtSat(D, FUNC, ROUND, f32)                  \
   ICvtSat(D, FUNC, ROUND, f64)  
 
@@ -443,7 +452,7 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
   
 
 #define FCvt(D,FUNC,ROUND,TYPE)                 \
-  /* D ## Cvt(FUNC, ROUND, f16, TYPE) */        \
+  D ## Cvt(FUNC, ROUND, f16, TYPE)              \
   D ## Cvt(FUNC, ROUND, f32, TYPE)              \
   D ## Cvt(FUNC, ROUND, f64, TYPE)
 
@@ -507,30 +516,30 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
     return FUNC ## Vector(t, u, shift);                           \
   }
 
-#define defineAtomicUnary(FUNC,TYPE)                            \
-  extern "C" TYPE Atomic ## FUNC ## _ ## TYPE (TYPE *t) {       \
-    return Atomic ## FUNC(t);                                   \
+#define defineAtomicUnary(FUNC,NAME,ORDER,TYPE)                 \
+  extern "C" TYPE Atomic ## NAME ## _ ## TYPE (TYPE *t) {       \
+    return Atomic ## FUNC<ORDER>(t);                            \
   }                                                             \
-  extern "C" void AtomicNoRet ## FUNC ## _ ## TYPE (TYPE *t) {  \
-    Atomic ## FUNC(t);                                          \
+  extern "C" void AtomicNoRet ## NAME ## _ ## TYPE (TYPE *t) {  \
+    Atomic ## FUNC<ORDER>(t);                                   \
   }
 
-#define defineAtomicBinary(FUNC,TYPE)                                   \
-  extern "C" TYPE Atomic ## FUNC ## _ ## TYPE (TYPE *t, TYPE u) {       \
-    return Atomic ## FUNC(t, u);                                        \
+#define defineAtomicBinary(FUNC,NAME,ORDER,TYPE)                        \
+  extern "C" TYPE Atomic ## NAME ## _ ## TYPE (TYPE *t, TYPE u) {       \
+    return Atomic ## FUNC<ORDER>(t, u);                                 \
   }                                                                     \
-  extern "C" void AtomicNoRet ## FUNC ## _ ## TYPE (TYPE *t, TYPE u) {  \
-    Atomic ## FUNC(t, u);                                               \
+  extern "C" void AtomicNoRet ## NAME ## _ ## TYPE (TYPE *t, TYPE u) {  \
+    Atomic ## FUNC<ORDER>(t, u);                                        \
   }
 
-#define defineAtomicTernary(FUNC,TYPE)                                  \
+#define defineAtomicTernary(FUNC,NAME,ORDER,TYPE)                       \
   extern "C"                                                            \
-  TYPE Atomic ## FUNC ## _ ## TYPE (TYPE *t, TYPE u, TYPE v) {          \
-    return Atomic ## FUNC(t, u, v);                                     \
+  TYPE Atomic ## NAME ## _ ## TYPE (TYPE *t, TYPE u, TYPE v) {          \
+    return Atomic ## FUNC<ORDER>(t, u, v);                              \
   }                                                                     \
   extern "C"                                                            \
-  void AtomicNoRet ## FUNC ## _ ## TYPE (TYPE *t, TYPE u, TYPE v) {     \
-    Atomic ## FUNC(t, u, v);                                            \
+  void AtomicNoRet ## NAME ## _ ## TYPE (TYPE *t, TYPE u, TYPE v) {     \
+    Atomic ## FUNC<ORDER>(t, u, v);                                     \
   }
 
 #define declarePack(DTYPE,STYPE)                             \
@@ -590,15 +599,15 @@ inline void ForEach(typename T::SForEachFn MapFn, T x, T y, unsigned z) {
 #define declareShuffleVector(FUNC,TYPE)                               \
   extern "C" TYPE FUNC ## _ ## TYPE (TYPE t, TYPE u, unsigned shift);
 
-#define declareAtomicBinary(FUNC,TYPE)                                  \
-  extern "C" TYPE Atomic ## FUNC ## _ ## TYPE (TYPE *t, TYPE u);        \
-  extern "C" void AtomicNoRet ## FUNC ## _ ## TYPE (TYPE *t, TYPE u);
+#define declareAtomicBinary(FUNC,NAME,ORDER,TYPE)                       \
+  extern "C" TYPE Atomic ## NAME ## _ ## TYPE (TYPE *t, TYPE u);        \
+  extern "C" void AtomicNoRet ## NAME ## _ ## TYPE (TYPE *t, TYPE u);
 
-#define declareAtomicTernary(FUNC,TYPE)                                 \
+#define declareAtomicTernary(FUNC,NAME,ORDER,TYPE)                      \
   extern "C"                                                            \
-  TYPE Atomic ## FUNC ## _ ## TYPE (TYPE *t, TYPE u, TYPE v);           \
+  TYPE Atomic ## NAME ## _ ## TYPE (TYPE *t, TYPE u, TYPE v);           \
   extern "C"                                                            \
-  void AtomicNoRet ## FUNC ## _ ## TYPE (TYPE *t, TYPE u, TYPE v);
+  void AtomicNoRet ## NAME ## _ ## TYPE (TYPE *t, TYPE u, TYPE v);
 
 #define defineBitMask(TYPE)                              \
   extern "C" TYPE BitMask ## _ ## TYPE (b32 t, b32 u) {  \
@@ -656,6 +665,7 @@ template<> struct Int<s64> : public IntPolicy<s64, u64, true>  {};
 template<class T> inline bool isNan(T t) { return false; }
 template<> inline bool isNan(float f) { return std::isnan(f); }
 template<> inline bool isNan(double d) { return std::isnan(d); }
+template<> inline bool isNan(f16 h) { return (h.getBits() & 0x7FFF) > 0x7C00; }
 
 template<class T> inline bool isSNan(T t) { return false; }
 template<> inline bool isSNan(f32 f) {
@@ -670,6 +680,11 @@ template<> inline bool isSNan(f64 f) {
   b64 mask = (1ULL << 51);
   return Conv.b & mask;
 }
+template<> inline bool isSNan(f16 h) {
+  if (!isNan(h)) return false;
+  b16 mask = (1U << 9);
+  return h.getBits() & mask;
+}
 
 template<class T> inline bool isQNan(T t) { return isNan(t) && !isSNan(t); }
 
@@ -682,6 +697,7 @@ template<class T> inline bool isDivisionError(T x, T y) {
 }
 template<> inline bool isDivisionError(float, float) { return false; }
 template<> inline bool isDivisionError(double, double) { return false; }
+template<> inline bool isDivisionError(f16, f16) { return false; }
 
 template<class T> inline T Int48Ty(T t) {
   unsigned shift = Int<T>::Bits - 48;
@@ -705,30 +721,47 @@ template<> inline bool isNegZero(float  f) {
 template<> inline bool isNegZero(double d) {
   return d == 0.0 && copysign(1.0, d) < 0.0;
 }
+template<> inline bool isNegZero(f16 h) { return h.getBits() == 0x8000; }
 
 template<class T> inline bool isPosZero(T t) { return false; }
 template<> inline bool isPosZero(f32 f) { return f == 0.0 && !isNegZero(f); }
 template<> inline bool isPosZero(f64 f) { return f == 0.0 && !isNegZero(f); }
+template<> inline bool isPosZero(f16 h) { return h.getBits() == 0x0000; }
 
 template<class T> inline bool isInf(T t) { return false; }
 template<> inline bool isInf(float f)  { return std::isinf(f); }
 template<> inline bool isInf(double d) { return std::isinf(d); }
+template<> inline bool isInf(f16 h)    { return (h.getBits() & 0x7FFF) == 0x7C00; }
 
 template<class T> inline bool isPosInf(T t) { return false; }
 template<> inline bool isPosInf(float f)  { return std::isinf(f) && f > 0.0; }
 template<> inline bool isPosInf(double d) { return std::isinf(d) && d > 0.0; }
+template<> inline bool isPosInf(f16 h)    { return h.getBits() == 0x7C00; }
 
 template<class T> inline bool isNegInf(T t) { return false; }
 template<> inline bool isNegInf(float f)  { return std::isinf(f) && f < 0.0; }
 template<> inline bool isNegInf(double d) { return std::isinf(d) && d < 0.0; }
+template<> inline bool isNegInf(f16 h)    { return h.getBits() == 0xFC00; }
+
+// Classifies by the bits of a half, since every half is a normal float.
+template<class T> inline int fpClassify(T t) { return std::fpclassify(t); }
+template<> inline int fpClassify(f16 h) {
+  b16 exponent = h.getBits() & 0x7C00;
+  b16 mantissa = h.getBits() & 0x03FF;
+  if (exponent == 0x7C00) return mantissa ? FP_NAN : FP_INFINITE;
+  if (exponent) return FP_NORMAL;
+  return mantissa ? FP_SUBNORMAL : FP_ZERO;
+}
 
 template<class T> inline T getMax() { return Int<T>::Max; }
 template<> inline b1  getMax() { return true; }
+template<> inline f16 getMax() { return INFINITY; }
 template<> inline f32 getMax() { return INFINITY; }
 template<> inline f64 getMax() { return INFINITY; }
 
 template<class T> inline T getMin() { return Int<T>::Min; }
 template<> inline b1  getMin() { return false; }
+template<> inline f16 getMin() { return -INFINITY; }
 template<> inline f32 getMin() { return -INFINITY; }
 template<> inline f64 getMin() { return -INFINITY; }
 
@@ -754,11 +787,37 @@ template<> inline f32 cmpResult(bool result) {
 template<> inline f64 cmpResult(bool result) {
   return result ? 1.0 : 0.0;
 }
+template<> inline f16 cmpResult(bool result) {
+  return result ? 1.0 : 0.0;
+}
 
 template<class T> inline b1 isUnordered(T x, T y) {
   return isNan(x) || isNan(y);
 }
 
+// Rounds to an integral value in the direction of mode, a FE_* constant,
+// without changing the rounding mode. Values below 2^(digits - 1) are
+// truncated exactly through a 64-bit integer and then adjusted; larger
+// values are already integral. The runtime uses this where SSE4.1 is
+// missing.
+template<class T> inline T roundIntegral(T t, int mode) {
+  const T integral = T(u64(1) << (std::numeric_limits<T>::digits - 1));
+  if (!(std::fabs(t) < integral)) return t;
+
+  T trunc = copysign(T(s64(t)), t);
+  T frac = t - trunc;
+  T step = copysign(T(1), t);
+  switch (mode) {
+  case FE_UPWARD:     return frac > 0 ? trunc + 1 : trunc;
+  case FE_DOWNWARD:   return frac < 0 ? trunc - 1 : trunc;
+  case FE_TOWARDZERO: return trunc;
+  default:
+    if (std::fabs(frac) > T(0.5)) return trunc + step;
+    if (std::fabs(frac) == T(0.5) && (s64(trunc) & 1)) return trunc + step;
+    return trunc;
+  }
+}
+
 } // namespace brig
 } // namespace hsa
 
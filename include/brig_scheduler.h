@@ -0,0 +1,81 @@
+//===- brig_scheduler.h ---------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_SCHEDULER_H
+#define BRIG_SCHEDULER_H
+
+#include <vector>
+
+#include <pthread.h>
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+// Shares the processors of a device between the kernels that run on it at
+// the same time. A kernel joins as a client with a weight, and takes
+// processors one work-group at a time, as many as the work-group has
+// work-items, giving them back when the work-group is done. So the
+// work-groups of concurrent kernels interleave, and together they never
+// run more work-items than there are processors.
+//
+// Processors go to the waiting client that has had the least of them for
+// its weight, like stride scheduling: each grant of n processors advances
+// the client's pass by n / weight. A client joins at the lowest pass of
+// the clients already there, so a small kernel that arrives behind a long
+// one gets the next free processors, rather than the long kernel's
+// backlog.
+class BrigScheduler {
+
+ public:
+
+  explicit BrigScheduler(uint32_t capacity);
+  ~BrigScheduler();
+
+  class Client;
+
+  // Weights below 1 count as 1.
+  Client *join(uint32_t weight);
+  // The client must have given back every processor it took.
+  void leave(Client *client);
+
+  // Waits until count processors are free and no waiting client is owed
+  // more, then takes them. More than the capacity waits for all of it, so
+  // a work-group larger than the device still runs, alone. Returns the
+  // number of processors taken, which is what release needs.
+  uint32_t acquire(Client *client, uint32_t count);
+  void release(uint32_t count);
+
+  uint32_t getCapacity() const { return capacity_; }
+
+  // The number of pthreads waiting in acquire.
+  uint32_t getWaiting();
+
+ private:
+
+  // Do not define
+  BrigScheduler(const BrigScheduler &) /* = delete */;
+  BrigScheduler &operator=(const BrigScheduler &) /* = delete */;
+
+  bool isNext(const Client *client) const;
+
+  pthread_mutex_t lock_;
+  pthread_cond_t freed_;
+  uint32_t capacity_;
+  uint32_t free_;
+  // In the order they joined, which breaks ties between passes.
+  std::vector<Client *> clients_;
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_SCHEDULER_H
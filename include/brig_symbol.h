@@ -28,9 +28,11 @@ class BrigSymbol {
   }
 
   BrigSegment getStorageClass() const {
-    return BrigSegment(getSymbol()->modifier);
+    return BrigSegment(getSymbol()->segment);
   }
 
+  unsigned getAlign() const { return getSymbol()->align; }
+
   BrigLinkage8_t getLinkage() const {
     return BrigLinkage8_t(getSymbol()->modifier) & BRIG_SYMBOL_LINKAGE;
   }
@@ -0,0 +1,64 @@
+//===- brig_topology.h ----------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_TOPOLOGY_H
+#define BRIG_TOPOLOGY_H
+
+#include <vector>
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+// The NUMA nodes of the host and the processors this process may run on.
+// On Linux it is read from /sys/devices/system/node and the process's
+// affinity mask. Elsewhere, or when that fails, there is a single node with
+// every processor.
+class Topology {
+
+ public:
+
+  struct Node {
+    unsigned id;
+    std::vector<unsigned> cpus;
+    uint64_t memory;            // bytes
+  };
+
+  static const Topology &get();
+
+  unsigned getNodeCount() const { return nodes_.size(); }
+  const Node &getNode(unsigned i) const { return nodes_[i]; }
+
+  // The index of the node a processor belongs to, or getNodeCount() if it
+  // is not on any.
+  unsigned getNodeIndex(unsigned cpu) const;
+
+  // Every usable processor, grouped by node in node order. Workers that are
+  // pinned to consecutive entries share a node for as long as possible.
+  const std::vector<unsigned> &getCpus() const { return cpus_; }
+
+  // Parses a list such as "0-3,8,10-11". Returns false if it is malformed.
+  static bool parseCpuList(const char *list, std::vector<unsigned> &cpus);
+
+ private:
+
+  Topology();
+
+  bool readNodes();
+
+  std::vector<Node> nodes_;
+  std::vector<unsigned> cpus_;
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_TOPOLOGY_H
@@ -11,8 +11,12 @@
 #define _BRIG_UTIL_H_
 
 #include "brig.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace llvm {
 class raw_ostream;
@@ -83,6 +87,52 @@ template<class T, class Base> inline bool isa(const Base *base) {
   return dyn_cast<T>(base);
 }
 
+// Random-access index over the directive, code and operand sections. Entry n
+// of an offset array is the byte offset of the n-th entry of the section,
+// and the last entry is the section size. controlBlocks holds the sorted
+// offsets of every label and executable directive. functions and labels
+// map the names of executable directives and labels to their offsets,
+// sorted by name and then offset.
+struct BrigSectionIndex {
+  typedef std::vector<std::pair<std::string, uint32_t> > NameTable;
+
+  std::vector<uint32_t> dirOffsets;
+  std::vector<uint32_t> instOffsets;
+  std::vector<uint32_t> operOffsets;
+  std::vector<uint32_t> controlBlocks;
+  NameTable functions;
+  NameTable labels;
+
+  static uint32_t advance(const std::vector<uint32_t> &offsets,
+                          uint32_t offset, intptr_t addend) {
+    std::vector<uint32_t>::const_iterator it =
+      std::lower_bound(offsets.begin(), offsets.end(), offset);
+    assert(it != offsets.end() && *it == offset && "Not an entry offset");
+    assert(addend < offsets.end() - it && "Advanced past section end");
+    return it[addend];
+  }
+
+  // Returns the offset of the first control block starting after offset, or
+  // end if there is none.
+  uint32_t nextControlBlock(uint32_t offset, uint32_t end) const {
+    std::vector<uint32_t>::const_iterator it =
+      std::upper_bound(controlBlocks.begin(), controlBlocks.end(), offset);
+    return it != controlBlocks.end() ? *it : end;
+  }
+
+  // Returns the offset of the first entry of table named name in the
+  // directive range [begin, end), or end if there is none.
+  static uint32_t findName(const NameTable &table, const std::string &name,
+                           uint32_t begin, uint32_t end) {
+    NameTable::const_iterator it =
+      std::lower_bound(table.begin(), table.end(),
+                       std::make_pair(name, begin));
+    if (it == table.end() || it->first != name || it->second >= end)
+      return end;
+    return it->second;
+  }
+};
+
 template<class Super> class brig_iterator {
 
   public:
@@ -90,12 +140,21 @@ template<class Super> class brig_iterator {
   typedef typename Super::Base Base;
   typedef brig_iterator<Super> Self;
 
-  explicit brig_iterator() : super(), curr(NULL) {}
-  explicit brig_iterator(const char *curr) : super(), curr(curr) {}
-  brig_iterator(const Self &other) : super(), curr(other.curr) {}
+  explicit brig_iterator() :
+    super(), curr(NULL), base(NULL), offsets(NULL) {}
+  explicit brig_iterator(const char *curr) :
+    super(), curr(curr), base(NULL), offsets(NULL) {}
+  // An iterator over the section starting at base, whose entry offsets are
+  // in offsets. Iterator arithmetic then takes logarithmic time.
+  brig_iterator(const char *curr, const char *base,
+                const std::vector<uint32_t> *offsets) :
+    super(), curr(curr), base(base), offsets(offsets) {}
+  brig_iterator(const Self &other) :
+    super(), curr(other.curr), base(other.base), offsets(other.offsets) {}
 
   template<class T> explicit brig_iterator(const T *t) :
-    super(t), curr(reinterpret_cast<const char *>(t)) {}
+    super(t), curr(reinterpret_cast<const char *>(t)), base(NULL),
+    offsets(NULL) {}
 
   Self operator++(int) {
     brig_iterator other = *this;
@@ -130,6 +189,11 @@ template<class Super> class brig_iterator {
 
   Self operator+(intptr_t addend) const {
     brig_iterator other = *this;
+    if (offsets) {
+      other.curr = base +
+        BrigSectionIndex::advance(*offsets, curr - base, addend);
+      return other;
+    }
     for (intptr_t i = 0; i < addend; ++i) {
       ++other;
     }
@@ -141,6 +205,8 @@ template<class Super> class brig_iterator {
   private:
   Super super;
   const char *curr;
+  const char *base;
+  const std::vector<uint32_t> *offsets;
 };
 
 struct dir_super {
@@ -185,6 +251,18 @@ template<class T, class It> inline bool isa(const It it) {
   return isa<T>(&*it);
 }
 
+// FNV-1a hash, used to identify BRIG sections by their contents.
+inline uint32_t hashBrigSection(uint32_t hash,
+                                const char *data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= (unsigned char) data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static const uint32_t BrigSectionHashSeed = 2166136261u;
+
 struct BrigSections {
   const char *strings;
   const char *directives;
@@ -197,6 +275,10 @@ struct BrigSections {
   const size_t operandsSize;
   const size_t debugSize;
 
+  // Set by the owning BrigModule once the sections have been validated.
+  // Iterators from begin(), code_begin() and oper_begin() then use it.
+  mutable const BrigSectionIndex *index;
+
   enum { HeaderSize = sizeof(BrigSectionHeader) };
 
   BrigSections(const char *strings,
@@ -212,21 +294,66 @@ struct BrigSections {
     strings(strings), directives(directives),
     code(code), operands(operands), debug(debug),
     stringsSize(stringsSize), directivesSize(directivesSize),
-    codeSize(codeSize), operandsSize(operandsSize), debugSize(debugSize) {}
+    codeSize(codeSize), operandsSize(operandsSize), debugSize(debugSize),
+    index(NULL) {}
+
+  // Checksum of the directives, code, operands and strings sections.
+  uint32_t getChecksum() const {
+    uint32_t hash = BrigSectionHashSeed;
+    hash = hashBrigSection(hash, directives, directivesSize);
+    hash = hashBrigSection(hash, code, codeSize);
+    hash = hashBrigSection(hash, operands, operandsSize);
+    hash = hashBrigSection(hash, strings, stringsSize);
+    return hash;
+  }
+
+  // Iterator arithmetic. Logarithmic time when an index is available,
+  // otherwise linear in addend.
+  dir_iterator advance(const dir_iterator it, intptr_t addend) const {
+    if (!index) return it + addend;
+    uint32_t offset =
+      index->advance(index->dirOffsets, it - directives, addend);
+    return dir_iterator(directives + offset, directives, &index->dirOffsets);
+  }
+
+  inst_iterator advance(const inst_iterator it, intptr_t addend) const {
+    if (!index) return it + addend;
+    uint32_t offset = index->advance(index->instOffsets, it - code, addend);
+    return inst_iterator(code + offset, code, &index->instOffsets);
+  }
 
-  dir_iterator begin() const { return dir_iterator(directives + HeaderSize); }
+  oper_iterator advance(const oper_iterator it, intptr_t addend) const {
+    if (!index) return it + addend;
+    uint32_t offset =
+      index->advance(index->operOffsets, it - operands, addend);
+    return oper_iterator(operands + offset, operands, &index->operOffsets);
+  }
+
+  dir_iterator begin() const {
+    return dir_iterator(directives + HeaderSize, directives,
+                        index ? &index->dirOffsets : NULL);
+  }
   dir_iterator end() const {
-    return dir_iterator(directives + directivesSize);
+    return dir_iterator(directives + directivesSize, directives,
+                        index ? &index->dirOffsets : NULL);
   }
 
-  inst_iterator code_begin() const { return inst_iterator(code + HeaderSize); }
-  inst_iterator code_end() const { return inst_iterator(code + codeSize); }
+  inst_iterator code_begin() const {
+    return inst_iterator(code + HeaderSize, code,
+                         index ? &index->instOffsets : NULL);
+  }
+  inst_iterator code_end() const {
+    return inst_iterator(code + codeSize, code,
+                         index ? &index->instOffsets : NULL);
+  }
 
   oper_iterator oper_begin() const {
-    return oper_iterator(operands + HeaderSize);
+    return oper_iterator(operands + HeaderSize, operands,
+                         index ? &index->operOffsets : NULL);
   }
   oper_iterator oper_end() const {
-    return oper_iterator(operands + operandsSize);
+    return oper_iterator(operands + operandsSize, operands,
+                         index ? &index->operOffsets : NULL);
   }
 
   debug_iterator debug_begin() const {
@@ -0,0 +1,78 @@
+//===- brig_wavefront.h ---------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_WAVEFRONT_H
+#define BRIG_WAVEFRONT_H
+
+#include "brig_barrier.h"
+
+// Not included in C++98
+#include <stdint.h>
+
+namespace hsa {
+namespace brig {
+
+// The lanes of a wavefront are consecutive work-items of a work-group, each
+// on its own thread. The cross-lane instructions meet at the wavefront's
+// barrier and exchange values through a buffer with one slot per lane.
+//
+// Every lane of the wavefront must execute the same cross-lane instructions
+// in the same order, passing the number of cross-lane instructions it has
+// already executed as the phase. Consecutive phases use alternate halves of
+// the buffer, so one barrier per instruction is enough: a lane can only
+// write a half again after every lane has left the previous instruction on
+// that half.
+class Wavefront {
+
+ public:
+
+  enum { MaxSize = 64 };
+
+  Wavefront() { init(1, 0); }
+
+  // Lanes is the number of work-items in this wavefront, which is smaller
+  // than the wavefront size at the end of a work-group.
+  void init(uint32_t lanes, uint32_t spins);
+
+  uint32_t getLanes() const { return lanes_; }
+
+  // The mask of the lanes whose predicate is true.
+  uint64_t mask(uint32_t lane, uint32_t phase, bool pred);
+
+  // Returns the value of lane source. Lanes that do not exist read as 0.
+  uint32_t receive(uint32_t lane, uint32_t phase,
+                   uint32_t value, uint32_t source);
+
+  // Sends value to lane target and returns the value sent to this lane. If
+  // several lanes send to the same lane, the highest lane wins; a lane that
+  // nobody sends to reads 0.
+  uint32_t send(uint32_t lane, uint32_t phase,
+                uint32_t value, uint32_t target);
+
+  // Takes a lane out of the cross-lane instructions still to come, so the
+  // others no longer wait for it. What they read from its slots is stale.
+  void drop() { barrier_.drop(); }
+
+ private:
+
+  // Do not define
+  Wavefront(const Wavefront &) /* = delete */;
+  Wavefront &operator=(const Wavefront &) /* = delete */;
+
+  WorkGroupBarrier barrier_;
+  uint32_t lanes_;
+  // Each slot holds the phase and sending lane in its upper half, so stale
+  // slots and lower senders lose to the current highest sender.
+  uint64_t slots_[2][MaxSize];
+};
+
+} // namespace brig
+} // namespace hsa
+
+#endif // BRIG_WAVEFRONT_H
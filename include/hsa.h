@@ -362,6 +362,28 @@ typedef struct LaunchAttributes_ {
 
 } LaunchAttributes;
 
+/**
+ * @brief One kernel of a batch submitted with Queue::dispatchBatch.
+ */
+typedef struct BatchEntry_ {
+
+    hsa::Kernel *kernel;
+    LaunchAttributes launchAttr;
+    KernelArg *args;            /*!< copied when the batch is submitted */
+    uint32_t numArgs;
+
+    /*!<
+     * @brief Whether the kernel waits for every earlier kernel of the batch
+     * to complete before it starts. Clear it only for kernels that neither
+     * read nor write what the kernels before them since the last barrier
+     * write. Default is true.
+     */
+    bool barrier;
+
+    BatchEntry_() : kernel(NULL), args(NULL), numArgs(0), barrier(true) {}
+
+} BatchEntry;
+
 
 /**
  * @brief Allocate global memory that is shared by all devices
@@ -979,6 +1001,48 @@ public:
                                          hsa::vector<hsa::Event *> &depEvents,
                                          hsa::vector<KernelArg> &krnlArgs) = 0;
 
+    /**
+     * @brief Submits a batch of kernels that run back to back, in order, on
+     * one set of worker threads, without the cost of a dispatch per kernel.
+     * Kernels only wait for the kernels before them when their barrier is
+     * set.
+     *
+     * @param entries the kernels, their attributes and their arguments.
+     *
+     * @param numEntries number of entries.
+     *
+     * @param depEvents list of dependent events on which the batch must
+     * wait prior to starting the execution of its first kernel.
+     *
+     * @return hsa::Event * pointer to an event that is signalled once every
+     * kernel of the batch has completed.
+     */
+    virtual hsa::Event *dispatchBatch(const hsa::BatchEntry *entries,
+                                      uint32_t numEntries,
+                                      hsa::vector<hsa::Event *> &depEvents) = 0;
+
+    /**
+     * @brief Sets the queue's share of its device while kernels from other
+     * queues run on it at the same time. The device starts the
+     * work-groups of concurrent kernels in proportion to the weights of
+     * their queues, so a small kernel does not wait for a long-running
+     * kernel from another queue to finish.
+     *
+     * @param weight the queue's weight. The default is 1, and lower
+     * weights count as 1.
+     */
+    virtual void setWeight(uint32_t weight) = 0;
+
+    /**
+     * @brief Cancels every dispatch and batch submitted to the queue so
+     * far. Those that have not started complete without running. Those
+     * running stop before their next work-group, or at their next yield
+     * point if their kernels were compiled under SIMYIELD. Waiting on a
+     * cancelled command returns STATUS_CANCELLED, unless it completed
+     * first.
+     */
+    virtual void cancel() = 0;
+
     virtual void flush()=0;
 
 };
@@ -1009,6 +1073,23 @@ public:
 
    virtual hsa::string& getName()=0;
 
+   /** @brief Reserves group memory in the group segment of every
+     *        work-group of the kernel's later dispatches.
+     *
+     *        Group addresses are relative to the group segment. The
+     *        returned pointer is getGroupMemoryBase() plus the offset of
+     *        the reservation in the segment, so subtracting the base gives
+     *        the group address a kernel uses.
+     *
+     * @return NULL if the reservation does not fit in the group segment.
+     */
+    virtual void* allocateGroupMemory(size_t size, size_t align) = 0;
+
+   /** @brief Releases a reservation made by allocateGroupMemory.
+     *        NULL is ignored.
+     */
+    virtual void freeGroupMemory(const void* ptr) = 0;
+
    /** @brief Returns the starting address of the group memory
      *        in flat memory model.
      *
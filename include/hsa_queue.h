@@ -0,0 +1,94 @@
+//===- hsa_queue.h --------------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef HSA_QUEUE_H
+#define HSA_QUEUE_H
+
+// hsa.h and hsacore.h both declare an extern "C" getRuntime(), so no file
+// can include both. This header includes neither.
+#include "hsacommon.h"
+
+namespace hsacore {
+class Queue;
+}
+
+namespace hsa {
+
+class Device;
+class Kernel;
+
+// The packets of a user-mode queue. Every packet is one 64-byte slot of the
+// ring buffer. Producers get a slot from acquireWriteAddr(AqlPacketWords),
+// fill in everything but the header, and publish it with releaseWriteAddr,
+// which writes the header and rings the doorbell. Packets complete in the
+// order of their slots.
+struct AqlPacket {
+  // Owned by the queue: zero while the slot is free, and nonzero once it is
+  // published.
+  uint32_t header;
+  // hsacore::ISAKERNEL dispatches the kernel. Any other type does nothing
+  // but signal completion, which, as packets complete in order, makes it a
+  // barrier for the packets before it.
+  uint32_t type;
+  uint32_t groupCount;       // work-groups in the grid
+  uint32_t groupSize;        // work-items per work-group
+  uint64_t kernel;           // hsa::Kernel *
+  // KernelArg *, which must stay valid until the packet completes.
+  uint64_t kernarg;
+  uint32_t argCount;
+  // Bytes of group segment after the kernel's group variables.
+  uint32_t dynamicGroupSize;
+  // If not zero, the address of a uint32_t that is set to an AqlCompletion
+  // once the packet has completed.
+  uint64_t completion;
+  uint64_t reserved[2];
+};
+
+enum { AqlPacketWords = sizeof(AqlPacket) / sizeof(uint32_t) };
+
+// How a packet completed. A kernel fails without running if the device
+// refuses it, as when its group segment is too large, or if its arguments
+// do not fit the KernelArgs that hold them.
+enum AqlCompletion { AqlCompleted = 1, AqlFailed = 2 };
+
+// Creates a user-mode queue of size packets, which must be a power of two,
+// and starts its packet processor. Any number of threads may produce
+// packets concurrently: slots are reserved by atomically bumping the write
+// index, and nothing takes a lock unless the packet processor is asleep.
+// Returns NULL if the size is invalid. Kernels run on the given device, or
+// on the runtime's first device if it is NULL, with the weight as their
+// share of the device while kernels from other queues run on it, as for
+// Queue::setWeight.
+//
+// acquireWriteAddr and getWriteAddr return NULL when the queue is full.
+// At most MaxUserModeQueues queues exist at a time, and creating another
+// returns NULL. Every queue has VM id 0, since kernels run in the process's
+// own address space. detach stops the packet processor once the packet it
+// is running completes, and reattach restarts it; packets published in
+// between wait in the ring, and waitEmpty waits for reattach. alter waits
+// for the queue to empty, then takes schedPrior as the queue's weight if
+// it is positive. The ring cannot be replaced, nor the device's SIMDs
+// divided, so the buffer and SIMD share keep their old values, as the
+// interface specifies for invalid ones.
+enum { MaxUserModeQueues = 64 };
+hsacore::Queue *createUserModeQueue(uint32_t size, Device *device = NULL,
+                                    uint32_t weight = 1);
+
+// Runs a kernel to completion on a device, or on the runtime's first device
+// if it is NULL, with the given weight. The packet processors use it to run
+// ISAKERNEL packets.
+// Returns false if the device refused the kernel, or if it has fewer
+// arguments than parameters or a parameter larger than a KernelArg.
+bool runKernel(Device *device, Kernel *kernel, uint32_t groupCount,
+               uint32_t groupSize, size_t dynamicGroupSize, KernelArg *args,
+               uint32_t argCount, uint32_t weight = 1);
+
+} // namespace hsa
+
+#endif // HSA_QUEUE_H
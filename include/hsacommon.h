@@ -1190,6 +1190,9 @@ typedef enum {
     // Failed due to the memory type being unsupported
     STATUS_UNSUPPORTED = -9,
 
+    /// The command was cancelled before it completed
+    STATUS_CANCELLED = -10,
+
     /// Not categorized yet!!!
     STATUS_UNCATEGORIZED = -15
 
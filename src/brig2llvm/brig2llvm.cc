@@ -18,18 +18,31 @@
 
 #include "llvm/DIBuilder.h"
 #include "llvm/DebugInfo.h"
+#include "llvm/Linker.h"
+#include "llvm/PassManager.h"
 #include "llvm/Analysis/Verifier.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Dwarf.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include <cstdlib>
+#include <map>
+#include <vector>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 namespace hsa{
@@ -70,7 +83,10 @@ static llvm::StructType *createSOAType(llvm::LLVMContext &C,
   return soa_type;
 }
 
-static void insertGPUStateTy(llvm::LLVMContext &C) {
+static void insertGPUStateTy(llvm::LLVMContext &C, llvm::Module *M) {
+  // Modules linked together share a context, and so the register types.
+  if (M->getTypeByName("struct.regs")) return;
+
   llvm::StructType *c_reg_type =
     createSOAType(C, llvm::Type::getInt1Ty(C), "c_regs", 8);
   llvm::StructType *s_reg_type =
@@ -116,7 +132,9 @@ static llvm::Type *runOnType(llvm::LLVMContext &C, BrigType type) {
     case BRIG_TYPE_ROIMG: case BRIG_TYPE_RWIMG: case BRIG_TYPE_SAMP:
       return llvm::Type::getInt64Ty(C);
     case BRIG_TYPE_F16:
-      return llvm::Type::getHalfTy(C);
+      // The runtime stores halves as their 16 bits and does the arithmetic
+      // itself, so they are passed around as integers.
+      return llvm::Type::getInt16Ty(C);
     case BRIG_TYPE_F32:
       return llvm::Type::getFloatTy(C);
     case BRIG_TYPE_F64:
@@ -184,9 +202,31 @@ static unsigned getRegOffset(const BrigString *name) {
 typedef std::map<uint32_t, llvm::Function *> FunMap;
 typedef std::map<const void *, llvm::Value *> SymbolMap;
 
+// Group segment variables are shared by the work-items of a work-group.
+// They are laid out at fixed offsets from a base that the engine gives each
+// work-group, and every function addresses them off that base.
+struct GroupSegment {
+  typedef std::map<const void *, std::pair<uint64_t, llvm::Type *> > VarMap;
+  typedef VarMap::const_iterator VarIt;
+
+  VarMap vars;
+  uint64_t size;
+
+  GroupSegment(uint64_t size) : size(size) {}
+
+  void add(const BrigSymbol &S, llvm::Type *type, const llvm::DataLayout &DL) {
+    uint64_t align = std::max(uint64_t(S.getAlign()),
+                              uint64_t(DL.getPrefTypeAlignment(type)));
+    size = (size + align - 1) / align * align;
+    vars[S.getAddr()] = std::make_pair(size, type);
+    size += DL.getTypeAllocSize(type);
+  }
+};
+
 struct ModScope {
   FunMap &funMap;
   SymbolMap &symbolMap;
+  GroupSegment &group;
   llvm::DIContext *debugInfo;
   const Callback callback;
   const CallbackData cbd;
@@ -194,11 +234,12 @@ struct ModScope {
 
   ModScope(FunMap &funMap,
            SymbolMap &symbolMap,
+           GroupSegment &group,
            llvm::DIContext *debugInfo,
            const Callback callback,
            const CallbackData cbd,
            llvm::DIBuilder &DB) :
-    funMap(funMap), symbolMap(symbolMap),
+    funMap(funMap), symbolMap(symbolMap), group(group),
     debugInfo(debugInfo), callback(callback), cbd(cbd),
     DB(DB) {}
 };
@@ -251,10 +292,30 @@ struct FunScope {
           E = brigFun.local_end(); local != E; ++local) {
       llvm::StringRef name = getStringRef(local.getName());
       llvm::Type *type = runOnType(C, local);
+      if (local.getStorageClass() == BRIG_SEGMENT_GROUP) {
+        parent.group.add(local, type, DL);
+        continue;
+      }
       parent.symbolMap[local.getAddr()] =
         new llvm::AllocaInst(type, name, &entry);
     }
 
+    if (!parent.group.vars.empty()) {
+      llvm::FunctionType *getGroupBaseTy =
+        llvm::FunctionType::get(llvm::Type::getInt8PtrTy(C), false);
+      llvm::Constant *getGroupBase =
+        M->getOrInsertFunction("getGroupBase", getGroupBaseTy);
+      llvm::Value *base = builder.CreateCall(getGroupBase);
+
+      const GroupSegment::VarMap &vars = parent.group.vars;
+      for (GroupSegment::VarIt it = vars.begin(), E = vars.end();
+           it != E; ++it) {
+        llvm::Value *addr = builder.CreateConstGEP1_64(base, it->second.first);
+        llvm::Type *ptrTy = it->second.second->getPointerTo(0);
+        parent.symbolMap[it->first] = builder.CreateBitCast(addr, ptrTy);
+      }
+    }
+
     if (!hasDebugInfo()) return;
 
     BrigControlBlock firstCB = brigFun.begin();
@@ -529,6 +590,11 @@ static llvm::Type *getOperandTy(llvm::LLVMContext &C,
   if ((inst->opcode == BRIG_OPCODE_SHUFFLE && opnum == 3))
     return runOnType(C, BRIG_TYPE_U64);
 
+  // Predicates may be c or s registers.
+  if ((inst->opcode == BRIG_OPCODE_COUNTLANE && opnum == 1) ||
+     (inst->opcode == BRIG_OPCODE_MASKLANE  && opnum == 1))
+    return runOnType(C, BRIG_TYPE_U32);
+
   return destType;
 }
 
@@ -625,7 +691,8 @@ static bool isSRet(const inst_iterator inst) {
   if (isI386())
     return
       BrigInstHelper::hasDest(inst) &&
-      BrigInstHelper::isVectorTy(BrigType(inst->type));
+      (BrigInstHelper::isVectorTy(BrigType(inst->type)) ||
+       inst->type == BRIG_TYPE_F16);
 
   if (isARM()) {
     BrigType type = BrigType(inst->type);
@@ -633,6 +700,7 @@ static bool isSRet(const inst_iterator inst) {
       return
         type == BRIG_TYPE_U8X8  || type == BRIG_TYPE_S8X8  ||
         type == BRIG_TYPE_U16X4 || type == BRIG_TYPE_S16X4 ||
+        type == BRIG_TYPE_F16X4 ||
         type == BRIG_TYPE_U32X2 || type == BRIG_TYPE_S32X2 ||
         type == BRIG_TYPE_B128;
 
@@ -752,6 +820,18 @@ static void insertDebugCallback(llvm::BasicBlock &B,
   llvm::CallInst::Create(cbFPValue, args, "", &B);
 }
 
+// The kernarg segment does not change while a kernel runs, so loads from
+// it need no runtime function.
+static bool isKernargLoad(const inst_iterator inst,
+                          const std::vector<llvm::Value *> &sources) {
+  const BrigInstMem *mem = dyn_cast<BrigInstMem>(inst);
+  if (!mem || inst->opcode != BRIG_OPCODE_LD ||
+      mem->segment != BRIG_SEGMENT_KERNARG || sources.size() != 1)
+    return false;
+  llvm::Type *type = runOnType(sources[0]->getContext(), BrigType(inst->type));
+  return sources[0]->getType() == type->getPointerTo();
+}
+
 static void runOnComplexInst(llvm::BasicBlock &B,
                              const inst_iterator inst,
                              const BrigInstHelper &helper,
@@ -784,8 +864,13 @@ static void runOnComplexInst(llvm::BasicBlock &B,
   }
 
   llvm::Module *M = B.getParent()->getParent();
-  llvm::Function *instFun = getInstFun(inst, sources, M);
-  llvm::Value *resultRaw = llvm::CallInst::Create(instFun, sources, "", &B);
+  llvm::Value *resultRaw;
+  if (!sret && isKernargLoad(inst, sources)) {
+    resultRaw = new llvm::LoadInst(sources[0], "", false, &B);
+  } else {
+    llvm::Function *instFun = getInstFun(inst, sources, M);
+    resultRaw = llvm::CallInst::Create(instFun, sources, "", &B);
+  }
 
   if (destAddr && !sret) {
     llvm::PointerType *destPtrTy =
@@ -800,6 +885,131 @@ static void runOnComplexInst(llvm::BasicBlock &B,
   if (ftz) insertDisableFtz(B);
 }
 
+static bool isImageQuery(const inst_iterator inst) {
+  switch (inst->opcode) {
+    case BRIG_OPCODE_QUERYIMAGEARRAY:
+    case BRIG_OPCODE_QUERYIMAGEDEPTH:
+    case BRIG_OPCODE_QUERYIMAGEFORMAT:
+    case BRIG_OPCODE_QUERYIMAGEHEIGHT:
+    case BRIG_OPCODE_QUERYIMAGEORDER:
+    case BRIG_OPCODE_QUERYIMAGEWIDTH:
+    case BRIG_OPCODE_QUERYSAMPLERCOORD:
+    case BRIG_OPCODE_QUERYSAMPLERFILTER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Images and samplers are 64-bit handles, either in a register or in the
+// memory an address operand names.
+static llvm::Value *getHandle(llvm::BasicBlock &B,
+                              const BrigOperandBase *op,
+                              const BrigInstHelper &helper,
+                              const FunScope &scope) {
+
+  llvm::LLVMContext &C = B.getContext();
+  llvm::Type *int64Ty = llvm::Type::getInt64Ty(C);
+  llvm::Value *value = getOperand(B, op, helper, scope);
+
+  if (isa<BrigOperandAddress>(op)) {
+    llvm::Type *handlePtrTy = int64Ty->getPointerTo(0);
+    llvm::Instruction::CastOps castOp =
+      llvm::CastInst::getCastOpcode(value, false, handlePtrTy, false);
+    llvm::Value *addr =
+      llvm::CastInst::Create(castOp, value, handlePtrTy, "", &B);
+    return new llvm::LoadInst(addr, "", false, &B);
+  }
+
+  if (value->getType() == int64Ty) return value;
+  return llvm::CastInst::CreateZExtOrBitCast(value, int64Ty, "", &B);
+}
+
+// Image instructions name up to four registers for the texel and up to
+// three for the coordinates. The runtime always takes four texel registers
+// and three coordinates, so the translator pads both.
+static void runOnImageInst(llvm::BasicBlock &B,
+                           const inst_iterator inst,
+                           const BrigInstHelper &helper,
+                           const FunScope &scope) {
+
+  llvm::LLVMContext &C = B.getContext();
+  llvm::Module *M = B.getParent()->getParent();
+  llvm::Type *int32Ty = llvm::Type::getInt32Ty(C);
+  std::string name = BrigInstHelper::getInstName(inst);
+  std::vector<llvm::Value *> args;
+
+  if (isImageQuery(inst)) {
+    const BrigOperandBase *dest = helper.getOperand(inst, 0);
+    llvm::Value *destAddr = getOperandAddr(B, dest, helper, scope);
+    args.push_back(getHandle(B, helper.getOperand(inst, 1), helper, scope));
+
+    llvm::Type *paramTy[] = { args[0]->getType() };
+    llvm::FunctionType *queryTy =
+      llvm::FunctionType::get(int32Ty, paramTy, false);
+    llvm::Constant *query = M->getOrInsertFunction(name, queryTy);
+    llvm::Value *result = llvm::CallInst::Create(query, args, "", &B);
+    new llvm::StoreInst(result, destAddr, &B);
+    return;
+  }
+
+  const BrigInstImage *image = cast<BrigInstImage>(inst);
+  bool isStore = inst->opcode == BRIG_OPCODE_STIMAGE;
+  unsigned operand = 0;
+
+  const BrigOperandRegVector *texel =
+    cast<BrigOperandRegVector>(helper.getOperand(inst, operand++));
+  llvm::Type *texelTy = isStore ? int32Ty : int32Ty->getPointerTo(0);
+  for (unsigned i = 0; i < 4; ++i) {
+    if (i >= texel->regCount) {
+      args.push_back(llvm::Constant::getNullValue(texelTy));
+      continue;
+    }
+    llvm::Value *regAddr =
+      getRegAddr(B, helper.getRegName(texel, i), helper, scope);
+    args.push_back(isStore ? new llvm::LoadInst(regAddr, "", false, &B) :
+                             regAddr);
+  }
+
+  args.push_back(getHandle(B, helper.getOperand(inst, operand++),
+                           helper, scope));
+  if (inst->opcode == BRIG_OPCODE_RDIMAGE)
+    args.push_back(getHandle(B, helper.getOperand(inst, operand++),
+                             helper, scope));
+
+  std::vector<llvm::Value *> coords;
+  const BrigOperandBase *coordOp = helper.getOperand(inst, operand);
+  if (const BrigOperandRegVector *vec =
+      dyn_cast<BrigOperandRegVector>(coordOp)) {
+    for (unsigned i = 0; i < vec->regCount; ++i) {
+      llvm::Value *regAddr =
+        getRegAddr(B, helper.getRegName(vec, i), helper, scope);
+      coords.push_back(new llvm::LoadInst(regAddr, "", false, &B));
+    }
+  } else {
+    coords.push_back(getOperand(B, coordOp, helper, scope));
+  }
+
+  llvm::Type *coordTy = runOnType(C, BrigType(image->coordType));
+  for (unsigned i = 0; i < 3; ++i) {
+    if (i >= coords.size()) {
+      args.push_back(llvm::Constant::getNullValue(coordTy));
+    } else if (coords[i]->getType() != coordTy) {
+      args.push_back(new llvm::BitCastInst(coords[i], coordTy, "", &B));
+    } else {
+      args.push_back(coords[i]);
+    }
+  }
+
+  std::vector<llvm::Type *> params;
+  for (unsigned i = 0; i < args.size(); ++i)
+    params.push_back(args[i]->getType());
+  llvm::FunctionType *imageFunTy =
+    llvm::FunctionType::get(llvm::Type::getVoidTy(C), params, false);
+  llvm::Constant *imageFun = M->getOrInsertFunction(name, imageFunTy);
+  llvm::CallInst::Create(imageFun, args, "", &B);
+}
+
 static void runOnDirectBranchInst(llvm::BasicBlock &B,
                                   const inst_iterator inst,
                                   const BrigInstHelper &helper,
@@ -925,6 +1135,8 @@ static void runOnInstruction(llvm::BasicBlock &B,
     runOnIndirectBranchInst(B, inst, helper, scope);
   } else if (inst->opcode == BRIG_OPCODE_CALL) {
     runOnCallInst(B, inst, helper, scope);
+  } else if (isa<BrigInstImage>(inst) || isImageQuery(inst)) {
+    runOnImageInst(B, inst, helper, scope);
   } else {
     runOnComplexInst(B, inst, helper, scope);
   }
@@ -975,32 +1187,74 @@ static void runOnCB(llvm::Function &F, const BrigControlBlock &CB,
   }
 }
 
+// Each argument sits in the kernarg segment at the next offset aligned to
+// its size, up to 16 bytes.
+static uint64_t layoutKernargs(const llvm::DataLayout &DL,
+                               llvm::FunctionType *funTy,
+                               std::vector<uint64_t> &offsets,
+                               std::vector<uint64_t> &sizes) {
+  uint64_t segmentSize = 0;
+  for (unsigned i = 0; i < funTy->getNumParams(); ++i) {
+    llvm::Type *argTy =
+      llvm::cast<llvm::PointerType>(funTy->getParamType(i))->getElementType();
+    uint64_t size = DL.getTypeStoreSize(argTy);
+    uint64_t align = 1;
+    while (align < size && align < 16) align <<= 1;
+    segmentSize = (segmentSize + align - 1) / align * align;
+    offsets.push_back(segmentSize);
+    sizes.push_back(size);
+    segmentSize += size;
+  }
+  return segmentSize;
+}
+
+// The engine lays out the kernarg segment of a kernel by the array of
+// 64-bit integers in this variable, suffixed with the name of the kernel:
+// the size of the segment, then the offset and size of each argument. The
+// kernel itself may be inlined into its trampoline.
+static const char kernargLayoutPrefix[] = "__brigKernargLayout.";
+
+static void setKernargLayout(llvm::Module &M, llvm::StringRef name,
+                             uint64_t segmentSize,
+                             const std::vector<uint64_t> &offsets,
+                             const std::vector<uint64_t> &sizes) {
+  std::vector<uint64_t> layout(1, segmentSize);
+  for (unsigned i = 0; i < offsets.size(); ++i) {
+    layout.push_back(offsets[i]);
+    layout.push_back(sizes[i]);
+  }
+  llvm::Constant *init =
+    llvm::ConstantDataArray::get(M.getContext(), layout);
+  new llvm::GlobalVariable(M, init->getType(), true,
+                           llvm::GlobalValue::ExternalLinkage, init,
+                           kernargLayoutPrefix + name);
+}
+
 static llvm::Value *getParameter(llvm::BasicBlock *bb,
-                                 llvm::Value *argArray,
+                                 llvm::Value *kernarg,
                                  llvm::Type *paramTy,
-                                 unsigned paramNo) {
+                                 uint64_t offset) {
   llvm::LLVMContext &C = bb->getContext();
-  llvm::Value *offset =
-    llvm::ConstantInt::get(llvm::Type::getInt32Ty(C), paramNo);
-  llvm::Value *gep = llvm::GetElementPtrInst::Create(argArray, offset, "", bb);
-
-  llvm::Value *load = new llvm::LoadInst(gep, "", bb);
-  return new llvm::BitCastInst(load, paramTy, "", bb);
+  llvm::Value *offsetValue =
+    llvm::ConstantInt::get(llvm::Type::getInt64Ty(C), offset);
+  llvm::Value *gep =
+    llvm::GetElementPtrInst::Create(kernarg, offsetValue, "", bb);
+  return new llvm::BitCastInst(gep, paramTy, "", bb);
 }
 
 
 // We create a trampoline with the function signature:
-// void fun(char **argv)
-// The real function arguments are encoded in the argv array.
+// void fun(ThreadInfo *info, char *kernarg)
+// The real function arguments live in the kernarg segment, which every
+// work-item of a dispatch shares, and the kernel reads them in place.
 static void makeKernelTrampoline(llvm::Function *fun, llvm::StringRef name) {
 
   llvm::LLVMContext &C = fun->getContext();
   llvm::Module *M = fun->getParent();
 
   llvm::Type *voidTy = llvm::Type::getVoidTy(C);
-  llvm::Type *trampArgs[] = {
-    llvm::Type::getInt8Ty(C)->getPointerTo()->getPointerTo()
-  };
+  llvm::Type *int8PtrTy = llvm::Type::getInt8PtrTy(C);
+  llvm::Type *trampArgs[] = { int8PtrTy, int8PtrTy };
   llvm::FunctionType *trampFunTy =
     llvm::FunctionType::get(voidTy, trampArgs, false);
   llvm::GlobalValue::LinkageTypes linkage = fun->getLinkage();
@@ -1009,17 +1263,22 @@ static void makeKernelTrampoline(llvm::Function *fun, llvm::StringRef name) {
     llvm::Function::Create(trampFunTy, linkage, name, fun->getParent());
   llvm::BasicBlock *bb = llvm::BasicBlock::Create(C, "", trampFun);
 
-  llvm::Value *argArray = trampFun->arg_begin();
-  llvm::Type *int8PtrTy = llvm::Type::getInt8PtrTy(C);
-  llvm::Value *args[] = { getParameter(bb, argArray, int8PtrTy, 0) };
+  llvm::Function::arg_iterator trampArg = trampFun->arg_begin();
+  llvm::Value *args[] = { trampArg++ };
+  llvm::Value *kernarg = trampArg;
   llvm::Value *setThreadInfoFun = M->getFunction("__setThreadInfo");
   llvm::CallInst::Create(setThreadInfoFun, args, "", bb);
 
   llvm::FunctionType *funTy = fun->getFunctionType();
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> sizes;
+  uint64_t segmentSize =
+    layoutKernargs(llvm::DataLayout(M), funTy, offsets, sizes);
+  setKernargLayout(*M, name, segmentSize, offsets, sizes);
   std::vector<llvm::Value *> trampParams;
   for (unsigned i = 0; i < fun->arg_size(); ++i) {
     llvm::Type *paramTy = funTy->getParamType(i);
-    trampParams.push_back(getParameter(bb, argArray, paramTy, i + 1));
+    trampParams.push_back(getParameter(bb, kernarg, paramTy, offsets[i]));
   }
 
   llvm::CallInst::Create(fun, trampParams, "", bb);
@@ -1047,6 +1306,84 @@ static llvm::Function *createFunctionDecl(llvm::Module &M,
   return llvm::Function::Create(funTy, linkage, name, &M);
 }
 
+// A yield point checks __brigYieldFlag and calls __brigYield if it is set,
+// then goes on to dest. The branch is weighted as almost never taken, so
+// the check costs a load and a predicted branch.
+static llvm::BasicBlock *createYieldPoint(llvm::Function &F,
+                                          llvm::BasicBlock *dest) {
+  llvm::LLVMContext &C = F.getContext();
+  llvm::Module *M = F.getParent();
+  llvm::Type *int32Ty = llvm::Type::getInt32Ty(C);
+  llvm::Constant *flag = M->getOrInsertGlobal("__brigYieldFlag", int32Ty);
+  llvm::FunctionType *yieldTy =
+    llvm::FunctionType::get(llvm::Type::getVoidTy(C), false);
+  llvm::Constant *yield = M->getOrInsertFunction("__brigYield", yieldTy);
+
+  llvm::BasicBlock *check =
+    llvm::BasicBlock::Create(C, dest->getName() + ".yield", &F);
+  llvm::BasicBlock *slow =
+    llvm::BasicBlock::Create(C, dest->getName() + ".yielding", &F);
+  llvm::Value *pending = new llvm::LoadInst(flag, "", true, check);
+  llvm::Value *raised =
+    new llvm::ICmpInst(*check, llvm::ICmpInst::ICMP_NE, pending,
+                       llvm::ConstantInt::get(int32Ty, 0));
+  llvm::BranchInst *branch =
+    llvm::BranchInst::Create(slow, dest, raised, check);
+  branch->setMetadata(llvm::LLVMContext::MD_prof,
+                      llvm::MDBuilder(C).createBranchWeights(1, 1 << 20));
+  llvm::CallInst::Create(yield, "", slow);
+  llvm::BranchInst::Create(dest, slow);
+  return check;
+}
+
+// Puts a yield point at the entry of the function and on every edge that
+// closes a loop, so that a work-item runs a bounded stretch of code between
+// two of them, however long the kernel runs.
+static void insertYieldPoints(llvm::Function &F) {
+  typedef std::pair<llvm::BasicBlock *, unsigned> Step;
+  typedef std::pair<llvm::TerminatorInst *, unsigned> Edge;
+
+  // The edges to a block still on the path of a depth-first search close a
+  // loop.
+  llvm::BasicBlock *entry = &F.getEntryBlock();
+  std::map<llvm::BasicBlock *, bool> onPath;
+  std::vector<Step> path;
+  std::vector<Edge> backEdges;
+  onPath[entry] = true;
+  path.push_back(Step(entry, 0));
+  while (!path.empty()) {
+    llvm::TerminatorInst *term = path.back().first->getTerminator();
+    unsigned succ = path.back().second++;
+    if (succ == term->getNumSuccessors()) {
+      onPath[path.back().first] = false;
+      path.pop_back();
+      continue;
+    }
+    llvm::BasicBlock *next = term->getSuccessor(succ);
+    std::map<llvm::BasicBlock *, bool>::iterator it = onPath.find(next);
+    if (it == onPath.end()) {
+      onPath[next] = true;
+      path.push_back(Step(next, 0));
+    } else if (it->second) {
+      backEdges.push_back(Edge(term, succ));
+    }
+  }
+
+  for (unsigned i = 0; i < backEdges.size(); ++i) {
+    llvm::TerminatorInst *term = backEdges[i].first;
+    unsigned succ = backEdges[i].second;
+    term->setSuccessor(succ, createYieldPoint(F, term->getSuccessor(succ)));
+  }
+
+  // The allocas stay in the entry block, where mem2reg looks for them.
+  llvm::BasicBlock::iterator first = entry->begin();
+  while (llvm::isa<llvm::AllocaInst>(&*first)) ++first;
+  llvm::BasicBlock *body =
+    entry->splitBasicBlock(first, entry->getName() + ".body");
+  entry->getTerminator()->eraseFromParent();
+  llvm::BranchInst::Create(createYieldPoint(F, body), entry);
+}
+
 static void runOnFunction(llvm::Module &M, const BrigFunction &F,
                           ModScope &mScope) {
 
@@ -1067,6 +1404,8 @@ static void runOnFunction(llvm::Module &M, const BrigFunction &F,
     runOnCB(*fun, cb, fScope);
   }
 
+  if (getenv("SIMYIELD")) insertYieldPoints(*fun);
+
   llvm::StringRef nameRef = getStringRef(F.getName());
   if (F.isKernel()) makeKernelTrampoline(fun, nameRef);
 }
@@ -1107,7 +1446,7 @@ static llvm::Constant *runOnInitializer(llvm::LLVMContext &C,
 }
 
 static void runOnGlobal(llvm::Module &M, const BrigSymbol &S,
-                        SymbolMap &symbolMap) {
+                        SymbolMap &symbolMap, bool isLinking) {
   llvm::LLVMContext &C = M.getContext();
   llvm::Type *type = runOnType(C, S);
   bool isConst = S.isConst();
@@ -1133,6 +1472,9 @@ static void runOnGlobal(llvm::Module &M, const BrigSymbol &S,
     } else {
       assert(false && "Unimplemented");
     }
+  } else if (isLinking && S.getLinkage() == BRIG_LINKAGE_EXTERN) {
+    // Defined in another module
+    init = NULL;
   } else {
     init = llvm::Constant::getNullValue(type);
   }
@@ -1174,27 +1516,31 @@ llvm::DIContext *runOnDebugInfo(const BrigModule &M) {
   return NULL;
 }
 
-BrigProgram GenLLVM::getLLVMModule(const BrigModule &M,
-                                   Callback callback,
-                                   CallbackData cbd) {
-
-  if (!M.isValid()) return NULL;
+static llvm::Module *translate(const BrigModule &M,
+                               llvm::LLVMContext &C,
+                               llvm::DIContext *debugInfo,
+                               Callback callback,
+                               CallbackData cbd,
+                               bool isLinking,
+                               GroupSegment &group) {
 
-  llvm::LLVMContext *C = new llvm::LLVMContext();
-  llvm::Module *mod = new llvm::Module("BRIG", *C);
-  llvm::DIContext *debugInfo = runOnDebugInfo(M);
+  llvm::Module *mod = new llvm::Module("BRIG", C);
 
   llvm::DIBuilder DB(*mod);
   DB.createCompileUnit(llvm::dwarf::DW_LANG_lo_user,
                        "-", "", "brig2llvm", true, "", 0);
 
-  insertGPUStateTy(*C);
-  insertSetThreadInfo(*C, mod);
+  insertGPUStateTy(C, mod);
+  insertSetThreadInfo(C, mod);
 
   SymbolMap symbolMap;
+  llvm::DataLayout DL(mod);
   for (BrigSymbol symbol = M.global_begin(),
         E = M.global_end(); symbol != E; ++symbol) {
-    runOnGlobal(*mod, symbol, symbolMap);
+    if (symbol.getStorageClass() == BRIG_SEGMENT_GROUP)
+      group.add(symbol, runOnType(C, symbol), DL);
+    else
+      runOnGlobal(*mod, symbol, symbolMap, isLinking);
   }
 
   FunMap funMap;
@@ -1202,16 +1548,242 @@ BrigProgram GenLLVM::getLLVMModule(const BrigModule &M,
     funMap[fun.getOffset()] = createFunctionDecl(*mod, fun);
   }
 
-  ModScope scope(funMap, symbolMap, debugInfo, callback, cbd, DB);
+  ModScope scope(funMap, symbolMap, group, debugInfo, callback, cbd, DB);
   for (BrigFunction fun = M.begin(), E = M.end(); fun != E; ++fun) {
     runOnFunction(*mod, fun, scope);
   }
 
   DB.finalize();
 
+  return mod;
+}
+
+// The engine reads the size of the group segment from this variable.
+static const char groupSegmentSizeName[] = "__brigGroupSegmentSize";
+
+static void setGroupSegmentSize(llvm::Module &M, uint64_t size) {
+  if (!size) return;
+  llvm::Type *int64Ty = llvm::Type::getInt64Ty(M.getContext());
+  new llvm::GlobalVariable(M, int64Ty, true,
+                           llvm::GlobalValue::ExternalLinkage,
+                           llvm::ConstantInt::get(int64Ty, size),
+                           groupSegmentSizeName);
+}
+
+uint64_t GenLLVM::getGroupSegmentSize(const llvm::Module *M) {
+  const llvm::GlobalVariable *GV = M->getNamedGlobal(groupSegmentSizeName);
+  if (!GV || !GV->hasInitializer()) return 0;
+  return llvm::cast<llvm::ConstantInt>(GV->getInitializer())->getZExtValue();
+}
+
+uint64_t GenLLVM::getKernargLayout(const llvm::Function *entry,
+                                   std::vector<uint64_t> &offsets,
+                                   std::vector<uint64_t> &sizes) {
+  // Fused kernels have no layout.
+  const llvm::Module *M = entry->getParent();
+  const llvm::GlobalVariable *GV =
+    M->getNamedGlobal((kernargLayoutPrefix + entry->getName()).str());
+  if (!GV || !GV->hasInitializer()) return 0;
+  // A kernel without arguments has an all zero layout.
+  const llvm::ConstantDataSequential *layout =
+    llvm::dyn_cast<llvm::ConstantDataSequential>(GV->getInitializer());
+  if (!layout) return 0;
+  for (unsigned i = 1; i + 1 < layout->getNumElements(); i += 2) {
+    offsets.push_back(layout->getElementAsInteger(i));
+    sizes.push_back(layout->getElementAsInteger(i + 1));
+  }
+  return layout->getElementAsInteger(0);
+}
+
+BrigProgram GenLLVM::getLLVMModule(const BrigModule &M,
+                                   Callback callback,
+                                   CallbackData cbd) {
+
+  if (!M.isValid()) return NULL;
+
+  llvm::LLVMContext *C = new llvm::LLVMContext();
+  llvm::DIContext *debugInfo = runOnDebugInfo(M);
+  GroupSegment group(0);
+  llvm::Module *mod =
+    translate(M, *C, debugInfo, callback, cbd, false, group);
+  setGroupSegmentSize(*mod, group.size);
+
   return BrigProgram(mod, debugInfo);
 }
 
+// Linked programs, keyed by the checksum and size of each module in link
+// order. An entry keeps the contents of its modules, compared on every hit so
+// that a checksum collision is a miss, and the linked module as bitcode, which
+// each caller parses into a module and context of its own. Engines may then
+// change their module freely, and the cache holds no LLVM objects. The least
+// recently used entry is evicted once the cache is full.
+typedef std::vector<uint64_t> LinkKey;
+struct LinkEntry {
+  std::string contents;
+  std::string bitcode;
+  uint64_t lastUse;
+};
+typedef std::map<LinkKey, LinkEntry> LinkCache;
+enum { LinkCacheSize = 8 };
+static LinkCache linkCache;
+static uint64_t linkCacheClock;
+static pthread_mutex_t linkCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool findLinked(const LinkKey &key, const std::string &contents,
+                       std::string &bitcode) {
+  pthread_mutex_lock(&linkCacheLock);
+  LinkCache::iterator it = linkCache.find(key);
+  bool found = it != linkCache.end() && it->second.contents == contents;
+  if (found) {
+    it->second.lastUse = ++linkCacheClock;
+    bitcode = it->second.bitcode;
+  }
+  pthread_mutex_unlock(&linkCacheLock);
+  return found;
+}
+
+static void insertLinked(const LinkKey &key, const std::string &contents,
+                         const llvm::Module &M) {
+  LinkEntry entry;
+  entry.contents = contents;
+  llvm::raw_string_ostream os(entry.bitcode);
+  llvm::WriteBitcodeToFile(&M, os);
+  os.flush();
+
+  pthread_mutex_lock(&linkCacheLock);
+  if (linkCache.size() >= LinkCacheSize && !linkCache.count(key)) {
+    LinkCache::iterator oldest = linkCache.begin();
+    for (LinkCache::iterator it = linkCache.begin(), E = linkCache.end();
+         it != E; ++it) {
+      if (it->second.lastUse < oldest->second.lastUse) oldest = it;
+    }
+    linkCache.erase(oldest);
+  }
+  entry.lastUse = ++linkCacheClock;
+  linkCache[key] = entry;
+  pthread_mutex_unlock(&linkCacheLock);
+}
+
+// Parses a cached program into a new context.
+static llvm::Module *parseLinked(const std::string &bitcode) {
+  llvm::LLVMContext *C = new llvm::LLVMContext();
+  llvm::MemoryBuffer *buffer =
+    llvm::MemoryBuffer::getMemBuffer(bitcode, "", false);
+  llvm::Module *M = llvm::ParseBitcodeFile(buffer, *C);
+  delete buffer;
+  if (!M) delete C;
+  return M;
+}
+
+static bool linkError(std::string *errMsg, const std::string &msg) {
+  if (errMsg) *errMsg = msg;
+  return false;
+}
+
+// Checks that every extern function and variable declared by the modules is
+// defined by one of them.
+static bool checkExterns(const std::vector<const BrigModule *> &modules,
+                         const llvm::Module &linked,
+                         std::string *errMsg) {
+  for (unsigned i = 0; i < modules.size(); ++i) {
+    const BrigModule &M = *modules[i];
+
+    for (BrigFunction fun = M.begin(), E = M.end(); fun != E; ++fun) {
+      if (!fun.isDeclaration() || fun.isKernel()) continue;
+      llvm::StringRef name = getStringRef(fun.getName());
+      const llvm::Function *F = linked.getFunction(name);
+      if (!F || F->isDeclaration())
+        return linkError(errMsg, "Unresolved function: " + name.str());
+    }
+
+    for (BrigSymbol symbol = M.global_begin(),
+          E = M.global_end(); symbol != E; ++symbol) {
+      if (symbol.getLinkage() != BRIG_LINKAGE_EXTERN) continue;
+      llvm::StringRef name = getStringRef(symbol.getName());
+      const llvm::GlobalVariable *G = linked.getGlobalVariable(name);
+      if (!G || G->isDeclaration())
+        return linkError(errMsg, "Unresolved variable: " + name.str());
+    }
+  }
+
+  return true;
+}
+
+static void optimizeLinkedModule(llvm::Module &M) {
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = 2;
+  builder.Inliner = llvm::createFunctionInliningPass();
+
+  llvm::PassManager PM;
+  builder.populateModulePassManager(PM);
+  PM.run(M);
+}
+
+BrigProgram GenLLVM::linkLLVMModules(
+  const std::vector<const BrigModule *> &modules,
+  std::string *errMsg) {
+
+  if (modules.empty()) {
+    linkError(errMsg, "Nothing to link");
+    return NULL;
+  }
+
+  LinkKey key;
+  std::string contents;
+  for (unsigned i = 0; i < modules.size(); ++i) {
+    if (!modules[i]->isValid()) {
+      linkError(errMsg, "Invalid module");
+      return NULL;
+    }
+    key.push_back((uint64_t(modules[i]->getSize()) << 32) |
+                  modules[i]->getChecksum());
+    modules[i]->appendContents(contents);
+  }
+
+  std::string bitcode;
+  if (findLinked(key, contents, bitcode)) {
+    if (llvm::Module *M = parseLinked(bitcode)) return BrigProgram(M);
+  }
+
+  llvm::LLVMContext *C = new llvm::LLVMContext();
+  // The modules share one group segment, each after the one before.
+  GroupSegment group(0);
+  llvm::Module *linked =
+    translate(*modules[0], *C, NULL, NULL, NULL, true, group);
+
+  for (unsigned i = 1; i < modules.size(); ++i) {
+    GroupSegment next(group.size);
+    llvm::Module *mod =
+      translate(*modules[i], *C, NULL, NULL, NULL, true, next);
+    group.size = next.size;
+    std::string linkMsg;
+    bool failed = llvm::Linker::LinkModules(linked, mod,
+                                            llvm::Linker::DestroySource,
+                                            &linkMsg);
+    delete mod;
+    if (failed) {
+      linkError(errMsg, linkMsg);
+      delete linked;
+      delete C;
+      return NULL;
+    }
+  }
+
+  if (!checkExterns(modules, *linked, errMsg)) {
+    delete linked;
+    delete C;
+    return NULL;
+  }
+
+  setGroupSegmentSize(*linked, group.size);
+
+  optimizeLinkedModule(*linked);
+
+  insertLinked(key, contents, *linked);
+
+  return BrigProgram(linked);
+}
+
 std::string GenLLVM::getLLVMString(const BrigModule &M,
                                    Callback callback,
                                    CallbackData cbd) {
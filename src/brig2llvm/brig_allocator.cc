@@ -0,0 +1,392 @@
+//===- brig_allocator.cc --------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_allocator.h"
+#include "brig_topology.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+namespace hsa {
+namespace brig {
+
+// The first block of every slab holds its header.
+struct SlabHeader {
+  unsigned sizeClass;
+};
+
+static size_t getPageSize() {
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+static size_t roundUp(size_t value, size_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+static size_t getClassSize(unsigned sizeClass) {
+  return size_t(BrigAllocator::MinSmallSize) << sizeClass;
+}
+
+static unsigned getSizeClass(size_t size) {
+  unsigned sizeClass = 0;
+  while (getClassSize(sizeClass) < size) ++sizeClass;
+  return sizeClass;
+}
+
+// Never destroyed, so that static destructors may still free memory.
+BrigAllocator &BrigAllocator::get() {
+  static BrigAllocator *allocator = new BrigAllocator();
+  return *allocator;
+}
+
+static bool partitionPages(char *base, size_t length,
+                           const std::vector<unsigned> &cpus, bool move);
+
+// Sets the memory policy of whole pages. Without move, only pages not yet
+// touched follow the policy.
+static bool bindPages(char *base, size_t length,
+                      BrigAllocator::Placement placement, unsigned node,
+                      bool move) {
+  if (placement == BrigAllocator::PlacePartitioned)
+    return partitionPages(base, length, Topology::get().getCpus(), move);
+
+#if defined(__linux__) && defined(SYS_mbind)
+  enum { MaxNodes = 1024, Bits = 8 * sizeof(unsigned long) };
+  unsigned long mask[MaxNodes / Bits];
+  memset(mask, 0, sizeof(mask));
+
+  const Topology &topology = Topology::get();
+  int mode = MPOL_DEFAULT;
+  if (placement == BrigAllocator::PlaceLocal) {
+    bool known = false;
+    for (unsigned i = 0; i < topology.getNodeCount(); ++i)
+      known |= topology.getNode(i).id == node;
+    if (!known || node >= MaxNodes) return false;
+    mask[node / Bits] |= 1UL << node % Bits;
+    mode = MPOL_PREFERRED;
+  } else if (placement == BrigAllocator::PlaceInterleaved) {
+    for (unsigned i = 0; i < topology.getNodeCount(); ++i) {
+      unsigned id = topology.getNode(i).id;
+      if (id < MaxNodes) mask[id / Bits] |= 1UL << id % Bits;
+    }
+    mode = MPOL_INTERLEAVE;
+  }
+
+  // The kernel reads one bit less than maxnode.
+  unsigned flags = move && mode != MPOL_DEFAULT ? MPOL_MF_MOVE : 0;
+  return !syscall(SYS_mbind, base, length, mode,
+                  mode == MPOL_DEFAULT ? NULL : mask, MaxNodes + 1, flags);
+#else
+  (void) base; (void) length; (void) node; (void) move;
+  return placement == BrigAllocator::PlaceFirstTouch;
+#endif
+}
+
+// Gives each run of processors on one node its share of the pages, in
+// order, as BrigEngine gives the pthreads on them their share of the
+// work-groups.
+static bool partitionPages(char *base, size_t length,
+                           const std::vector<unsigned> &cpus, bool move) {
+  const Topology &topology = Topology::get();
+  size_t pageSize = getPageSize();
+  bool placed = !cpus.empty();
+  for (size_t first = 0, end; first < cpus.size(); first = end) {
+    unsigned node = topology.getNodeIndex(cpus[first]);
+    for (end = first + 1; end < cpus.size(); ++end)
+      if (topology.getNodeIndex(cpus[end]) != node) break;
+    size_t from = length / pageSize * first / cpus.size() * pageSize;
+    size_t to = end == cpus.size() ? length :
+      length / pageSize * end / cpus.size() * pageSize;
+    if (node == topology.getNodeCount()) placed = false;
+    else if (to > from)
+      placed &= bindPages(base + from, to - from, BrigAllocator::PlaceLocal,
+                          topology.getNode(node).id, move);
+  }
+  // Recycled regions must not keep part of a placement.
+  if (!placed)
+    bindPages(base, length, BrigAllocator::PlaceFirstTouch, 0, false);
+  return placed;
+}
+
+BrigAllocator::BrigAllocator() :
+  prefault_(getenv("SIMPREFAULT")), placement_(PlaceFirstTouch),
+  placementNode_(0) {
+  if (const char *numa = getenv("SIMNUMA")) {
+    char *end;
+    unsigned long node = strtoul(numa, &end, 10);
+    if (!strcmp(numa, "interleave")) {
+      placement_ = PlaceInterleaved;
+    } else if (!strcmp(numa, "partition")) {
+      placement_ = PlacePartitioned;
+    } else if (end != numa && !*end) {
+      placement_ = PlaceLocal;
+      placementNode_ = node;
+    }
+  }
+
+  pthread_mutex_init(&lock_, NULL);
+  for (unsigned i = 0; i < SmallClasses; ++i) {
+    classes_[i].freeList = NULL;
+    classes_[i].bump = NULL;
+    classes_[i].end = NULL;
+  }
+  stats_.allocations = 0;
+  stats_.frees = 0;
+  stats_.recycled = 0;
+  stats_.bytesInUse = 0;
+  stats_.bytesMapped = 0;
+  stats_.bytesCached = 0;
+  stats_.hugeTLBBytes = 0;
+}
+
+void *BrigAllocator::allocate(size_t size, size_t align, bool hugePages) {
+  if (!size) return NULL;
+  if (!align) align = 1;
+  assert(!(align & (align - 1)) && "Alignment must be a power of two");
+
+  pthread_mutex_lock(&lock_);
+  void *ptr;
+  size_t blockSize = std::max(size, align);
+  if (blockSize <= MaxSmallSize)
+    ptr = allocateSmall(getSizeClass(blockSize));
+  else
+    ptr = allocateLarge(size, align, hugePages);
+  if (ptr) ++stats_.allocations;
+  pthread_mutex_unlock(&lock_);
+  return ptr;
+}
+
+void *BrigAllocator::allocateSmall(unsigned sizeClass) {
+  SizeClass &sc = classes_[sizeClass];
+  size_t size = getClassSize(sizeClass);
+
+  if (sc.freeList) {
+    void *ptr = sc.freeList;
+    sc.freeList = *(void **) ptr;
+    ++stats_.recycled;
+    stats_.bytesInUse += size;
+    return ptr;
+  }
+
+  if (sc.bump == sc.end) {
+    Region slab;
+    if (!mapRegion(SlabSize, SlabSize, true, slab)) return NULL;
+    ((SlabHeader *) slab.base)->sizeClass = sizeClass;
+    sc.bump = slab.base + std::max(size, sizeof(SlabHeader));
+    sc.end = slab.base + SlabSize;
+  }
+
+  void *ptr = sc.bump;
+  sc.bump += size;
+  stats_.bytesInUse += size;
+  return ptr;
+}
+
+void *BrigAllocator::allocateLarge(size_t size, size_t align,
+                                   bool hugePages) {
+  size_t granule = hugePages && size >= HugePageSize ?
+    size_t(HugePageSize) : getPageSize();
+  size_t length = roundUp(size, granule);
+  align = std::max(align, granule);
+
+  // Take the smallest cached region that fits without wasting more than a
+  // quarter of it.
+  for (std::multimap<size_t, Region>::iterator I = cache_.lower_bound(length),
+         E = cache_.upper_bound(length + length / 4); I != E; ++I) {
+    Region &region = I->second;
+    if (uintptr_t(region.base) % align) continue;
+    if (region.hugePages != hugePages) continue;
+    void *ptr = region.base;
+    if (hugePages && placement_ != PlaceFirstTouch)
+      region.placed = bindPages(region.base, region.length, placement_,
+                                placementNode_, true);
+    large_[ptr] = region;
+    stats_.bytesCached -= region.length;
+    stats_.bytesInUse += region.length;
+    ++stats_.recycled;
+    cache_.erase(I);
+    return ptr;
+  }
+
+  Region region;
+  if (!mapRegion(length, align, hugePages, region)) {
+    // Make room by dropping the cache, then try once more.
+    if (cache_.empty()) return NULL;
+    for (std::multimap<size_t, Region>::iterator I = cache_.begin(),
+           E = cache_.end(); I != E; ++I)
+      unmapRegion(I->second);
+    cache_.clear();
+    stats_.bytesCached = 0;
+    if (!mapRegion(length, align, hugePages, region)) return NULL;
+  }
+  if (hugePages && placement_ != PlaceFirstTouch)
+    region.placed = bindPages(region.base, region.length, placement_,
+                              placementNode_, true);
+  large_[region.base] = region;
+  stats_.bytesInUse += region.length;
+  return region.base;
+}
+
+bool BrigAllocator::mapRegion(size_t length, size_t align, bool hugePages,
+                              Region &region) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+  if (prefault_ && hugePages) flags |= MAP_POPULATE;
+#endif
+
+  region.length = length;
+  region.hugePages = hugePages;
+  region.hugeTLB = false;
+  region.placed = false;
+
+#ifdef MAP_HUGETLB
+  if (hugePages && length % HugePageSize == 0 && align <= HugePageSize) {
+    void *ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     flags | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      region.base = (char *) ptr;
+      region.hugeTLB = true;
+      stats_.bytesMapped += length;
+      stats_.hugeTLBBytes += length;
+      return true;
+    }
+  }
+#endif
+
+  // Map enough to find an aligned start, then trim both ends.
+  size_t slack = align > getPageSize() ? align : 0;
+  void *ptr = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, flags,
+                   -1, 0);
+  if (ptr == MAP_FAILED) return false;
+  char *base = (char *) ptr;
+  char *start = (char *) roundUp(uintptr_t(base), align);
+  if (start != base) munmap(base, start - base);
+  if (start + length != base + length + slack)
+    munmap(start + length, base + slack - start);
+
+#ifdef MADV_HUGEPAGE
+  if (hugePages && length >= HugePageSize)
+    madvise(start, length, MADV_HUGEPAGE);
+#endif
+
+  region.base = start;
+  stats_.bytesMapped += length;
+  return true;
+}
+
+void BrigAllocator::unmapRegion(const Region &region) {
+  munmap(region.base, region.length);
+  stats_.bytesMapped -= region.length;
+  if (region.hugeTLB) stats_.hugeTLBBytes -= region.length;
+}
+
+void BrigAllocator::free(void *ptr) {
+  if (!ptr) return;
+
+  pthread_mutex_lock(&lock_);
+  ++stats_.frees;
+  std::map<void *, Region>::iterator I = large_.find(ptr);
+  if (I != large_.end()) {
+    Region region = I->second;
+    large_.erase(I);
+    stats_.bytesInUse -= region.length;
+    // Leave the pages where they are, but let the next user decide.
+    if (region.placed) {
+      bindPages(region.base, region.length, PlaceFirstTouch, 0, false);
+      region.placed = false;
+    }
+    if (stats_.bytesCached + region.length <= MaxCachedBytes) {
+      cache_.insert(std::make_pair(region.length, region));
+      stats_.bytesCached += region.length;
+    } else {
+      unmapRegion(region);
+    }
+  } else {
+    SlabHeader *slab =
+      (SlabHeader *) (uintptr_t(ptr) & ~uintptr_t(SlabSize - 1));
+    SizeClass &sc = classes_[slab->sizeClass];
+    *(void **) ptr = sc.freeList;
+    sc.freeList = ptr;
+    stats_.bytesInUse -= getClassSize(slab->sizeClass);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+size_t BrigAllocator::getSize(void *ptr) {
+  pthread_mutex_lock(&lock_);
+  size_t size;
+  std::map<void *, Region>::iterator I = large_.find(ptr);
+  if (I != large_.end()) {
+    size = I->second.length;
+  } else {
+    SlabHeader *slab =
+      (SlabHeader *) (uintptr_t(ptr) & ~uintptr_t(SlabSize - 1));
+    size = getClassSize(slab->sizeClass);
+  }
+  pthread_mutex_unlock(&lock_);
+  return size;
+}
+
+BrigAllocator::Stats BrigAllocator::getStats() {
+  pthread_mutex_lock(&lock_);
+  Stats stats = stats_;
+  pthread_mutex_unlock(&lock_);
+  return stats;
+}
+
+bool BrigAllocator::place(void *ptr, Placement placement, unsigned node) {
+  pthread_mutex_lock(&lock_);
+  std::map<void *, Region>::iterator I = large_.find(ptr);
+  bool placed = I != large_.end() &&
+    bindPages(I->second.base, I->second.length, placement, node, true);
+  if (placed) I->second.placed = placement != PlaceFirstTouch;
+  pthread_mutex_unlock(&lock_);
+  return placed;
+}
+
+bool BrigAllocator::partition(void *ptr, const std::vector<unsigned> &cpus) {
+  pthread_mutex_lock(&lock_);
+  std::map<void *, Region>::iterator I = large_.find(ptr);
+  bool placed = I != large_.end() &&
+    partitionPages(I->second.base, I->second.length, cpus, true);
+  if (placed) I->second.placed = true;
+  pthread_mutex_unlock(&lock_);
+  return placed;
+}
+
+void BrigAllocator::setDefaultPlacement(Placement placement, unsigned node) {
+  pthread_mutex_lock(&lock_);
+  placement_ = placement;
+  placementNode_ = node;
+  pthread_mutex_unlock(&lock_);
+}
+
+void BrigAllocator::setPrefault(bool prefault) {
+  pthread_mutex_lock(&lock_);
+  prefault_ = prefault;
+  pthread_mutex_unlock(&lock_);
+}
+
+} // namespace brig
+} // namespace hsa
@@ -0,0 +1,142 @@
+//===- brig_archive.cc ----------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_archive.h"
+#include "brig_reader.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hsa {
+namespace brig {
+
+const char BrigArchiveMagic[8] = { 'B', 'R', 'I', 'G', 'A', 'R', 'C', 'H' };
+
+BrigArchive::~BrigArchive() {
+  if (mapped_) munmap(const_cast<char *>(buffer_), size_);
+}
+
+bool BrigArchive::isArchive(const char *buffer, size_t size) {
+  return size >= sizeof(BrigArchiveHeader) &&
+    !memcmp(buffer, BrigArchiveMagic, sizeof(BrigArchiveMagic));
+}
+
+bool BrigArchive::isValid(const char *buffer, size_t size) {
+  if (!isArchive(buffer, size)) return false;
+
+  const BrigArchiveHeader *header =
+    reinterpret_cast<const BrigArchiveHeader *>(buffer);
+  if (header->version != BrigArchiveHeader::Version) return false;
+
+  uint64_t tables = sizeof(BrigArchiveHeader) +
+    uint64_t(header->memberCount) * sizeof(BrigArchiveMember) +
+    uint64_t(header->kernelCount) * sizeof(BrigArchiveKernel);
+  if (tables > header->namesOffset) return false;
+
+  // The name table must be NUL terminated so that names can not run past
+  // the end of the archive.
+  uint64_t namesEnd = uint64_t(header->namesOffset) + header->namesSize;
+  if (!header->namesSize || namesEnd > size) return false;
+  return !buffer[namesEnd - 1];
+}
+
+BrigArchive *BrigArchive::open(const char *filename) {
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) || size_t(st.st_size) < sizeof(BrigArchiveHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = st.st_size;
+  void *buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) return NULL;
+
+  if (!isValid((const char *) buffer, size)) {
+    munmap(buffer, size);
+    return NULL;
+  }
+
+  return new BrigArchive((const char *) buffer, size, true);
+}
+
+BrigArchive *BrigArchive::open(const char *buffer, size_t size) {
+  if (!isValid(buffer, size)) return NULL;
+  return new BrigArchive(buffer, size, false);
+}
+
+const char *BrigArchive::getName(uint32_t offset) const {
+  if (offset >= header_->namesSize) return NULL;
+  return names_ + offset;
+}
+
+const char *BrigArchive::getMemberName(unsigned member) const {
+  if (member >= getNumMembers()) return NULL;
+  return getName(members_[member].name);
+}
+
+const char *BrigArchive::getKernelName(unsigned kernel) const {
+  if (kernel >= getNumKernels()) return NULL;
+  return getName(kernels_[kernel].name);
+}
+
+unsigned BrigArchive::getKernelMember(unsigned kernel) const {
+  if (kernel >= getNumKernels()) return ~0U;
+  return kernels_[kernel].member;
+}
+
+llvm::StringRef BrigArchive::getMember(unsigned member) const {
+  if (member >= getNumMembers()) return llvm::StringRef();
+
+  const BrigArchiveMember &m = members_[member];
+  if (m.offset > size_ || m.size > size_ - m.offset) return llvm::StringRef();
+  return llvm::StringRef(buffer_ + m.offset, m.size);
+}
+
+int BrigArchive::findKernel(const char *name) const {
+  if (name[0] == '&') ++name;
+
+  unsigned lo = 0;
+  unsigned hi = getNumKernels();
+  while (lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    const char *kernel = getKernelName(mid);
+    if (!kernel) return -1;
+    if (kernel[0] == '&') ++kernel;
+
+    int cmp = strcmp(kernel, name);
+    if (!cmp) return kernels_[mid].member;
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return -1;
+}
+
+BrigReader *BrigArchive::createBrigReader(unsigned member) const {
+  llvm::StringRef contents = getMember(member);
+  if (contents.empty()) return NULL;
+  return BrigReader::createBrigReader(contents.data(), contents.size());
+}
+
+BrigReader *BrigArchive::createBrigKernelReader(const char *kernelName) const {
+  int member = findKernel(kernelName);
+  if (member < 0) return NULL;
+  return createBrigReader(member);
+}
+
+}  // namespace brig
+}  // namespace hsa
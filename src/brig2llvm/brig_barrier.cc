@@ -0,0 +1,104 @@
+//===- brig_barrier.cc ----------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_barrier.h"
+
+#include <climits>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <sched.h>
+#endif
+
+namespace hsa {
+namespace brig {
+
+static void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+// Sleeps while *addr is value. Spurious returns are fine; the caller
+// rechecks.
+static void sleepWhile(uint32_t *addr, uint32_t value) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+  (void) addr; (void) value;
+  sched_yield();
+#endif
+}
+
+static void wakeAll(uint32_t *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  (void) addr;
+#endif
+}
+
+void WorkGroupBarrier::init(uint32_t size, uint32_t spins) {
+  count_ = size;
+  generation_ = 0;
+  sleepers_ = 0;
+  size_ = size;
+  spins_ = spins;
+  dropped_ = 0;
+}
+
+// Returns whether this was the last arrival, which started the next
+// generation.
+bool WorkGroupBarrier::arrive(uint32_t generation) {
+  if (__atomic_sub_fetch(&count_, 1, __ATOMIC_ACQ_REL)) return false;
+
+  // Nobody touches the count or the size again until the generation
+  // flips, and a thread that drops out counts itself in dropped_ before it
+  // arrives.
+  size_ -= __atomic_exchange_n(&dropped_, 0, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&count_, size_, __ATOMIC_RELAXED);
+  __atomic_store_n(&generation_, generation + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST))
+    wakeAll(&generation_);
+  return true;
+}
+
+void WorkGroupBarrier::drop() {
+  uint32_t generation = __atomic_load_n(&generation_, __ATOMIC_ACQUIRE);
+  __atomic_add_fetch(&dropped_, 1, __ATOMIC_RELEASE);
+  arrive(generation);
+}
+
+void WorkGroupBarrier::wait() {
+  uint32_t generation = __atomic_load_n(&generation_, __ATOMIC_ACQUIRE);
+  if (arrive(generation)) return;
+
+  for (uint32_t i = 0; i < spins_; ++i) {
+    if (__atomic_load_n(&generation_, __ATOMIC_ACQUIRE) != generation)
+      return;
+    cpuRelax();
+  }
+
+  // The sleeper count and the generation are both sequentially consistent,
+  // so either the last thread sees this sleeper and wakes it, or the futex
+  // sees the new generation and does not sleep.
+  __atomic_add_fetch(&sleepers_, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&generation_, __ATOMIC_SEQ_CST) == generation)
+    sleepWhile(&generation_, generation);
+  __atomic_sub_fetch(&sleepers_, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+} // namespace brig
+} // namespace hsa
@@ -10,6 +10,7 @@
 #include "brig_control_block.h"
 #include "brig_function.h"
 #include "brig_inst_helper.h"
+#include <cstring>
 
 namespace hsa {
 namespace brig {
@@ -18,6 +19,13 @@ BrigControlBlock &BrigControlBlock::operator++() {
   dir_iterator E = S_.end();
   if (it_ == E) return *this;
 
+  if (S_.index) {
+    uint32_t offset = it_ - S_.directives;
+    it_ = dir_iterator(S_.directives +
+                       S_.index->nextControlBlock(offset, S_.directivesSize));
+    return *this;
+  }
+
   for (++it_; it_ != E; ++it_)
     if (isa<BrigDirectiveLabel>(it_) || isa<BrigDirectiveExecutable>(it_))
       return *this;
@@ -45,5 +53,27 @@ BrigControlBlock cb_end(const BrigFunction &F) {
 BrigControlBlock BrigFunction::begin() const { return cb_begin(*this); }
 BrigControlBlock BrigFunction::end() const { return cb_end(*this); }
 
+BrigControlBlock BrigFunction::findLabel(const char *name) const {
+  uint32_t next = getMethod()->nextTopLevelDirective;
+  if (S_.index) {
+    uint32_t offset =
+      BrigSectionIndex::findName(S_.index->labels, name, getOffset(), next);
+    if (offset == next) return end();
+    return BrigControlBlock(S_, dir_iterator(S_.directives + offset,
+                                             S_.directives,
+                                             &S_.index->dirOffsets));
+  }
+
+  size_t length = strlen(name);
+  for (BrigControlBlock cb = begin(), E = end(); cb != E; ++cb) {
+    const BrigDirectiveLabel *label = dyn_cast<BrigDirectiveLabel>(cb.it_);
+    if (!label) continue;
+    const BrigString *str = (const BrigString *) (S_.strings + label->name);
+    if (str->byteCount == length && !memcmp(str->bytes, name, length))
+      return cb;
+  }
+  return end();
+}
+
 }  // namespace brig
 }  // namespace hsa
@@ -7,8 +7,13 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "brig_allocator.h"
+#include "brig_barrier.h"
 #include "brig_engine.h"
 #include "brig_runtime.h"
+#include "brig_scheduler.h"
+#include "brig_topology.h"
+#include "brig_wavefront.h"
 
 #include "llvm/ADT/Triple.h"
 #include "llvm/Bitcode/ReaderWriter.h"
@@ -33,9 +38,17 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Memory.h"
+#include <algorithm>
 #include <cerrno>
+#include <csetjmp>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
 #include <dlfcn.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #ifdef __linux__
 // These includes used by LLIMCJITMemoryManager::getPointerToNamedFunction()
@@ -69,14 +82,16 @@ static ForceBrigRuntimeLinkage runtime;
 
 BrigEngine::BrigEngine(hsa::brig::BrigProgram &BP,
                        bool forceInterpreter,
-                       char optLevel) : EE_(NULL), M_(BP.M.get()) {
-  init(forceInterpreter, optLevel);
+                       char optLevel,
+                       NativeMath nativeMath) : EE_(NULL), M_(BP.M.get()) {
+  init(forceInterpreter, optLevel, nativeMath);
 }
 
 BrigEngine::BrigEngine(llvm::Module *Mod,
                        bool forceInterpreter,
-                       char optLevel) : EE_(NULL), M_(Mod) {
-  init(forceInterpreter, optLevel);
+                       char optLevel,
+                       NativeMath nativeMath) : EE_(NULL), M_(Mod) {
+  init(forceInterpreter, optLevel, nativeMath);
 }
 
 #ifdef __arm__
@@ -96,16 +111,75 @@ static bool isHardFP(void) {
 
 static std::set<std::string> loadedLibs;
 
-void BrigEngine::init(bool forceInterpreter, char optLevel) {
+// Binds the native math instructions to the fast runtime kernels as MCJIT
+// resolves the external symbols of the module. The module itself is left
+// alone, so engines sharing it may still choose differently.
+class FastNativeMathMemoryManager : public llvm::SectionMemoryManager {
+ public:
+  virtual void *getPointerToNamedFunction(const std::string &Name,
+                                          bool AbortOnFailure = true) {
+    static const char *const natives[][2] = {
+      { "Ncos_f32",   "NcosFast_f32"   },
+      { "Nsin_f32",   "NsinFast_f32"   },
+      { "Nlog2_f32",  "Nlog2Fast_f32"  },
+      { "Nexp2_f32",  "Nexp2Fast_f32"  },
+      { "Nrsqrt_f32", "NrsqrtFast_f32" },
+      { "Nrcp_f32",   "NrcpFast_f32"   }
+    };
+
+    for (unsigned i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i) {
+      if (Name == natives[i][0])
+        return SectionMemoryManager::getPointerToNamedFunction(
+          natives[i][1], AbortOnFailure);
+    }
+    return SectionMemoryManager::getPointerToNamedFunction(Name,
+                                                           AbortOnFailure);
+  }
+};
+
+// Pinning to single processors piles the pthreads of every engine on the
+// same first ones, so by default they are only pinned to their node, and
+// only where there is more than one.
+BrigEngine::Pinning BrigEngine::getPinning(const std::vector<unsigned> &cpus) {
+  const char *pin = getenv("SIMPIN");
+  if (pin) return strcmp(pin, "0") ? PinCpus : PinNone;
+  const Topology &topology = Topology::get();
+  for (size_t i = 1; i < cpus.size(); ++i)
+    if (topology.getNodeIndex(cpus[i]) != topology.getNodeIndex(cpus[0]))
+      return PinNodes;
+  return PinNone;
+}
+
+void BrigEngine::init(bool forceInterpreter, char optLevel,
+                      NativeMath nativeMath) {
 
   Dl_info info;
+  // The topology only lists the processors in the process's affinity mask.
+  // SIMTHREADS may ask for more pthreads than there are processors, so
+  // they are only pinned when the count comes from the topology.
+  cpus_ = Topology::get().getCpus();
+
   char *threnv = getenv("SIMTHREADS");
   if (threnv != NULL && atoi(threnv) > 0) {
     numProcessors = atoi(threnv);
-  } else if (sysconf(_SC_NPROCESSORS_CONF) > 0) {
-    numProcessors = sysconf(_SC_NPROCESSORS_CONF);
+    pin_ = PinNone;
   } else {
-    numProcessors = 1;
+    numProcessors = cpus_.size();
+    pin_ = getPinning(cpus_);
+  }
+
+  groupArena_ = NULL;
+  groupArenaSize_ = 0;
+  scheduler_ = NULL;
+  weight_ = 1;
+  cancelled_ = false;
+  pthread_mutex_init(&launchesLock_, NULL);
+
+  wavefrontSize_ = 1;
+  char *waveenv = getenv("SIMWAVESIZE");
+  if (waveenv != NULL && !setWavefrontSize(atoi(waveenv))) {
+    llvm::errs() << "Invalid wavefront size " << waveenv << ".\n";
+    exit(1);
   }
 
   int err = dladdr(&runtime, &info);
@@ -129,6 +203,9 @@ void BrigEngine::init(bool forceInterpreter, char optLevel) {
     exit(1);
   }
 
+  if (const char *mathenv = getenv("SIMFASTMATH"))
+    nativeMath = atoi(mathenv) ? FastNativeMath : ExactNativeMath;
+
   llvm::EngineBuilder builder(M_);
   builder.setErrorStr(&errorMsg);
   builder.setEngineKind(forceInterpreter
@@ -137,7 +214,9 @@ void BrigEngine::init(bool forceInterpreter, char optLevel) {
 
   llvm::SectionMemoryManager *JMM = NULL;
   if (!forceInterpreter) {
-    JMM = new llvm::SectionMemoryManager();
+    JMM = nativeMath == FastNativeMath
+      ? new FastNativeMathMemoryManager()
+      : new llvm::SectionMemoryManager();
     builder.setJITMemoryManager(JMM);
   }
 
@@ -196,64 +275,293 @@ void BrigEngine::init(bool forceInterpreter, char optLevel) {
     JMM->invalidateInstructionCache();
 }
 
+void BrigEngine::setCpus(const std::vector<unsigned> &cpus) {
+  if (cpus.empty()) return;
+  cpus_ = cpus;
+  numProcessors = cpus.size();
+  pin_ = getPinning(cpus);
+}
+
+void BrigEngine::setScheduler(BrigScheduler *scheduler, uint32_t weight) {
+  scheduler_ = scheduler;
+  weight_ = weight;
+}
+
+// Each cancelled launch holds __brigYieldFlag up until it ends, so that its
+// work-items find out at their next yield point.
+void BrigEngine::cancel() {
+  pthread_mutex_lock(&launchesLock_);
+  cancelled_ = true;
+  for (unsigned i = 0; i < launches_.size(); ++i) {
+    if (!__atomic_exchange_n(launches_[i], 1, __ATOMIC_SEQ_CST))
+      __atomic_add_fetch(&__brigYieldFlag, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&launchesLock_);
+}
 
-typedef void *(*EntryFunPtrTy)(void*);
+void BrigEngine::resume() {
+  pthread_mutex_lock(&launchesLock_);
+  cancelled_ = false;
+  pthread_mutex_unlock(&launchesLock_);
+}
+
+bool BrigEngine::setWavefrontSize(uint32_t size) {
+  if (!size || size > Wavefront::MaxSize || (size & (size - 1)))
+    return false;
+  wavefrontSize_ = size;
+  return true;
+}
+
+typedef void (*EntryFunPtrTy)(void *, const char *);
+
+static uint32_t roundUp(int val, int multiple) {
+  return ((val + multiple - 1) / multiple) * multiple;
+}
+
+// Under a scheduler, the pthreads of a resident work-group start each of
+// its work-groups together, once the scheduler has given the work-group
+// its processors. The pthread of local id 0 asks for them, after the
+// work-group before has given them back. A cancelled launch closes the
+// gate, and lets no more work-groups in.
+struct GroupGate {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint32_t opened;   // one past the last work-group let in
+  uint32_t running;  // work-items of that work-group still running
+  uint32_t taken;    // the processors it holds
+  bool closed;
+
+  GroupGate() : opened(0), running(0), taken(0), closed(false) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+  }
+
+  ~GroupGate() {
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+  }
+
+  // Returns false if the gate closed before the work-group was let in.
+  bool enter(BrigScheduler *scheduler, BrigScheduler::Client *client,
+             uint32_t workGroupNum, uint32_t localId, uint32_t groupSize) {
+    pthread_mutex_lock(&lock);
+    if (!localId) {
+      while (running && !closed) pthread_cond_wait(&changed, &lock);
+      if (!closed) {
+        pthread_mutex_unlock(&lock);
+        uint32_t count = scheduler->acquire(client, groupSize);
+        pthread_mutex_lock(&lock);
+        if (closed) {
+          scheduler->release(count);
+        } else {
+          taken = count;
+          running = groupSize;
+          opened = workGroupNum + 1;
+          pthread_cond_broadcast(&changed);
+        }
+      }
+    } else {
+      while (opened <= workGroupNum && !closed)
+        pthread_cond_wait(&changed, &lock);
+    }
+    bool entered = opened > workGroupNum;
+    pthread_mutex_unlock(&lock);
+    return entered;
+  }
+
+  void leave(BrigScheduler *scheduler) {
+    pthread_mutex_lock(&lock);
+    if (!--running) {
+      scheduler->release(taken);
+      pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  // A work-item that stops at a work-group the gate let in leaves it too.
+  void stop(BrigScheduler *scheduler, uint32_t workGroupNum) {
+    pthread_mutex_lock(&lock);
+    closed = true;
+    if (opened > workGroupNum && !--running) scheduler->release(taken);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+  }
+};
 
 // a struct that adds fields used by the threads that run the WorkItemLoop
 struct WorkItemLoopThreadInfo : public ThreadInfo {
   EntryFunPtrTy EntryFunPtr;
-  uint32_t absidLow;
-  uint32_t absidStep;
+  uint32_t localId;
+  uint32_t firstGroup;
+  uint32_t endGroup;
   uint32_t groupSize;
-  pthread_barrier_t *barriers;
+  WorkGroupBarrier *barriers;
+  Wavefront *wavefronts;
+  uint32_t wavefrontsPerGroup;
+  char *groupSlab;
+  // NULL without a scheduler
+  GroupGate *gate;
+  BrigScheduler *scheduler;
+  BrigScheduler::Client *client;
+  // Set by BrigEngine::cancel
+  const uint32_t *cancelled;
+  // Where a work-item that stops at a yield point goes
+  jmp_buf stop;
 
   WorkItemLoopThreadInfo(uint32_t NDRangeSize, uint32_t workdim,
                          uint32_t workGroupSize[3], uint32_t workItemAbsId[3],
-                         pthread_barrier_t *barrier,
-                         void *const *args, size_t size,
+                         WorkGroupBarrier *barrier,
+                         const char *kernarg,
                          EntryFunPtrTy EntryFunPtr,
-                         uint32_t absidLow, uint32_t absidStep,
-                         uint32_t groupSize, pthread_barrier_t *barriers) :
-    ThreadInfo(NDRangeSize, workdim, workGroupSize, workItemAbsId, barrier, args, size),
-    EntryFunPtr(EntryFunPtr), absidLow(absidLow), absidStep(absidStep),
-    groupSize(groupSize), barriers(barriers) {
+                         uint32_t localId, uint32_t firstGroup,
+                         uint32_t endGroup,
+                         uint32_t groupSize, WorkGroupBarrier *barriers,
+                         uint32_t wavefrontSize, Wavefront *wavefronts,
+                         char *groupSlab, const uint32_t *cancelled) :
+    ThreadInfo(NDRangeSize, workdim, workGroupSize, workItemAbsId, barrier, kernarg),
+    EntryFunPtr(EntryFunPtr), localId(localId), firstGroup(firstGroup),
+    endGroup(endGroup),
+    groupSize(groupSize), barriers(barriers), wavefronts(wavefronts),
+    wavefrontsPerGroup(roundUp(groupSize, wavefrontSize) / wavefrontSize),
+    groupSlab(groupSlab), gate(NULL), scheduler(NULL), client(NULL),
+    cancelled(cancelled) {
+    this->wavefrontSize = wavefrontSize;
   }
 };
 
-static uint32_t roundUp(int val, int multiple) {
-  return ((val + multiple - 1) / multiple) * multiple;
+static bool isCancelled(const WorkItemLoopThreadInfo *thrInfo) {
+  return __atomic_load_n(thrInfo->cancelled, __ATOMIC_RELAXED);
+}
+
+// The yield hook of every work-item, which __brigYield only calls once
+// the launch is cancelled. No frame of the kernel has anything to clean up,
+// so the work-item jumps straight out of it.
+static void yieldWorkItem(ThreadInfo *info) {
+  longjmp(static_cast<WorkItemLoopThreadInfo *>(info)->stop, 1);
+}
+
+// Returns false if the work-item stopped at a yield point.
+static bool runWorkItem(WorkItemLoopThreadInfo *thrInfo) {
+  if (setjmp(thrInfo->stop)) return false;
+  (thrInfo->EntryFunPtr)(static_cast<ThreadInfo *>(thrInfo),
+                         thrInfo->kernarg);
+  return true;
+}
+
+// A work-item that stops takes itself out of the barriers and wavefronts
+// of the work-groups it has left, so the other work-items of each do not
+// wait for it.
+static void stopWorkItem(WorkItemLoopThreadInfo *thrInfo,
+                         uint32_t workGroupNum) {
+  uint32_t localId = thrInfo->localId;
+  for (uint32_t group = workGroupNum; group < thrInfo->endGroup; ++group) {
+    if (group * thrInfo->groupSize + localId >= thrInfo->NDRangeSize) break;
+    thrInfo->barriers[group].drop();
+    thrInfo->wavefronts[group * thrInfo->wavefrontsPerGroup +
+                        localId / thrInfo->wavefrontSize].drop();
+  }
+  if (thrInfo->gate) thrInfo->gate->stop(thrInfo->scheduler, workGroupNum);
 }
 
 // the workItemLoop runs a set of workItems (from different workGroups)
 // all in the same pthread.  It assigns the workItems a barrier
 // based on the workGroupId. (absid / workGroupSize)
+//
+// The pthreads of one resident work-group run the same local id of a run
+// of consecutive work-groups, so that neighbouring work-groups, which tend
+// to touch neighbouring memory, stay on the same processors.
 
-static void *workItemLoop(void *vargs) {
-  void **args = (void **) vargs;
-  WorkItemLoopThreadInfo *thrInfo = (WorkItemLoopThreadInfo *) (args[0]);
+static void workItemLoop(WorkItemLoopThreadInfo *thrInfo) {
   // compute size of the last group
   uint32_t lastGroupSize = thrInfo->NDRangeSize % thrInfo->groupSize;
   uint32_t lastGroupNum = (roundUp(thrInfo->NDRangeSize, thrInfo->groupSize) / thrInfo->groupSize) - 1;
   if (lastGroupSize == 0) lastGroupSize = thrInfo->groupSize;
-  for (uint32_t absid = thrInfo->absidLow; absid < thrInfo->NDRangeSize; absid += thrInfo->absidStep ) {
+  uint32_t localId = thrInfo->localId;
+  thrInfo->groupBase = thrInfo->groupSlab;
+  for (uint32_t workGroupNum = thrInfo->firstGroup;
+       workGroupNum < thrInfo->endGroup; ++workGroupNum) {
+    uint32_t absid = workGroupNum * thrInfo->groupSize + localId;
+    if (absid >= thrInfo->NDRangeSize) break;
+    if (isCancelled(thrInfo)) {
+      stopWorkItem(thrInfo, workGroupNum);
+      return;
+    }
     thrInfo->workItemAbsId[0] = absid;
-    uint32_t workGroupNum = absid / thrInfo->groupSize;
     thrInfo->barrier = &thrInfo->barriers[workGroupNum];
+    thrInfo->wavefront =
+      &thrInfo->wavefronts[workGroupNum * thrInfo->wavefrontsPerGroup +
+                           localId / thrInfo->wavefrontSize];
+    thrInfo->laneId = localId % thrInfo->wavefrontSize;
+    thrInfo->lanePhase = 0;
     // insert correct groupsize if we are in last group
     if (workGroupNum == lastGroupNum) {
       thrInfo->workGroupSize[0] = lastGroupSize;
     }
-    // all other fields such as argsArray, etc were set up when thrInfo created
-    (thrInfo->EntryFunPtr)(vargs);
+    if (thrInfo->gate &&
+        !thrInfo->gate->enter(thrInfo->scheduler, thrInfo->client,
+                              workGroupNum, localId,
+                              thrInfo->workGroupSize[0])) {
+      stopWorkItem(thrInfo, workGroupNum);
+      return;
+    }
+    // all other fields such as kernarg, etc were set up when thrInfo created
+    if (!runWorkItem(thrInfo)) {
+      stopWorkItem(thrInfo, workGroupNum);
+      return;
+    }
+    // The next work-group on this slab may not start until every
+    // work-item of this one is done with it.
+    if (thrInfo->groupSlab) thrInfo->barrier->wait();
+    if (thrInfo->gate) thrInfo->gate->leave(thrInfo->scheduler);
   }
-  return NULL;
 }
 
 
-void BrigEngine::launch(llvm::Function *EntryFn,
+// The state of one kernel of a launch.
+struct KernelRun {
+  // The arguments, laid out as the kernel reads them, shared by every
+  // pthread.
+  char *kernarg;
+  WorkGroupBarrier *barriers;
+  Wavefront *wavefronts;
+  // One per resident work-group, under a scheduler.
+  GroupGate *gates;
+  // Indexed by pthread. Pthreads past the end sit the kernel out.
+  std::vector<WorkItemLoopThreadInfo *> threads;
+  bool barrier;
+};
+
+// A pthread of a launch runs its part of each kernel in turn, waiting for
+// every other pthread first whenever a kernel has a barrier.
+struct LaunchWorker {
+  uint32_t index;
+  KernelRun *runs;
+  uint32_t kernelCount;
+  WorkGroupBarrier *launchBarrier;
+  pthread_t tid;
+};
+
+static void *launchLoop(void *varg) {
+  LaunchWorker *worker = (LaunchWorker *) varg;
+  for (uint32_t i = 0; i < worker->kernelCount; ++i) {
+    KernelRun &run = worker->runs[i];
+    if (i && run.barrier) worker->launchBarrier->wait();
+    if (worker->index < run.threads.size())
+      workItemLoop(run.threads[worker->index]);
+  }
+  return NULL;
+}
+
+bool BrigEngine::launch(llvm::Function *EntryFn,
                         llvm::ArrayRef<void *> args,
                         uint32_t blockNum,
-                        uint32_t workGroupSize) {
+                        uint32_t workGroupSize,
+                        size_t dynamicGroupSize) {
+  Launch kernel(EntryFn, args, blockNum, workGroupSize, dynamicGroupSize);
+  return launch(llvm::ArrayRef<Launch>(kernel));
+}
+
+bool BrigEngine::launch(llvm::ArrayRef<Launch> batch) {
 
   /***
    *  Note: This interface is currently built on the assumption that
@@ -267,92 +575,265 @@ void BrigEngine::launch(llvm::Function *EntryFn,
    *  current interface that would have to change.
    ***/
 
-  uint32_t NDRangeSize = blockNum * workGroupSize;
+  if (batch.empty()) return true;
 
+  uint64_t staticGroupSize = GenLLVM::getGroupSegmentSize(M_);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    assert(batch[i].blockNum && batch[i].threadNum &&
+           "Thread count too low");
+    if (staticGroupSize + batch[i].dynamicGroupSize > MaxGroupMemorySize)
+      return false;
+  }
 
-  assert(blockNum && workGroupSize && "Thread count too low");
+  // compute how many pthreads each kernel needs: at least as many as the
+  // incoming workGroupSize but we will also try to keep all the
+  // processors busy by using multiples of the workGroupSize if
+  // necessary. The launch starts as many as its largest kernel needs.
+  std::vector<uint32_t> concurrentWorkGroups(batch.size());
+  uint32_t numPthreads = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    uint32_t workGroupSize = batch[i].threadNum;
+    uint32_t numConcurrentWorkGroups =
+      roundUp(numProcessors, workGroupSize) / workGroupSize;
+    concurrentWorkGroups[i] =
+      std::min(numConcurrentWorkGroups, batch[i].blockNum);
+    numPthreads = std::max(numPthreads,
+                           concurrentWorkGroups[i] * workGroupSize);
+  }
 
-  EntryFunPtrTy EntryFunPtr =
-    (EntryFunPtrTy)(intptr_t) EE_->getPointerToFunction(EntryFn);
+  // Waiters only spin while every pthread has a processor of its own.
+  // Otherwise they would hold the processor the last arrival needs.
+  uint32_t spins = numPthreads <= numProcessors ?
+    WorkGroupBarrier::DefaultSpins : 0;
+
+  // Each resident work-group gets a cache line aligned slab of the arena.
+  // The work-groups that later run on the same pthreads reuse it. Kernels
+  // between two barriers may run at the same time, so each gets slabs of
+  // its own.
+  std::vector<size_t> slabSizes(batch.size());
+  std::vector<size_t> slabOffsets(batch.size());
+  size_t arenaSize = 0;
+  for (size_t i = 0, offset = 0; i < batch.size(); ++i) {
+    if (batch[i].barrier) offset = 0;
+    slabSizes[i] =
+      roundUp(int(staticGroupSize + batch[i].dynamicGroupSize), 64);
+    slabOffsets[i] = offset;
+    offset += slabSizes[i] * concurrentWorkGroups[i];
+    arenaSize = std::max(arenaSize, offset);
+  }
+  BrigAllocator &allocator = BrigAllocator::get();
+  if (arenaSize > groupArenaSize_) {
+    allocator.free(groupArena_);
+    groupArena_ = (char *) allocator.allocate(arenaSize, 64);
+    assert(groupArena_ && "Out of memory");
+    groupArenaSize_ = arenaSize;
+  }
 
-  pthread_attr_t attr;
-  pthread_attr_init(&attr);
-  pthread_barrierattr_t barrierAttr;
-  pthread_barrierattr_init(&barrierAttr);
+  uint32_t cancelled = 0;
+  pthread_mutex_lock(&launchesLock_);
+  bool resumed = !cancelled_;
+  if (resumed) launches_.push_back(&cancelled);
+  pthread_mutex_unlock(&launchesLock_);
+  if (!resumed) return false;
 
-  /***
-   * Currently we use one barrier per block (although we probably
-   * could get away with a number of barriers equal to the number of
-   * concurrently executing workgroups).  Another optimization would
-   * be to avoid barrier initialization at all if we had detected that
-   * the kernel never uses barriers (nor calls external functions)
-   ***/
-  pthread_barrier_t *barriers = new pthread_barrier_t[blockNum];
+  BrigScheduler::Client *client =
+    scheduler_ ? scheduler_->join(weight_) : NULL;
 
-  // compute how many pthreads we will start we need at least as many
-  // as the incoming workGroupSize but we will also try to keep all
-  // the processors busy by using multiples of the workGroupSize if
-  // necessary
-  uint32_t numConcurrentWorkGroups = roundUp(numProcessors, workGroupSize) / workGroupSize;
-  uint32_t numPthreads = numConcurrentWorkGroups * workGroupSize;
+  uint32_t workdim = 1;
+  std::vector<KernelRun> runs(batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Launch &kernel = batch[i];
+    KernelRun &run = runs[i];
+    uint32_t blockNum = kernel.blockNum;
+    uint32_t workGroupSize = kernel.threadNum;
+    uint32_t NDRangeSize = blockNum * workGroupSize;
+    uint32_t numConcurrentWorkGroups = concurrentWorkGroups[i];
+    uint32_t workGroupSizeV3[] = { workGroupSize, 1, 1 };
+    run.barrier = kernel.barrier;
+
+    EntryFunPtrTy EntryFunPtr =
+      (EntryFunPtrTy)(intptr_t) EE_->getPointerToFunction(kernel.EntryFn);
+
+    // The arguments are copied once into the kernarg segment, which the
+    // work-items read in place.
+    std::vector<uint64_t> argOffsets;
+    std::vector<uint64_t> argSizes;
+    uint64_t kernargSize =
+      GenLLVM::getKernargLayout(kernel.EntryFn, argOffsets, argSizes);
+    assert(kernel.args.size() >= argOffsets.size() &&
+           "Too few kernel arguments");
+    run.kernarg = (char *) allocator.allocate(kernargSize);
+    for (size_t a = 0; a < argOffsets.size(); ++a)
+      memcpy(run.kernarg + argOffsets[a], kernel.args[a], argSizes[a]);
+
+    /***
+     * Currently we use one barrier per block (although we probably
+     * could get away with a number of barriers equal to the number of
+     * concurrently executing workgroups).  Another optimization would
+     * be to avoid barrier initialization at all if we had detected that
+     * the kernel never uses barriers (nor calls external functions)
+     ***/
+    // new[] only aligns to 16 bytes, so the barriers would straddle cache
+    // lines; the allocator places them on a cache line boundary.
+    run.barriers = (WorkGroupBarrier *)
+      allocator.allocate(blockNum * sizeof(WorkGroupBarrier), 64);
+    for (uint32_t b = 0; b < blockNum; ++b) {
+      new (&run.barriers[b]) WorkGroupBarrier();
+      run.barriers[b].init(workGroupSize, spins);
+    }
 
-  WorkItemLoopThreadInfo **threads = new WorkItemLoopThreadInfo *[numPthreads];
+    // The final barrier might not have the full workGroupSize threads on it
+    // (when we move to the input being NDRangeSize)
+    if (NDRangeSize % workGroupSize != 0) {
+      run.barriers[blockNum-1].init(NDRangeSize % workGroupSize, spins);
+    }
 
-  uint32_t workdim = 1;
-  uint32_t workGroupSizeV3[] = { workGroupSize, 1, 1 };
+    // Wavefronts split each work-group into runs of wavefrontSize_ lanes.
+    // The last wavefront of a group, and every wavefront of a short final
+    // group, may have fewer lanes.
+    uint32_t wavefrontsPerGroup =
+      roundUp(workGroupSize, wavefrontSize_) / wavefrontSize_;
+    run.wavefronts = new Wavefront[blockNum * wavefrontsPerGroup];
+    for (uint32_t b = 0; b < blockNum; ++b) {
+      uint32_t groupSize = workGroupSize;
+      if (b == blockNum - 1 && NDRangeSize % workGroupSize != 0)
+        groupSize = NDRangeSize % workGroupSize;
+      for (uint32_t w = 0; w < wavefrontsPerGroup; ++w) {
+        uint32_t first = w * wavefrontSize_;
+        uint32_t lanes = first < groupSize ?
+          std::min(wavefrontSize_, groupSize - first) : 1;
+        run.wavefronts[b * wavefrontsPerGroup + w].init(lanes, spins);
+      }
+    }
 
-  // initialize all the barriers
-  for (uint32_t i = 0; i < blockNum; ++i) {
-    pthread_barrier_init(barriers + i, &barrierAttr, workGroupSize);
+    run.gates = client ? new GroupGate[numConcurrentWorkGroups] : NULL;
+
+    run.threads.resize(numConcurrentWorkGroups * workGroupSize);
+    for (uint32_t k = 0; k < run.threads.size(); ++k) {
+      // filled in by the workItemLoop
+      uint32_t workItemAbsId[] = { 0, 0, 0 };
+      WorkGroupBarrier *barrier = NULL;
+      uint32_t slot = k / workGroupSize;
+      uint32_t firstGroup =
+        uint64_t(slot) * blockNum / numConcurrentWorkGroups;
+      uint32_t endGroup =
+        uint64_t(slot + 1) * blockNum / numConcurrentWorkGroups;
+      char *groupSlab = slabSizes[i] ?
+        groupArena_ + slabOffsets[i] + slot * slabSizes[i] : NULL;
+
+      run.threads[k] =
+        new WorkItemLoopThreadInfo(NDRangeSize, workdim,
+                                   workGroupSizeV3, workItemAbsId,
+                                   barrier,
+                                   run.kernarg,
+                                   EntryFunPtr,
+                                   k % workGroupSize,
+                                   firstGroup, endGroup,
+                                   workGroupSize, run.barriers,
+                                   wavefrontSize_, run.wavefronts,
+                                   groupSlab, &cancelled);
+      run.threads[k]->yield = yieldWorkItem;
+      run.threads[k]->yieldRequest = &cancelled;
+      if (client) {
+        run.threads[k]->gate = &run.gates[slot];
+        run.threads[k]->scheduler = scheduler_;
+        run.threads[k]->client = client;
+      }
+    }
   }
 
-  // The final barrier might not have the full workGroupSize threads on it
-  // (when we move to the input being NDRangeSize)
-  if (NDRangeSize % workGroupSize != 0) {
-    pthread_barrier_init(&barriers[blockNum-1], &barrierAttr, NDRangeSize % workGroupSize);
-  }
+  WorkGroupBarrier launchBarrier;
+  launchBarrier.init(numPthreads, spins);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
 
-  // create the workItemLoop pthreads
+  // The private segments live on the pthreads' stacks, which also come
+  // from the allocator, so that later launches reuse them. The lowest page
+  // of each is a guard page.
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t stackSize;
+  pthread_attr_getstacksize(&attr, &stackSize);
+  stackSize = roundUp(stackSize, pageSize);
+  char **stacks = new char *[numPthreads];
+  LaunchWorker *workers = new LaunchWorker[numPthreads];
+
+  // Spread the pthreads evenly over the processors, which the topology
+  // orders by node. The pthreads of a slot, and so its run of work-groups,
+  // take consecutive processors, so each node gets the part of the
+  // NDRange, and of the buffers BrigAllocator partitions, that matches its
+  // share of the processors.
+#ifdef __linux__
+  const Topology &topology = Topology::get();
+#endif
+
+  // create the launchLoop pthreads
   for (uint32_t k=0; k<numPthreads; k++) {
-    uint32_t workItemAbsId[] = { 0, 0, 0 };  // will be filled in by the workItemLoop
-    pthread_barrier_t *barrier = NULL;     // will be filled in by the workItemLoop
-    uint32_t absidLow = k;
-    uint32_t absidStep = numPthreads;
-    uint32_t groupSize = workGroupSize;
-
-    threads[k] = new WorkItemLoopThreadInfo(NDRangeSize, workdim,
-                                            workGroupSizeV3, workItemAbsId,
-                                            barrier,
-                                            args.data(), args.size(),
-                                            EntryFunPtr,
-                                            absidLow, absidStep,
-                                            groupSize, barriers);
-
-
-    pthread_create(&threads[k]->tid, &attr, &workItemLoop, threads[k]->argsArray);
+    workers[k].index = k;
+    workers[k].runs = &runs[0];
+    workers[k].kernelCount = runs.size();
+    workers[k].launchBarrier = &launchBarrier;
+
+    stacks[k] = (char *) allocator.allocate(pageSize + stackSize, pageSize,
+                                            false);
+    assert(stacks[k] && "Out of memory");
+    mprotect(stacks[k], pageSize, PROT_NONE);
+    pthread_attr_setstack(&attr, stacks[k] + pageSize, stackSize);
+
+#ifdef __linux__
+    unsigned cpu = cpus_[uint64_t(k) * cpus_.size() / numPthreads];
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (pin_ == PinCpus && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &cpuSet);
+    } else if (pin_ == PinNodes) {
+      unsigned node = topology.getNodeIndex(cpu);
+      for (size_t j = 0; j < cpus_.size(); ++j)
+        if (cpus_[j] < CPU_SETSIZE && topology.getNodeIndex(cpus_[j]) == node)
+          CPU_SET(cpus_[j], &cpuSet);
+    }
+    if (CPU_COUNT(&cpuSet))
+      pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet);
+    else
+      pthread_attr_setaffinity_np(&attr, 0, NULL);
+#endif
+
+    pthread_create(&workers[k].tid, &attr, &launchLoop, &workers[k]);
   }
 
-  // join all the workItemLoop pthreads
+  // join all the launchLoop pthreads
   for (uint32_t k=0; k<numPthreads; k++) {
-    WorkItemLoopThreadInfo *thrInfo = threads[k];
     void *retVal;
-    pthread_join(thrInfo->tid, &retVal);
-    delete threads[k];
+    pthread_join(workers[k].tid, &retVal);
+    mprotect(stacks[k], pageSize, PROT_READ | PROT_WRITE);
+    allocator.free(stacks[k]);
   }
 
-  // destroy all the barriers
-  for (uint32_t i = 0; i < blockNum; ++i) {
-    pthread_barrier_destroy(barriers + i);
+  pthread_attr_destroy(&attr);
+
+  for (size_t i = 0; i < runs.size(); ++i) {
+    for (size_t k = 0; k < runs[i].threads.size(); ++k)
+      delete runs[i].threads[k];
+    allocator.free(runs[i].barriers);
+    delete[] runs[i].wavefronts;
+    delete[] runs[i].gates;
+    allocator.free(runs[i].kernarg);
   }
+  if (client) scheduler_->leave(client);
+  delete[] workers;
+  delete[] stacks;
 
-  pthread_barrierattr_destroy(&barrierAttr);
-  pthread_attr_destroy(&attr);
+  pthread_mutex_lock(&launchesLock_);
+  launches_.erase(std::find(launches_.begin(), launches_.end(), &cancelled));
+  if (cancelled) __atomic_sub_fetch(&__brigYieldFlag, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&launchesLock_);
 
-  delete[] barriers;
-  delete[] threads;
+  return !cancelled;
 }
 
 BrigEngine::~BrigEngine() {
+  pthread_mutex_destroy(&launchesLock_);
+  BrigAllocator::get().free(groupArena_);
   EE_->removeModule(M_);
   delete EE_;
 }
@@ -10,6 +10,7 @@
 #include "brig_function.h"
 #include "brig_module.h"
 #include <cassert>
+#include <cstring>
 
 namespace hsa {
 namespace brig {
@@ -55,5 +56,24 @@ BrigFunction BrigModule::end() const {
   return hsa::brig::fun_end(S_);
 }
 
+BrigFunction BrigModule::findFunction(const char *name) const {
+  if (S_.index) {
+    uint32_t offset =
+      BrigSectionIndex::findName(S_.index->functions, name, 0,
+                                 S_.directivesSize);
+    return BrigFunction(S_, dir_iterator(S_.directives + offset,
+                                         S_.directives,
+                                         &S_.index->dirOffsets));
+  }
+
+  size_t length = strlen(name);
+  for (BrigFunction fun = begin(), E = end(); fun != E; ++fun) {
+    const BrigString *str = fun.getName();
+    if (str->byteCount == length && !memcmp(str->bytes, name, length))
+      return fun;
+  }
+  return end();
+}
+
 }  // namespace brig
 }  // namespace hsa
@@ -0,0 +1,642 @@
+//===- brig_fusion.cc -----------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Fuses a chain of kernels that run over the same NDRange into one kernel.
+// Each work-item of the fused kernel runs the work-item of the same id of
+// every kernel in turn, which is only the same as running the kernels one
+// after another if no work-item reads or writes what another work-item of a
+// later or earlier kernel wrote. That is proven on the fused kernel once it
+// has been optimized, from the addresses of its loads and stores.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_llvm.h"
+
+#include "llvm/PassManager.h"
+#include "llvm/Analysis/Passes.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/GetElementPtrTypeIterator.h"
+#include "llvm/Support/InstIterator.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace hsa {
+namespace brig {
+
+// The fused kernel and the constants holding the kernel arguments.
+static const char fusedKernelName[] = "__brigFused";
+static const char fusedArgName[] = "__brigFusedArg";
+
+enum {
+  MaxInlineDepth = 16,
+  MaxLinearDepth = 32,
+  MaxAccesses = 1024
+};
+
+// The kernel a trampoline calls.
+static llvm::Function *getKernelBody(llvm::Function *trampoline) {
+  for (llvm::inst_iterator I = llvm::inst_begin(trampoline),
+         E = llvm::inst_end(trampoline); I != E; ++I) {
+    llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&*I);
+    if (!call) continue;
+    llvm::Function *callee = call->getCalledFunction();
+    if (callee && callee->getName() != "__setThreadInfo") return callee;
+  }
+  return NULL;
+}
+
+// A kernel argument of this type, read from the value arg points to.
+static llvm::Constant *getArgConstant(llvm::Type *type, const void *arg) {
+  if (llvm::IntegerType *intTy = llvm::dyn_cast<llvm::IntegerType>(type)) {
+    if (intTy->getBitWidth() > 64) return NULL;
+    uint64_t bits = 0;
+    memcpy(&bits, arg, (intTy->getBitWidth() + 7) / 8);
+    return llvm::ConstantInt::get(intTy, bits);
+  }
+  if (type->isFloatTy()) {
+    float f;
+    memcpy(&f, arg, sizeof(f));
+    return llvm::ConstantFP::get(type, f);
+  }
+  if (type->isDoubleTy()) {
+    double d;
+    memcpy(&d, arg, sizeof(d));
+    return llvm::ConstantFP::get(type, d);
+  }
+  return NULL;
+}
+
+// Runtime functions that depend on other work-items, on the work-group or on
+// memory the fusion cannot see.
+static bool isUnfusable(llvm::StringRef name) {
+  return name == "Barrier" || name == "Sync" || name == "getGroupBase" ||
+    name.startswith("Atomic") || name.startswith("Query") ||
+    name.startswith("LaneId") || name.startswith("CountLane") ||
+    name.startswith("CountUpLane") || name.startswith("MaskLane") ||
+    name.startswith("SendLane") || name.startswith("ReceiveLane") ||
+    name.find("Image") != llvm::StringRef::npos ||
+    // Functions of the BRIG program that were not linked in
+    name.startswith("&") || name.startswith("kernel.");
+}
+
+// Runtime functions that return the same value for every call in a
+// work-item, given the same arguments.
+static bool isWorkItemQuery(llvm::StringRef name) {
+  return name == "WorkItemAbsId_u32" || name == "WorkGroupSize_u32" ||
+    name == "getWavefrontSize";
+}
+
+// Runtime functions are grouped by the part of their name before the first
+// '_', which leaves out the types.
+template<unsigned N>
+static bool isInFamily(llvm::StringRef name, const char *const (&families)[N]) {
+  llvm::StringRef family = name.substr(0, name.find('_'));
+  for (unsigned i = 0; i < N; ++i)
+    if (family == families[i]) return true;
+  return false;
+}
+
+// Runtime functions that compute only on their arguments and the floating
+// point modes. Anything else may read the work-item's state or memory.
+static bool isPureMath(llvm::StringRef name) {
+  static const char *const families[] = {
+    "Abs", "Add", "AddSat", "And", "BitAlign", "BitExtract", "BitInsert",
+    "BitMask", "BitRev", "BitSelect", "Borrow", "ByteAlign", "Carry", "Ceil",
+    "Class", "Cmov", "Cmp", "Combine", "CopySign", "Cvt", "Div", "FirstBit",
+    "Floor", "Fma", "Fract", "LastBit", "Lerp", "Mad", "Mad24", "Mad24Hi",
+    "Max", "Min", "Mov", "Mul", "Mul24", "Mul24Hi", "MulHi", "MulSat",
+    "NFma", "Ncos", "Neg", "Nexp2", "Nlog2", "Not", "Nrcp", "Nrsqrt",
+    "Nsin", "Nsqrt", "Or", "Pack", "PopCount", "Rem", "Rint", "Sad",
+    "Sadhi", "Shl", "Shr", "Shuffle", "Sqrt", "Sub", "SubSat", "Trunc",
+    "Unpack", "UnpackHi", "UnpackLo", "Xor"
+  };
+  return isInFamily(name, families);
+}
+
+// Runtime functions that read the work-item's state, which stays the same
+// for the whole work-item, so they only read memory. clock is left out:
+// two reads with no store between them could be merged into one.
+static bool readsThreadState(llvm::StringRef name) {
+  static const char *const families[] = {
+    "CurrentWorkGroupSize", "DispatchId", "GridGroups", "GridSize", "Qid",
+    "WorkGroupId", "WorkGroupSize", "WorkItemAbsId", "WorkItemId",
+    "getWavefrontSize"
+  };
+  return isInFamily(name, families);
+}
+
+static bool isModeChange(llvm::StringRef name) {
+  return name.startswith("setRoundingMode_") || name == "enableFtzMode" ||
+    name == "disableFtzMode";
+}
+
+static bool isAbsId(const llvm::Value *V) {
+  const llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(V);
+  if (!call || !call->getCalledFunction()) return false;
+  if (call->getCalledFunction()->getName() != "WorkItemAbsId_u32")
+    return false;
+  const llvm::ConstantInt *dim =
+    llvm::dyn_cast<llvm::ConstantInt>(call->getArgOperand(0));
+  return dim && dim->isZero();
+}
+
+static bool isPrivate(const llvm::Value *ptr, const llvm::DataLayout &DL) {
+  return llvm::isa<llvm::AllocaInst>(llvm::GetUnderlyingObject(ptr, &DL));
+}
+
+// An integer or address of the form base + offset + scale * id, where id is
+// the absolute id of the work-item in dimension 0, and base is NULL for
+// plain integers. Integers narrower than 64 bits are kept equal to the value
+// modulo their width, and only extended once they are known to fit.
+struct Linear {
+  const llvm::Value *base;
+  int64_t offset;
+  int64_t scale;
+};
+
+static const int64_t MaxOffset = int64_t(1) << 62;
+// Small enough that no offset of an NDRange overflows
+static const int64_t MaxScale = int64_t(1) << 28;
+
+static int64_t getMin(const Linear &l, uint32_t NDRangeSize) {
+  return l.offset + std::min<int64_t>(0, l.scale * (NDRangeSize - 1));
+}
+
+static int64_t getMax(const Linear &l, uint32_t NDRangeSize) {
+  return l.offset + std::max<int64_t>(0, l.scale * (NDRangeSize - 1));
+}
+
+static bool add(Linear &l, const Linear &r) {
+  if (l.base && r.base) return false;
+  if (r.base) l.base = r.base;
+  l.offset += r.offset;
+  l.scale += r.scale;
+  return l.offset < MaxOffset && l.offset > -MaxOffset &&
+    l.scale < MaxScale && l.scale > -MaxScale;
+}
+
+static bool multiply(Linear &l, int64_t factor) {
+  if (factor == 1) return true;
+  if (l.base || factor >= MaxScale || factor <= -MaxScale) return false;
+  int64_t absFactor = factor < 0 ? -factor : factor;
+  int64_t absOffset = l.offset < 0 ? -l.offset : l.offset;
+  int64_t absScale = l.scale < 0 ? -l.scale : l.scale;
+  if (absFactor && (absOffset >= MaxOffset / absFactor ||
+                    absScale >= MaxScale / absFactor))
+    return false;
+  l.offset *= factor;
+  l.scale *= factor;
+  return true;
+}
+
+// Extends a value of this many bits to 64 bits.
+static bool extend(Linear &l, unsigned bits, bool isSigned,
+                   uint32_t NDRangeSize) {
+  if (bits >= 64) return true;
+  if (l.base) return false;
+  int64_t lo = isSigned ? -(int64_t(1) << (bits - 1)) : 0;
+  int64_t hi = isSigned ? int64_t(1) << (bits - 1) : int64_t(1) << bits;
+  return getMin(l, NDRangeSize) >= lo && getMax(l, NDRangeSize) < hi;
+}
+
+static bool linearize(const llvm::Value *V, const llvm::DataLayout &DL,
+                      uint32_t NDRangeSize, Linear &l, unsigned depth = 0) {
+  if (depth > MaxLinearDepth) return false;
+  l.base = NULL;
+  l.offset = 0;
+  l.scale = 0;
+
+  if (const llvm::ConstantInt *CI = llvm::dyn_cast<llvm::ConstantInt>(V)) {
+    // Any value equal modulo the width will do, so narrow addresses are
+    // taken as unsigned and small offsets as signed.
+    unsigned bits = CI->getBitWidth();
+    if (bits > 64) return false;
+    l.offset = CI->getSExtValue();
+    if (bits < 64 && (l.offset < -(1 << 16) || l.offset >= 1 << 16))
+      l.offset = CI->getZExtValue();
+    return l.offset < MaxOffset && l.offset > -MaxOffset;
+  }
+  if (llvm::isa<llvm::ConstantPointerNull>(V)) return true;
+  if (llvm::isa<llvm::GlobalValue>(V)) {
+    l.base = V;
+    return true;
+  }
+  if (isAbsId(V)) {
+    l.scale = 1;
+    return true;
+  }
+
+  if (const llvm::GEPOperator *gep = llvm::dyn_cast<llvm::GEPOperator>(V)) {
+    if (!linearize(gep->getPointerOperand(), DL, NDRangeSize, l, depth + 1))
+      return false;
+    for (llvm::gep_type_iterator GTI = llvm::gep_type_begin(gep),
+           E = llvm::gep_type_end(gep); GTI != E; ++GTI) {
+      const llvm::Value *idx = GTI.getOperand();
+      Linear r = { NULL, 0, 0 };
+      if (llvm::StructType *ST = llvm::dyn_cast<llvm::StructType>(*GTI)) {
+        unsigned field = llvm::cast<llvm::ConstantInt>(idx)->getZExtValue();
+        r.offset = DL.getStructLayout(ST)->getElementOffset(field);
+      } else {
+        if (!idx->getType()->isIntegerTy()) return false;
+        unsigned bits = idx->getType()->getIntegerBitWidth();
+        if (!linearize(idx, DL, NDRangeSize, r, depth + 1) ||
+            !extend(r, bits, true, NDRangeSize) ||
+            !multiply(r, DL.getTypeAllocSize(GTI.getIndexedType())))
+          return false;
+      }
+      if (!add(l, r)) return false;
+    }
+    return true;
+  }
+
+  const llvm::Operator *op = llvm::dyn_cast<llvm::Operator>(V);
+  if (!op) return false;
+  llvm::Type *srcTy = op->getNumOperands() ?
+    op->getOperand(0)->getType() : NULL;
+  Linear r;
+  switch (op->getOpcode()) {
+  case llvm::Instruction::BitCast:
+    return linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1);
+  case llvm::Instruction::IntToPtr:
+    // Narrower integers are zero extended, as with the small model.
+    return srcTy->isIntegerTy() &&
+      linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) &&
+      extend(l, srcTy->getIntegerBitWidth(), false, NDRangeSize);
+  case llvm::Instruction::PtrToInt:
+    if (op->getType()->isIntegerTy(64))
+      return linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1);
+    // Fall through
+  case llvm::Instruction::Trunc:
+    return linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) &&
+      !l.base;
+  case llvm::Instruction::ZExt:
+  case llvm::Instruction::SExt:
+    return srcTy->isIntegerTy() &&
+      linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) &&
+      extend(l, srcTy->getIntegerBitWidth(),
+             op->getOpcode() == llvm::Instruction::SExt, NDRangeSize);
+  case llvm::Instruction::Add:
+    return linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) &&
+      linearize(op->getOperand(1), DL, NDRangeSize, r, depth + 1) &&
+      add(l, r);
+  case llvm::Instruction::Sub:
+    return linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) &&
+      linearize(op->getOperand(1), DL, NDRangeSize, r, depth + 1) &&
+      multiply(r, -1) && add(l, r);
+  case llvm::Instruction::Mul:
+    if (!linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) ||
+        !linearize(op->getOperand(1), DL, NDRangeSize, r, depth + 1))
+      return false;
+    if (!l.base && !l.scale) std::swap(l, r);
+    return !r.base && !r.scale && multiply(l, r.offset);
+  case llvm::Instruction::Shl:
+    if (!linearize(op->getOperand(0), DL, NDRangeSize, l, depth + 1) ||
+        !linearize(op->getOperand(1), DL, NDRangeSize, r, depth + 1))
+      return false;
+    return !r.base && !r.scale && r.offset >= 0 && r.offset < 31 &&
+      multiply(l, int64_t(1) << r.offset);
+  default:
+    return false;
+  }
+}
+
+// A load or store of global memory.
+struct Access {
+  Linear address;
+  bool known;
+  uint64_t size;
+  bool write;
+};
+
+static bool mayConflict(const Access &a, const Access &b,
+                        uint32_t NDRangeSize) {
+  if (!a.write && !b.write) return false;
+  if (!a.known || !b.known) return true;
+  if (a.address.base != b.address.base) {
+    // Distinct variables never overlap, but nothing is known about where
+    // a variable is relative to a plain address.
+    return !a.address.base || !b.address.base;
+  }
+
+  // The same element of each work-item, with elements that do not overlap
+  uint64_t stride = a.address.scale < 0 ?
+    -a.address.scale : a.address.scale;
+  if (a.address.offset == b.address.offset &&
+      a.address.scale == b.address.scale &&
+      std::max(a.size, b.size) <= stride)
+    return false;
+
+  int64_t aLo = getMin(a.address, NDRangeSize);
+  int64_t aHi = getMax(a.address, NDRangeSize) + int64_t(a.size);
+  int64_t bLo = getMin(b.address, NDRangeSize);
+  int64_t bHi = getMax(b.address, NDRangeSize) + int64_t(b.size);
+  return aLo < bHi && bLo < aHi;
+}
+
+// Replaces the Ld and St calls the translator emits with loads and stores,
+// so that the optimizer can forward values through memory. Nothing is known
+// about their alignment.
+static void lowerMemoryCalls(llvm::Function *F) {
+  std::vector<llvm::CallInst *> calls;
+  for (llvm::inst_iterator I = llvm::inst_begin(F), E = llvm::inst_end(F);
+       I != E; ++I) {
+    llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&*I);
+    if (call && call->getCalledFunction()) calls.push_back(call);
+  }
+
+  for (unsigned i = 0; i < calls.size(); ++i) {
+    llvm::CallInst *call = calls[i];
+    llvm::StringRef name = call->getCalledFunction()->getName();
+    if (name.startswith("Ld_") && call->getNumArgOperands() == 1) {
+      llvm::Value *load = new llvm::LoadInst(call->getArgOperand(0), "",
+                                             false, 1, call);
+      if (load->getType() != call->getType()) {
+        llvm::cast<llvm::Instruction>(load)->eraseFromParent();
+        continue;
+      }
+      call->replaceAllUsesWith(load);
+      call->eraseFromParent();
+    } else if (name.startswith("St_") && call->getNumArgOperands() == 2) {
+      new llvm::StoreInst(call->getArgOperand(0), call->getArgOperand(1),
+                          false, 1, call);
+      call->eraseFromParent();
+    }
+  }
+}
+
+// Checks what the fused kernel calls, and gives every work-item query a
+// single call at the top, after setThreadInfo. Queries of the work-item's
+// state are marked as only reading memory. If no kernel changes the
+// floating point modes, the pure math functions only compute on their
+// arguments, and are marked as such.
+static bool prepareCalls(llvm::Function *F, llvm::CallInst *setThreadInfo,
+                         const llvm::DataLayout &DL) {
+  std::vector<llvm::CallInst *> queries;
+  std::vector<llvm::CallInst *> pure;
+  bool modeChanges = false;
+
+  for (llvm::inst_iterator I = llvm::inst_begin(F), E = llvm::inst_end(F);
+       I != E; ++I) {
+    llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&*I);
+    if (!call || call == setThreadInfo) continue;
+    llvm::Function *callee = call->getCalledFunction();
+    if (!callee) return false;
+    if (llvm::isa<llvm::DbgInfoIntrinsic>(call)) continue;
+    if (callee->getIntrinsicID() == llvm::Intrinsic::lifetime_start ||
+        callee->getIntrinsicID() == llvm::Intrinsic::lifetime_end)
+      continue;
+
+    llvm::StringRef name = callee->getName();
+    // A yield point may stop the work-item, so it stays where it is.
+    if (name == "__brigYield") continue;
+    if (!callee->isDeclaration() || isUnfusable(name)) return false;
+    if (isModeChange(name)) {
+      modeChanges = true;
+      continue;
+    }
+
+    bool takesPointers = false;
+    for (unsigned i = 0; i < call->getNumArgOperands(); ++i) {
+      llvm::Value *arg = call->getArgOperand(i);
+      if (!arg->getType()->isPointerTy()) continue;
+      if (!isPrivate(arg, DL)) return false;
+      takesPointers = true;
+    }
+    if (isWorkItemQuery(name)) queries.push_back(call);
+    if (readsThreadState(name)) call->setOnlyReadsMemory();
+    else if (!takesPointers && isPureMath(name)) pure.push_back(call);
+  }
+
+  llvm::BasicBlock::iterator top(setThreadInfo);
+  ++top;
+  std::map<std::pair<llvm::Function *, uint64_t>, llvm::CallInst *> hoisted;
+  for (unsigned i = 0; i < queries.size(); ++i) {
+    llvm::CallInst *call = queries[i];
+    uint64_t dim = 0;
+    if (call->getNumArgOperands()) {
+      llvm::ConstantInt *CI =
+        llvm::dyn_cast<llvm::ConstantInt>(call->getArgOperand(0));
+      if (!CI) continue;
+      dim = CI->getZExtValue();
+    }
+    llvm::CallInst *&first =
+      hoisted[std::make_pair(call->getCalledFunction(), dim)];
+    if (first) {
+      call->replaceAllUsesWith(first);
+      call->eraseFromParent();
+    } else {
+      first = call;
+      call->moveBefore(&*top);
+    }
+  }
+
+  if (!modeChanges) {
+    for (unsigned i = 0; i < pure.size(); ++i)
+      pure[i]->setDoesNotAccessMemory();
+  }
+  return true;
+}
+
+// Every access of global memory by a work-item of the fused kernel must
+// leave what the other work-items read and write alone.
+static bool isElementWise(llvm::Function *F, const llvm::DataLayout &DL,
+                          uint32_t NDRangeSize) {
+  std::vector<Access> accesses;
+  for (llvm::inst_iterator I = llvm::inst_begin(F), E = llvm::inst_end(F);
+       I != E; ++I) {
+    const llvm::Value *ptr;
+    llvm::Type *type;
+    bool write;
+    if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&*I)) {
+      ptr = load->getPointerOperand();
+      type = load->getType();
+      write = false;
+    } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&*I)) {
+      ptr = store->getPointerOperand();
+      type = store->getValueOperand()->getType();
+      write = true;
+    } else if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&*I)) {
+      for (unsigned i = 0; i < call->getNumArgOperands(); ++i) {
+        llvm::Value *arg = call->getArgOperand(i);
+        if (arg->getType()->isPointerTy() && !isPrivate(arg, DL))
+          return false;
+      }
+      continue;
+    } else {
+      if (I->mayReadOrWriteMemory()) return false;
+      continue;
+    }
+
+    const llvm::Value *object = llvm::GetUnderlyingObject(ptr, &DL);
+    if (llvm::isa<llvm::AllocaInst>(object)) continue;
+    const llvm::GlobalVariable *GV =
+      llvm::dyn_cast<llvm::GlobalVariable>(object);
+    if (GV && GV->isConstant() && !write) continue;
+    if (GV && GV->getName() == "__brigYieldFlag") continue;
+
+    if (accesses.size() == MaxAccesses) return false;
+    Access access;
+    access.known = linearize(ptr, DL, NDRangeSize, access.address);
+    if (access.known && !access.address.base)
+      access.known = getMin(access.address, NDRangeSize) >= 0;
+    access.size = DL.getTypeStoreSize(type);
+    access.write = write;
+    accesses.push_back(access);
+  }
+
+  for (unsigned i = 0; i < accesses.size(); ++i)
+    for (unsigned j = i + 1; j < accesses.size(); ++j)
+      if (mayConflict(accesses[i], accesses[j], NDRangeSize)) return false;
+  return true;
+}
+
+static void optimizeFusedKernel(llvm::Module *M, llvm::Function *F) {
+  llvm::FunctionPassManager FPM(M);
+  FPM.add(new llvm::DataLayout(M));
+  FPM.add(llvm::createBasicAliasAnalysisPass());
+  FPM.add(llvm::createSROAPass());
+  FPM.add(llvm::createEarlyCSEPass());
+  FPM.add(llvm::createInstructionCombiningPass());
+  FPM.add(llvm::createGVNPass());
+  FPM.add(llvm::createDeadStoreEliminationPass());
+  FPM.add(llvm::createInstructionCombiningPass());
+  FPM.add(llvm::createCFGSimplificationPass());
+  FPM.doInitialization();
+  FPM.run(*F);
+  FPM.doFinalization();
+}
+
+static void eraseUnusedArgs(llvm::Module *M) {
+  std::vector<llvm::GlobalVariable *> unused;
+  for (llvm::Module::global_iterator GV = M->global_begin(),
+         E = M->global_end(); GV != E; ++GV) {
+    if (GV->getName().startswith(fusedArgName) && GV->use_empty())
+      unused.push_back(GV);
+  }
+  for (unsigned i = 0; i < unused.size(); ++i)
+    unused[i]->eraseFromParent();
+}
+
+llvm::Function *GenLLVM::fuseKernels(
+  llvm::Module *M,
+  const std::vector<llvm::Function *> &kernels,
+  const std::vector<std::vector<void *> > &args,
+  uint32_t NDRangeSize) {
+
+  if (kernels.size() < 2 || kernels.size() != args.size() || !NDRangeSize)
+    return NULL;
+  llvm::Function *setThreadInfoFun = M->getFunction("__setThreadInfo");
+  if (!setThreadInfoFun || M->MaterializeAllPermanently()) return NULL;
+
+  std::vector<llvm::Function *> bodies;
+  for (unsigned k = 0; k < kernels.size(); ++k) {
+    llvm::Function *body = getKernelBody(kernels[k]);
+    if (!body || body->isDeclaration() || body->arg_size() != args[k].size())
+      return NULL;
+    bodies.push_back(body);
+  }
+
+  // void __brigFused(ThreadInfo *info, char *kernarg) calls the kernels one
+  // after another, with their arguments in constants rather than in the
+  // kernarg segment.
+  llvm::LLVMContext &C = M->getContext();
+  llvm::Type *int8PtrTy = llvm::Type::getInt8PtrTy(C);
+  llvm::Type *params[] = { int8PtrTy, int8PtrTy };
+  llvm::FunctionType *funTy =
+    llvm::FunctionType::get(llvm::Type::getVoidTy(C), params, false);
+  llvm::Function *F =
+    llvm::Function::Create(funTy, llvm::GlobalValue::ExternalLinkage,
+                           fusedKernelName, M);
+  llvm::BasicBlock *bb = llvm::BasicBlock::Create(C, "", F);
+  llvm::Value *info = F->arg_begin();
+  llvm::CallInst *setThreadInfo =
+    llvm::CallInst::Create(setThreadInfoFun, info, "", bb);
+
+  for (unsigned k = 0; k < bodies.size(); ++k) {
+    std::vector<llvm::Value *> values;
+    unsigned i = 0;
+    for (llvm::Function::arg_iterator A = bodies[k]->arg_begin(),
+           E = bodies[k]->arg_end(); A != E; ++A, ++i) {
+      llvm::Type *type =
+        llvm::cast<llvm::PointerType>(A->getType())->getElementType();
+      llvm::Constant *value = getArgConstant(type, args[k][i]);
+      if (!value) {
+        eraseFusedKernel(F);
+        return NULL;
+      }
+      values.push_back(
+        new llvm::GlobalVariable(*M, type, true,
+                                 llvm::GlobalValue::PrivateLinkage, value,
+                                 fusedArgName));
+    }
+    llvm::CallInst::Create(bodies[k], values, "", bb);
+  }
+  llvm::ReturnInst::Create(C, bb);
+
+  // Inline the kernels and every function of the program they call.
+  for (unsigned depth = 0; ; ++depth) {
+    std::vector<llvm::CallInst *> calls;
+    for (llvm::inst_iterator I = llvm::inst_begin(F), E = llvm::inst_end(F);
+         I != E; ++I) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      if (call && call->getCalledFunction() &&
+          !call->getCalledFunction()->isDeclaration())
+        calls.push_back(call);
+    }
+    if (calls.empty()) break;
+
+    bool inlined = depth < MaxInlineDepth;
+    for (unsigned i = 0; inlined && i < calls.size(); ++i) {
+      llvm::InlineFunctionInfo IFI;
+      inlined = llvm::InlineFunction(calls[i], IFI);
+    }
+    if (!inlined) {
+      eraseFusedKernel(F);
+      return NULL;
+    }
+  }
+
+  llvm::DataLayout DL(M);
+  lowerMemoryCalls(F);
+  if (!prepareCalls(F, setThreadInfo, DL)) {
+    eraseFusedKernel(F);
+    return NULL;
+  }
+  optimizeFusedKernel(M, F);
+  if (!isElementWise(F, DL, NDRangeSize)) {
+    eraseFusedKernel(F);
+    return NULL;
+  }
+  // Arguments folded into the code
+  eraseUnusedArgs(M);
+  return F;
+}
+
+void GenLLVM::eraseFusedKernel(llvm::Function *F) {
+  llvm::Module *M = F->getParent();
+  F->eraseFromParent();
+  eraseUnusedArgs(M);
+}
+
+} // namespace brig
+} // namespace hsa
@@ -0,0 +1,456 @@
+//===- brig_image.cc ------------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_image.h"
+#include "brig_runtime.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace hsa {
+namespace brig {
+
+static unsigned getChannelSize(ImageChannelType type) {
+  switch (type) {
+    case UnormInt8: case SnormInt8: case SignedInt8: case UnsignedInt8:
+      return 1;
+    case UnormInt16: case SnormInt16: case SignedInt16: case UnsignedInt16:
+    case HalfFloat:
+      return 2;
+    case SignedInt32: case UnsignedInt32: case Float:
+      return 4;
+  }
+  return 0;
+}
+
+static unsigned getChannelCount(ImageChannelOrder order) {
+  switch (order) {
+    case ChannelR:    return 1;
+    case ChannelRG:   return 2;
+    case ChannelRGBA: return 4;
+  }
+  return 0;
+}
+
+static b32 fromFloat(f32 f) {
+  b32 b;
+  memcpy(&b, &f, sizeof(b));
+  return b;
+}
+
+static f32 toFloat(b32 b) {
+  f32 f;
+  memcpy(&f, &b, sizeof(f));
+  return f;
+}
+
+// Clamps f to [lo, hi], taking NaN to lo.
+static f32 clamp(f32 f, f32 lo, f32 hi) {
+  return f > lo ? (f < hi ? f : hi) : lo;
+}
+
+template<class T> static T loadChannel(const char *p) {
+  T t;
+  memcpy(&t, p, sizeof(t));
+  return t;
+}
+
+template<class T> static void storeChannel(char *p, T t) {
+  memcpy(p, &t, sizeof(t));
+}
+
+static b32 decodeChannel(ImageChannelType type, const char *p) {
+  switch (type) {
+    case UnormInt8:
+      return fromFloat(loadChannel<u8>(p) / 255.0f);
+    case UnormInt16:
+      return fromFloat(loadChannel<u16>(p) / 65535.0f);
+    case SnormInt8:
+      return fromFloat(std::max(loadChannel<s8>(p) / 127.0f, -1.0f));
+    case SnormInt16:
+      return fromFloat(std::max(loadChannel<s16>(p) / 32767.0f, -1.0f));
+    case SignedInt8:    return b32(s32(loadChannel<s8>(p)));
+    case SignedInt16:   return b32(s32(loadChannel<s16>(p)));
+    case SignedInt32:   return loadChannel<b32>(p);
+    case UnsignedInt8:  return loadChannel<u8>(p);
+    case UnsignedInt16: return loadChannel<u16>(p);
+    case UnsignedInt32: return loadChannel<b32>(p);
+    case HalfFloat:
+      return fromFloat(f16::toFloat(loadChannel<b16>(p)));
+    case Float:
+      return loadChannel<b32>(p);
+  }
+  return 0;
+}
+
+static void encodeChannel(ImageChannelType type, char *p, b32 b) {
+  s32 s = s32(b);
+  switch (type) {
+    case UnormInt8:
+      storeChannel(p, u8(rintf(clamp(toFloat(b), 0.0f, 1.0f) * 255.0f)));
+      break;
+    case UnormInt16:
+      storeChannel(p, u16(rintf(clamp(toFloat(b), 0.0f, 1.0f) * 65535.0f)));
+      break;
+    case SnormInt8:
+      storeChannel(p, s8(rintf(clamp(toFloat(b), -1.0f, 1.0f) * 127.0f)));
+      break;
+    case SnormInt16:
+      storeChannel(p, s16(rintf(clamp(toFloat(b), -1.0f, 1.0f) * 32767.0f)));
+      break;
+    case SignedInt8:
+      storeChannel(p, s8(std::min(std::max(s, -128), 127)));
+      break;
+    case SignedInt16:
+      storeChannel(p, s16(std::min(std::max(s, -32768), 32767)));
+      break;
+    case UnsignedInt8:
+      storeChannel(p, u8(std::min(b, b32(0xFF))));
+      break;
+    case UnsignedInt16:
+      storeChannel(p, u16(std::min(b, b32(0xFFFF))));
+      break;
+    case HalfFloat:
+      storeChannel(p, f16::fromFloat(toFloat(b)));
+      break;
+    case SignedInt32: case UnsignedInt32: case Float:
+      storeChannel(p, b);
+      break;
+  }
+}
+
+BrigImage::BrigImage(ImageGeometry geometry, ImageChannelOrder order,
+                     ImageChannelType type, uint32_t width, uint32_t height,
+                     uint32_t depth) :
+  geometry_(geometry), order_(order), type_(type),
+  width_(width), height_(height), depth_(depth),
+  channels_(getChannelCount(order)),
+  texelSize_(channels_ * getChannelSize(type)),
+  data_(NULL) {
+
+  tileBits_[0] = tileBits_[1] = tileBits_[2] = 0;
+  if (geometry == Image2D || geometry == Image2DArray) {
+    tileBits_[0] = tileBits_[1] = 3;
+  } else if (geometry == Image3D) {
+    tileBits_[0] = tileBits_[1] = tileBits_[2] = 2;
+  }
+
+  // Bit i of the tiled coordinate d lands at bit i * tiled + d of the
+  // Morton index.
+  unsigned tiled = 0;
+  for (unsigned d = 0; d < 3; ++d)
+    if (tileBits_[d]) ++tiled;
+
+  for (unsigned d = 0, pos = 0; d < 3; ++d) {
+    for (unsigned v = 0; v < 8; ++v) {
+      spread_[d][v] = 0;
+      for (unsigned i = 0; i < tileBits_[d]; ++i)
+        spread_[d][v] |= ((v >> i) & 1) << (i * tiled + pos);
+    }
+    if (tileBits_[d]) ++pos;
+  }
+
+  tilesX_ = (width + (1U << tileBits_[0]) - 1) >> tileBits_[0];
+  tilesY_ = (height + (1U << tileBits_[1]) - 1) >> tileBits_[1];
+}
+
+BrigImage::~BrigImage() {
+  delete[] data_;
+}
+
+BrigImage *BrigImage::create(ImageGeometry geometry,
+                             ImageChannelOrder order, ImageChannelType type,
+                             uint32_t width, uint32_t height, uint32_t depth,
+                             const void *linear,
+                             size_t rowPitch, size_t slicePitch) {
+
+  if (unsigned(geometry) > Image2DArray || unsigned(order) > ChannelRGBA ||
+      unsigned(type) > Float)
+    return NULL;
+
+  if (!height) height = 1;
+  if (!depth) depth = 1;
+
+  bool hasHeight = geometry != Image1D && geometry != Image1DBuffer;
+  bool hasDepth = geometry == Image3D || geometry == Image2DArray;
+  if (!width || (!hasHeight && height != 1) || (!hasDepth && depth != 1))
+    return NULL;
+
+  // Coordinates are signed 32-bit values.
+  const uint32_t maxSize = 1U << 30;
+  if (width > maxSize || height > maxSize || depth > maxSize) return NULL;
+
+  BrigImage *image =
+    new BrigImage(geometry, order, type, width, height, depth);
+
+  // Every product and shift is checked, so that an image too large to
+  // address fails here rather than wrapping to a small allocation.
+  const unsigned *tileBits = image->tileBits_;
+  const unsigned tileShift = tileBits[0] + tileBits[1] + tileBits[2];
+  uint64_t tilesZ = (depth + (1U << tileBits[2]) - 1) >> tileBits[2];
+  // tilesX_ and tilesY_ are at most 2^30, so their product fits.
+  uint64_t tiles = uint64_t(image->tilesX_) * image->tilesY_;
+  const uint64_t maxU64 = ~uint64_t(0);
+  const size_t maxSizeT = ~size_t(0);
+  uint64_t size = 0;
+  bool fits = tiles <= maxU64 / tilesZ;
+  if (fits) {
+    tiles *= tilesZ;
+    fits = tiles <= (maxU64 >> tileShift);
+  }
+  if (fits) {
+    uint64_t texels = tiles << tileShift;
+    fits = texels <= maxSizeT / image->texelSize_;
+    size = texels * image->texelSize_;
+  }
+
+  // Zero the padding of partial tiles too.
+  if (fits) image->data_ = new (std::nothrow) char[size]();
+  if (!image->data_) {
+    delete image;
+    return NULL;
+  }
+
+  if (!linear) return image;
+
+  if (!rowPitch) rowPitch = size_t(width) * image->texelSize_;
+  if (!slicePitch) slicePitch = rowPitch * height;
+
+  const char *src = (const char *) linear;
+  for (uint32_t z = 0; z < depth; ++z)
+    for (uint32_t y = 0; y < height; ++y)
+      for (uint32_t x = 0; x < width; ++x)
+        memcpy(image->getTexel(x, y, z),
+               src + z * slicePitch + y * rowPitch + x * image->texelSize_,
+               image->texelSize_);
+
+  return image;
+}
+
+void BrigImage::read(void *linear, size_t rowPitch, size_t slicePitch) const {
+  if (!rowPitch) rowPitch = size_t(width_) * texelSize_;
+  if (!slicePitch) slicePitch = rowPitch * height_;
+
+  char *dest = (char *) linear;
+  for (uint32_t z = 0; z < depth_; ++z)
+    for (uint32_t y = 0; y < height_; ++y)
+      for (uint32_t x = 0; x < width_; ++x)
+        memcpy(dest + z * slicePitch + y * rowPitch + x * texelSize_,
+               getTexel(x, y, z), texelSize_);
+}
+
+char *BrigImage::getTexel(uint32_t x, uint32_t y, uint32_t z) const {
+  uint64_t tile =
+    (uint64_t(z >> tileBits_[2]) * tilesY_ + (y >> tileBits_[1])) * tilesX_ +
+    (x >> tileBits_[0]);
+  unsigned inner =
+    spread_[0][x & ((1U << tileBits_[0]) - 1)] |
+    spread_[1][y & ((1U << tileBits_[1]) - 1)] |
+    spread_[2][z & ((1U << tileBits_[2]) - 1)];
+  unsigned tileShift = tileBits_[0] + tileBits_[1] + tileBits_[2];
+  return data_ + ((tile << tileShift) + inner) * texelSize_;
+}
+
+unsigned BrigImage::getDims() const {
+  switch (geometry_) {
+    case Image1D: case Image1DBuffer: case Image1DArray: return 1;
+    case Image2D: case Image2DArray: return 2;
+    case Image3D: return 3;
+  }
+  return 0;
+}
+
+bool BrigImage::isFloat() const {
+  switch (type_) {
+    case UnormInt8: case UnormInt16: case SnormInt8: case SnormInt16:
+    case HalfFloat: case Float:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The value of a missing channel, which is also the border color.
+static void fillMissing(b32 texel[4], unsigned channels, bool isFloat) {
+  for (unsigned i = channels; i < 3; ++i) texel[i] = 0;
+  if (channels < 4) texel[3] = isFloat ? fromFloat(1.0f) : 1;
+}
+
+static void decodeTexel(const BrigImage &image, const char *p, b32 texel[4]) {
+  ImageChannelType type = image.getType();
+  unsigned channels = image.getChannels();
+
+#ifdef __SSE2__
+  if (type == UnormInt8 && channels == 4) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i i = _mm_cvtsi32_si128(loadChannel<s32>(p));
+    i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(i, zero), zero);
+    __m128 f = _mm_div_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(255.0f));
+    _mm_storeu_si128((__m128i *) texel, _mm_castps_si128(f));
+    return;
+  }
+#endif
+
+  unsigned size = getChannelSize(type);
+  for (unsigned i = 0; i < channels; ++i)
+    texel[i] = decodeChannel(type, p + i * size);
+  fillMissing(texel, channels, image.isFloat());
+}
+
+void BrigImage::load(int32_t x, int32_t y, int32_t z, b32 texel[4]) const {
+  if (uint32_t(x) >= width_ || uint32_t(y) >= height_ ||
+      uint32_t(z) >= depth_) {
+    texel[0] = texel[1] = texel[2] = texel[3] = 0;
+    return;
+  }
+
+  decodeTexel(*this, getTexel(x, y, z), texel);
+}
+
+void BrigImage::store(int32_t x, int32_t y, int32_t z, const b32 texel[4]) {
+  if (uint32_t(x) >= width_ || uint32_t(y) >= height_ ||
+      uint32_t(z) >= depth_)
+    return;
+
+  char *p = getTexel(x, y, z);
+  unsigned size = getChannelSize(type_);
+  for (unsigned i = 0; i < channels_; ++i)
+    encodeChannel(type_, p + i * size, texel[i]);
+}
+
+// Maps a texel coordinate into [0, size), or to -1 for the border.
+static int32_t address(int32_t i, int64_t size, SamplerAddressing mode) {
+  switch (mode) {
+    case AddressRepeat: {
+      int64_t r = i % size;
+      return int32_t(r < 0 ? r + size : r);
+    }
+    case AddressMirroredRepeat: {
+      int64_t r = i % (2 * size);
+      if (r < 0) r += 2 * size;
+      return int32_t(r < size ? r : 2 * size - 1 - r);
+    }
+    case AddressClampToBorder:
+      return i >= 0 && i < size ? i : -1;
+    case AddressClampToEdge: case AddressUndefined:
+      break;
+  }
+  return int32_t(std::min(std::max(int64_t(i), int64_t(0)), size - 1));
+}
+
+// Converts a float coordinate to an integer one, keeping infinities and NaN
+// in range.
+static f32 clampCoord(f32 u) {
+  const f32 limit = 1 << 30;
+  return clamp(u, -limit, limit);
+}
+
+// Reads the texel at coord. Only the first dims coordinates are addressed;
+// the others are already in range.
+static void fetch(const BrigImage &image, const BrigSampler &sampler,
+                  unsigned dims, const int32_t coord[3], b32 texel[4]) {
+  const int64_t size[3] = {
+    image.getWidth(), image.getHeight(), image.getDepth()
+  };
+  int32_t at[3] = { coord[0], coord[1], coord[2] };
+  for (unsigned d = 0; d < dims; ++d) {
+    at[d] = address(coord[d], size[d], sampler.getAddressing());
+    if (at[d] < 0) {
+      fillMissing(texel, 0, image.isFloat());
+      if (image.getChannels() == 4) texel[3] = 0;
+      return;
+    }
+  }
+  image.load(at[0], at[1], at[2], texel);
+}
+
+// Adds weight times a float texel to sum.
+static void accumulate(f32 sum[4], const b32 texel[4], f32 weight) {
+#ifdef __SSE2__
+  __m128 t = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) texel));
+  __m128 s = _mm_loadu_ps(sum);
+  _mm_storeu_ps(sum, _mm_add_ps(s, _mm_mul_ps(t, _mm_set1_ps(weight))));
+#else
+  for (unsigned i = 0; i < 4; ++i) sum[i] += toFloat(texel[i]) * weight;
+#endif
+}
+
+static bool isArray(ImageGeometry geometry) {
+  return geometry == Image1DArray || geometry == Image2DArray;
+}
+
+void BrigImage::sample(const BrigSampler &sampler, f32 x, f32 y, f32 z,
+                       b32 texel[4]) const {
+  const f32 coord[3] = { x, y, z };
+  const uint32_t size[3] = { width_, height_, depth_ };
+  const unsigned dims = getDims();
+  const bool linear = sampler.getFilter() == FilterLinear && isFloat();
+
+  int32_t lo[3] = { 0, 0, 0 };
+  f32 frac[3] = { 0, 0, 0 };
+  for (unsigned d = 0; d < dims; ++d) {
+    f32 u = coord[d];
+    if (sampler.isNormalized()) u *= size[d];
+    if (linear) u -= 0.5f;
+    u = clampCoord(u);
+    f32 base = std::floor(u);
+    lo[d] = int32_t(base);
+    frac[d] = u - base;
+  }
+
+  // The layer of an array is the nearest integer coordinate.
+  if (isArray(geometry_)) {
+    f32 layer = rintf(clampCoord(coord[dims]));
+    lo[dims] = int32_t(clamp(layer, 0, f32(size[dims] - 1)));
+  }
+
+  if (!linear) {
+    fetch(*this, sampler, dims, lo, texel);
+    return;
+  }
+
+  f32 sum[4] = { 0, 0, 0, 0 };
+  for (unsigned corner = 0; corner < 1U << dims; ++corner) {
+    int32_t at[3] = { lo[0], lo[1], lo[2] };
+    f32 weight = 1;
+    for (unsigned d = 0; d < dims; ++d) {
+      bool upper = corner >> d & 1;
+      at[d] += upper;
+      weight *= upper ? frac[d] : 1 - frac[d];
+    }
+    if (weight == 0) continue;
+
+    b32 value[4];
+    fetch(*this, sampler, dims, at, value);
+    accumulate(sum, value, weight);
+  }
+
+  for (unsigned i = 0; i < 4; ++i) texel[i] = fromFloat(sum[i]);
+}
+
+void BrigImage::sample(const BrigSampler &sampler,
+                       int32_t x, int32_t y, int32_t z, b32 texel[4]) const {
+  const int32_t size[3] = { int32_t(width_), int32_t(height_),
+                            int32_t(depth_) };
+  const unsigned dims = getDims();
+  int32_t coord[3] = { x, y, z };
+  for (unsigned d = dims; d < 3; ++d) coord[d] = 0;
+  if (isArray(geometry_))
+    coord[dims] = std::min(std::max(dims == 1 ? y : z, 0), size[dims] - 1);
+  fetch(*this, sampler, dims, coord, texel);
+}
+
+} // namespace brig
+} // namespace hsa
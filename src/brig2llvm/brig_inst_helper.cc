@@ -344,6 +344,26 @@ const char *getAtomicOpName(BrigAtomicOperation atomicOp) {
 #undef caseBrigAtomic
 }
 
+// Matches the memory order suffixes of the runtime atomics. Partial
+// semantics only narrow the segments ordered, so they share the full ones.
+const char *getMemorySemanticName(BrigMemorySemantic semantic) {
+  switch (semantic) {
+    case BRIG_SEMANTIC_REGULAR:
+      return "_rlx";
+    case BRIG_SEMANTIC_ACQUIRE:
+    case BRIG_SEMANTIC_PARTIAL_ACQUIRE:
+      return "_acq";
+    case BRIG_SEMANTIC_RELEASE:
+    case BRIG_SEMANTIC_PARTIAL_RELEASE:
+      return "_rel";
+    case BRIG_SEMANTIC_NONE:
+    case BRIG_SEMANTIC_ACQUIRE_RELEASE:
+    case BRIG_SEMANTIC_PARTIAL_ACQUIRE_RELEASE:
+      return "";
+  default: assert(false && "Unknown memory semantic");
+  }
+}
+
 std::string BrigInstHelper::getInstName(const inst_iterator inst) {
   const char *base = getBaseName(inst);
   const char *packing = getPackingName(inst);
@@ -370,7 +390,15 @@ std::string BrigInstHelper::getInstName(const inst_iterator inst) {
   if (const BrigInstAtomic *atom = dyn_cast<BrigInstAtomic>(inst)) {
     BrigAtomicOperation atomicOp = BrigAtomicOperation(atom->atomicOperation);
     const char *atomicOpName = getAtomicOpName(atomicOp);
-    return std::string(base) + atomicOpName + type;
+    BrigMemorySemantic semantic = BrigMemorySemantic(atom->memorySemantic);
+    const char *semanticName = getMemorySemanticName(semantic);
+    return std::string(base) + atomicOpName + semanticName + type;
+  }
+
+  // The runtime handles every geometry, so it is not part of the name.
+  if (const BrigInstImage *image = dyn_cast<BrigInstImage>(inst)) {
+    const char *coordType = getTypeName(BrigType(image->coordType));
+    return std::string(base) + type + coordType;
   }
 
   if (const BrigInstSourceType *src = dyn_cast<BrigInstSourceType>(inst)) {
@@ -10,9 +10,12 @@
 #include "brig_module.h"
 #include "brig_inst_helper.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <cstring>
 #include <set>
 
+#include <sys/time.h>
+
 namespace hsa {
 namespace brig {
 
@@ -28,6 +31,498 @@ bool (BrigModule::check)(bool test, const Message &msg,
   return test;
 }
 
+const char *BrigModule::getValidationLevelName(ValidationLevel level) {
+  switch (level) {
+    case NoValidation: return "none";
+    case StructuralValidation: return "structural";
+    case FullValidation: return "full";
+    case DefaultValidation: return "default";
+  }
+  return "unknown";
+}
+
+bool BrigModule::runValidation(const BrigReader &reader) {
+  // A stamped module has already passed full validation when it was
+  // produced. Unless full validation was asked for explicitly, only
+  // re-check what translation needs to stay in bounds.
+  if (level_ == DefaultValidation)
+    level_ = reader.hasValidationStamp() ?
+      StructuralValidation : FullValidation;
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  bool valid = true;
+  switch (level_) {
+    case NoValidation: break;
+    case StructuralValidation: valid = validateStructure(); break;
+    case FullValidation: valid = validate(); break;
+    case DefaultValidation: break;
+  }
+
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  validationTime_ = uint64_t(end.tv_sec - start.tv_sec) * 1000000 +
+    end.tv_usec - start.tv_usec;
+
+  return valid;
+}
+
+static std::string getName(const BrigSections &S,
+                           BrigStringOffset32_t name) {
+  const BrigString *str = (const BrigString *) (S.strings + name);
+  return std::string((const char *) str->bytes, str->byteCount);
+}
+
+void BrigModule::buildIndex() {
+  typedef std::pair<std::string, uint32_t> Name;
+
+  for (dir_iterator it = S_.begin(), E = S_.end(); it != E; ++it) {
+    uint32_t offset = it - S_.directives;
+    index_.dirOffsets.push_back(offset);
+    if (const BrigDirectiveLabel *label = dyn_cast<BrigDirectiveLabel>(it)) {
+      index_.controlBlocks.push_back(offset);
+      index_.labels.push_back(Name(getName(S_, label->name), offset));
+    } else if (const BrigDirectiveExecutable *exec =
+               dyn_cast<BrigDirectiveExecutable>(it)) {
+      index_.controlBlocks.push_back(offset);
+      index_.functions.push_back(Name(getName(S_, exec->name), offset));
+    }
+  }
+  index_.dirOffsets.push_back(S_.directivesSize);
+  std::sort(index_.functions.begin(), index_.functions.end());
+  std::sort(index_.labels.begin(), index_.labels.end());
+
+  for (inst_iterator it = S_.code_begin(), E = S_.code_end(); it != E; ++it)
+    index_.instOffsets.push_back(it - S_.code);
+  index_.instOffsets.push_back(S_.codeSize);
+
+  for (oper_iterator it = S_.oper_begin(), E = S_.oper_end(); it < E; ++it)
+    index_.operOffsets.push_back(it - S_.operands);
+  index_.operOffsets.push_back(S_.operandsSize);
+
+  S_.index = &index_;
+}
+
+// Returns true if offset starts one of the entries in offsets, a section
+// index array whose last element is the section size.
+static bool isEntry(const std::vector<uint32_t> &offsets, uint32_t offset) {
+  return std::binary_search(offsets.begin(), offsets.end() - 1, offset);
+}
+
+// Returns true if offset starts a directive of kind T.
+template<class T>
+static bool isDirective(const BrigSections &S, const BrigSectionIndex &index,
+                        uint32_t offset) {
+  return isEntry(index.dirOffsets, offset) &&
+    isa<T>(dir_iterator(S.directives + offset));
+}
+
+// Returns true if the first count elements of the trailing array of brig lie
+// within brig->size.
+template<class T, class E>
+static bool fitsArray(const T *brig, const E *array, size_t count) {
+  const char *start = reinterpret_cast<const char *>(brig);
+  const char *first = reinterpret_cast<const char *>(array);
+  return size_t(first - start) + count * sizeof(E) <= brig->size;
+}
+
+// Size of the fixed part of each kind of entry, or 0 for unknown kinds.
+static size_t getMinSize(const dir_iterator dir) {
+#define caseBrig(X) case Brig ## X::DirKind: return sizeof(Brig ## X)
+  switch (dir->kind) {
+    caseBrig(DirectiveArgScopeEnd);
+    caseBrig(DirectiveArgScopeStart);
+    caseBrig(BlockEnd);
+    caseBrig(BlockNumeric);
+    caseBrig(BlockStart);
+    caseBrig(BlockString);
+    caseBrig(DirectiveComment);
+    caseBrig(DirectiveControl);
+    caseBrig(DirectiveExtension);
+    caseBrig(DirectiveFbarrier);
+    caseBrig(DirectiveFile);
+    caseBrig(DirectiveFunction);
+    caseBrig(DirectiveImage);
+    caseBrig(DirectiveImageInit);
+    caseBrig(DirectiveKernel);
+    caseBrig(DirectiveLabel);
+    caseBrig(DirectiveLabelInit);
+    caseBrig(DirectiveLabelTargets);
+    caseBrig(DirectiveLoc);
+    caseBrig(DirectivePragma);
+    caseBrig(DirectiveSampler);
+    caseBrig(DirectiveSamplerInit);
+    caseBrig(DirectiveSignature);
+    caseBrig(DirectiveVariable);
+    caseBrig(DirectiveVariableInit);
+    caseBrig(DirectiveVersion);
+  }
+#undef caseBrig
+  return 0;
+}
+
+static size_t getMinSize(const inst_iterator inst) {
+#define caseBrig(X) case Brig ## X::InstKind: return sizeof(Brig ## X)
+  switch (inst->kind) {
+    caseBrig(InstNone);
+    caseBrig(InstBasic);
+    caseBrig(InstAtomic);
+    caseBrig(InstAtomicImage);
+    caseBrig(InstBar);
+    caseBrig(InstBr);
+    caseBrig(InstCmp);
+    caseBrig(InstCvt);
+    caseBrig(InstFbar);
+    caseBrig(InstImage);
+    caseBrig(InstMem);
+    caseBrig(InstAddr);
+    caseBrig(InstMod);
+    caseBrig(InstSeg);
+    caseBrig(InstSourceType);
+  }
+#undef caseBrig
+  return 0;
+}
+
+static size_t getMinSize(const oper_iterator operand) {
+#define caseBrig(X) case Brig ## X::OperKind: return sizeof(Brig ## X)
+  switch (operand->kind) {
+    caseBrig(OperandImmed);
+    caseBrig(OperandWavesize);
+    caseBrig(OperandReg);
+    caseBrig(OperandRegVector);
+    caseBrig(OperandAddress);
+    caseBrig(OperandLabelRef);
+    caseBrig(OperandArgumentRef);
+    caseBrig(OperandArgumentList);
+    caseBrig(OperandFunctionRef);
+    caseBrig(OperandFunctionList);
+    caseBrig(OperandSignatureRef);
+    caseBrig(OperandFbarrierRef);
+  }
+#undef caseBrig
+  return 0;
+}
+
+bool BrigModule::validateStructure(void) const {
+  if (!validateSectionSize(S_.directives, S_.directivesSize)) return false;
+  if (!validateSectionSize(S_.code, S_.codeSize)) return false;
+  if (!validateSectionSize(S_.operands, S_.operandsSize)) return false;
+  if (!validateSectionSize(S_.strings, S_.stringsSize)) return false;
+
+  if (!check(S_.begin() != S_.end(), "Empty directive section"))
+    return false;
+
+  // First make sure every entry lies within its section, recording where
+  // the entries start so that references between them can be checked.
+  BrigSectionIndex index;
+
+  for (dir_iterator it = S_.begin(); it != S_.end(); ++it) {
+    if (!validateStructure(it)) return false;
+    index.dirOffsets.push_back(it - S_.directives);
+  }
+  index.dirOffsets.push_back(S_.directivesSize);
+
+  for (inst_iterator it = S_.code_begin(); it != S_.code_end(); ++it) {
+    if (!validateStructure(it)) return false;
+    index.instOffsets.push_back(it - S_.code);
+  }
+  index.instOffsets.push_back(S_.codeSize);
+
+  for (oper_iterator it = S_.oper_begin(); it < S_.oper_end(); ++it) {
+    if (!validateStructure(it)) return false;
+    index.operOffsets.push_back(it - S_.operands);
+  }
+  index.operOffsets.push_back(S_.operandsSize);
+
+  const char *curr = S_.strings + 4;
+  size_t maxLen = S_.stringsSize - 4;
+  while (maxLen) {
+    const BrigString *str = (const BrigString *) curr;
+    if (!check(maxLen >= 4 && str->byteCount <= maxLen - 4,
+               "String overflows string section"))
+      return false;
+    size_t size = (size_t(str->byteCount) + 7) / 4 * 4;
+    maxLen -= std::min(size, maxLen);
+    curr += size;
+  }
+
+  for (dir_iterator it = S_.begin(); it != S_.end(); ++it)
+    if (!validateStructure(it, index)) return false;
+
+  for (inst_iterator it = S_.code_begin(); it != S_.code_end(); ++it)
+    if (!validateStructure(it, index)) return false;
+
+  for (oper_iterator it = S_.oper_begin(); it < S_.oper_end(); ++it)
+    if (!validateStructure(it, index)) return false;
+
+  return validateCCode();
+}
+
+bool BrigModule::validateStructure(const dir_iterator dir) const {
+  if (!validate(dir)) return false;
+  if (!check(dir->size >= sizeof(BrigDirectiveBase),
+             "Directive too small"))
+    return false;
+  if (!check(dir - S_.directives + dir->size <= S_.directivesSize,
+             "dir spans the directives section"))
+    return false;
+
+  size_t minSize = getMinSize(dir);
+  if (!check(minSize, "Unknown directive kind")) return false;
+  if (!check(dir->size >= minSize, "Directive too small for its kind"))
+    return false;
+  return validateCCode(dir->code);
+}
+
+bool BrigModule::validateStructure(const inst_iterator inst) const {
+  if (!validate(inst)) return false;
+  if (!check(inst->size >= sizeof(BrigInstBase), "Instruction too small"))
+    return false;
+  if (!check(inst - S_.code + inst->size <= S_.codeSize,
+             "inst spans the code section"))
+    return false;
+
+  size_t minSize = getMinSize(inst);
+  if (!check(minSize, "Unknown instruction kind")) return false;
+  return check(inst->size >= minSize, "Instruction too small for its kind");
+}
+
+bool BrigModule::validateStructure(const oper_iterator operand) const {
+  if (!validate(operand)) return false;
+  if (!check(operand->size >= sizeof(BrigOperandBase), "Operand too small"))
+    return false;
+  if (!check(operand - S_.operands + operand->size <= S_.operandsSize,
+             "operand spans the operand section"))
+    return false;
+
+  size_t minSize = getMinSize(operand);
+  if (!check(minSize, "Unknown operand kind")) return false;
+  return check(operand->size >= minSize, "Operand too small for its kind");
+}
+
+// Only checks what the translator dereferences: string offsets, trailing
+// arrays, and references to other entries, which must start an entry of the
+// kind the translator casts them to.
+bool BrigModule::validateStructure(const dir_iterator dir,
+                                   const BrigSectionIndex &index) const {
+  bool valid = true;
+
+  if (const BrigDirectiveExecutable *exec =
+      dyn_cast<BrigDirectiveExecutable>(dir)) {
+    valid &= validateSName(exec->name);
+    valid &= check(std::binary_search(index.dirOffsets.begin(),
+                                      index.dirOffsets.end(),
+                                      exec->firstInArg),
+                   "firstInArg is not a directive");
+    valid &= check(std::binary_search(index.dirOffsets.begin(),
+                                      index.dirOffsets.end(),
+                                      exec->firstScopedDirective),
+                   "firstScopedDirective is not a directive");
+    valid &= check(std::binary_search(index.dirOffsets.begin(),
+                                      index.dirOffsets.end(),
+                                      exec->nextTopLevelDirective),
+                   "nextTopLevelDirective is not a directive");
+    return valid;
+  }
+
+  if (const BrigDirectiveSymbol *symbol = dyn_cast<BrigDirectiveSymbol>(dir)) {
+    valid &= validateSName(symbol->name);
+    if (!symbol->init) return valid;
+    if (isa<BrigDirectiveVariable>(dir))
+      valid &= check(isDirective<BrigDirectiveVariableInit>(S_, index,
+                                                            symbol->init) ||
+                     isDirective<BrigDirectiveLabelInit>(S_, index,
+                                                         symbol->init),
+                     "Variable init is not an initializer");
+    else if (isa<BrigDirectiveImage>(dir))
+      valid &= check(isDirective<BrigDirectiveImageInit>(S_, index,
+                                                         symbol->init),
+                     "Image init is not an image initializer");
+    else
+      valid &= check(isDirective<BrigDirectiveSamplerInit>(S_, index,
+                                                           symbol->init),
+                     "Sampler init is not a sampler initializer");
+    return valid;
+  }
+
+  switch (dir->kind) {
+    case BRIG_DIRECTIVE_BLOCK_NUMERIC:
+      return validateSName(cast<BrigBlockNumeric>(dir)->data);
+    case BRIG_DIRECTIVE_BLOCK_START:
+      return validateSName(cast<BrigBlockStart>(dir)->name);
+    case BRIG_DIRECTIVE_BLOCK_STRING:
+      return validateSName(cast<BrigBlockString>(dir)->string);
+    case BRIG_DIRECTIVE_COMMENT:
+      return validateSName(cast<BrigDirectiveComment>(dir)->name);
+    case BRIG_DIRECTIVE_EXTENSION:
+      return validateSName(cast<BrigDirectiveExtension>(dir)->name);
+    case BRIG_DIRECTIVE_FBARRIER:
+      return validateSName(cast<BrigDirectiveFbarrier>(dir)->name);
+    case BRIG_DIRECTIVE_FILE:
+      return validateSName(cast<BrigDirectiveFile>(dir)->filename);
+    case BRIG_DIRECTIVE_LABEL:
+      return validateSName(cast<BrigDirectiveLabel>(dir)->name);
+    case BRIG_DIRECTIVE_PRAGMA:
+      return validateSName(cast<BrigDirectivePragma>(dir)->name);
+    case BRIG_DIRECTIVE_VARIABLE_INIT:
+      return validateSName(cast<BrigDirectiveVariableInit>(dir)->data);
+
+    case BRIG_DIRECTIVE_CONTROL: {
+      const BrigDirectiveControl *control = cast<BrigDirectiveControl>(dir);
+      if (!check(fitsArray(control, control->values, control->valueCount),
+                 "BrigDirectiveControl values overflow the directive"))
+        return false;
+      for (unsigned i = 0; i < control->valueCount; ++i)
+        valid &= check(isEntry(index.operOffsets, control->values[i]),
+                       "BrigDirectiveControl value is not an operand");
+      return valid;
+    }
+
+    case BRIG_DIRECTIVE_LABEL_INIT: {
+      const BrigDirectiveLabelInit *init = cast<BrigDirectiveLabelInit>(dir);
+      if (!check(fitsArray(init, init->labels, init->labelCount),
+                 "BrigDirectiveLabelInit labels overflow the directive"))
+        return false;
+      for (unsigned i = 0; i < init->labelCount; ++i)
+        valid &= check(isDirective<BrigDirectiveLabel>(S_, index,
+                                                       init->labels[i]),
+                       "BrigDirectiveLabelInit label is not a label");
+      return valid;
+    }
+
+    case BRIG_DIRECTIVE_LABEL_TARGETS: {
+      const BrigDirectiveLabelTargets *targets =
+        cast<BrigDirectiveLabelTargets>(dir);
+      if (!check(fitsArray(targets, targets->labels, targets->labelCount),
+                 "BrigDirectiveLabelTargets labels overflow the directive"))
+        return false;
+      for (unsigned i = 0; i < targets->labelCount; ++i)
+        valid &= check(isDirective<BrigDirectiveLabel>(S_, index,
+                                                       targets->labels[i]),
+                       "BrigDirectiveLabelTargets label is not a label");
+      return valid;
+    }
+
+    case BRIG_DIRECTIVE_SIGNATURE: {
+      const BrigDirectiveSignature *sig = cast<BrigDirectiveSignature>(dir);
+      valid &= validateSName(sig->name);
+      valid &= check(fitsArray(sig, sig->args,
+                               size_t(sig->inArgCount) + sig->outArgCount),
+                     "BrigDirectiveSignature args overflow the directive");
+      return valid;
+    }
+  }
+
+  return true;
+}
+
+bool BrigModule::validateStructure(const inst_iterator inst,
+                                   const BrigSectionIndex &index) const {
+  if (isa<BrigInstNone>(inst)) return true;
+
+  bool valid = true;
+  for (unsigned i = 0; i < 5; ++i) {
+    BrigOperandOffset32_t offset = inst->operands[i];
+    valid &= check(!offset || isEntry(index.operOffsets, offset),
+                   "Instruction operand is not an operand");
+  }
+  return valid;
+}
+
+bool BrigModule::validateStructure(const oper_iterator operand,
+                                   const BrigSectionIndex &index) const {
+  bool valid = true;
+
+  switch (operand->kind) {
+    case BRIG_OPERAND_ADDRESS: {
+      const BrigOperandAddress *address = cast<BrigOperandAddress>(operand);
+      valid &= check(!address->symbol ||
+                     isDirective<BrigDirectiveSymbol>(S_, index,
+                                                      address->symbol),
+                     "BrigOperandAddress symbol is not a symbol");
+      valid &= !address->reg || validateSName(address->reg);
+      return valid;
+    }
+
+    case BRIG_OPERAND_IMMED: {
+      const BrigOperandImmed *immed = cast<BrigOperandImmed>(operand);
+      return check(fitsArray(immed, immed->bytes, immed->byteCount),
+                   "BrigOperandImmed bytes overflow the operand");
+    }
+
+    case BRIG_OPERAND_REG:
+      return validateSName(cast<BrigOperandReg>(operand)->reg);
+
+    case BRIG_OPERAND_REG_VECTOR: {
+      const BrigOperandRegVector *vec = cast<BrigOperandRegVector>(operand);
+      if (!check(fitsArray(vec, vec->regs, vec->regCount),
+                 "BrigOperandRegVector regs overflow the operand"))
+        return false;
+      for (unsigned i = 0; i < vec->regCount; ++i)
+        valid &= validateSName(vec->regs[i]);
+      return valid;
+    }
+
+    case BRIG_OPERAND_ARGUMENT_LIST: {
+      const BrigOperandArgumentList *list =
+        cast<BrigOperandArgumentList>(operand);
+      if (!check(fitsArray(list, list->elements, list->elementCount),
+                 "BrigOperandArgumentList elements overflow the operand"))
+        return false;
+      for (unsigned i = 0; i < list->elementCount; ++i)
+        valid &= check(isDirective<BrigDirectiveSymbol>(S_, index,
+                                                        list->elements[i]),
+                       "BrigOperandArgumentList element is not a symbol");
+      return valid;
+    }
+
+    case BRIG_OPERAND_FUNCTION_LIST: {
+      const BrigOperandFunctionList *list =
+        cast<BrigOperandFunctionList>(operand);
+      if (!check(fitsArray(list, list->elements, list->elementCount),
+                 "BrigOperandFunctionList elements overflow the operand"))
+        return false;
+      for (unsigned i = 0; i < list->elementCount; ++i)
+        valid &= check(isEntry(index.operOffsets, list->elements[i]),
+                       "BrigOperandFunctionList element is not an operand");
+      return valid;
+    }
+
+    case BRIG_OPERAND_ARGUMENT_REF:
+      return check(isDirective<BrigDirectiveSymbol>(
+                     S_, index, cast<BrigOperandArgumentRef>(operand)->ref),
+                   "BrigOperandArgumentRef does not refer to a symbol");
+
+    case BRIG_OPERAND_FUNCTION_REF: {
+      uint32_t ref = cast<BrigOperandFunctionRef>(operand)->ref;
+      return check(isDirective<BrigDirectiveExecutable>(S_, index, ref) ||
+                   isDirective<BrigDirectiveSignature>(S_, index, ref),
+                   "BrigOperandFunctionRef does not refer to a function");
+    }
+
+    case BRIG_OPERAND_LABEL_REF: {
+      uint32_t ref = cast<BrigOperandLabelRef>(operand)->ref;
+      return check(isDirective<BrigDirectiveLabel>(S_, index, ref) ||
+                   isDirective<BrigDirectiveLabelTargets>(S_, index, ref),
+                   "BrigOperandLabelRef does not refer to a label");
+    }
+
+    case BRIG_OPERAND_SIGNATURE_REF:
+      return check(isDirective<BrigDirectiveSignature>(
+                     S_, index, cast<BrigOperandSignatureRef>(operand)->ref),
+                   "BrigOperandSignatureRef does not refer to a signature");
+
+    case BRIG_OPERAND_FBARRIER_REF:
+      return check(isDirective<BrigDirectiveFbarrier>(
+                     S_, index, cast<BrigOperandFbarrierRef>(operand)->ref),
+                   "BrigOperandFbarrierRef does not refer to a fbarrier");
+  }
+
+  return true;
+}
+
 bool BrigModule::validate(void) const {
   bool valid = true;
   valid &= validateDirectives();
@@ -1149,7 +1644,8 @@ bool BrigModule::validateCCode(BrigCodeOffset32_t c_code) const {
 bool BrigModule::validateSName(BrigStringOffset32_t s_name) const {
   bool valid = true;
 
-  valid &= check(s_name < S_.stringsSize,
+  valid &= check(S_.stringsSize >= sizeof(uint32_t) &&
+                 s_name <= S_.stringsSize - sizeof(uint32_t),
                  "s_name past the strings section");
 
   // Do attempt the next test if s_name is past the end of the strings
@@ -1160,12 +1656,14 @@ bool BrigModule::validateSName(BrigStringOffset32_t s_name) const {
   const BrigString *bs = reinterpret_cast <const BrigString *>(S_.strings +
                                                                s_name);
   uint32_t numBytes = bs->byteCount;
+  size_t maxBytes = S_.stringsSize - s_name - sizeof(uint32_t);
 
-  if (!check(s_name + numBytes <= S_.stringsSize,
+  if (!check(numBytes <= maxBytes,
              "s_name past the end of string section"))
     return false;
 
-  for (uint32_t i = numBytes; i < ((numBytes + 3)/4)*4; i++) {
+  size_t padded = std::min(maxBytes, (size_t(numBytes) + 3) / 4 * 4);
+  for (size_t i = numBytes; i < padded; i++) {
     valid &= check(!bs->bytes[i],
                    "Padding bytes in BrigString must be zero");
     if (!valid) break;
@@ -8,14 +8,41 @@
 //===----------------------------------------------------------------------===//
 
 #include "brig_reader.h"
+#include "brig_util.h"
 
 #include "llvm/Object/ELF.h"
 #include "llvm/Support/MemoryBuffer.h"
 
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <zlib.h>
+
 namespace hsa {
 namespace brig {
 
-BrigReader::~BrigReader() { delete objFile_; }
+BrigReader::~BrigReader() {
+  delete objFile_;
+  free(arena_);
+}
+
+uint32_t BrigReader::getChecksum() const {
+  BrigSections S(strings_.data(), directives_.data(), code_.data(),
+                 operands_.data(), debug_.data(),
+                 strings_.size(), directives_.size(), code_.size(),
+                 operands_.size(), debug_.size());
+  return S.getChecksum();
+}
+
+bool BrigReader::hasValidationStamp() const {
+  if (stamp_.size() != sizeof(uint32_t)) return false;
+  uint32_t stamp;
+  memcpy(&stamp, stamp_.data(), sizeof(stamp));
+  return stamp == getChecksum();
+}
 
 BrigReader *BrigReader::createBrigReader(const char *filename) {
   llvm::OwningPtr<llvm::MemoryBuffer> file;
@@ -41,12 +68,107 @@ BrigReader *BrigReader::createBrigReader(const char *buffer, size_t size) {
   return reader;
 }
 
+// Compressed sections are named .zbrig_* instead of .brig_*. Like the
+// .zdebug_* sections, their contents start with "ZLIB" and the uncompressed
+// size as a 64-bit big endian integer, followed by the zlib stream.
+static const char ZlibMagic[4] = { 'Z', 'L', 'I', 'B' };
+enum { ZlibHeaderSize = 12, ArenaAlignment = 16 };
+// Deflate cannot compress by more than about 1032:1, so a header claiming
+// more than this per compressed byte is corrupt. BRIG offsets are 32-bit,
+// which also bounds the size of a section.
+enum { ZlibMaxRatio = 1032, ZlibMaxOverhead = 64 };
+
+namespace {
+struct SectionInflater {
+  llvm::StringRef *section;
+  char *dest;
+  uint64_t size;
+  bool ok;
+};
+}  // namespace
+
+static void *inflateSection(void *arg) {
+  SectionInflater *inflater = (SectionInflater *) arg;
+  llvm::StringRef src = inflater->section->substr(ZlibHeaderSize);
+  uLongf destLen = inflater->size;
+  int err = uncompress((Bytef *) inflater->dest, &destLen,
+                       (const Bytef *) src.data(), src.size());
+  inflater->ok = err == Z_OK && destLen == inflater->size;
+  return NULL;
+}
+
+// Decompresses the sections into a single arena, one thread per section,
+// and points the sections at their decompressed contents. Returns the arena,
+// or NULL on failure.
+static char *inflateSections(const std::vector<llvm::StringRef *> &sections) {
+  std::vector<SectionInflater> inflaters(sections.size());
+  uint64_t arenaSize = 0;
+
+  for (unsigned i = 0; i < sections.size(); ++i) {
+    llvm::StringRef contents = *sections[i];
+    if (contents.size() < ZlibHeaderSize ||
+        memcmp(contents.data(), ZlibMagic, sizeof(ZlibMagic)))
+      return NULL;
+
+    uint64_t size = 0;
+    for (unsigned b = 4; b < ZlibHeaderSize; ++b)
+      size = (size << 8) | (unsigned char) contents[b];
+
+    uint64_t payload = contents.size() - ZlibHeaderSize;
+    if (size >> 32 || size > payload * ZlibMaxRatio + ZlibMaxOverhead)
+      return NULL;
+
+    inflaters[i].section = sections[i];
+    inflaters[i].size = size;
+    inflaters[i].ok = false;
+    arenaSize += (size + ArenaAlignment - 1) / ArenaAlignment * ArenaAlignment;
+  }
+
+  if (arenaSize != size_t(arenaSize)) return NULL;
+  char *arena = (char *) malloc(arenaSize ? arenaSize : 1);
+  if (!arena) return NULL;
+
+  char *dest = arena;
+  for (unsigned i = 0; i < inflaters.size(); ++i) {
+    inflaters[i].dest = dest;
+    dest += (inflaters[i].size + ArenaAlignment - 1) /
+      ArenaAlignment * ArenaAlignment;
+  }
+
+  // Inflate the first section on this thread while the others run.
+  std::vector<pthread_t> threads(inflaters.size());
+  std::vector<bool> started(inflaters.size(), false);
+  for (unsigned i = 1; i < inflaters.size(); ++i)
+    started[i] = !pthread_create(&threads[i], NULL, inflateSection,
+                                 &inflaters[i]);
+  if (!inflaters.empty()) inflateSection(&inflaters[0]);
+
+  bool ok = true;
+  for (unsigned i = 0; i < inflaters.size(); ++i) {
+    if (i && started[i]) pthread_join(threads[i], NULL);
+    else if (i) inflateSection(&inflaters[i]);
+    ok &= inflaters[i].ok;
+  }
+
+  if (!ok) {
+    free(arena);
+    return NULL;
+  }
+
+  for (unsigned i = 0; i < inflaters.size(); ++i)
+    *inflaters[i].section = llvm::StringRef(inflaters[i].dest,
+                                            inflaters[i].size);
+  return arena;
+}
+
 BrigReader *BrigReader::createBrigReader(llvm::object::ObjectFile *objFile) {
   llvm::StringRef directives;
   llvm::StringRef code;
   llvm::StringRef operands;
   llvm::StringRef debug;
   llvm::StringRef strings;
+  llvm::StringRef stamp;
+  std::vector<llvm::StringRef *> compressed;
 
   typedef llvm::object::section_iterator SecIt;
   const SecIt E = objFile->end_sections();
@@ -55,29 +177,48 @@ BrigReader *BrigReader::createBrigReader(llvm::object::ObjectFile *objFile) {
 
     if (ec) return NULL;
 
-    llvm::StringRef name;
-    it->getName(name);
+    llvm::StringRef rawName;
+    it->getName(rawName);
 
+    bool isCompressed = rawName.startswith(".zbrig_");
+    std::string name = isCompressed ?
+      ".brig_" + rawName.substr(strlen(".zbrig_")).str() : rawName.str();
+
+    llvm::StringRef *section = NULL;
     if (name == ".brig_directives" || name == ".directives") {
-      if (it->getContents(directives)) return NULL;
+      section = &directives;
     } else if (name == ".brig_code" || name == ".code") {
-      if (it->getContents(code)) return NULL;
+      section = &code;
     } else if (name == ".brig_operands" || name == ".operands") {
-      if (it->getContents(operands)) return NULL;
+      section = &operands;
     } else if (name == ".brig_debug" || name == ".debug") {
-      if (it->getContents(debug)) return NULL;
+      section = &debug;
     } else if (name == ".brig_strtab" || name == ".strtab" ||
               name == ".strings") {
-      if (it->getContents(strings)) return NULL;
+      section = &strings;
+    } else if (name == ".brig_validated") {
+      section = &stamp;
     }
+
+    if (!section) continue;
+    if (it->getContents(*section)) return NULL;
+    if (isCompressed) compressed.push_back(section);
+  }
+
+  char *arena = NULL;
+  if (!compressed.empty()) {
+    arena = inflateSections(compressed);
+    if (!arena) return NULL;
   }
 
-  if (!directives.size()) return NULL;
-  if (!code.size()) return NULL;
-  if (!operands.size()) return NULL;
-  if (!strings.size()) return NULL;
+  if (!directives.size() || !code.size() || !operands.size() ||
+      !strings.size()) {
+    free(arena);
+    return NULL;
+  }
 
-  return new BrigReader(objFile, directives, code, operands, debug, strings);
+  return new BrigReader(objFile, directives, code, operands, debug, strings,
+                        stamp, arena);
 }
 
 }  // namespace brig
@@ -7,16 +7,105 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "brig_barrier.h"
+#include "brig_image.h"
 #include "brig_runtime.h"
 #include "brig_runtime_internal.h"
+#include "brig_runtime_simd.h"
+#include "brig_wavefront.h"
 
 #if defined(__i386__) || defined(__x86_64__)
 #include <pmmintrin.h>
 #endif  // defined(__i386__) || defined(__x86_64__)
 
 #include <algorithm>
+#include <cfloat>
 #include <cmath>
 #include <cstdlib>
+#include <limits>
+
+// Half precision conversions in software, rounding to nearest even as
+// vcvtps2ph does. Signalling NaNs are quieted, as the hardware does.
+static f32 halfToFloat(b16 h) {
+  b32 sign = b32(h & 0x8000) << 16;
+  b32 exponent = (h >> 10) & 0x1F;
+  b32 mantissa = h & 0x3FF;
+  b32 bits;
+  if (exponent == 0x1F) {
+    if (mantissa) mantissa |= 0x200;
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent) {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if (mantissa) {
+    // A denormal half is a normal float.
+    unsigned shift = 0;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      ++shift;
+    }
+    bits = sign | ((127 - 14 - shift) << 23) | ((mantissa & 0x3FF) << 13);
+  } else {
+    bits = sign;
+  }
+  union { b32 b; f32 f; } Conv = { bits };
+  return Conv.f;
+}
+
+static b16 floatToHalf(f32 f) {
+  union { f32 f; b32 b; } Conv = { f };
+  b16 sign = (Conv.b >> 16) & 0x8000;
+  b32 bits = Conv.b & 0x7FFFFFFF;
+
+  if (bits > 0x7F800000)
+    return sign | 0x7E00 | ((bits >> 13) & 0x3FF);
+  // 65520 is half way between the largest half and 2^16.
+  if (bits >= 0x477FF000)
+    return sign | 0x7C00;
+  if (bits >= 0x38800000) {
+    bits -= (127 - 15) << 23;
+    bits += 0xFFF + ((bits >> 13) & 1);
+    return sign | (bits >> 13);
+  }
+  // 2^-25 is half way between zero and the smallest denormal half.
+  if (bits <= 0x33000000)
+    return sign;
+
+  unsigned shift = 126 - (bits >> 23);
+  b32 mantissa = (bits & 0x7FFFFF) | 0x800000;
+  b32 result = mantissa >> shift;
+  b32 rest = mantissa & ((1U << shift) - 1);
+  b32 half = 1U << (shift - 1);
+  if (rest > half || (rest == half && (result & 1))) ++result;
+  return sign | result;
+}
+
+f32 f16::toFloat(b16 b) {
+#if defined(__SSE2__)
+  if (hsa::brig::HasF16C) return hsa::brig::halfToFloatF16C(b);
+#endif  // defined(__SSE2__)
+  return halfToFloat(b);
+}
+
+b16 f16::fromFloat(f32 f) {
+#if defined(__SSE2__)
+  if (hsa::brig::HasF16C) return hsa::brig::floatToHalfF16C(f);
+#endif  // defined(__SSE2__)
+  return floatToHalf(f);
+}
+
+// Rounding a double to float and then to half could round twice. Where the
+// float is inexact, it is replaced by the float with the odd significand
+// between it and zero. Rounding to odd keeps the information that the value
+// was inexact, and with 13 extra bits the second rounding is then correct.
+b16 f16::fromDouble(f64 d) {
+  f32 f = f32(d);
+  if (f64(f) == d || d != d) return fromFloat(f);
+
+  union { f32 f; b32 b; } Conv = { f };
+  if (std::fabs(f64(f)) > std::fabs(d)) --Conv.b;
+  Conv.b |= 1;
+  return fromFloat(Conv.f);
+}
 
 namespace hsa {
 namespace brig {
@@ -27,6 +116,16 @@ static __thread ThreadInfo *__brigThreadInfo;
 
 extern "C" void __setThreadInfo(ThreadInfo *info) { __brigThreadInfo = info; }
 
+extern "C" {
+volatile uint32_t __brigYieldFlag = 0;
+}
+
+extern "C" void __brigYield(void) {
+  ThreadInfo *info = __brigThreadInfo;
+  if (info->yield && __atomic_load_n(info->yieldRequest, __ATOMIC_RELAXED))
+    info->yield(info);
+}
+
 extern "C" void enableFtzMode(void) {
 #if defined(__i386__) || defined(__x86_64__)
   _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
@@ -94,9 +193,12 @@ extern "C" void setRoundingMode_down(void) {
   fesetround(FE_DOWNWARD);
 }
 
-extern "C" unsigned getWavefrontSize(void) { return 1; }
+extern "C" unsigned getWavefrontSize(void) {
+  return __brigThreadInfo->wavefrontSize;
+}
 
 template<class T> static T Abs(T t) { return std::abs(t); }
+static f16 Abs(f16 t) { return f16::fromBits(t.getBits() & 0x7FFF); }
 template<class T> static T AbsVector(T t) { return map(Abs, t); }
 SignedInst(define, Abs, Unary)
 FloatInst(define, Abs, Unary)
@@ -122,16 +224,57 @@ FloatVectorInst(define, Floor, Unary)
 
 static float  Trunc(float t)  { return ::truncf(fixFTZ(t)); }
 static double Trunc(double t) { return ::trunc(fixFTZ(t)); }
+static f16    Trunc(f16 t)    { return Trunc(f32(t)); }
 template<class T> static T TruncVector(T t) { return map(Trunc, t); }
 FloatInst(define, Trunc, Unary)
 FloatVectorInst(define, Trunc, Unary)
 
+// Rounds to an integral value in an explicit direction, without changing
+// the rounding mode. SSE4.1 encodes the direction in the instruction;
+// otherwise roundIntegral adjusts a truncated value.
+#if defined(__SSE2__)
+// SSE4.1 roundss and roundsd take the direction as an immediate.
+enum {
+  RoundUp   = _MM_FROUND_TO_POS_INF     | _MM_FROUND_NO_EXC,
+  RoundDown = _MM_FROUND_TO_NEG_INF     | _MM_FROUND_NO_EXC,
+  RoundZero = _MM_FROUND_TO_ZERO        | _MM_FROUND_NO_EXC,
+  RoundNear = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC
+};
+
+__attribute__((target("sse4.1")))
+static f32 roundSSE41(f32 f, int mode) {
+  __m128 x = _mm_set_ss(f);
+  switch (mode) {
+  case FE_UPWARD:     x = _mm_round_ss(x, x, RoundUp);   break;
+  case FE_DOWNWARD:   x = _mm_round_ss(x, x, RoundDown); break;
+  case FE_TOWARDZERO: x = _mm_round_ss(x, x, RoundZero); break;
+  default:            x = _mm_round_ss(x, x, RoundNear); break;
+  }
+  return _mm_cvtss_f32(x);
+}
+
+__attribute__((target("sse4.1")))
+static f64 roundSSE41(f64 d, int mode) {
+  __m128d x = _mm_set_sd(d);
+  switch (mode) {
+  case FE_UPWARD:     x = _mm_round_sd(x, x, RoundUp);   break;
+  case FE_DOWNWARD:   x = _mm_round_sd(x, x, RoundDown); break;
+  case FE_TOWARDZERO: x = _mm_round_sd(x, x, RoundZero); break;
+  default:            x = _mm_round_sd(x, x, RoundNear); break;
+  }
+  return _mm_cvtsd_f64(x);
+}
+#endif  // defined(__SSE2__)
+
+template<class T> static T roundTo(T t, int mode) {
+#if defined(__SSE2__)
+  if (HasSSE41) return roundSSE41(t, mode);
+#endif  // defined(__SSE2__)
+  return roundIntegral(t, mode);
+}
+
 template<class T> static T Rint(T t)  { 
-  int oldMode = fegetround();
-  fesetround(FE_TONEAREST);
-  volatile T result = T(nearbyint(fixFTZ(t)));
-  fesetround(oldMode);
-  return result;
+  return roundTo(fixFTZ(t), FE_TONEAREST);
 }
 template<class T> static T RintVector(T t) { return map(Rint, t); }
 FloatInst(define, Rint, Unary)
@@ -212,24 +355,34 @@ template<class T> static T MulHi(T x, T y) {
   Int64Ty res = x64 * y64;
   return T(res >> Int<T>::Bits);
 }
-template<class T> static u64 MulHi64(T x, T y) {
-  T x_lo = x & 0xFFFFFFFF;
-  T x_hi = x >> 32;
-  T y_lo = y & 0xFFFFFFFF;
-  T y_hi = y >> 32;
-
-  T prod1 = x_lo*y_lo;
-  T prod3 = y_hi*x_hi;
-  T prod2 = (x_hi + x_lo)*(y_hi + y_lo) - prod1 - prod3;
-  T temp = prod2 + (prod1 >> 32);
-  // lower part of the product:
-  //  T res_lo =  (prod1 & 0xFFFFFFFF) +
-  //              ((temp & 0xFFFFFFFF) << 32);
-  T res_hi = prod3 + (temp >> 32);
-  return res_hi;
-}
-template<> u64 MulHi(u64 x, u64 y) { return MulHi64(x, y); }
-template<> s64 MulHi(s64 x, s64 y) { return MulHi64(x, y); }
+#ifdef __SIZEOF_INT128__
+template<> u64 MulHi(u64 x, u64 y) {
+  return u64((unsigned __int128) x * y >> 64);
+}
+template<> s64 MulHi(s64 x, s64 y) {
+  return s64((__int128) x * y >> 64);
+}
+#else
+template<> u64 MulHi(u64 x, u64 y) {
+  u64 x_lo = x & 0xFFFFFFFF;
+  u64 x_hi = x >> 32;
+  u64 y_lo = y & 0xFFFFFFFF;
+  u64 y_hi = y >> 32;
+
+  u64 lo = x_lo * y_lo;
+  u64 mid1 = x_hi * y_lo + (lo >> 32);
+  u64 mid2 = x_lo * y_hi + (mid1 & 0xFFFFFFFF);
+  return x_hi * y_hi + (mid1 >> 32) + (mid2 >> 32);
+}
+// The signed high half is the unsigned one less each operand that the
+// other's sign bit multiplied in.
+template<> s64 MulHi(s64 x, s64 y) {
+  u64 hi = MulHi(u64(x), u64(y));
+  if (x < 0) hi -= u64(y);
+  if (y < 0) hi -= u64(x);
+  return s64(hi);
+}
+#endif
 template<class T> static T MulHiVector(T x, T y) { return map(MulHi, x, y); }
 defineBinary(MulHi, s32)
 defineBinary(MulHi, u32)
@@ -437,22 +590,19 @@ static u32 PopCount_u32(b64 x) { return __builtin_popcountll(x); }
 defineUnary(PopCount_u32, b32)
 defineUnary(PopCount_u32, b64)
 
-// Bit reverse implementation loosely adapted from Sean Eron Anderson's article
-// at: http://graphics.stanford.edu/~seander/bithacks.html
-template<class T> static T BitRev(T x) {
-  typedef typename Int<T>::Unsigned Unsigned;
-  Unsigned v = Unsigned(x);  // input bits to be reversed
-  Unsigned r = v;  // r will be reversed bits of v; first get LSB of v
-  int s = Int<T>::Bits - 1;  // extra shift needed at end
-
-  for (v >>= 1; v; v >>= 1) {
-    r <<= 1;
-    r |= v & 1;
-    s--;
-  }
-  r <<= s;  // shift when v's highest bits are zero
-
-  return T(r);
+static u32 BitRev(u32 x) {
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_bitreverse32)
+  return __builtin_bitreverse32(x);
+#endif
+#endif
+  x = __builtin_bswap32(x);
+  x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+  x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+  return ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+}
+static u64 BitRev(u64 x) {
+  return u64(BitRev(u32(x))) << 32 | BitRev(u32(x >> 32));
 }
 defineUnary(BitRev, b32)
 defineUnary(BitRev, b64)
@@ -482,7 +632,7 @@ template<class T> static T BitMask(b32 y, b32 z) {
   unsigned offset = Int<T>::ShiftMask & y;
   unsigned width  = Int<T>::ShiftMask & z;
   if (!width) return 0;
-  T mask = (1 << width) - 1;
+  T mask = ~(~T(0) << width);
   return mask << offset;
 }
 defineBitMask(b32)
@@ -494,27 +644,24 @@ template<class T> static T BitSelect(T x, T y, T z) {
 defineTernary(BitSelect, b32)
 defineTernary(BitSelect, b64)
 
+static unsigned countLeadingZeros(u32 x) { return __builtin_clz(x); }
+static unsigned countLeadingZeros(u64 x) { return __builtin_clzll(x); }
+static unsigned countTrailingZeros(u32 x) { return __builtin_ctz(x); }
+static unsigned countTrailingZeros(u64 x) { return __builtin_ctzll(x); }
+
 template<class T> static T FirstBit_u32(T x) {
+  typedef typename Int<T>::Unsigned Unsigned;
   if (Int<T>::isNeg(x)) x = ~x;
   if (!x) return ~T(0);
-  T pos = T(0);
-  while (!(x & Int<T>::HighBit)) {
-    x <<= 1;
-    ++pos;
-  }
-  return pos;
+  return T(countLeadingZeros(Unsigned(x)));
 }
 SignedInst(define, FirstBit_u32, Unary)
 UnsignedInst(define, FirstBit_u32, Unary)
 
 template<class T> static T LastBit_u32(T x) {
+  typedef typename Int<T>::Unsigned Unsigned;
   if (!x) return ~T(0);
-  T pos = T(0);
-  while (!(x & 1)) {
-    x >>= 1;
-    ++pos;
-  }
-  return pos;
+  return T(countTrailingZeros(Unsigned(x)));
 }
 SignedInst(define, LastBit_u32, Unary)
 UnsignedInst(define, LastBit_u32, Unary)
@@ -582,6 +729,14 @@ extern "C" f64 Fract_f64(f64 d) {
   return std::min(d - std::floor(d), AlmostOne.d);
 }
 
+// 0x3BFF == 0x1.ffcp-1. The clamp follows the rounding to half, which
+// may round up to 1.0.
+extern "C" f16 Fract_f16(f16 h) {
+  f16 AlmostOne = f16::fromBits(0x3BFF);
+  f16 fract = f32(h) - std::floor(f32(h));
+  return std::min(fract, AlmostOne);
+}
+
 template<class T> static T Sqrt(T x) { return std::sqrt(x); }
 FloatInst(define, Sqrt, Unary)
 
@@ -592,10 +747,13 @@ template<class T> static T NFma(T x, T y, T z) { return fma(x, y, z); }
 FloatInst(define, NFma, Ternary)
 
 template<class T> static T CopySign(T x, T y) { return copysign(x, y); }
+static f16 CopySign(f16 x, f16 y) {
+  return f16::fromBits((x.getBits() & 0x7FFF) | (y.getBits() & 0x8000));
+}
 FloatInst(define, CopySign, Binary)
 
 template<class T> static b1 Class(T x, b32 y) {
-  int fpclass = std::fpclassify(x);
+  int fpclass = fpClassify(x);
   if (y & SNan && isSNan(x)) return true;
   if (y & QNan && isQNan(x)) return true;
   if (y & NegInf && isNegInf(x)) return true;
@@ -608,6 +766,7 @@ template<class T> static b1 Class(T x, b32 y) {
   if (y & PosInf && isPosInf(x)) return true;
   return false;
 }
+extern "C" b1 Class_f16(f16 f, b32 y) { return Class(f, y); }
 extern "C" b1 Class_f32(f32 f, b32 y) { return Class(f, y); }
 extern "C" b1 Class_f64(f64 f, b32 y) { return Class(f, y); }
 
@@ -653,7 +812,7 @@ extern "C" f32 Nexp2_f32(f32 x) {
 }
 
 template<class T> static T Nrsqrt(T x) {
-  if (std::fpclassify(x) == FP_SUBNORMAL) {
+  if (fpClassify(x) == FP_SUBNORMAL) {
     return x > 0 ? INFINITY : -INFINITY;
   } else {
     return  T(1.0) / std::sqrt(x);
@@ -662,7 +821,7 @@ template<class T> static T Nrsqrt(T x) {
 FloatInst(define, Nrsqrt, Unary)
 
 template<class T> static T Nrcp(T x) {
-  if (std::fpclassify(x) == FP_SUBNORMAL) {
+  if (fpClassify(x) == FP_SUBNORMAL) {
     return x > 0 ? INFINITY : -INFINITY;
   } else {
     return T(1.0) / x;
@@ -670,6 +829,145 @@ template<class T> static T Nrcp(T x) {
 }
 FloatInst(define, Nrcp, Unary)
 
+// Fast native math. BrigEngine binds ncos, nsin, nlog2, nexp2, nrsqrt and
+// nrcp to these instead of the libm based versions above when it is created
+// with FastNativeMath. Each handles the common case, normal arguments in the
+// accurate range, with straight-line code and no libm calls. Every other
+// argument takes a single branch to the exact version, so special values
+// behave identically in both modes. All are accurate to well within the
+// bounds the PRM sets for the native instructions.
+
+static b32 floatBits(f32 f) {
+  union { f32 f; b32 b; } Conv = { f };
+  return Conv.b;
+}
+
+static f64 doubleFromBits(b64 b) {
+  union { b64 b; f64 d; } Conv = { b };
+  return Conv.d;
+}
+
+// Biased exponent of a float. Zero for zeros and denormals, 0xFF for
+// infinities and NaNs.
+static unsigned floatExponent(f32 f) { return (floatBits(f) >> 23) & 0xFF; }
+
+// x = k * pi/2 + r with |r| <= pi/4. pi/2 is split in two so that k * pi/2
+// is exact in its first part for every k in the native range of 512 pi.
+static f64 reduceHalfPi(f32 x, unsigned &quadrant) {
+  const f64 halfPi1 = 1.57079632673412561417e+00;   // first 33 bits
+  const f64 halfPi1Tail = 6.07710050650619224932e-11;
+  s32 k = s32(x * M_2_PI + copysign(0.5, x));
+  quadrant = k & 3;
+  return (x - k * halfPi1) - k * halfPi1Tail;
+}
+
+// Minimax polynomials for sin and cos on [-pi/4, pi/4], from the Cephes
+// sinf and cosf, with relative errors below 2^-24.
+static f64 sinKernel(f64 r) {
+  const f64 S1 = -1.6666654611e-1;
+  const f64 S2 = 8.3321608736e-3;
+  const f64 S3 = -1.9515295891e-4;
+  f64 z = r * r;
+  return r + r * z * (S1 + z * (S2 + z * S3));
+}
+
+static f64 cosKernel(f64 r) {
+  const f64 C1 = 4.166664568298827e-2;
+  const f64 C2 = -1.388731625493765e-3;
+  const f64 C3 = 2.443315711809948e-5;
+  f64 z = r * r;
+  return (1 - 0.5 * z) + z * z * (C1 + z * (C2 + z * C3));
+}
+
+// Normal arguments in [-512 pi, 512 pi]; 0x44C90FDA is the largest float
+// no greater than 512 pi.
+static bool isFastTrigArg(f32 x) {
+  return (floatBits(x) & 0x7FFFFFFF) - 0x00800000 <= 0x44C90FDA - 0x00800000;
+}
+
+// Both kernels are evaluated and the quadrant selects between them without
+// a branch, which random arguments would mispredict half the time.
+extern "C" f32 NcosFast_f32(f32 x) {
+  if (!isFastTrigArg(x)) return Ncos_f32(x);
+  unsigned quadrant;
+  f64 r = reduceHalfPi(x, quadrant);
+  f64 s = sinKernel(r), c = cosKernel(r);
+  f64 y = quadrant & 1 ? s : c;
+  return f32(y * (1.0 - ((quadrant + 1) & 2)));
+}
+
+extern "C" f32 NsinFast_f32(f32 x) {
+  if (!isFastTrigArg(x)) return Nsin_f32(x);
+  unsigned quadrant;
+  f64 r = reduceHalfPi(x, quadrant);
+  f64 s = sinKernel(r), c = cosKernel(r);
+  f64 y = quadrant & 1 ? c : s;
+  return f32(y * (1.0 - (quadrant & 2)));
+}
+
+// exp2(x) = 2^n * 2^f with n the nearest integer to x and |f| <= 1/2. The
+// Taylor series of 2^f = e^(f ln 2) to degree 7 is accurate to 2^-27.
+extern "C" f32 Nexp2Fast_f32(f32 x) {
+  // Positive normal arguments below 128, whose results are finite.
+  if (floatBits(x) - 0x00800000 >= 0x43000000 - 0x00800000)
+    return Nexp2_f32(x);
+
+  s32 n = s32(x + 0.5);
+  f64 t = (x - n) * M_LN2;
+  f64 t2 = t * t;
+  f64 series = (1 + t * (1.0 + t * (1.0 / 2))) +
+    t2 * t * ((1.0 / 6 + t * (1.0 / 24)) +
+              t2 * (1.0 / 120 + t * (1.0 / 720 + t * (1.0 / 5040))));
+  return f32(series * doubleFromBits(b64(1023 + n) << 52));
+}
+
+// log2(x) = e + log2(m) with m in [3/4, 3/2), and
+// log2(m) = 2 / ln(2) * atanh((m - 1) / (m + 1)).
+extern "C" f32 Nlog2Fast_f32(f32 x) {
+  unsigned exponent = floatExponent(x);
+  if (exponent == 0 || exponent == 0xFF || x < 0) return Nlog2_f32(x);
+
+  // Mantissas of 3/2 and above are halved by lowering their exponent.
+  b32 bits = floatBits(x);
+  unsigned half = (bits >> 22) & 1;
+  s32 e = s32(exponent) - 127 + half;
+  b64 mantissa = b64(bits & 0x7FFFFF) << 29;
+  f64 m = doubleFromBits(mantissa | (b64(1023 - half) << 52));
+
+  f64 s = (m - 1) / (m + 1);
+  f64 s2 = s * s;
+  f64 s4 = s2 * s2;
+  f64 series = s * ((1 + s2 * (1.0 / 3)) +
+                    s4 * ((1.0 / 5 + s2 * (1.0 / 7)) +
+                          s4 * (1.0 / 9 + s2 * (1.0 / 11))));
+  return f32(e + 2 * M_LOG2E * series);
+}
+
+// The hardware estimates are accurate to 12 bits; one Newton-Raphson step
+// brings them to 22.
+extern "C" f32 NrsqrtFast_f32(f32 x) {
+  unsigned exponent = floatExponent(x);
+  if (exponent == 0 || exponent == 0xFF || x < 0) return Nrsqrt_f32(x);
+#if defined(__SSE2__)
+  f32 y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+  return y * (1.5f - 0.5f * x * y * y);
+#else
+  return 1.0f / std::sqrt(x);
+#endif  // defined(__SSE2__)
+}
+
+extern "C" f32 NrcpFast_f32(f32 x) {
+  // rcpss flushes results below FLT_MIN, so those arguments are exact too.
+  unsigned exponent = floatExponent(x);
+  if (exponent == 0 || exponent >= 0xFD) return Nrcp_f32(x);
+#if defined(__SSE2__)
+  f32 y = _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(x)));
+  return y * (2.0f - x * y);
+#else
+  return 1.0f / x;
+#endif  // defined(__SSE2__)
+}
+
 extern "C" b32 BitAlign_b32(b32 w, b32 x, b32 y) {
   return (b64(w) << y) | (b64(x) >> (32 - y));
 }
@@ -679,6 +977,9 @@ extern "C" b32 ByteAlign_b32(b32 w, b32 x, b32 y) {
 }
 
 extern "C" b32 Lerp_b32(b32 w, b32 x, b32 y) {
+#if defined(__SSE2__)
+  return LerpBytes(w, x, y);
+#else
   b32 result = 0;
   for (unsigned i = 0; i < 4; ++i) {
     result |= (((((w >> 8 * i) & 0xFF)
@@ -686,6 +987,7 @@ extern "C" b32 Lerp_b32(b32 w, b32 x, b32 y) {
                  + ((y >> 8 * i) & 0x1)) >> 1) & 0xFF) << 8 * i;
   }
   return result;
+#endif  // defined(__SSE2__)
 }
 
 extern "C" u32 Sad_u32_u32(u32 w, u32 x, u32 y) {
@@ -701,17 +1003,19 @@ extern "C" u32 Sad_u32_u16x2(u16x2 w, u16x2 x, u32 y) {
 }
 
 extern "C" u32 Sad_u32_u8x4(u8x4 w, u8x4 x, u32 y) {
+#if defined(__SSE2__)
+  return SadBytes(w, x) + y;
+#else
   u32 result = 0;
   for (unsigned i = 0; i < 4; ++i)
     result += Sad_u32_u32(w[i], x[i], 0);
 
   return result + y;
+#endif  // defined(__SSE2__)
 }
 
 extern "C" u16x2 Sadhi_u16x2_u8x4(u8x4 w, u8x4 x, u16x2 y) {
-  u32 temp_result = 0;
-  for (unsigned i = 0; i < 4; ++i)
-    temp_result += Sad_u32_u32(w[i], x[i], 0);
+  u32 temp_result = Sad_u32_u8x4(w, x, 0);
     
   u16x2 result = y;
   result[1] += temp_result;
@@ -734,16 +1038,16 @@ CmpImpl(snum, !isNan(x) && !isNan(y))
 CmpImpl(nan,   isNan(x) ||  isNan(y))
 CmpImpl(snan,  isNan(x) ||  isNan(y))
 
-// Cmp(define, num, f16)
+Cmp(define, num,  f16)
 Cmp(define, num,  f32)
 Cmp(define, num,  f64)
-// Cmp(define, snum, f16)
+Cmp(define, snum, f16)
 Cmp(define, snum, f32)
 Cmp(define, snum, f64)
-// Cmp(define, nan, f16)
+Cmp(define, nan,  f16)
 Cmp(define, nan,  f32)
 Cmp(define, nan,  f64)
-// Cmp(define, snan, f16)
+Cmp(define, snan, f16)
 Cmp(define, snan, f32)
 Cmp(define, snan, f64)
 
@@ -761,11 +1065,7 @@ template<class R> static R Cvt(f32 f, int mode) {
   // an exception should be thrown
   
     
-  int oldMode = fegetround();
-  fesetround(mode);
-  volatile R result = R(nearbyint(f));
-  fesetround(oldMode);
-  return result;
+  return R(roundTo(f, mode));
 }
 template<class R> static R Cvt_sat(f32 f, int mode) {
   if (isPosInf(f)) return getMax<R>();
@@ -774,11 +1074,7 @@ template<class R> static R Cvt_sat(f32 f, int mode) {
   if (f < getMin<R>()) return getMin<R>();
   if (isNan(f)) return 0;
   if (!~mode) return R(f);
-  int oldMode = fegetround();
-  fesetround(mode);
-  volatile R result = R(nearbyint(f));
-  fesetround(oldMode);
-  return result;
+  return R(roundTo(f, mode));
 }
 
 template<> bool Cvt(f32 f, int mode) { return f != 0.0f; }
@@ -790,11 +1086,7 @@ template<class R> static R Cvt(f64 f, int mode) {
     return 0;   // should be undefined value 
   // an exception should be thrown  
     
-  int oldMode = fegetround();
-  fesetround(mode);
-  volatile R result = R(nearbyint(f));
-  fesetround(oldMode);
-  return result;
+  return R(roundTo(f, mode));
 }
 template<class R> static R Cvt_sat(f64 f, int mode) {
   if (isPosInf(f)) return getMax<R>();
@@ -803,11 +1095,7 @@ template<class R> static R Cvt_sat(f64 f, int mode) {
   if (f < getMin<R>()) return getMin<R>();
   if (isNan(f)) return 0;
   if (!~mode) return R(f);
-  int oldMode = fegetround();
-  fesetround(mode);
-  volatile R result = R(nearbyint(f));
-  fesetround(oldMode);
-  return result;
+  return R(roundTo(f, mode));
 }
 
 // Float to Float
@@ -822,25 +1110,148 @@ template<> f64 Cvt(f32 f, int mode) {
   return f64(f);
 }
 
+// The next half away from h, upwards or downwards.
+static f16 nextHalf(f16 h, bool up) {
+  b16 b = h.getBits();
+  bool isNeg = b & 0x8000;
+  if (!(b & 0x7FFF)) return f16::fromBits(up ? 0x0001 : 0x8001);
+  return f16::fromBits(isNeg == up ? b - 1 : b + 1);
+}
+
+// Converts to half, rounding in an explicit direction. Every half is exact
+// as a double, so the nearest half and the double pick the neighbours.
+static f16 roundHalf(f64 d, int mode) {
+  f16 h = d;
+  f64 r = f32(h);
+  if (isNan(h) || r == d || mode == FE_TONEAREST) return h;
+
+  f16 lo = r < d ? h : nextHalf(h, false);
+  f16 hi = r < d ? nextHalf(h, true) : h;
+  switch (mode) {
+  case FE_UPWARD:   return hi;
+  case FE_DOWNWARD: return lo;
+  default:          return d > 0 ? lo : hi;
+  }
+}
+
+template<> f16 Cvt(f32 f, int mode) { return roundHalf(f, mode); }
+template<> f16 Cvt(f64 f, int mode) { return roundHalf(f, mode); }
+
+// Half to integer and half to float conversions go through f32, which
+// holds every half exactly.
+template<class R> static R Cvt(f16 f, int mode) { return Cvt<R>(f32(f), mode); }
+
+#if LDBL_MANT_DIG >= 64
+static f32 nextAfter(f32 x, f32 y) { return nextafterf(x, y); }
+static f64 nextAfter(f64 x, f64 y) { return nextafter(x, y); }
+
+static bool isOdd(f32 f) {
+  union { f32 f; b32 b; } Conv = { f };
+  return Conv.b & 1;
+}
+static bool isOdd(f64 d) {
+  union { f64 f; b64 b; } Conv = { d };
+  return Conv.b & 1;
+}
+
+// Checks the bits, since comparisons treat denormals as zero in DAZ mode.
+static bool isDenormal(f32 f) {
+  union { f32 f; b32 b; } Conv = { f };
+  return (Conv.b & 0x7FFFFFFF) && !(Conv.b & 0x7F800000);
+}
+static bool isDenormal(f64 d) {
+  union { f64 f; b64 b; } Conv = { d };
+  return (Conv.b & 0x7FFFFFFFFFFFFFFFULL) && !(Conv.b & 0x7FF0000000000000ULL);
+}
+
+// The value of a neighbour as a long double, where infinity stands for the
+// next power of two past the largest finite value.
+template<class R> static long double neighbour(R r) {
+  if (!std::isinf(r)) return r;
+  return copysign(ldexpl(1.0L, std::numeric_limits<R>::max_exponent), r);
+}
+
+// Converts to a floating point type, rounding in an explicit direction
+// without changing the rounding mode. The conversion in the current mode
+// lands on one of the two representable neighbours of the exact value. A
+// long double holds every 64-bit integer and every double exactly, so
+// comparing against it picks the right neighbour.
+template<class R, class T> static R roundFloat(T t, int mode) {
+  R r = R(t);
+  long double x = t;
+  if (isNan(r) || (long double) r == x) return r;
+
+  R lo = r;
+  R hi = r;
+  if ((long double) r < x) hi = nextAfter(r, R(INFINITY));
+  else lo = nextAfter(r, R(-INFINITY));
+
+  switch (mode) {
+  case FE_UPWARD:     r = hi; break;
+  case FE_DOWNWARD:   r = lo; break;
+  case FE_TOWARDZERO: r = x > 0 ? lo : hi; break;
+  default: {
+    long double below = x - neighbour(lo);
+    long double above = neighbour(hi) - x;
+    if (below != above) r = below < above ? lo : hi;
+    else r = isOdd(lo) ? hi : lo;
+  }
+  }
+
+#if defined(__SSE2__)
+  // Without the hardware conversion, the flush to zero mode is applied here.
+  if (isDenormal(r) && _MM_GET_FLUSH_ZERO_MODE() == _MM_FLUSH_ZERO_ON)
+    r = copysign(R(0), r);
+#endif  // defined(__SSE2__)
+
+  return r;
+}
+
+// Integer to integer conversions are exact in every rounding mode.
+template<class R, class T> static R roundConvert(T t, int, R *) {
+  return R(t);
+}
+template<class T> static f32 roundConvert(T t, int mode, f32 *) {
+  return roundFloat<f32>(t, mode);
+}
+template<class T> static f64 roundConvert(T t, int mode, f64 *) {
+  return roundFloat<f64>(t, mode);
+}
+#else
+template<class R, class T> static R roundConvert(T t, int mode, R *) {
+  int oldMode = fegetround();
+  fesetround(mode);
+  volatile R result = R(t);
+  fesetround(oldMode);
+  return result;
+}
+#endif  // LDBL_MANT_DIG >= 64
+
+// Integers too large to be exact as a double are far beyond the largest
+// half, so converting through a double picks the same half.
+template<class T> static f16 roundConvert(T t, int mode, f16 *) {
+  return roundHalf(f64(t), mode);
+}
+
 // Floating point rounding:
 // f64 to f32
 template<> f32 Cvt(f64 f, int mode) {
+#if LDBL_MANT_DIG >= 64
+  return roundFloat<f32>(f, mode);
+#else
   int oldMode = fegetround();
   fesetround(mode);
   volatile f32 result = f32(f);
   fesetround(oldMode);
   return result;
+#endif  // LDBL_MANT_DIG >= 64
 }
 template<> bool Cvt(f64 f, int mode) { return f != 0.0; }
 // Floating point rounding:
 // Int to Int, Int to f32, Int to f64
 template<class R, class T> static R Cvt(T t, int mode)  {
   if (!~mode) return R(t);
-  int oldMode = fegetround();
-  fesetround(mode);
-  volatile R result = R(t);
-  fesetround(oldMode);
-  return result;
+  return roundConvert(t, mode, (R *) NULL);
 }
 
 #if defined(__arm__)
@@ -879,12 +1290,14 @@ defineCvt(Cvt,       ~0,            b1,  s16)
 defineCvt(Cvt,       ~0,            b1,  u16)
 defineCvt(Cvt,       ~0,            b1,  s32)
 defineCvt(Cvt,       ~0,            b1,  u32)
+defineCvt(Cvt,       ~0,            b1,  f16)
 defineCvt(Cvt,       ~0,            b1,  f32)
 defineCvt(Cvt,       ~0,            b1,  s64)
 defineCvt(Cvt,       ~0,            b1,  u64)
 defineCvt(Cvt,       ~0,            b1,  f64)
 
 // b1 to f must not specify rounding
+defineCvt(Cvt,      ~0,            f16, b1)
 defineCvt(Cvt,      ~0,            f32, b1)
 defineCvt(Cvt,      ~0,            f64, b1)
 
@@ -894,13 +1307,24 @@ defineCvt(Cvt_up,   FE_UPWARD,      f32, f64)
 defineCvt(Cvt_down, FE_DOWNWARD,    f32, f64)
 defineCvt(Cvt_zero, FE_TOWARDZERO,  f32, f64)
 defineCvt(Cvt_near, FE_TONEAREST,   f32, f64)
+defineCvt(Cvt_up,   FE_UPWARD,      f16, f32)
+defineCvt(Cvt_down, FE_DOWNWARD,    f16, f32)
+defineCvt(Cvt_zero, FE_TOWARDZERO,  f16, f32)
+defineCvt(Cvt_near, FE_TONEAREST,   f16, f32)
+defineCvt(Cvt_up,   FE_UPWARD,      f16, f64)
+defineCvt(Cvt_down, FE_DOWNWARD,    f16, f64)
+defineCvt(Cvt_zero, FE_TOWARDZERO,  f16, f64)
+defineCvt(Cvt_near, FE_TONEAREST,   f16, f64)
 
 // A rounding modifier is illegal in conversion from f to f
 // with the same size or larger size, and in conversion 
 // from f to b1 and vice-versa, and in conversion from
 // b1, s or u to b1, s or u
 RIICvt(define)
+defineCvt(Cvt, ~0, f32, f16)
+defineCvt(Cvt, ~0, f64, f16)
 defineCvt(Cvt, ~0, f64, f32)
+defineCvt(Cvt, ~0, f16, f16)
 defineCvt(Cvt, ~0, f32, f32)
 defineCvt(Cvt, ~0, f64, f64)
 
@@ -915,9 +1339,13 @@ defineLd(s8)
 defineLd(s16)
 defineLd(s32)
 defineLd(s64)
-// defineLd(f16)
+defineLd(f16)
 defineLd(f32)
 defineLd(f64)
+// Images and samplers are kernel arguments holding 64-bit handles.
+extern "C" b64 Ld_ROImg(b64 *x) { return Ld(x); }
+extern "C" b64 Ld_RWImg(b64 *x) { return Ld(x); }
+extern "C" b64 Ld_Samp(b64 *x) { return Ld(x); }
 
 template<class T> static void St(T x, T *y) { *y = x; }
 #define defineSt(X)                                         \
@@ -930,84 +1358,248 @@ defineSt(s8)
 defineSt(s16)
 defineSt(s32)
 defineSt(s64)
-// defineSt(f16)
+defineSt(f16)
 defineSt(f32)
 defineSt(f64)
 defineSt(b128)
 
-template<class T> static T AtomicAnd(T *x, T y) {
-  return __sync_fetch_and_and(x, y);
+// A failed compare and swap only reads, so it keeps the acquire half of the
+// order.
+template<int M> struct CasFailure {
+  enum {
+    Order = M == __ATOMIC_RELEASE ? __ATOMIC_RELAXED :
+            M == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : M
+  };
+};
+
+template<int M, class T> static T AtomicAnd(T *x, T y) {
+  return __atomic_fetch_and(x, y, M);
 }
 AtomicInst(define, And, Binary)
 
-template<class T> static T AtomicOr(T *x, T y) {
-  return __sync_fetch_and_or(x, y);
+template<int M, class T> static T AtomicOr(T *x, T y) {
+  return __atomic_fetch_or(x, y, M);
 }
 AtomicInst(define, Or, Binary)
 
-template<class T> static T AtomicXor(T *x, T y) {
-  return __sync_fetch_and_xor(x, y);
+template<int M, class T> static T AtomicXor(T *x, T y) {
+  return __atomic_fetch_xor(x, y, M);
 }
 AtomicInst(define, Xor, Binary)
 
-template<class T> static T AtomicCas(T *x, T y, T z) {
-  return __sync_val_compare_and_swap(x, y, z);
+template<int M, class T> static T AtomicCas(T *x, T y, T z) {
+  __atomic_compare_exchange_n(x, &y, z, false, M, CasFailure<M>::Order);
+  return y;
 }
 AtomicInst(define, Cas, Ternary)
 
-template<class T> static T AtomicExch(T *x, T y) {
-  return __sync_val_compare_and_swap(x, *x, y);
+template<int M, class T> static T AtomicExch(T *x, T y) {
+  return __atomic_exchange_n(x, y, M);
 }
 AtomicInst(define, Exch, Binary)
 
-template<class T> static T AtomicAdd(T *x, T y) {
-  return __sync_fetch_and_add (x, y);
+template<int M, class T> static T AtomicAdd(T *x, T y) {
+  return __atomic_fetch_add(x, y, M);
 }
 AtomicInst(define, Add, Binary)
 
-template<class T> static T AtomicSub(T *x, T y) {
-  return __sync_fetch_and_sub (x, y);
+template<int M, class T> static T AtomicSub(T *x, T y) {
+  return __atomic_fetch_sub(x, y, M);
 }
 AtomicInst(define, Sub, Binary)
 
-template<class T> static T AtomicInc(T *x) {
-  return __sync_fetch_and_add (x, 1);
+template<int M, class T> static T AtomicInc(T *x) {
+  return __atomic_fetch_add(x, 1, M);
 }
 AtomicInst(define, Inc, Unary)
 
-template<class T> static T AtomicDec(T *x) {
-  return __sync_fetch_and_sub (x, 1);
+template<int M, class T> static T AtomicDec(T *x) {
+  return __atomic_fetch_sub(x, 1, M);
 }
 AtomicInst(define, Dec, Unary)
 
-template<class T> static T AtomicMax(volatile T *x, T y) {
-  T oldVal;
-  T max;
-  do {
-    oldVal = *x;
-    max = std::max(oldVal, y);
-  } while (!__sync_bool_compare_and_swap(x, oldVal, max));
-  return max;
+// There is no native max or min, so these retry a weak compare and swap. A
+// value that would not change is returned without writing the location.
+template<int M, class T> static T AtomicMax(T *x, T y) {
+  T oldVal = __atomic_load_n(x, CasFailure<M>::Order);
+  while (oldVal < y &&
+         !__atomic_compare_exchange_n(x, &oldVal, y, true, M,
+                                      CasFailure<M>::Order));
+  return oldVal;
 }
 AtomicInst(define, Max, Binary)
 
-template<class T> static T AtomicMin(volatile T *x, T y) {
-  T oldVal;
-  T min;
-  do {
-    oldVal = *x;
-    min = std::min(oldVal, y);
-  } while (!__sync_bool_compare_and_swap(x, oldVal, min));
-  return min;
+template<int M, class T> static T AtomicMin(T *x, T y) {
+  T oldVal = __atomic_load_n(x, CasFailure<M>::Order);
+  while (y < oldVal &&
+         !__atomic_compare_exchange_n(x, &oldVal, y, true, M,
+                                      CasFailure<M>::Order));
+  return oldVal;
 }
 AtomicInst(define, Min, Binary)
 
+// The image instructions take the four destination registers by address,
+// any of which may be NULL, and three coordinates padded with zeros.
+static void storeTexel(const b32 texel[4],
+                       b32 *r, b32 *g, b32 *b, b32 *a) {
+  if (r) *r = texel[0];
+  if (g) *g = texel[1];
+  if (b) *b = texel[2];
+  if (a) *a = texel[3];
+}
+
+#define defineRdImage(TYPE,COORD)                                       \
+  extern "C" void RdImage_ ## TYPE ## _ ## COORD(b32 *r, b32 *g,        \
+                                                 b32 *b, b32 *a,        \
+                                                 b64 image, b64 sampler, \
+                                                 COORD x, COORD y,      \
+                                                 COORD z) {             \
+    b32 texel[4];                                                       \
+    BrigImage::fromHandle(image)->sample(                               \
+      *BrigSampler::fromHandle(sampler), x, y, z, texel);               \
+    storeTexel(texel, r, g, b, a);                                      \
+  }
+defineRdImage(f32, f32)
+defineRdImage(s32, f32)
+defineRdImage(u32, f32)
+defineRdImage(f32, s32)
+defineRdImage(s32, s32)
+defineRdImage(u32, s32)
+
+#define defineLdImage(TYPE,COORD)                                       \
+  extern "C" void LdImage_ ## TYPE ## _ ## COORD(b32 *r, b32 *g,        \
+                                                 b32 *b, b32 *a,        \
+                                                 b64 image,             \
+                                                 COORD x, COORD y,      \
+                                                 COORD z) {             \
+    b32 texel[4];                                                       \
+    BrigImage::fromHandle(image)->load(x, y, z, texel);                 \
+    storeTexel(texel, r, g, b, a);                                      \
+  }
+defineLdImage(f32, s32)
+defineLdImage(s32, s32)
+defineLdImage(u32, s32)
+defineLdImage(f32, u32)
+defineLdImage(s32, u32)
+defineLdImage(u32, u32)
+
+#define defineStImage(TYPE,COORD)                                       \
+  extern "C" void StImage_ ## TYPE ## _ ## COORD(b32 r, b32 g,          \
+                                                 b32 b, b32 a,          \
+                                                 b64 image,             \
+                                                 COORD x, COORD y,      \
+                                                 COORD z) {             \
+    const b32 texel[4] = { r, g, b, a };                                \
+    BrigImage::fromHandle(image)->store(x, y, z, texel);                \
+  }
+defineStImage(f32, s32)
+defineStImage(s32, s32)
+defineStImage(u32, s32)
+defineStImage(f32, u32)
+defineStImage(s32, u32)
+defineStImage(u32, u32)
+
+static u32 QueryImageWidth(const BrigImage *image) {
+  return image->getWidth();
+}
+
+static u32 QueryImageHeight(const BrigImage *image) {
+  ImageGeometry geometry = image->getGeometry();
+  bool hasHeight = geometry == Image2D || geometry == Image3D ||
+                   geometry == Image2DArray;
+  return hasHeight ? image->getHeight() : 0;
+}
+
+static u32 QueryImageDepth(const BrigImage *image) {
+  return image->getGeometry() == Image3D ? image->getDepth() : 0;
+}
+
+static u32 QueryImageArray(const BrigImage *image) {
+  switch (image->getGeometry()) {
+    case Image1DArray: return image->getHeight();
+    case Image2DArray: return image->getDepth();
+    default: return 0;
+  }
+}
+
+static u32 QueryImageFormat(const BrigImage *image) {
+  return image->getType();
+}
+
+static u32 QueryImageOrder(const BrigImage *image) {
+  return image->getOrder();
+}
+
+#define defineQueryImage(FUNC,TYPE)                             \
+  extern "C" u32 FUNC ## _u32_ ## TYPE(b64 image) {             \
+    return FUNC(BrigImage::fromHandle(image));                  \
+  }
+#define QueryImage(FUNC)                        \
+  defineQueryImage(FUNC, ROImg)                 \
+  defineQueryImage(FUNC, RWImg)
+QueryImage(QueryImageWidth)
+QueryImage(QueryImageHeight)
+QueryImage(QueryImageDepth)
+QueryImage(QueryImageArray)
+QueryImage(QueryImageFormat)
+QueryImage(QueryImageOrder)
+
+extern "C" u32 QuerySamplerCoord_u32_Samp(b64 sampler) {
+  return BrigSampler::fromHandle(sampler)->isNormalized();
+}
+
+extern "C" u32 QuerySamplerFilter_u32_Samp(b64 sampler) {
+  return BrigSampler::fromHandle(sampler)->getFilter();
+}
+
 extern "C" void Barrier(void) {
-  pthread_barrier_wait(__brigThreadInfo->barrier);
+  __brigThreadInfo->barrier->wait();
 }
 
+// Every work-item runs on its own thread, so group fences need the same
+// hardware ordering as global ones. Sync is a sequentially consistent fence:
+// a store before it must be visible to other work-items before any load
+// after it, which needs mfence on x86.
 extern "C" void Sync(void) {
-  __sync_synchronize();
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+extern "C" void *getGroupBase(void) {
+  return __brigThreadInfo->groupBase;
+}
+
+extern "C" u32 LaneId_u32(void) {
+  return __brigThreadInfo->laneId;
+}
+
+// Cross-lane instructions. Lane numbers wrap at the wavefront size.
+extern "C" u32 CountLane_u32(b32 pred) {
+  ThreadInfo *info = __brigThreadInfo;
+  u64 mask = info->wavefront->mask(info->laneId, info->lanePhase++, pred);
+  return __builtin_popcountll(mask);
+}
+
+extern "C" u32 CountUpLane_u32(void) {
+  ThreadInfo *info = __brigThreadInfo;
+  u64 mask = info->wavefront->mask(info->laneId, info->lanePhase++, true);
+  return __builtin_popcountll(mask & ((u64(1) << info->laneId) - 1));
+}
+
+extern "C" b64 MaskLane_b64(b32 pred) {
+  ThreadInfo *info = __brigThreadInfo;
+  return info->wavefront->mask(info->laneId, info->lanePhase++, pred);
+}
+
+extern "C" b32 SendLane_b32(b32 value, b32 lane) {
+  ThreadInfo *info = __brigThreadInfo;
+  return info->wavefront->send(info->laneId, info->lanePhase++, value,
+                               lane % info->wavefrontSize);
+}
+
+extern "C" b32 ReceiveLane_b32(b32 value, b32 lane) {
+  ThreadInfo *info = __brigThreadInfo;
+  return info->wavefront->receive(info->laneId, info->lanePhase++, value,
+                                  lane % info->wavefrontSize);
 }
 
 extern "C" u32 WorkItemAbsId_u32(u32 x) {
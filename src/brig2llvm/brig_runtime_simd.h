@@ -0,0 +1,432 @@
+//===- brig_runtime_simd.h ------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// SIMD implementations of the packed instructions. Each function here is a
+// non-template overload of a scalar template in brig_runtime.cc, such as
+// AddVector. Overload resolution prefers an exact non-template match, so the
+// define*VectorPacking macros pick these up without change, while the scalar
+// templates remain the reference implementation for every other type.
+//
+// Every HSAIL packed type is at most 128 bits wide, so SSE2 and NEON cover
+// them in a single register. SSE2 is part of the baseline the runtime is
+// compiled for; SSSE3 and SSE4.1 are only used where they are available at
+// load time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BRIG_RUNTIME_SIMD_H
+#define BRIG_RUNTIME_SIMD_H
+
+#include "brig_runtime.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include <smmintrin.h>
+#include <tmmintrin.h>
+#endif  // defined(__SSE2__)
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif  // defined(__ARM_NEON__)
+
+namespace hsa {
+namespace brig {
+
+#if defined(__SSE2__)
+
+// Vectors are moved to and from registers one element at a time, since
+// neither Vector nor f16 is a trivial type that memcpy may overwrite. The
+// copies are of constant size, so they fold into a single load or store.
+template<class B> static inline void storeLane(char *p, B b) {
+  memcpy(p, &b, sizeof(B));
+}
+static inline void storeLane(char *p, f16 h) {
+  b16 b = h.getBits();
+  memcpy(p, &b, sizeof(b));
+}
+
+template<class B> static inline void loadLane(B &b, const char *p) {
+  memcpy(&b, p, sizeof(B));
+}
+static inline void loadLane(f16 &h, const char *p) {
+  b16 b;
+  memcpy(&b, p, sizeof(b));
+  h = f16::fromBits(b);
+}
+
+template<class T> static inline __m128i toXmm(T t) {
+  char bytes[sizeof(__m128i)] = { 0 };
+  for (unsigned i = 0; i < T::Len; ++i)
+    storeLane(bytes + i * sizeof(typename T::Base), t[i]);
+  return _mm_loadu_si128((const __m128i *) bytes);
+}
+
+template<class T> static inline T fromXmm(__m128i x) {
+  char bytes[sizeof(__m128i)];
+  _mm_storeu_si128((__m128i *) bytes, x);
+  T t;
+  for (unsigned i = 0; i < T::Len; ++i)
+    loadLane(t[i], bytes + i * sizeof(typename T::Base));
+  return t;
+}
+
+template<class T> static inline __m128 toXmmPs(T t) {
+  return _mm_castsi128_ps(toXmm(t));
+}
+
+template<class T> static inline T fromXmmPs(__m128 x) {
+  return fromXmm<T>(_mm_castps_si128(x));
+}
+
+static bool hasCPUFeature(unsigned ecxBit) {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  return ecx & ecxBit;
+}
+
+// F16C is VEX encoded, so the OS must also save the AVX state.
+static bool hasAVXState() {
+  if (!hasCPUFeature(bit_OSXSAVE)) return false;
+  unsigned eax, edx;
+  __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (eax & 0x6) == 0x6;
+}
+
+// Checked once, when the runtime is loaded.
+static const bool HasSSSE3 = hasCPUFeature(bit_SSSE3);
+static const bool HasSSE41 = hasCPUFeature(bit_SSE4_1);
+static const bool HasF16C = hasCPUFeature(bit_F16C) && hasAVXState();
+
+#define defineSSE2Binary(FUNC,TYPE,OP)                      \
+  static inline TYPE FUNC ## Vector(TYPE x, TYPE y) {       \
+    return fromXmm<TYPE>(OP(toXmm(x), toXmm(y)));           \
+  }
+
+#define defineSSE2FloatBinary(FUNC,TYPE,OP)                 \
+  static inline TYPE FUNC ## Vector(TYPE x, TYPE y) {       \
+    return fromXmmPs<TYPE>(OP(toXmmPs(x), toXmmPs(y)));     \
+  }
+
+#define defineSSE2Binary8(FUNC,SOP,UOP)         \
+  defineSSE2Binary(FUNC, s8x4, SOP)             \
+  defineSSE2Binary(FUNC, s8x8, SOP)             \
+  defineSSE2Binary(FUNC, u8x4, UOP)             \
+  defineSSE2Binary(FUNC, u8x8, UOP)
+
+#define defineSSE2Binary16(FUNC,SOP,UOP)        \
+  defineSSE2Binary(FUNC, s16x2, SOP)            \
+  defineSSE2Binary(FUNC, s16x4, SOP)            \
+  defineSSE2Binary(FUNC, u16x2, UOP)            \
+  defineSSE2Binary(FUNC, u16x4, UOP)
+
+#define defineSSE2Binary32(FUNC,SOP,UOP)        \
+  defineSSE2Binary(FUNC, s32x2, SOP)            \
+  defineSSE2Binary(FUNC, u32x2, UOP)
+
+// SSE2 lacks some signed and unsigned variants of min, max and compare.
+// They are emulated by flipping the sign bit, which maps one ordering onto
+// the other.
+static inline __m128i blend(__m128i mask, __m128i x, __m128i y) {
+  return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static inline __m128i min_epi8(__m128i x, __m128i y) {
+  return blend(_mm_cmplt_epi8(x, y), x, y);
+}
+static inline __m128i max_epi8(__m128i x, __m128i y) {
+  return blend(_mm_cmpgt_epi8(x, y), x, y);
+}
+static inline __m128i min_epu16(__m128i x, __m128i y) {
+  const __m128i bias = _mm_set1_epi16(-0x8000);
+  return _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(x, bias),
+                                     _mm_xor_si128(y, bias)), bias);
+}
+static inline __m128i max_epu16(__m128i x, __m128i y) {
+  const __m128i bias = _mm_set1_epi16(-0x8000);
+  return _mm_xor_si128(_mm_max_epi16(_mm_xor_si128(x, bias),
+                                     _mm_xor_si128(y, bias)), bias);
+}
+static inline __m128i min_epi32(__m128i x, __m128i y) {
+  return blend(_mm_cmplt_epi32(x, y), x, y);
+}
+static inline __m128i max_epi32(__m128i x, __m128i y) {
+  return blend(_mm_cmpgt_epi32(x, y), x, y);
+}
+static inline __m128i cmplt_epu32(__m128i x, __m128i y) {
+  const __m128i bias = _mm_set1_epi32(0x80000000);
+  return _mm_cmplt_epi32(_mm_xor_si128(x, bias), _mm_xor_si128(y, bias));
+}
+static inline __m128i min_epu32(__m128i x, __m128i y) {
+  return blend(cmplt_epu32(x, y), x, y);
+}
+static inline __m128i max_epu32(__m128i x, __m128i y) {
+  return blend(cmplt_epu32(y, x), x, y);
+}
+
+defineSSE2Binary8(Add, _mm_add_epi8, _mm_add_epi8)
+defineSSE2Binary16(Add, _mm_add_epi16, _mm_add_epi16)
+defineSSE2Binary32(Add, _mm_add_epi32, _mm_add_epi32)
+defineSSE2FloatBinary(Add, f32x2, _mm_add_ps)
+
+defineSSE2Binary8(Sub, _mm_sub_epi8, _mm_sub_epi8)
+defineSSE2Binary16(Sub, _mm_sub_epi16, _mm_sub_epi16)
+defineSSE2Binary32(Sub, _mm_sub_epi32, _mm_sub_epi32)
+defineSSE2FloatBinary(Sub, f32x2, _mm_sub_ps)
+
+defineSSE2Binary8(AddSat, _mm_adds_epi8, _mm_adds_epu8)
+defineSSE2Binary16(AddSat, _mm_adds_epi16, _mm_adds_epu16)
+
+defineSSE2Binary8(SubSat, _mm_subs_epi8, _mm_subs_epu8)
+defineSSE2Binary16(SubSat, _mm_subs_epi16, _mm_subs_epu16)
+
+defineSSE2Binary16(Mul, _mm_mullo_epi16, _mm_mullo_epi16)
+defineSSE2FloatBinary(Mul, f32x2, _mm_mul_ps)
+
+defineSSE2Binary16(MulHi, _mm_mulhi_epi16, _mm_mulhi_epu16)
+
+// Float min and max keep the scalar path: minps and maxps disagree with
+// the HSAIL rules for NaNs and signed zeros.
+defineSSE2Binary8(Max, max_epi8, _mm_max_epu8)
+defineSSE2Binary16(Max, _mm_max_epi16, max_epu16)
+defineSSE2Binary32(Max, max_epi32, max_epu32)
+
+defineSSE2Binary8(Min, min_epi8, _mm_min_epu8)
+defineSSE2Binary16(Min, _mm_min_epi16, min_epu16)
+defineSSE2Binary32(Min, min_epi32, min_epu32)
+
+#undef defineSSE2Binary8
+#undef defineSSE2Binary16
+#undef defineSSE2Binary32
+#undef defineSSE2FloatBinary
+#undef defineSSE2Binary
+
+__attribute__((target("ssse3")))
+static inline __m128i abs_epi8_ssse3(__m128i x) { return _mm_abs_epi8(x); }
+__attribute__((target("ssse3")))
+static inline __m128i abs_epi16_ssse3(__m128i x) { return _mm_abs_epi16(x); }
+__attribute__((target("ssse3")))
+static inline __m128i abs_epi32_ssse3(__m128i x) { return _mm_abs_epi32(x); }
+
+// |x| == (x ^ s) - s, where s is x's sign extended across the element.
+static inline __m128i abs_epi8(__m128i x) {
+  if (HasSSSE3) return abs_epi8_ssse3(x);
+  __m128i sign = _mm_cmpgt_epi8(_mm_setzero_si128(), x);
+  return _mm_sub_epi8(_mm_xor_si128(x, sign), sign);
+}
+static inline __m128i abs_epi16(__m128i x) {
+  if (HasSSSE3) return abs_epi16_ssse3(x);
+  __m128i sign = _mm_srai_epi16(x, 15);
+  return _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+}
+static inline __m128i abs_epi32(__m128i x) {
+  if (HasSSSE3) return abs_epi32_ssse3(x);
+  __m128i sign = _mm_srai_epi32(x, 31);
+  return _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+}
+
+#define defineSSE2Unary(FUNC,TYPE,OP)               \
+  static inline TYPE FUNC ## Vector(TYPE x) {       \
+    return fromXmm<TYPE>(OP(toXmm(x)));             \
+  }
+
+defineSSE2Unary(Abs, s8x4, abs_epi8)
+defineSSE2Unary(Abs, s8x8, abs_epi8)
+defineSSE2Unary(Abs, s16x2, abs_epi16)
+defineSSE2Unary(Abs, s16x4, abs_epi16)
+defineSSE2Unary(Abs, s32x2, abs_epi32)
+
+#undef defineSSE2Unary
+
+static inline f32x2 AbsVector(f32x2 x) {
+  return fromXmm<f32x2>(_mm_and_si128(toXmm(x), _mm_set1_epi32(0x7FFFFFFF)));
+}
+
+#define defineSSE2Neg(TYPE,SUB)                                    \
+  static inline TYPE NegVector(TYPE x) {                           \
+    return fromXmm<TYPE>(SUB(_mm_setzero_si128(), toXmm(x)));      \
+  }
+
+defineSSE2Neg(s8x4, _mm_sub_epi8)
+defineSSE2Neg(s8x8, _mm_sub_epi8)
+defineSSE2Neg(s16x2, _mm_sub_epi16)
+defineSSE2Neg(s16x4, _mm_sub_epi16)
+defineSSE2Neg(s32x2, _mm_sub_epi32)
+
+#undef defineSSE2Neg
+
+static inline f32x2 NegVector(f32x2 x) {
+  return fromXmm<f32x2>(_mm_xor_si128(toXmm(x), _mm_set1_epi32(0x80000000)));
+}
+
+// There are no 8-bit shifts, so those keep the scalar path. The shift
+// amount is masked exactly as in the scalar Shl and Shr.
+#define defineSSE2Shift(FUNC,TYPE,BITS,OP)                            \
+  static inline TYPE FUNC ## Vector(TYPE x, unsigned y) {             \
+    __m128i count = _mm_cvtsi32_si128(y & (BITS - 1));                \
+    return fromXmm<TYPE>(OP(toXmm(x), count));                        \
+  }
+
+defineSSE2Shift(Shl, s16x2, 16, _mm_sll_epi16)
+defineSSE2Shift(Shl, s16x4, 16, _mm_sll_epi16)
+defineSSE2Shift(Shl, u16x2, 16, _mm_sll_epi16)
+defineSSE2Shift(Shl, u16x4, 16, _mm_sll_epi16)
+defineSSE2Shift(Shl, s32x2, 32, _mm_sll_epi32)
+defineSSE2Shift(Shl, u32x2, 32, _mm_sll_epi32)
+
+defineSSE2Shift(Shr, s16x2, 16, _mm_sra_epi16)
+defineSSE2Shift(Shr, s16x4, 16, _mm_sra_epi16)
+defineSSE2Shift(Shr, u16x2, 16, _mm_srl_epi16)
+defineSSE2Shift(Shr, u16x4, 16, _mm_srl_epi16)
+defineSSE2Shift(Shr, s32x2, 32, _mm_sra_epi32)
+defineSSE2Shift(Shr, u32x2, 32, _mm_srl_epi32)
+
+#undef defineSSE2Shift
+
+// Cmov selects y where the element of x is non-zero, and z elsewhere.
+#define defineSSE2Cmov(TYPE,CMPEQ)                                    \
+  static inline TYPE CmovVector(TYPE x, TYPE y, TYPE z) {             \
+    __m128i zero = CMPEQ(toXmm(x), _mm_setzero_si128());              \
+    return fromXmm<TYPE>(blend(zero, toXmm(z), toXmm(y)));            \
+  }
+
+defineSSE2Cmov(s8x4, _mm_cmpeq_epi8)
+defineSSE2Cmov(s8x8, _mm_cmpeq_epi8)
+defineSSE2Cmov(u8x4, _mm_cmpeq_epi8)
+defineSSE2Cmov(u8x8, _mm_cmpeq_epi8)
+defineSSE2Cmov(s16x2, _mm_cmpeq_epi16)
+defineSSE2Cmov(s16x4, _mm_cmpeq_epi16)
+defineSSE2Cmov(u16x2, _mm_cmpeq_epi16)
+defineSSE2Cmov(u16x4, _mm_cmpeq_epi16)
+defineSSE2Cmov(s32x2, _mm_cmpeq_epi32)
+defineSSE2Cmov(u32x2, _mm_cmpeq_epi32)
+
+#undef defineSSE2Cmov
+
+// The float comparison treats -0.0 as zero, as the scalar Cmov does.
+static inline f32x2 CmovVector(f32x2 x, f32x2 y, f32x2 z) {
+  __m128i zero = _mm_castps_si128(_mm_cmpeq_ps(toXmmPs(x), _mm_setzero_ps()));
+  return fromXmm<f32x2>(blend(zero, toXmm(z), toXmm(y)));
+}
+
+// Half precision. vcvtph2ps widens four halves to floats exactly, and
+// vcvtps2ph rounds them back to nearest even whatever the rounding mode.
+// Abs, Neg and Cmov only look at the bits, so they need no conversion.
+__attribute__((target("f16c")))
+static inline f32 halfToFloatF16C(b16 b) { return _cvtsh_ss(b); }
+
+__attribute__((target("f16c")))
+static inline b16 floatToHalfF16C(f32 f) {
+  return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+}
+
+#define defineF16CBinary(FUNC,TYPE,OP,SOP)                                \
+  __attribute__((target("f16c")))                                         \
+  static TYPE FUNC ## F16C(TYPE x, TYPE y) {                              \
+    __m128 result = OP(_mm_cvtph_ps(toXmm(x)), _mm_cvtph_ps(toXmm(y)));   \
+    return fromXmm<TYPE>(_mm_cvtps_ph(result, _MM_FROUND_TO_NEAREST_INT)); \
+  }                                                                       \
+  static inline TYPE FUNC ## Vector(TYPE x, TYPE y) {                     \
+    if (HasF16C) return FUNC ## F16C(x, y);                               \
+    for (unsigned i = 0; i < TYPE::Len; ++i)                              \
+      x[i] = f32(x[i]) SOP f32(y[i]);                                     \
+    return x;                                                             \
+  }
+
+defineF16CBinary(Add, f16x2, _mm_add_ps, +)
+defineF16CBinary(Add, f16x4, _mm_add_ps, +)
+defineF16CBinary(Sub, f16x2, _mm_sub_ps, -)
+defineF16CBinary(Sub, f16x4, _mm_sub_ps, -)
+defineF16CBinary(Mul, f16x2, _mm_mul_ps, *)
+defineF16CBinary(Mul, f16x4, _mm_mul_ps, *)
+
+#undef defineF16CBinary
+
+#define defineSSE2HalfBits(TYPE)                                          \
+  static inline TYPE AbsVector(TYPE x) {                                  \
+    return fromXmm<TYPE>(_mm_and_si128(toXmm(x), _mm_set1_epi16(0x7FFF))); \
+  }                                                                       \
+  static inline TYPE NegVector(TYPE x) {                                  \
+    return fromXmm<TYPE>(_mm_xor_si128(toXmm(x),                          \
+                                       _mm_set1_epi16(-0x8000)));         \
+  }                                                                       \
+  static inline TYPE CmovVector(TYPE x, TYPE y, TYPE z) {                 \
+    __m128i magnitude = _mm_and_si128(toXmm(x), _mm_set1_epi16(0x7FFF));  \
+    __m128i zero = _mm_cmpeq_epi16(magnitude, _mm_setzero_si128());       \
+    return fromXmm<TYPE>(blend(zero, toXmm(z), toXmm(y)));                \
+  }
+
+defineSSE2HalfBits(f16x2)
+defineSSE2HalfBits(f16x4)
+
+#undef defineSSE2HalfBits
+
+// Sum of absolute differences of the four bytes of x and y.
+static inline u32 SadBytes(u8x4 x, u8x4 y) {
+  return _mm_cvtsi128_si32(_mm_sad_epu8(toXmm(x), toXmm(y)));
+}
+
+// pavgb rounds up, (w + x + 1) >> 1. Where the rounding bit of y is clear,
+// subtract the carry that rounding added: the low bit of w ^ x.
+static inline b32 LerpBytes(b32 w, b32 x, b32 y) {
+  __m128i a = _mm_cvtsi32_si128(w);
+  __m128i b = _mm_cvtsi32_si128(x);
+  __m128i round = _mm_andnot_si128(_mm_cvtsi32_si128(y),
+                                   _mm_set1_epi8(0x01));
+  __m128i carry = _mm_and_si128(_mm_xor_si128(a, b), round);
+  return _mm_cvtsi128_si32(_mm_sub_epi8(_mm_avg_epu8(a, b), carry));
+}
+
+#elif defined(__ARM_NEON__)
+
+#define defineNEONBinary(FUNC,TYPE,VTYPE,SUFFIX,OP)                 \
+  static inline TYPE FUNC ## Vector(TYPE x, TYPE y) {               \
+    VTYPE a, b;                                                     \
+    memcpy(&a, &x, sizeof(TYPE));                                   \
+    memcpy(&b, &y, sizeof(TYPE));                                   \
+    a = OP ## _ ## SUFFIX(a, b);                                    \
+    memcpy(&x, &a, sizeof(TYPE));                                   \
+    return x;                                                       \
+  }
+
+#define defineNEONIntBinary(FUNC,OP)                            \
+  defineNEONBinary(FUNC, s8x8, int8x8_t, s8, OP)                \
+  defineNEONBinary(FUNC, u8x8, uint8x8_t, u8, OP)               \
+  defineNEONBinary(FUNC, s16x4, int16x4_t, s16, OP)             \
+  defineNEONBinary(FUNC, u16x4, uint16x4_t, u16, OP)            \
+  defineNEONBinary(FUNC, s32x2, int32x2_t, s32, OP)             \
+  defineNEONBinary(FUNC, u32x2, uint32x2_t, u32, OP)
+
+// Only the 64-bit types fill a D register; the 32-bit types keep the scalar
+// path. vmin and vmax are exact for integers, and vqadd and vqsub saturate
+// exactly as AddSat and SubSat do.
+defineNEONIntBinary(Add, vadd)
+defineNEONIntBinary(Sub, vsub)
+defineNEONIntBinary(AddSat, vqadd)
+defineNEONIntBinary(SubSat, vqsub)
+defineNEONIntBinary(Max, vmax)
+defineNEONIntBinary(Min, vmin)
+defineNEONBinary(Add, f32x2, float32x2_t, f32, vadd)
+defineNEONBinary(Sub, f32x2, float32x2_t, f32, vsub)
+defineNEONBinary(Mul, f32x2, float32x2_t, f32, vmul)
+defineNEONBinary(Mul, s16x4, int16x4_t, s16, vmul)
+defineNEONBinary(Mul, u16x4, uint16x4_t, u16, vmul)
+
+#undef defineNEONIntBinary
+#undef defineNEONBinary
+
+#endif  // defined(__ARM_NEON__)
+
+}  // namespace brig
+}  // namespace hsa
+
+#endif  // BRIG_RUNTIME_SIMD_H
@@ -0,0 +1,115 @@
+//===- brig_scheduler.cc --------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace hsa {
+namespace brig {
+
+// Passes are in fixed point, so that equal shares compare equal.
+enum { StrideOne = 1 << 20 };
+
+class BrigScheduler::Client {
+ public:
+  uint64_t stride;      // StrideOne / weight
+  uint64_t pass;
+  uint32_t waiters;     // pthreads blocked in acquire
+};
+
+BrigScheduler::BrigScheduler(uint32_t capacity) :
+  capacity_(std::max(capacity, 1U)), free_(capacity_) {
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&freed_, NULL);
+}
+
+BrigScheduler::~BrigScheduler() {
+  assert(clients_.empty() && "Kernels still running");
+  pthread_cond_destroy(&freed_);
+  pthread_mutex_destroy(&lock_);
+}
+
+BrigScheduler::Client *BrigScheduler::join(uint32_t weight) {
+  Client *client = new Client;
+  client->stride = StrideOne / std::max(weight, 1U);
+  client->pass = 0;
+  client->waiters = 0;
+
+  pthread_mutex_lock(&lock_);
+  for (unsigned i = 0; i < clients_.size(); ++i)
+    if (!i || clients_[i]->pass < client->pass)
+      client->pass = clients_[i]->pass;
+  clients_.push_back(client);
+  pthread_mutex_unlock(&lock_);
+  return client;
+}
+
+void BrigScheduler::leave(Client *client) {
+  pthread_mutex_lock(&lock_);
+  assert(!client->waiters && "Client still waiting");
+  clients_.erase(std::find(clients_.begin(), clients_.end(), client));
+  // The client may have been the one the others were waiting behind.
+  pthread_cond_broadcast(&freed_);
+  pthread_mutex_unlock(&lock_);
+  delete client;
+}
+
+// Whether no other waiting client has a lower pass, or the same pass and
+// joined earlier. The caller holds the lock.
+bool BrigScheduler::isNext(const Client *client) const {
+  bool earlier = true;
+  for (unsigned i = 0; i < clients_.size(); ++i) {
+    const Client *other = clients_[i];
+    if (other == client) {
+      earlier = false;
+    } else if (other->waiters && (other->pass < client->pass ||
+                                  (earlier && other->pass == client->pass))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t BrigScheduler::acquire(Client *client, uint32_t count) {
+  count = std::min(count, capacity_);
+
+  pthread_mutex_lock(&lock_);
+  ++client->waiters;
+  while (count > free_ || !isNext(client))
+    pthread_cond_wait(&freed_, &lock_);
+  --client->waiters;
+  free_ -= count;
+  client->pass += count * client->stride;
+  // The next client in line may fit in what is left.
+  if (free_) pthread_cond_broadcast(&freed_);
+  pthread_mutex_unlock(&lock_);
+  return count;
+}
+
+uint32_t BrigScheduler::getWaiting() {
+  pthread_mutex_lock(&lock_);
+  uint32_t waiting = 0;
+  for (unsigned i = 0; i < clients_.size(); ++i)
+    waiting += clients_[i]->waiters;
+  pthread_mutex_unlock(&lock_);
+  return waiting;
+}
+
+void BrigScheduler::release(uint32_t count) {
+  pthread_mutex_lock(&lock_);
+  free_ += count;
+  assert(free_ <= capacity_ && "Released more than was taken");
+  pthread_cond_broadcast(&freed_);
+  pthread_mutex_unlock(&lock_);
+}
+
+} // namespace brig
+} // namespace hsa
@@ -39,12 +39,12 @@ void BrigSymbol::nextValid() {
 }
 
 BrigSymbol arg_begin(const BrigFunction &fun) {
-  BrigSymbol symbol(fun.S_, fun.it_ + 1);
+  BrigSymbol symbol(fun.S_, fun.S_.advance(fun.it_, 1));
   return symbol;
 }
 
 BrigSymbol arg_end(const BrigFunction &fun) {
-  BrigSymbol symbol(fun.S_, fun.it_ + 1 + fun.getNumArgs());
+  BrigSymbol symbol(fun.S_, fun.S_.advance(fun.it_, 1 + fun.getNumArgs()));
   return symbol;
 }
 
@@ -0,0 +1,142 @@
+//===- brig_topology.cc ---------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_topology.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace hsa {
+namespace brig {
+
+const Topology &Topology::get() {
+  static const Topology *topology = new Topology();
+  return *topology;
+}
+
+bool Topology::parseCpuList(const char *list, std::vector<unsigned> &cpus) {
+  const char *p = list;
+  while (*p && *p != '\n') {
+    char *end;
+    unsigned long first = strtoul(p, &end, 10);
+    if (end == p) return false;
+    unsigned long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtoul(++p, &end, 10);
+      if (end == p || last < first) return false;
+      p = end;
+    }
+    for (unsigned long cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+    if (*p == ',') ++p;
+    else if (*p && *p != '\n') return false;
+  }
+  return true;
+}
+
+unsigned Topology::getNodeIndex(unsigned cpu) const {
+  for (unsigned i = 0; i < nodes_.size(); ++i) {
+    const std::vector<unsigned> &cpus = nodes_[i].cpus;
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) return i;
+  }
+  return nodes_.size();
+}
+
+static bool isUsable(unsigned cpu) {
+#ifdef __linux__
+  static cpu_set_t allowed;
+  static bool known = !sched_getaffinity(0, sizeof(allowed), &allowed);
+  return !known || cpu >= CPU_SETSIZE || CPU_ISSET(cpu, &allowed);
+#else
+  (void) cpu;
+  return true;
+#endif
+}
+
+bool Topology::readNodes() {
+  const char *root = "/sys/devices/system/node";
+  DIR *dir = opendir(root);
+  if (!dir) return false;
+
+  std::vector<unsigned> ids;
+  while (struct dirent *entry = readdir(dir)) {
+    unsigned id;
+    char tail;
+    if (sscanf(entry->d_name, "node%u%c", &id, &tail) == 1)
+      ids.push_back(id);
+  }
+  closedir(dir);
+  std::sort(ids.begin(), ids.end());
+
+  for (unsigned i = 0; i < ids.size(); ++i) {
+    char path[64];
+    char line[4096];
+    Node node;
+    node.id = ids[i];
+    node.memory = 0;
+
+    std::vector<unsigned> cpus;
+    snprintf(path, sizeof(path), "%s/node%u/cpulist", root, node.id);
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    bool valid = fgets(line, sizeof(line), file) &&
+      parseCpuList(line, cpus);
+    fclose(file);
+    if (!valid) return false;
+    for (unsigned j = 0; j < cpus.size(); ++j)
+      if (isUsable(cpus[j])) node.cpus.push_back(cpus[j]);
+
+    snprintf(path, sizeof(path), "%s/node%u/meminfo", root, node.id);
+    if ((file = fopen(path, "r"))) {
+      unsigned long long kb;
+      while (fgets(line, sizeof(line), file)) {
+        const char *total = strstr(line, "MemTotal:");
+        if (total && sscanf(total, "MemTotal: %llu", &kb) == 1)
+          node.memory = uint64_t(kb) * 1024;
+      }
+      fclose(file);
+    }
+
+    // Memory-only nodes still take allocations.
+    nodes_.push_back(node);
+    cpus_.insert(cpus_.end(), node.cpus.begin(), node.cpus.end());
+  }
+  return !cpus_.empty();
+}
+
+Topology::Topology() {
+#ifdef __linux__
+  if (readNodes()) return;
+  nodes_.clear();
+  cpus_.clear();
+#endif
+
+  Node node;
+  node.id = 0;
+  long count = sysconf(_SC_NPROCESSORS_CONF);
+  for (long cpu = 0; cpu < std::max(count, 1L); ++cpu)
+    if (isUsable(cpu)) node.cpus.push_back(cpu);
+  if (node.cpus.empty()) node.cpus.push_back(0);
+  node.memory = uint64_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+  nodes_.push_back(node);
+  cpus_ = node.cpus;
+}
+
+} // namespace brig
+} // namespace hsa
@@ -0,0 +1,81 @@
+//===- brig_wavefront.cc --------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_wavefront.h"
+
+namespace hsa {
+namespace brig {
+
+// A slot is laid out as phase:25, sender + 1:7, value:32. A sender of zero
+// marks a slot nobody wrote in this phase.
+static uint64_t makeSlot(uint32_t phase, uint32_t lane, uint32_t value) {
+  uint64_t tag = (uint64_t(phase) << 7 | (lane + 1)) & 0xFFFFFFFF;
+  return tag << 32 | value;
+}
+
+static bool isCurrent(uint64_t slot, uint32_t phase) {
+  uint32_t tag = uint32_t(slot >> 32);
+  return (tag & 0x7F) && (tag >> 7) == (phase & 0x1FFFFFF);
+}
+
+static uint32_t getSender(uint64_t slot) {
+  return uint32_t(slot >> 32 & 0x7F);
+}
+
+void Wavefront::init(uint32_t lanes, uint32_t spins) {
+  barrier_.init(lanes, spins);
+  lanes_ = lanes;
+  for (unsigned i = 0; i < 2; ++i)
+    for (unsigned j = 0; j < MaxSize; ++j)
+      slots_[i][j] = 0;
+}
+
+uint64_t Wavefront::mask(uint32_t lane, uint32_t phase, bool pred) {
+  uint64_t *slots = slots_[phase & 1];
+  __atomic_store_n(&slots[lane], makeSlot(phase, lane, pred),
+                   __ATOMIC_RELAXED);
+  barrier_.wait();
+
+  uint64_t result = 0;
+  for (uint32_t i = 0; i < lanes_; ++i) {
+    uint64_t slot = __atomic_load_n(&slots[i], __ATOMIC_RELAXED);
+    result |= uint64_t(uint32_t(slot) != 0) << i;
+  }
+  return result;
+}
+
+uint32_t Wavefront::receive(uint32_t lane, uint32_t phase,
+                            uint32_t value, uint32_t source) {
+  uint64_t *slots = slots_[phase & 1];
+  __atomic_store_n(&slots[lane], makeSlot(phase, lane, value),
+                   __ATOMIC_RELAXED);
+  barrier_.wait();
+
+  if (source >= lanes_) return 0;
+  return uint32_t(__atomic_load_n(&slots[source], __ATOMIC_RELAXED));
+}
+
+uint32_t Wavefront::send(uint32_t lane, uint32_t phase,
+                         uint32_t value, uint32_t target) {
+  uint64_t *slots = slots_[phase & 1];
+  if (target < lanes_) {
+    uint64_t mine = makeSlot(phase, lane, value);
+    uint64_t old = __atomic_load_n(&slots[target], __ATOMIC_RELAXED);
+    while ((!isCurrent(old, phase) || getSender(old) < getSender(mine)) &&
+           !__atomic_compare_exchange_n(&slots[target], &old, mine, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  }
+  barrier_.wait();
+
+  uint64_t slot = __atomic_load_n(&slots[lane], __ATOMIC_RELAXED);
+  return isCurrent(slot, phase) ? uint32_t(slot) : 0;
+}
+
+} // namespace brig
+} // namespace hsa
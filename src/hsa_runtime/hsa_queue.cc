@@ -0,0 +1,257 @@
+//===- hsa_queue.cc -------------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "hsa_queue.h"
+#include "hsacore.h"
+
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace hsa {
+
+// The user-mode queues that exist.
+static uint32_t userModeQueues;
+
+// A ring of AQL packets. Producers reserve slots by bumping the write
+// index, and the packet processor consumes them in order, waiting for each
+// slot's header. The read index only moves once a packet has completed, so
+// a slot is never reused before then.
+class SimUserModeQueue : public hsacore::Queue {
+
+ public:
+
+  SimUserModeQueue(uint32_t size, Device *device, uint32_t weight) :
+    device_(device), weight_(weight), size_(size), writeIndex_(0),
+    readIndex_(0), sleeping_(0), emptyWaiters_(0), valid_(true),
+    stop_(false), detached_(false) {
+    void *packets;
+    if (posix_memalign(&packets, sizeof(AqlPacket), size * sizeof(AqlPacket)))
+      abort();
+    packets_ = (AqlPacket *) packets;
+    memset(packets_, 0, size * sizeof(AqlPacket));
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&doorbell_, NULL);
+    pthread_cond_init(&empty_, NULL);
+    pthread_create(&processor_, NULL, processorLoop, this);
+  }
+
+  virtual ~SimUserModeQueue() {
+    if (valid_) destroy();
+    pthread_cond_destroy(&empty_);
+    pthread_cond_destroy(&doorbell_);
+    pthread_mutex_destroy(&lock_);
+    free(packets_);
+    __atomic_sub_fetch(&userModeQueues, 1, __ATOMIC_RELAXED);
+  }
+
+  virtual uint32_t getMaxQueues() { return MaxUserModeQueues; }
+
+  virtual bool isValid() { return valid_; }
+
+  virtual uint32_t getVmId() { return 0; }
+
+  // Raw access, for a single producer: getWriteAddr returns the slot that
+  // setWriteAddr then reserves and publishes.
+  virtual uint32_t *getWriteAddr() {
+    uint64_t write = __atomic_load_n(&writeIndex_, __ATOMIC_RELAXED);
+    if (write - __atomic_load_n(&readIndex_, __ATOMIC_ACQUIRE) >= size_)
+      return NULL;
+    return (uint32_t *) &packets_[write & (size_ - 1)];
+  }
+
+  virtual void setWriteAddr(uint32_t pktSize) {
+    uint32_t *writeAddr = acquireWriteAddr(pktSize);
+    if (writeAddr) releaseWriteAddr(writeAddr, pktSize);
+  }
+
+  virtual uint32_t *acquireWriteAddr(uint32_t pktSize) {
+    if (pktSize != AqlPacketWords) return NULL;
+    uint64_t write = __atomic_load_n(&writeIndex_, __ATOMIC_RELAXED);
+    do {
+      if (write - __atomic_load_n(&readIndex_, __ATOMIC_ACQUIRE) >= size_)
+        return NULL;
+    } while (!__atomic_compare_exchange_n(&writeIndex_, &write, write + 1,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return (uint32_t *) &packets_[write & (size_ - 1)];
+  }
+
+  virtual void releaseWriteAddr(uint32_t *writeAddr, uint32_t pktSize) {
+    if (pktSize != AqlPacketWords) return;
+    AqlPacket *packet = (AqlPacket *) writeAddr;
+    // Pairs with the packet processor's check of sleeping_: either it sees
+    // the header, or this producer sees it asleep and wakes it.
+    __atomic_store_n(&packet->header, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping_, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&lock_);
+      pthread_cond_signal(&doorbell_);
+      pthread_mutex_unlock(&lock_);
+    }
+  }
+
+  // Submits the packets in pktBuffer one at a time, waiting for room when
+  // the queue is full.
+  virtual void execCommand(uint32_t *pktBuffer, uint32_t pktSize) {
+    for (uint32_t i = 0; i + AqlPacketWords <= pktSize; i += AqlPacketWords) {
+      uint32_t *writeAddr;
+      while (!(writeAddr = acquireWriteAddr(AqlPacketWords)))
+        sched_yield();
+      memcpy(writeAddr + 1, pktBuffer + i + 1,
+             sizeof(AqlPacket) - sizeof(uint32_t));
+      releaseWriteAddr(writeAddr, AqlPacketWords);
+    }
+  }
+
+  virtual bool isEmpty() {
+    return __atomic_load_n(&readIndex_, __ATOMIC_SEQ_CST) ==
+      __atomic_load_n(&writeIndex_, __ATOMIC_SEQ_CST);
+  }
+
+  virtual void waitEmpty() {
+    pthread_mutex_lock(&lock_);
+    __atomic_add_fetch(&emptyWaiters_, 1, __ATOMIC_SEQ_CST);
+    while (!isEmpty())
+      pthread_cond_wait(&empty_, &lock_);
+    __atomic_sub_fetch(&emptyWaiters_, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  virtual void alter(uint32_t *, uint32_t, uint32_t, int32_t schedPrior) {
+    if (!valid_) return;
+    waitEmpty();
+    if (schedPrior > 0)
+      __atomic_store_n(&weight_, uint32_t(schedPrior), __ATOMIC_RELAXED);
+  }
+
+  // Runs the packets published so far, then stops the packet processor.
+  virtual void destroy() {
+    pthread_mutex_lock(&lock_);
+    valid_ = false;
+    __atomic_store_n(&stop_, true, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&doorbell_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(processor_, NULL);
+  }
+
+  virtual void detach() {
+    if (!valid_) return;
+    __atomic_store_n(&detached_, true, __ATOMIC_SEQ_CST);
+  }
+
+  virtual void reattach() {
+    if (!valid_) return;
+    pthread_mutex_lock(&lock_);
+    __atomic_store_n(&detached_, false, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&doorbell_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+ private:
+
+  static void *processorLoop(void *arg) {
+    static_cast<SimUserModeQueue *>(arg)->process();
+    return NULL;
+  }
+
+  // Waits for the packet's header, spinning briefly before sleeping until
+  // the doorbell rings. Returns false if the queue stops first.
+  bool waitPublished(AqlPacket *packet) {
+    for (unsigned i = 0; i < 1024; ++i) {
+      if (__atomic_load_n(&packet->header, __ATOMIC_ACQUIRE))
+        return true;
+      sched_yield();
+    }
+
+    pthread_mutex_lock(&lock_);
+    __atomic_store_n(&sleeping_, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&packet->header, __ATOMIC_SEQ_CST) &&
+           !__atomic_load_n(&stop_, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&doorbell_, &lock_);
+    __atomic_store_n(&sleeping_, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock_);
+    return __atomic_load_n(&packet->header, __ATOMIC_ACQUIRE);
+  }
+
+  // Sleeps while the queue is detached. Destroying it reattaches it, so
+  // that the packets already published still run.
+  void waitAttached() {
+    if (!__atomic_load_n(&detached_, __ATOMIC_SEQ_CST)) return;
+    pthread_mutex_lock(&lock_);
+    while (__atomic_load_n(&detached_, __ATOMIC_SEQ_CST) &&
+           !__atomic_load_n(&stop_, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&doorbell_, &lock_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void process() {
+    for (uint64_t read = 0; ; ++read) {
+      AqlPacket *packet = &packets_[read & (size_ - 1)];
+      if (!waitPublished(packet)) break;
+      waitAttached();
+
+      uint32_t status = AqlCompleted;
+      if (packet->type == hsacore::ISAKERNEL &&
+          !runKernel(device_, (Kernel *) uintptr_t(packet->kernel),
+                     packet->groupCount, packet->groupSize,
+                     packet->dynamicGroupSize,
+                     (KernelArg *) uintptr_t(packet->kernarg),
+                     packet->argCount,
+                     __atomic_load_n(&weight_, __ATOMIC_RELAXED)))
+        status = AqlFailed;
+
+      uint32_t *completion = (uint32_t *) uintptr_t(packet->completion);
+      __atomic_store_n(&packet->header, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&readIndex_, read + 1, __ATOMIC_SEQ_CST);
+      if (completion)
+        __atomic_store_n(completion, status, __ATOMIC_RELEASE);
+
+      if (__atomic_load_n(&emptyWaiters_, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&lock_);
+        pthread_cond_broadcast(&empty_);
+        pthread_mutex_unlock(&lock_);
+      }
+    }
+  }
+
+  Device *device_;
+  uint32_t weight_;
+  AqlPacket *packets_;
+  const uint32_t size_;
+  uint64_t writeIndex_;
+  uint64_t readIndex_;
+  uint32_t sleeping_;
+  uint32_t emptyWaiters_;
+  bool valid_;
+  bool stop_;
+  bool detached_;
+
+  pthread_mutex_t lock_;
+  pthread_cond_t doorbell_;
+  pthread_cond_t empty_;
+  pthread_t processor_;
+};
+
+hsacore::Queue *createUserModeQueue(uint32_t size, Device *device,
+                                    uint32_t weight) {
+  if (!size || (size & (size - 1))) return NULL;
+  if (__atomic_add_fetch(&userModeQueues, 1, __ATOMIC_RELAXED) >
+      MaxUserModeQueues) {
+    __atomic_sub_fetch(&userModeQueues, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return new SimUserModeQueue(size, device, std::max(weight, 1U));
+}
+
+}  // namespace hsa
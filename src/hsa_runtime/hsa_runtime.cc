@@ -12,16 +12,28 @@
 #include <cstring>
 
 #include "hsa.h"
+#include "hsa_queue.h"
 
+#include "brig_allocator.h"
 #include "brig_engine.h"
 #include "brig_llvm.h"
 #include "brig_module.h"
 #include "brig_reader.h"
+#include "brig_scheduler.h"
+#include "brig_topology.h"
 
 #include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdarg>
+#include <deque>
+#include <map>
+
+#include <pthread.h>
+#include <time.h>
 
 namespace hsa {
 
@@ -30,20 +42,48 @@ typedef vector<Device *> DeviceList;
 class SimKernel : public Kernel {
  public:
 
-  SimKernel(llvm::Function *F) : F_(F) {}
-
-  virtual void *allocateGroupMemory(size_t, size_t) {
-    return NULL;
+  SimKernel(llvm::Function *F) :
+    F_(F),
+    staticGroupSize_(hsa::brig::GenLLVM::getGroupSegmentSize(F->getParent())),
+    dynamicGroupSize_(0) {}
+
+  // Every work-group has a group segment of its own, so there is no single
+  // base address. Allocations are placed in the segment after the kernel's
+  // group variables, and last until they are freed. Each goes in the first
+  // gap between the live ones that fits it. They are returned as
+  // GroupMemoryBase plus their offset in the segment, so that one at
+  // offset 0 is not NULL.
+  virtual void *allocateGroupMemory(size_t size, size_t align) {
+    if (!align) align = 1;
+    size = std::max(size, size_t(1));
+    uint64_t offset = staticGroupSize_;
+    for (std::map<uint64_t, size_t>::const_iterator
+           I = groupAllocations_.begin(), E = groupAllocations_.end();
+         I != E; ++I) {
+      offset = (offset + align - 1) / align * align;
+      if (offset + size <= I->first) break;
+      offset = I->first + I->second;
+    }
+    offset = (offset + align - 1) / align * align;
+    if (offset + size > hsa::brig::BrigEngine::MaxGroupMemorySize)
+      return NULL;
+    groupAllocations_[offset] = size;
+    updateDynamicGroupSize();
+    return (void *) uintptr_t(GroupMemoryBase + offset);
   }
 
-  virtual void freeGroupMemory(const void *) {}
+  virtual void freeGroupMemory(const void *ptr) {
+    if (uintptr_t(ptr) < GroupMemoryBase) return;
+    groupAllocations_.erase(uintptr_t(ptr) - GroupMemoryBase);
+    updateDynamicGroupSize();
+  }
 
   virtual void *getISA() {
     return NULL;
   }
 
   virtual const void *getGroupMemoryBase() const {
-    return NULL;
+    return (const void *) uintptr_t(GroupMemoryBase);
   }
 
   virtual size_t getSizeOfISA() {
@@ -56,7 +96,25 @@ class SimKernel : public Kernel {
     return name;
   }
 
+  // A power of two above any offset in the segment, so a handle has the
+  // alignment of its offset, for alignments up to the segment's size.
+  enum { GroupMemoryBase = hsa::brig::BrigEngine::MaxGroupMemorySize };
+
   llvm::Function *F_;
+  uint64_t staticGroupSize_;
+  // Bytes of group segment from the end of the group variables to the end
+  // of the last live allocation.
+  size_t dynamicGroupSize_;
+
+ private:
+  void updateDynamicGroupSize() {
+    dynamicGroupSize_ = groupAllocations_.empty() ? 0 :
+      groupAllocations_.rbegin()->first + groupAllocations_.rbegin()->second -
+      staticGroupSize_;
+  }
+
+  // The size of each live allocation, by offset.
+  std::map<uint64_t, size_t> groupAllocations_;
 };
 
 class SimProgram : public Program {
@@ -78,66 +136,204 @@ class SimProgram : public Program {
     return NULL;
   }
 
-  virtual ~SimProgram() {}
+  // Drops the engines the devices keep for the program's module.
+  virtual ~SimProgram();
 
  private:
   hsa::brig::BrigProgram BP_;
 };
 
-class SimQueue : public Queue {
+// The JIT is not thread safe, so engines are created and destroyed one at a
+// time. The lock also guards the devices' idle engines. Kernels run outside
+// it.
+static pthread_mutex_t engineLock = PTHREAD_MUTEX_INITIALIZER;
 
+class SimMemoryDescriptor : public hsacommon::MemoryDescriptor {
  public:
 
-  SimQueue(Device *device) : device_(device) {}
+  SimMemoryDescriptor(uint64_t size) : size_(size) {}
 
-  virtual Device *getDevice() {
-    return device_;
+  virtual hsacommon::MemoryType getMemoryType() {
+    return hsacommon::MEMORY_TYPE_GLOBAL;
   }
 
-  virtual DispatchEvent* dispatch(Kernel *kernel,
-                                  LaunchAttributes attrs,
-                                  hsacommon::vector<Event *> &events,
-                                  uint32_t count, ...) {
+  virtual hsacommon::HeapType getHeapType() {
+    return hsacommon::HEAP_TYPE_SYSTEM;
+  }
 
-    hsacommon::vector<KernelArg> kernArgs;
+  virtual uint32_t getSizeLow() { return uint32_t(size_); }
+  virtual uint32_t getSizeHigh() { return uint32_t(size_ >> 32); }
+  virtual uint64_t getSize() { return size_; }
 
-    va_list ap;
-    va_start(ap, count);
-    for (unsigned i = 0; i < count; ++i) {
-      kernArgs.push_back(va_arg(ap, KernelArg));
-    }
+  virtual uint32_t getWidth() { return 64; }
 
-    return dispatch(kernel, attrs, events, kernArgs);
+  virtual uint32_t getMaxMemoryClock() { return 0; }
+
+ private:
+  uint64_t size_;
+};
+
+// Cancels a command from any thread, before it starts or while its kernels
+// run. The thread that runs the command names the engine it has taken with
+// start and finish around each launch. The engine stays cancelled until
+// finish, so a launch that had not quite started when the command was
+// cancelled does not run either.
+class SimCancel {
+ public:
+
+  SimCancel() : cancelled_(false), engine_(NULL) {
+    pthread_mutex_init(&lock_, NULL);
   }
 
-  virtual DispatchEvent* dispatch(Kernel *kernel,
-                                  LaunchAttributes attrs,
-                                  hsacommon::vector<Event *> &,
-                                  hsacommon::vector<KernelArg> &kernArgs) {
+  ~SimCancel() { pthread_mutex_destroy(&lock_); }
 
-    SimKernel *sk = reinterpret_cast<SimKernel *>(kernel);
+  void cancel() {
+    pthread_mutex_lock(&lock_);
+    cancelled_ = true;
+    if (engine_) engine_->cancel();
+    pthread_mutex_unlock(&lock_);
+  }
 
-    std::vector<void *> args;
-    for (unsigned i = 0; i < kernArgs.size(); ++i)
-      args.push_back(&kernArgs[i]);
+  bool isCancelled() {
+    pthread_mutex_lock(&lock_);
+    bool cancelled = cancelled_;
+    pthread_mutex_unlock(&lock_);
+    return cancelled;
+  }
 
-    llvm::Function *fun = sk->F_;
-    llvm::Module *mod = fun->getParent();
-    hsa::brig::BrigEngine BE(mod);
-    uint32_t blockNum = attrs.grid[0] * attrs.grid[1] * attrs.grid[2];
-    uint32_t threadNum = attrs.group[0] * attrs.group[1] * attrs.group[2];
-    BE.launch(fun, args, blockNum, threadNum);
-    return NULL;
+  void start(hsa::brig::BrigEngine *BE) {
+    pthread_mutex_lock(&lock_);
+    engine_ = BE;
+    if (cancelled_) BE->cancel();
+    pthread_mutex_unlock(&lock_);
   }
 
-  virtual void flush() {}
+  // The engine may be taken by other commands once resumed.
+  void finish() {
+    pthread_mutex_lock(&lock_);
+    engine_->resume();
+    engine_ = NULL;
+    pthread_mutex_unlock(&lock_);
+  }
 
  private:
-  Device *device_;
+  pthread_mutex_t lock_;
+  bool cancelled_;
+  hsa::brig::BrigEngine *engine_;
 };
 
-
+// A device owns a share of the host's processors, one compute unit each,
+// and splits its global memory over their nodes the way its engines split
+// work-groups. Kernels from different queues run on the device at the same
+// time, and its scheduler hands its processors to their work-groups by the
+// weights of the queues. Different devices run their kernels side by side.
+// On a host with several nodes, kernels stay on their device's processors
+// of each node, or on single processors if SIMPIN pins them.
 class SimDevice : public Device {
+ public:
+
+  SimDevice(const std::vector<unsigned> &cpus) :
+    cpus_(cpus), scheduler_(cpus.size()) {}
+
+  // The engine copies each argument into the kernarg segment from the
+  // KernelArg that holds it, so there must be a KernelArg for every
+  // parameter, and no parameter may be larger than one.
+  static bool checkArgs(SimKernel *kernel, size_t argCount) {
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> sizes;
+    hsa::brig::GenLLVM::getKernargLayout(kernel->F_, offsets, sizes);
+    if (argCount < sizes.size()) return false;
+    for (unsigned i = 0; i < sizes.size(); ++i)
+      if (sizes[i] > sizeof(KernelArg)) return false;
+    return true;
+  }
+
+  // The weight is the kernel's share of the device while other kernels run
+  // on it. The arguments must pass checkArgs. Returns false if the engine
+  // refused the kernel, as when its group segment is too large, or if the
+  // launch was cancelled through cancel, which may be NULL.
+  bool launch(SimKernel *kernel, uint32_t blockNum, uint32_t threadNum,
+              size_t dynamicGroupSize, KernelArg *kernArgs,
+              unsigned argCount, uint32_t weight, SimCancel *cancel) {
+    std::vector<void *> args;
+    for (unsigned i = 0; i < argCount; ++i)
+      args.push_back(&kernArgs[i]);
+
+    llvm::Function *fun = kernel->F_;
+    hsa::brig::BrigEngine *BE = acquireEngine(fun->getParent(), weight);
+    if (cancel) cancel->start(BE);
+    bool launched = BE->launch(fun, args, blockNum, threadNum,
+                               dynamicGroupSize);
+    if (cancel) cancel->finish();
+    releaseEngine(BE, fun->getParent());
+    return launched;
+  }
+
+  // One kernel of a batch.
+  struct BatchKernel {
+    SimKernel *kernel;
+    uint32_t blockNum;
+    uint32_t threadNum;
+    size_t dynamicGroupSize;
+    hsacommon::vector<KernelArg> args;
+    bool barrier;
+  };
+
+  // Consecutive kernels of the same program share an engine, and so one
+  // set of pthreads. With the SIMFUSE environment variable set, runs of
+  // them over the same grid are fused into one kernel where that is
+  // provably safe. The arguments of every kernel must pass checkArgs.
+  // Returns false as soon as the engine refuses a run or the batch is
+  // cancelled, and does not run the kernels after it.
+  bool launch(std::vector<BatchKernel> &batch, uint32_t weight,
+              SimCancel *cancel) {
+    for (size_t first = 0, end; first < batch.size(); first = end) {
+      if (cancel->isCancelled()) return false;
+      llvm::Module *M = batch[first].kernel->F_->getParent();
+      for (end = first + 1; end < batch.size(); ++end)
+        if (batch[end].kernel->F_->getParent() != M) break;
+
+      std::vector<std::vector<void *> > args(end - first);
+      std::vector<hsa::brig::BrigEngine::Launch> launches;
+      for (size_t i = first; i < end; ++i) {
+        BatchKernel &kernel = batch[i];
+        for (unsigned j = 0; j < kernel.args.size(); ++j)
+          args[i - first].push_back(&kernel.args[j]);
+        launches.push_back(
+          hsa::brig::BrigEngine::Launch(kernel.kernel->F_, args[i - first],
+                                        kernel.blockNum, kernel.threadNum,
+                                        kernel.dynamicGroupSize,
+                                        kernel.barrier));
+      }
+
+      // Other launches compile and run the module while this one fuses its
+      // kernels, so they are fused into a copy of the module, which only
+      // this launch's engine uses.
+      llvm::Module *fusedModule = NULL;
+      if (getenv("SIMFUSE")) {
+        pthread_mutex_lock(&engineLock);
+        fusedModule = fuse(M, args, launches);
+        pthread_mutex_unlock(&engineLock);
+      }
+      hsa::brig::BrigEngine *BE = fusedModule ?
+        createEngine(fusedModule, weight) : acquireEngine(M, weight);
+      cancel->start(BE);
+      bool launched = BE->launch(launches);
+      cancel->finish();
+
+      if (fusedModule) {
+        pthread_mutex_lock(&engineLock);
+        delete BE;
+        delete fusedModule;
+        pthread_mutex_unlock(&engineLock);
+      } else {
+        releaseEngine(BE, M);
+      }
+      if (!launched) return false;
+    }
+    return true;
+  }
+
   virtual DeviceType getType() const {
     return DEVICE_TYPE_GPU;
   }
@@ -161,8 +357,7 @@ class SimDevice : public Device {
   }
 
   virtual unsigned int getComputeUnitsCount() {
-    assert(false && "Unimplemented");
-    return 0;
+    return cpus_.size();
   }
 
   virtual uint32_t getCapabilities() {
@@ -176,11 +371,22 @@ class SimDevice : public Device {
     return name;
   }
 
+  // One descriptor per NUMA node the device's processors are on.
   typedef hsacommon::vector<hsacommon::MemoryDescriptor *> MemDescriptorList;
   virtual const MemDescriptorList &getMemoryDescriptors() {
-    assert(false && "Unimplemented");
-    static const MemDescriptorList mdl;
-    return mdl;
+    if (!memoryDescriptors_.size()) {
+      const hsa::brig::Topology &topology = hsa::brig::Topology::get();
+      for (unsigned i = 0; i < topology.getNodeCount(); ++i) {
+        const hsa::brig::Topology::Node &node = topology.getNode(i);
+        bool local = false;
+        for (unsigned j = 0; j < cpus_.size(); ++j)
+          local |= std::find(node.cpus.begin(), node.cpus.end(), cpus_[j]) !=
+            node.cpus.end();
+        if (local)
+          memoryDescriptors_.push_back(new SimMemoryDescriptor(node.memory));
+      }
+    }
+    return memoryDescriptors_;
   }
 
   typedef hsacommon::vector<hsacommon::CacheDescriptor *> CachDescriptorList;
@@ -206,8 +412,7 @@ class SimDevice : public Device {
   }
 
   virtual uint32_t getMaxGroupMemorySize() {
-    assert(false && "Unimplemented");
-    return false;
+    return hsa::brig::BrigEngine::MaxGroupMemorySize;
   }
 
   virtual uint32_t getMaxQueueSize() {
@@ -220,14 +425,21 @@ class SimDevice : public Device {
     return 0;
   }
 
-  virtual void *allocateGlobalMemory(size_t, size_t, hsacommon::HeapType,
-                                     uint32_t) {
-    assert(false && "Unimplemented");
-    return NULL;
+  // Large blocks are split over the device's nodes, so that a work-group
+  // indexing a buffer by its id mostly touches its own node's part. Small
+  // ones share pages with other devices' and stay where they are first
+  // touched.
+  virtual void *allocateGlobalMemory(size_t size, size_t align,
+                                     hsacommon::HeapType, uint32_t) {
+    hsa::brig::BrigAllocator &allocator = hsa::brig::BrigAllocator::get();
+    void *ptr = allocator.allocate(size, align);
+    if (ptr && hsa::brig::Topology::get().getNodeCount() > 1)
+      allocator.partition(ptr, cpus_);
+    return ptr;
   }
 
-  virtual void freeGlobalMemory(void *) {
-    assert(false && "Unimplemented");
+  virtual void freeGlobalMemory(void *ptr) {
+    hsa::brig::BrigAllocator::get().free(ptr);
   }
 
   virtual void registerMemory(void *, size_t) {
@@ -256,29 +468,599 @@ class SimDevice : public Device {
     return 0;
   }
 
-  virtual Event *createEvent() {
+  virtual Event *createEvent();
+
+  virtual Queue *createQueue(uint32_t);
+
+  // Deletes the idle engines of a module, which must not be running on the
+  // device.
+  void dropEngines(llvm::Module *M) {
+    pthread_mutex_lock(&engineLock);
+    EngineMap::iterator first = engines_.lower_bound(M);
+    EngineMap::iterator end = engines_.upper_bound(M);
+    for (EngineMap::iterator I = first; I != end; ++I)
+      delete I->second;
+    engines_.erase(first, end);
+    pthread_mutex_unlock(&engineLock);
+  }
+
+  virtual ~SimDevice() {
+    pthread_mutex_lock(&engineLock);
+    for (EngineMap::iterator I = engines_.begin(), E = engines_.end();
+         I != E; ++I)
+      delete I->second;
+    pthread_mutex_unlock(&engineLock);
+    for (unsigned i = 0; i < memoryDescriptors_.size(); ++i)
+      delete memoryDescriptors_[i];
+  }
+
+ private:
+  std::vector<unsigned> cpus_;
+  hsa::brig::BrigScheduler scheduler_;
+  hsa::brig::BrigEngine *createEngine(llvm::Module *M, uint32_t weight) {
+    pthread_mutex_lock(&engineLock);
+    hsa::brig::BrigEngine *BE = new hsa::brig::BrigEngine(M);
+    pthread_mutex_unlock(&engineLock);
+    BE->setCpus(cpus_);
+    BE->setScheduler(&scheduler_, weight);
+    return BE;
+  }
+
+  // Compiling a module takes far longer than most kernels run, so engines
+  // are kept once their launches end, along with their group segment
+  // arenas, and later launches of the module on the device take an idle
+  // one. A launch has its engine to itself, so the device keeps as many
+  // engines of a module as have run on it at the same time.
+  typedef std::multimap<llvm::Module *, hsa::brig::BrigEngine *> EngineMap;
+  EngineMap engines_;
+
+  hsa::brig::BrigEngine *acquireEngine(llvm::Module *M, uint32_t weight) {
+    pthread_mutex_lock(&engineLock);
+    EngineMap::iterator I = engines_.find(M);
+    hsa::brig::BrigEngine *BE = NULL;
+    if (I != engines_.end()) {
+      BE = I->second;
+      engines_.erase(I);
+    }
+    pthread_mutex_unlock(&engineLock);
+    if (!BE) return createEngine(M, weight);
+    BE->setScheduler(&scheduler_, weight);
+    return BE;
+  }
+
+  void releaseEngine(hsa::brig::BrigEngine *BE, llvm::Module *M) {
+    pthread_mutex_lock(&engineLock);
+    engines_.insert(std::make_pair(M, BE));
+    pthread_mutex_unlock(&engineLock);
+  }
+
+  // Replaces each run of kernels over the same grid, without group memory,
+  // with the kernel GenLLVM fuses from them, where it can. The fused kernel
+  // has a barrier if any kernel of its run has one, since a kernel in the
+  // middle of the run may read what kernels before the run write. Kernels
+  // are fused into a copy of M, and every launch is moved to the copy, which
+  // the caller deletes once its engine is gone. Returns NULL, leaving the
+  // launches as they were, if no run was fused. The caller holds
+  // engineLock.
+  static llvm::Module *fuse(llvm::Module *M,
+                            const std::vector<std::vector<void *> > &args,
+                            std::vector<hsa::brig::BrigEngine::Launch>
+                              &launches) {
+    typedef hsa::brig::BrigEngine::Launch Launch;
+    if (hsa::brig::GenLLVM::getGroupSegmentSize(M)) return NULL;
+
+    std::vector<size_t> runEnds;
+    bool candidates = false;
+    for (size_t first = 0, end; first < launches.size(); first = end) {
+      const Launch &head = launches[first];
+      for (end = first + 1; end < launches.size(); ++end) {
+        const Launch &next = launches[end];
+        if (next.blockNum != head.blockNum ||
+            next.threadNum != head.threadNum ||
+            next.dynamicGroupSize || head.dynamicGroupSize)
+          break;
+      }
+      runEnds.push_back(end);
+      candidates |= end - first > 1;
+    }
+    // Cloning copies no function bodies that are not yet read in.
+    if (!candidates || M->MaterializeAllPermanently()) return NULL;
+
+    llvm::ValueToValueMapTy VMap;
+    llvm::Module *clone = llvm::CloneModule(M, VMap);
+    std::vector<Launch> result;
+    bool fusedAny = false;
+    for (size_t run = 0, first = 0; run < runEnds.size();
+         first = runEnds[run++]) {
+      size_t end = runEnds[run];
+      const Launch &head = launches[first];
+      llvm::Function *F = NULL;
+      if (end - first > 1) {
+        std::vector<llvm::Function *> kernels;
+        for (size_t i = first; i < end; ++i)
+          kernels.push_back(getClone(VMap, launches[i].EntryFn));
+        std::vector<std::vector<void *> > kernelArgs(args.begin() + first,
+                                                     args.begin() + end);
+        F = hsa::brig::GenLLVM::fuseKernels(clone, kernels, kernelArgs,
+                                            head.blockNum * head.threadNum);
+      }
+
+      if (!F) {
+        for (size_t i = first; i < end; ++i) {
+          result.push_back(launches[i]);
+          result.back().EntryFn = getClone(VMap, launches[i].EntryFn);
+        }
+        continue;
+      }
+
+      bool barrier = false;
+      for (size_t i = first; i < end; ++i)
+        barrier |= launches[i].barrier;
+      fusedAny = true;
+      result.push_back(Launch(F, llvm::ArrayRef<void *>(), head.blockNum,
+                              head.threadNum, 0, barrier));
+    }
+
+    if (!fusedAny) {
+      delete clone;
+      return NULL;
+    }
+    launches.swap(result);
+    return clone;
+  }
+
+  static llvm::Function *getClone(llvm::ValueToValueMapTy &VMap,
+                                  llvm::Function *F) {
+    llvm::Value *clone = VMap[F];
+    return llvm::cast<llvm::Function>(clone);
+  }
+
+  MemDescriptorList memoryDescriptors_;
+};
+
+
+static uint64_t getTime() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// There is no way to signal an hsa::Event, so device events are created
+// signalled.
+class SimEvent : public Event {
+ public:
+  virtual Status wait() { return RSTATUS_SUCCESS; }
+  virtual Status wait(uint32_t) { return RSTATUS_SUCCESS; }
+};
+
+// The progress of a command through the EventState states, with the time
+// it entered each, in nanoseconds of the host's monotonic clock. A command
+// that fails still completes, and waiting on it returns why it failed.
+class SimCommandState {
+ public:
+
+  SimCommandState() : state_(STATE_INITITIATED), status_(RSTATUS_SUCCESS) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&completed_, NULL);
+    for (unsigned i = 0; i <= STATE_COMPLETED; ++i)
+      timestamps_[i] = 0;
+    timestamps_[STATE_INITITIATED] = getTime();
+  }
+
+  ~SimCommandState() {
+    pthread_cond_destroy(&completed_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  // 0xFFFFFFFF waits forever.
+  Status wait(uint32_t timeOut) {
+    pthread_mutex_lock(&lock_);
+    if (timeOut == 0xFFFFFFFF) {
+      while (state_ != STATE_COMPLETED)
+        pthread_cond_wait(&completed_, &lock_);
+    } else {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      uint64_t nsec = deadline.tv_nsec + uint64_t(timeOut % 1000) * 1000000;
+      deadline.tv_sec += timeOut / 1000 + nsec / 1000000000;
+      deadline.tv_nsec = nsec % 1000000000;
+      int err = 0;
+      while (state_ != STATE_COMPLETED && err != ETIMEDOUT)
+        err = pthread_cond_timedwait(&completed_, &lock_, &deadline);
+    }
+    Status status = state_ == STATE_COMPLETED ? status_ : RSTATUS_TIMEOUT;
+    pthread_mutex_unlock(&lock_);
+    return status;
+  }
+
+  EventState get() {
+    pthread_mutex_lock(&lock_);
+    EventState state = state_;
+    pthread_mutex_unlock(&lock_);
+    return state;
+  }
+
+  // The status only matters for STATE_COMPLETED.
+  void set(EventState state, Status status = RSTATUS_SUCCESS) {
+    pthread_mutex_lock(&lock_);
+    state_ = state;
+    status_ = status;
+    timestamps_[state] = getTime();
+    if (state == STATE_COMPLETED)
+      pthread_cond_broadcast(&completed_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  uint64_t getTimestamp(EventState state) {
+    if (state > STATE_COMPLETED) return 0;
+    pthread_mutex_lock(&lock_);
+    uint64_t timestamp = timestamps_[state];
+    pthread_mutex_unlock(&lock_);
+    return timestamp;
+  }
+
+ private:
+  pthread_mutex_t lock_;
+  pthread_cond_t completed_;
+  EventState state_;
+  Status status_;
+  uint64_t timestamps_[STATE_COMPLETED + 1];
+};
+
+// What a queue's executor runs. The queue completes a command once it no
+// longer refers to it, since the waiters may then delete it.
+class SimCommand {
+ public:
+  virtual ~SimCommand() {}
+
+  // Waits for the command's dependencies, then runs it, and returns its
+  // status. The weight is the queue's. A command cancelled before it starts
+  // does not run.
+  virtual Status execute(uint32_t weight) = 0;
+
+  void complete(Status status) { state_.set(STATE_COMPLETED, status); }
+
+  // From any thread, until the command is complete.
+  void cancel() { cancel_.cancel(); }
+
+ protected:
+  SimCommandState state_;
+  SimCancel cancel_;
+};
+
+// A dispatch keeps copies of its arguments, attributes and dependencies, as
+// the caller's may not outlive the call. Deleting the event waits for the
+// dispatch to complete. The kernel's dynamic group memory is the larger of
+// what was allocated from it and the attributes' groupMemorySize. Waiting
+// returns STATUS_INVALID_ARGUMENT if the arguments fail checkArgs,
+// STATUS_OUT_OF_RESOURCES if the group segment is too large for the device,
+// and STATUS_CANCELLED if the dispatch was cancelled before it completed.
+class SimDispatchEvent : public DispatchEvent, public SimCommand {
+ public:
+
+  SimDispatchEvent(SimDevice *device, SimKernel *kernel,
+                   const LaunchAttributes &attrs,
+                   const hsacommon::vector<Event *> &deps,
+                   const hsacommon::vector<KernelArg> &kernArgs) :
+    device_(device), kernel_(kernel),
+    dynamicGroupSize_(std::max(kernel->dynamicGroupSize_,
+                               attrs.groupMemorySize)),
+    attrs_(attrs),
+    deps_(deps), kernArgs_(kernArgs),
+    id_(__sync_fetch_and_add(&nextId_, 1)) {}
+
+  virtual ~SimDispatchEvent() { wait(); }
+
+  virtual Status wait() { return state_.wait(0xFFFFFFFF); }
+
+  virtual Status wait(uint32_t timeOut) { return state_.wait(timeOut); }
+
+  virtual EventState getState() { return state_.get(); }
+
+  // In nanoseconds of the host's monotonic clock.
+  virtual uint64_t getTimestamp(EventState state) {
+    return state_.getTimestamp(state);
+  }
+
+  virtual uint32_t getDispatchId() { return id_; }
+
+  virtual void getISA(void *&ptr, size_t &size) {
+    ptr = kernel_->getISA();
+    size = kernel_->getSizeOfISA();
+  }
+
+  virtual hsacommon::vector<KernelArg> &getKernelArguments() {
+    return kernArgs_;
+  }
+
+  virtual LaunchAttributes &getLaunchAttributes() { return attrs_; }
+
+  virtual hsacommon::vector<Event *> &getDependencies() { return deps_; }
+
+  // Runs on the queue's executor.
+  virtual Status execute(uint32_t weight) {
+    state_.set(STATE_BLOCKED);
+    for (unsigned i = 0; i < deps_.size(); ++i)
+      if (deps_[i]) deps_[i]->wait();
+    state_.set(STATE_SUBMITTED);
+    if (cancel_.isCancelled()) return STATUS_CANCELLED;
+
+    uint32_t blockNum = attrs_.grid[0] * attrs_.grid[1] * attrs_.grid[2];
+    uint32_t threadNum = attrs_.group[0] * attrs_.group[1] * attrs_.group[2];
+
+    state_.set(STATE_STARTED);
+    if (!SimDevice::checkArgs(kernel_, kernArgs_.size()))
+      return STATUS_INVALID_ARGUMENT;
+    if (device_->launch(kernel_, blockNum, threadNum, dynamicGroupSize_,
+                        kernArgs_.size() ? &kernArgs_[0] : NULL,
+                        kernArgs_.size(), weight, &cancel_))
+      return RSTATUS_SUCCESS;
+    return cancel_.isCancelled() ? STATUS_CANCELLED : STATUS_OUT_OF_RESOURCES;
+  }
+
+ private:
+
+  SimDevice *device_;
+  SimKernel *kernel_;
+  size_t dynamicGroupSize_;
+  LaunchAttributes attrs_;
+  hsacommon::vector<Event *> deps_;
+  hsacommon::vector<KernelArg> kernArgs_;
+  const uint32_t id_;
+  static uint32_t nextId_;
+};
+
+uint32_t SimDispatchEvent::nextId_;
+
+// A batch runs all of its kernels on one set of pthreads, though kernels
+// from other queues may share the device's processors with them. Deleting
+// the event waits for the batch to complete. Dynamic group memory is sized
+// as for a dispatch. Waiting returns STATUS_INVALID_ARGUMENT, and no
+// kernel runs, if the arguments of any kernel fail checkArgs. It returns
+// STATUS_OUT_OF_RESOURCES if the device refused a kernel. Neither that
+// kernel nor any kernel after it ran, and nor did the kernels before it of
+// the same program and engine. It returns STATUS_CANCELLED if the batch was
+// cancelled before it completed.
+class SimBatchEvent : public Event, public SimCommand {
+ public:
+
+  SimBatchEvent(SimDevice *device, const BatchEntry *entries,
+                uint32_t numEntries, const hsacommon::vector<Event *> &deps) :
+    device_(device), kernels_(numEntries), deps_(deps) {
+    for (uint32_t i = 0; i < numEntries; ++i) {
+      const BatchEntry &entry = entries[i];
+      const LaunchAttributes &attrs = entry.launchAttr;
+      SimDevice::BatchKernel &kernel = kernels_[i];
+      kernel.kernel = reinterpret_cast<SimKernel *>(entry.kernel);
+      kernel.blockNum = attrs.grid[0] * attrs.grid[1] * attrs.grid[2];
+      kernel.threadNum = attrs.group[0] * attrs.group[1] * attrs.group[2];
+      kernel.dynamicGroupSize = std::max(kernel.kernel->dynamicGroupSize_,
+                                         attrs.groupMemorySize);
+      for (uint32_t j = 0; j < entry.numArgs; ++j)
+        kernel.args.push_back(entry.args[j]);
+      kernel.barrier = entry.barrier;
+    }
+  }
+
+  virtual ~SimBatchEvent() { wait(); }
+
+  virtual Status wait() { return state_.wait(0xFFFFFFFF); }
+
+  virtual Status wait(uint32_t timeOut) { return state_.wait(timeOut); }
+
+  virtual Status execute(uint32_t weight) {
+    state_.set(STATE_BLOCKED);
+    for (unsigned i = 0; i < deps_.size(); ++i)
+      if (deps_[i]) deps_[i]->wait();
+    state_.set(STATE_SUBMITTED);
+    if (cancel_.isCancelled()) return STATUS_CANCELLED;
+
+    state_.set(STATE_STARTED);
+    for (unsigned i = 0; i < kernels_.size(); ++i) {
+      if (!SimDevice::checkArgs(kernels_[i].kernel, kernels_[i].args.size()))
+        return STATUS_INVALID_ARGUMENT;
+    }
+    if (device_->launch(kernels_, weight, &cancel_)) return RSTATUS_SUCCESS;
+    return cancel_.isCancelled() ? STATUS_CANCELLED : STATUS_OUT_OF_RESOURCES;
+  }
+
+ private:
+
+  SimDevice *device_;
+  std::vector<SimDevice::BatchKernel> kernels_;
+  hsacommon::vector<Event *> deps_;
+};
+
+// Dispatches return as soon as they are queued. Each queue has an executor
+// thread that runs its dispatches in order, once their dependencies, which
+// may belong to other queues, have completed.
+class SimQueue : public Queue {
+
+ public:
+
+  SimQueue(SimDevice *device) :
+    device_(device), weight_(1), running_(NULL), stop_(false) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&work_, NULL);
+    pthread_cond_init(&idle_, NULL);
+    pthread_create(&executor_, NULL, executorLoop, this);
+  }
+
+  // Runs the dispatches still in the queue before returning.
+  virtual ~SimQueue() {
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_signal(&work_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(executor_, NULL);
+    pthread_cond_destroy(&idle_);
+    pthread_cond_destroy(&work_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  virtual Device *getDevice() {
+    return device_;
+  }
+
+  virtual DispatchEvent* dispatch(Kernel *kernel,
+                                  LaunchAttributes attrs,
+                                  hsacommon::vector<Event *> &events,
+                                  uint32_t count, ...) {
+
+    hsacommon::vector<KernelArg> kernArgs;
+
+    va_list ap;
+    va_start(ap, count);
+    for (unsigned i = 0; i < count; ++i) {
+      kernArgs.push_back(va_arg(ap, KernelArg));
+    }
+    va_end(ap);
+
+    return dispatch(kernel, attrs, events, kernArgs);
+  }
+
+  virtual DispatchEvent* dispatch(Kernel *kernel,
+                                  LaunchAttributes attrs,
+                                  hsacommon::vector<Event *> &events,
+                                  hsacommon::vector<KernelArg> &kernArgs) {
+
+    SimKernel *sk = reinterpret_cast<SimKernel *>(kernel);
+    SimDispatchEvent *event =
+      new SimDispatchEvent(device_, sk, attrs, events, kernArgs);
+
+    submit(event);
+    return event;
+  }
+
+  virtual Event *dispatchBatch(const BatchEntry *entries, uint32_t numEntries,
+                               hsacommon::vector<Event *> &events) {
+    SimBatchEvent *event =
+      new SimBatchEvent(device_, entries, numEntries, events);
+    submit(event);
+    return event;
+  }
+
+  // Dispatches already running keep the weight they started with.
+  virtual void setWeight(uint32_t weight) {
+    pthread_mutex_lock(&lock_);
+    weight_ = std::max(weight, 1U);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  virtual void cancel() {
+    pthread_mutex_lock(&lock_);
+    for (unsigned i = 0; i < jobs_.size(); ++i)
+      jobs_[i]->cancel();
+    if (running_) running_->cancel();
+    pthread_mutex_unlock(&lock_);
+  }
+
+  // Waits until every dispatch queued so far has completed.
+  virtual void flush() {
+    pthread_mutex_lock(&lock_);
+    while (running_ || !jobs_.empty())
+      pthread_cond_wait(&idle_, &lock_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+ private:
+
+  void submit(SimCommand *command) {
+    pthread_mutex_lock(&lock_);
+    jobs_.push_back(command);
+    pthread_cond_signal(&work_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  static void *executorLoop(void *arg) {
+    static_cast<SimQueue *>(arg)->drain();
     return NULL;
   }
 
-  virtual Queue *createQueue(uint32_t) {
-    return new SimQueue(this);
+  void drain() {
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+      while (jobs_.empty() && !stop_)
+        pthread_cond_wait(&work_, &lock_);
+      if (jobs_.empty()) break;
+
+      running_ = jobs_.front();
+      jobs_.pop_front();
+      uint32_t weight = weight_;
+      pthread_mutex_unlock(&lock_);
+
+      Status status = running_->execute(weight);
+
+      pthread_mutex_lock(&lock_);
+      running_->complete(status);
+      running_ = NULL;
+      if (jobs_.empty())
+        pthread_cond_broadcast(&idle_);
+    }
+    pthread_mutex_unlock(&lock_);
   }
+
+  SimDevice *device_;
+  uint32_t weight_;
+
+  pthread_mutex_t lock_;
+  pthread_cond_t work_;
+  pthread_cond_t idle_;
+  std::deque<SimCommand *> jobs_;
+  // The command the executor is running, which cancel reaches too.
+  SimCommand *running_;
+  bool stop_;
+  pthread_t executor_;
 };
 
+Event *SimDevice::createEvent() {
+  return new SimEvent();
+}
+
+Queue *SimDevice::createQueue(uint32_t) {
+  return new SimQueue(this);
+}
+
 class SimRuntimeApi : public RuntimeApi {
  public:
 
+  // The SIMDEVICES environment variable sets the number of devices, one by
+  // default. The host's processors are split between them in node order, so
+  // that each device's share spans as few nodes as it can. Devices beyond
+  // the number of processors share one.
   SimRuntimeApi() {
-    if (!devices.size())
-      devices.push_back(new SimDevice());
+    if (devices.size()) return;
+
+    unsigned count = 1;
+    if (const char *env = getenv("SIMDEVICES"))
+      count = std::max(atoi(env), 1);
+
+    const std::vector<unsigned> &cpus = hsa::brig::Topology::get().getCpus();
+    for (unsigned i = 0; i < count; ++i) {
+      std::vector<unsigned> share(cpus.begin() + i * cpus.size() / count,
+                                  cpus.begin() + (i + 1) * cpus.size() / count);
+      if (share.empty()) share.push_back(cpus[i % cpus.size()]);
+      devices.push_back(new SimDevice(share));
+    }
   }
 
   ~SimRuntimeApi() {
     for (unsigned i = 0; i < devices.size(); ++i)
       delete devices[i];
+    devices.clear();
+  }
+
+  // Drops the engines every device keeps for a module.
+  static void dropEngines(llvm::Module *M) {
+    for (unsigned i = 0; i < devices.size(); ++i)
+      static_cast<SimDevice *>(devices[i])->dropEngines(M);
+  }
+
+  static SimDevice *getDefaultDevice() {
+    return devices.size() ? static_cast<SimDevice *>(devices[0]) : NULL;
   }
 
-  virtual uint32_t getDeviceCount() { return 1U; }
+  virtual uint32_t getDeviceCount() { return devices.size(); }
 
   virtual const DeviceList &getDevices() { return devices; }
 
@@ -309,18 +1091,15 @@ class SimRuntimeApi : public RuntimeApi {
   virtual const string &getVersion() { return version; }
 
   virtual Event *createDeviceEvent(Device *) {
-    return NULL;
+    return new SimEvent();
   }
 
   virtual void *allocateGlobalMemory(size_t size, size_t align) {
-    void *memptr;
-    if (posix_memalign(&memptr, std::max(sizeof(void *), align), size))
-      return NULL;
-    return memptr;
+    return hsa::brig::BrigAllocator::get().allocate(size, align);
   }
 
   virtual void freeGlobalMemory(void *ptr) {
-    free(ptr);
+    hsa::brig::BrigAllocator::get().free(ptr);
   }
 
  private:
@@ -331,8 +1110,25 @@ class SimRuntimeApi : public RuntimeApi {
 DeviceList SimRuntimeApi::devices;
 string SimRuntimeApi::version;
 
+SimProgram::~SimProgram() {
+  SimRuntimeApi::dropEngines(BP_.M.get());
+}
+
 RuntimeApi *getRuntime() {
   return new SimRuntimeApi();
 }
 
+bool runKernel(Device *device, Kernel *kernel, uint32_t groupCount,
+               uint32_t groupSize, size_t dynamicGroupSize, KernelArg *args,
+               uint32_t argCount, uint32_t weight) {
+  SimDevice *sd = device ? static_cast<SimDevice *>(device) :
+    SimRuntimeApi::getDefaultDevice();
+  // Kernels come from a runtime, so there is always a device.
+  assert(sd && "No runtime");
+  SimKernel *sk = reinterpret_cast<SimKernel *>(kernel);
+  if (!SimDevice::checkArgs(sk, argCount)) return false;
+  return sd->launch(sk, groupCount, groupSize, dynamicGroupSize, args,
+                    argCount, weight, NULL);
+}
+
 }  // namespace hsa
@@ -0,0 +1,164 @@
+//===- brig_native_math.cc ------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Reports the accuracy and throughput of the fast native math functions
+// against the exact libm based ones. Accuracy is measured in ulps against a
+// double precision reference over every step-th f32 bit pattern in the
+// domain the fast path handles.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_runtime.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <sys/time.h>
+
+extern "C" f32 Ncos_f32(f32);
+extern "C" f32 Nsin_f32(f32);
+extern "C" f32 Nlog2_f32(f32);
+extern "C" f32 Nexp2_f32(f32);
+extern "C" f32 Nrsqrt_f32(f32);
+extern "C" f32 Nrcp_f32(f32);
+extern "C" f32 NcosFast_f32(f32);
+extern "C" f32 NsinFast_f32(f32);
+extern "C" f32 Nlog2Fast_f32(f32);
+extern "C" f32 Nexp2Fast_f32(f32);
+extern "C" f32 NrsqrtFast_f32(f32);
+extern "C" f32 NrcpFast_f32(f32);
+
+static f64 rsqrt(f64 x) { return 1.0 / std::sqrt(x); }
+static f64 rcp(f64 x) { return 1.0 / x; }
+
+static f64 cosine(f64 x) { return std::cos(x); }
+static f64 sine(f64 x) { return std::sin(x); }
+
+static bool trigDomain(f32 x) { return std::fabs(x) <= 512 * M_PI; }
+static bool exp2Domain(f32 x) { return x > 0 && x < 128; }
+static bool logDomain(f32 x) { return x > 0; }
+static bool rcpDomain(f32 x) { return std::fabs(x) < std::ldexp(1.0f, 126); }
+
+struct NativeFunction {
+  const char *name;
+  f32 (*exact)(f32);
+  f32 (*fast)(f32);
+  f64 (*reference)(f64);
+  bool (*domain)(f32);
+};
+
+static const NativeFunction functions[] = {
+  { "ncos",   Ncos_f32,   NcosFast_f32,   cosine, trigDomain },
+  { "nsin",   Nsin_f32,   NsinFast_f32,   sine,   trigDomain },
+  { "nlog2",  Nlog2_f32,  Nlog2Fast_f32,  log2,   logDomain  },
+  { "nexp2",  Nexp2_f32,  Nexp2Fast_f32,  exp2,   exp2Domain },
+  { "nrsqrt", Nrsqrt_f32, NrsqrtFast_f32, rsqrt,  logDomain  },
+  { "nrcp",   Nrcp_f32,   NrcpFast_f32,   rcp,    rcpDomain  }
+};
+
+static f32 fromBits(b32 b) {
+  union { b32 b; f32 f; } Conv = { b };
+  return Conv.f;
+}
+
+// The spacing of floats at the magnitude of x.
+static f64 ulp(f64 x) {
+  int exp;
+  std::frexp(x, &exp);
+  return std::ldexp(1.0, std::max(exp, -125) - 24);
+}
+
+static f64 now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static f64 nsPerCall(f32 (*fn)(f32), const std::vector<f32> &inputs,
+                     unsigned repeat) {
+  volatile f32 sink = 0;
+  f64 start = now();
+  for (unsigned r = 0; r < repeat; ++r)
+    for (unsigned i = 0; i < inputs.size(); ++i)
+      sink += fn(inputs[i]);
+  return (now() - start) * 1e9 / (f64(repeat) * inputs.size());
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-step=<n>] [function]...\n", prog);
+}
+
+int main(int argc, char **argv) {
+
+  unsigned step = 61;
+  std::vector<const char *> selected;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strncmp(argv[i], "-step=", 6) && atoi(argv[i] + 6) > 0) {
+      step = atoi(argv[i] + 6);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      selected.push_back(argv[i]);
+    }
+  }
+
+  printf("%-8s %12s %10s %14s %12s %10s %10s\n", "function", "samples",
+         "max ulp", "at", "mean ulp", "exact ns", "fast ns");
+
+  const unsigned numFunctions = sizeof(functions) / sizeof(functions[0]);
+  for (unsigned f = 0; f < numFunctions; ++f) {
+    const NativeFunction &fn = functions[f];
+
+    bool wanted = selected.empty();
+    for (unsigned i = 0; i < selected.size(); ++i)
+      wanted |= !strcmp(selected[i], fn.name);
+    if (!wanted) continue;
+
+    unsigned long long samples = 0;
+    f64 maxUlp = 0;
+    f64 sumUlp = 0;
+    f32 worst = 0;
+    std::vector<f32> bench;
+
+    for (unsigned long long b = 0; b <= 0xFFFFFFFFULL; b += step) {
+      f32 x = fromBits(b32(b));
+      if (std::fpclassify(x) != FP_NORMAL || !fn.domain(x)) continue;
+
+      f64 expected = fn.reference(x);
+      if (!std::isfinite(expected) || std::fabs(expected) > FLT_MAX)
+        continue;
+
+      f64 err = std::fabs(fn.fast(x) - expected) / ulp(expected);
+      ++samples;
+      sumUlp += err;
+      if (err > maxUlp) {
+        maxUlp = err;
+        worst = x;
+      }
+      if (samples % 8191 == 0) bench.push_back(x);
+    }
+
+    if (bench.empty()) continue;
+
+    unsigned repeat = 1000;
+    printf("%-8s %12llu %10.2f %14.6g %12.4f %10.2f %10.2f\n", fn.name,
+           samples, maxUlp, worst, samples ? sumUlp / samples : 0.0,
+           nsPerCall(fn.exact, bench, repeat),
+           nsPerCall(fn.fast, bench, repeat));
+  }
+
+  return 0;
+}
@@ -0,0 +1,296 @@
+//===- brig_pack.cc -------------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "brig_archive.h"
+#include "brig_function.h"
+#include "brig_module.h"
+#include "brig_reader.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+using hsa::brig::BrigArchiveHeader;
+using hsa::brig::BrigArchiveKernel;
+using hsa::brig::BrigArchiveMember;
+
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [-z] -o <archive> <input.o>...\n";
+}
+
+static uint64_t alignUp(uint64_t offset) {
+  const uint64_t align = BrigArchiveHeader::Alignment;
+  return (offset + align - 1) / align * align;
+}
+
+// Compresses a section in the format BrigReader expects of .zbrig_*
+// sections: "ZLIB", the uncompressed size as a 64-bit big endian integer,
+// then the zlib stream.
+static bool compressSection(llvm::StringRef section, std::string &result) {
+  uLongf size = compressBound(section.size());
+  std::vector<Bytef> buffer(size);
+  if (compress2(&buffer[0], &size, (const Bytef *) section.data(),
+                section.size(), Z_BEST_COMPRESSION) != Z_OK)
+    return false;
+
+  result.assign("ZLIB");
+  for (int shift = 56; shift >= 0; shift -= 8)
+    result += char(uint64_t(section.size()) >> shift);
+  result.append((const char *) &buffer[0], size);
+  return true;
+}
+
+// Appends an uncompressed section to an ELF object being built.
+static void appendSection(const std::string &name, llvm::StringRef contents,
+                          std::string &shstrtab,
+                          std::vector<Elf64_Shdr> &headers,
+                          std::string &result) {
+  Elf64_Shdr header;
+  memset(&header, 0, sizeof(header));
+  header.sh_name = shstrtab.size();
+  header.sh_type = SHT_PROGBITS;
+  header.sh_offset = alignUp(result.size());
+  header.sh_size = contents.size();
+  header.sh_addralign = 1;
+  headers.push_back(header);
+
+  shstrtab += name;
+  shstrtab += '\0';
+  result.resize(header.sh_offset, '\0');
+  result += contents;
+}
+
+// Rewrites a BRIG object as a minimal ELF64 object whose non-empty sections
+// are compressed. A validation stamp is kept, uncompressed, since it still
+// matches the decompressed sections.
+static bool compressObject(const hsa::brig::BrigReader &reader,
+                           std::string &result) {
+  const char *names[] = {
+    "directives", "code", "operands", "debug", "strtab"
+  };
+  const llvm::StringRef *sections[] = {
+    &reader.getDirectives(), &reader.getCode(), &reader.getOperands(),
+    &reader.getDebug(), &reader.getStrings()
+  };
+  const unsigned numSections = sizeof(names) / sizeof(names[0]);
+
+  std::string shstrtab(1, '\0');
+  std::vector<Elf64_Shdr> headers(1);
+  memset(&headers[0], 0, sizeof(Elf64_Shdr));
+
+  result.assign(sizeof(Elf64_Ehdr), '\0');
+  for (unsigned i = 0; i < numSections; ++i) {
+    if (sections[i]->empty()) continue;
+
+    std::string contents;
+    if (!compressSection(*sections[i], contents)) return false;
+    appendSection(std::string(".zbrig_") + names[i], contents, shstrtab,
+                  headers, result);
+  }
+
+  if (reader.hasValidationStamp()) {
+    uint32_t stamp = reader.getChecksum();
+    appendSection(".brig_validated",
+                  llvm::StringRef((const char *) &stamp, sizeof(stamp)),
+                  shstrtab, headers, result);
+  }
+
+  Elf64_Shdr strtab;
+  memset(&strtab, 0, sizeof(strtab));
+  strtab.sh_name = shstrtab.size();
+  shstrtab += ".shstrtab";
+  shstrtab += '\0';
+  strtab.sh_type = SHT_STRTAB;
+  strtab.sh_offset = result.size();
+  strtab.sh_size = shstrtab.size();
+  strtab.sh_addralign = 1;
+  headers.push_back(strtab);
+  result += shstrtab;
+
+  Elf64_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_REL;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = headers.size();
+  ehdr.e_shstrndx = headers.size() - 1;
+  ehdr.e_shoff = alignUp(result.size());
+  memcpy(&result[0], &ehdr, sizeof(ehdr));
+
+  result.resize(ehdr.e_shoff, '\0');
+  result.append((const char *) &headers[0],
+                headers.size() * sizeof(Elf64_Shdr));
+  return true;
+}
+
+static std::string baseName(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+int main(int argc, char **argv) {
+
+  const char *output = NULL;
+  bool compress = false;
+  std::vector<const char *> inputs;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (!strcmp(argv[i], "-z")) {
+      compress = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+
+  if (!output || inputs.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> contents;
+  std::string names(1, '\0');
+  std::vector<BrigArchiveMember> members;
+  std::map<std::string, uint32_t> kernels;
+
+  for (unsigned i = 0; i < inputs.size(); ++i) {
+    llvm::OwningPtr<llvm::MemoryBuffer> file;
+    if (llvm::MemoryBuffer::getFile(inputs[i], file)) {
+      std::cerr << argv[0] << ": File not found: " << inputs[i] << "\n";
+      return 1;
+    }
+
+    hsa::brig::BrigReader *reader =
+      hsa::brig::BrigReader::createBrigReader(file->getBufferStart(),
+                                              file->getBufferSize());
+    if (!reader) {
+      std::cerr << argv[0] << ": Not a BRIG file: " << inputs[i] << "\n";
+      return 1;
+    }
+
+    hsa::brig::BrigModule mod(*reader, &llvm::errs());
+    if (!mod.isValid()) {
+      std::cerr << argv[0] << ": Input is invalid: " << inputs[i] << "\n";
+      delete reader;
+      return 1;
+    }
+
+    for (hsa::brig::BrigFunction fun = mod.begin(), E = mod.end();
+         fun != E; ++fun) {
+      if (!fun.isKernel() || fun.isDeclaration()) continue;
+
+      const BrigString *str = fun.getName();
+      std::string name((const char *) str->bytes, str->byteCount);
+      if (!name.empty() && name[0] == '&') name.erase(0, 1);
+
+      if (!kernels.insert(std::make_pair(name, i)).second) {
+        std::cerr << argv[0] << ": Duplicate kernel " << name << " in "
+                  << inputs[i] << "\n";
+        delete reader;
+        return 1;
+      }
+    }
+
+    std::string content = file->getBuffer().str();
+    if (compress && !compressObject(*reader, content)) {
+      std::cerr << argv[0] << ": Cannot compress " << inputs[i] << "\n";
+      delete reader;
+      return 1;
+    }
+
+    delete reader;
+
+    BrigArchiveMember member;
+    memset(&member, 0, sizeof(member));
+    member.size = content.size();
+    member.name = names.size();
+    members.push_back(member);
+
+    names += baseName(inputs[i]);
+    names += '\0';
+    contents.push_back(content);
+  }
+
+  // std::map iterates in strcmp order, which is the order
+  // BrigArchive::findKernel expects.
+  std::vector<BrigArchiveKernel> kernelTable;
+  typedef std::map<std::string, uint32_t>::const_iterator KernelIt;
+  for (KernelIt it = kernels.begin(), E = kernels.end(); it != E; ++it) {
+    BrigArchiveKernel kernel;
+    kernel.name = names.size();
+    kernel.member = it->second;
+    kernelTable.push_back(kernel);
+    names += it->first;
+    names += '\0';
+  }
+
+  BrigArchiveHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, hsa::brig::BrigArchiveMagic, sizeof(header.magic));
+  header.version = BrigArchiveHeader::Version;
+  header.memberCount = members.size();
+  header.kernelCount = kernelTable.size();
+  header.namesOffset = sizeof(header) +
+    members.size() * sizeof(BrigArchiveMember) +
+    kernelTable.size() * sizeof(BrigArchiveKernel);
+  header.namesSize = names.size();
+
+  uint64_t offset = alignUp(uint64_t(header.namesOffset) + header.namesSize);
+  for (unsigned i = 0; i < members.size(); ++i) {
+    members[i].offset = offset;
+    offset = alignUp(offset + members[i].size);
+  }
+
+  std::ofstream out(output, std::ios::binary);
+  if (!out) {
+    std::cerr << argv[0] << ": Cannot write " << output << "\n";
+    return 1;
+  }
+
+  out.write((const char *) &header, sizeof(header));
+  out.write((const char *) &members[0],
+            members.size() * sizeof(BrigArchiveMember));
+  if (!kernelTable.empty())
+    out.write((const char *) &kernelTable[0],
+              kernelTable.size() * sizeof(BrigArchiveKernel));
+  out.write(names.data(), names.size());
+
+  uint64_t written = uint64_t(header.namesOffset) + header.namesSize;
+  for (unsigned i = 0; i < members.size(); ++i) {
+    std::string padding(members[i].offset - written, '\0');
+    out.write(padding.data(), padding.size());
+    out.write(contents[i].data(), contents[i].size());
+    written = members[i].offset + members[i].size;
+  }
+
+  if (!out) {
+    std::cerr << argv[0] << ": Cannot write " << output << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -7,7 +7,10 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "brig_archive.h"
+#include "brig_control_block.h"
 #include "brig_engine.h"
+#include "brig_function.h"
 #include "brig_llvm.h"
 #include "brig_module.h"
 #include "brig_reader.h"
@@ -15,6 +18,7 @@
 #include "hsailasm_wrapper.h"
 
 #include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/MemoryBuffer.h"
@@ -23,14 +27,22 @@
 #include "gtest/gtest.h"
 
 #include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <elf.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #define STR(X) #X
 #define XSTR(X) STR(X)
 
 using hsa::brig::BrigReader;
 
-hsa::brig::BrigProgram TestHSAIL(const std::string &source) {
-
+static BrigReader *AssembleHSAIL(const std::string &source) {
 
   int result_fd;
   llvm::SmallString<128> resultPath;
@@ -53,6 +65,17 @@ hsa::brig::BrigProgram TestHSAIL(const std::string &source) {
   BrigReader *reader =
     BrigReader::createBrigReader(resultPath.c_str());
   EXPECT_TRUE(reader);
+
+  bool existed;
+  llvm::sys::fs::remove(resultPath.c_str(), existed);
+  EXPECT_TRUE(existed);
+
+  return reader;
+}
+
+hsa::brig::BrigProgram TestHSAIL(const std::string &source) {
+
+  BrigReader *reader = AssembleHSAIL(source);
   if (!reader) return NULL;
 
   hsa::brig::BrigModule mod(*reader, &llvm::errs());
@@ -64,10 +87,6 @@ hsa::brig::BrigProgram TestHSAIL(const std::string &source) {
 
   delete reader;
 
-  bool existed;
-  llvm::sys::fs::remove(resultPath.c_str(), existed);
-  EXPECT_TRUE(existed);
-
   return BP;
 }
 
@@ -131,6 +150,163 @@ TEST(BrigKernelTest, Cosine) {
   delete arg_val0;
 }
 
+TEST(BrigKernelTest, MixedKernargs) {
+  hsa::brig::BrigProgram BP = TestHSAIL(
+    "version 0:96:$full:$large;\n"
+    "kernel &mixed(kernarg_u32 %a, kernarg_f64 %b, kernarg_u64 %out)\n"
+    "{\n"
+    "  ld_kernarg_u32 $s0, [%a];\n"
+    "  ld_kernarg_f64 $d1, [%b];\n"
+    "  ld_kernarg_u64 $d2, [%out];\n"
+    "  st_global_u32 $s0, [$d2];\n"
+    "  add_u64 $d3, $d2, 8;\n"
+    "  st_global_f64 $d1, [$d3];\n"
+    "  ret;\n"
+    "};\n"
+    );
+
+  EXPECT_TRUE(BP);
+  if (!BP) return;
+
+  llvm::Function *fun = BP->getFunction("mixed");
+  std::vector<uint64_t> offsets, sizes;
+  EXPECT_EQ(24U, hsa::brig::GenLLVM::getKernargLayout(fun, offsets, sizes));
+  ASSERT_EQ(3U, offsets.size());
+  EXPECT_EQ(0U, offsets[0]);
+  EXPECT_EQ(8U, offsets[1]);
+  EXPECT_EQ(16U, offsets[2]);
+  EXPECT_EQ(4U, sizes[0]);
+  EXPECT_EQ(8U, sizes[1]);
+  EXPECT_EQ(8U, sizes[2]);
+
+  uint64_t out[2] = { 0, 0 };
+  uint32_t a = 42;
+  double b = 2.5;
+  uint64_t *outPtr = out;
+  void *args[] = { &a, &b, &outPtr };
+  hsa::brig::BrigEngine BE(BP);
+  EXPECT_TRUE(BE.launch(fun, args));
+
+  EXPECT_EQ(42U, uint32_t(out[0]));
+  double result;
+  memcpy(&result, &out[1], sizeof(result));
+  EXPECT_EQ(2.5, result);
+}
+
+// Only pure math is marked as not accessing memory once fused. Work-item
+// queries read the work-item's state.
+TEST(BrigKernelTest, FusedCallAttributes) {
+  hsa::brig::BrigProgram BP = TestHSAIL(
+    "version 0:96:$full:$large;\n"
+    "kernel &cosine(kernarg_u64 %in, kernarg_u64 %out)\n"
+    "{\n"
+    "  workitemabsid_u32 $s0, 0;\n"
+    "  cvt_u64_u32 $d0, $s0;\n"
+    "  shl_u64 $d0, $d0, 2;\n"
+    "  ld_kernarg_u64 $d1, [%in];\n"
+    "  add_u64 $d1, $d1, $d0;\n"
+    "  ld_global_f32 $s1, [$d1];\n"
+    "  ncos_f32 $s1, $s1;\n"
+    "  ld_kernarg_u64 $d2, [%out];\n"
+    "  add_u64 $d2, $d2, $d0;\n"
+    "  st_global_f32 $s1, [$d2];\n"
+    "  ret;\n"
+    "};\n"
+    );
+
+  EXPECT_TRUE(BP);
+  if (!BP) return;
+
+  float in[4] = { 0, 0, 0, 0 }, out[4];
+  float *inPtr = in, *outPtr = out;
+  std::vector<void *> args;
+  args.push_back(&inPtr);
+  args.push_back(&outPtr);
+  std::vector<std::vector<void *> > kernelArgs(2, args);
+  kernelArgs[1][0] = &outPtr;
+  llvm::Function *fun = BP->getFunction("cosine");
+  std::vector<llvm::Function *> kernels(2, fun);
+  llvm::Function *F =
+    hsa::brig::GenLLVM::fuseKernels(BP.M.get(), kernels, kernelArgs, 4);
+  ASSERT_TRUE(F);
+
+  unsigned queries = 0, cosines = 0;
+  for (llvm::Function::iterator B = F->begin(), BEnd = F->end(); B != BEnd;
+       ++B) {
+    for (llvm::BasicBlock::iterator I = B->begin(), E = B->end(); I != E;
+         ++I) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      if (!call || !call->getCalledFunction()) continue;
+      llvm::StringRef name = call->getCalledFunction()->getName();
+      if (name == "WorkItemAbsId_u32") {
+        ++queries;
+        EXPECT_TRUE(call->onlyReadsMemory());
+        EXPECT_FALSE(call->doesNotAccessMemory());
+      } else if (name == "Ncos_f32") {
+        ++cosines;
+        EXPECT_TRUE(call->doesNotAccessMemory());
+      }
+    }
+  }
+  EXPECT_EQ(1U, queries);
+  EXPECT_LE(1U, cosines);
+  hsa::brig::GenLLVM::eraseFusedKernel(F);
+}
+
+struct CancelInfo {
+  hsa::brig::BrigEngine *engine;
+  const uint32_t *started;
+};
+
+// Cancels once, after a work-item has stored to started, so the launch is
+// known to be running.
+static void *CancelOnceStarted(void *arg) {
+  CancelInfo *info = static_cast<CancelInfo *>(arg);
+  while (!__atomic_load_n(info->started, __ATOMIC_ACQUIRE))
+    sched_yield();
+  info->engine->cancel();
+  return NULL;
+}
+
+// Under SIMYIELD, a kernel that never ends stops at a yield point once its
+// launch is cancelled.
+TEST(BrigKernelTest, CancelAtYieldPoint) {
+  setenv("SIMYIELD", "1", 1);
+  hsa::brig::BrigProgram BP = TestHSAIL(
+    "version 0:96:$full:$large;\n"
+    "kernel &spin(kernarg_u64 %out)\n"
+    "{\n"
+    "  ld_kernarg_u64 $d1, [%out];\n"
+    "  mov_b32 $s0, 0;\n"
+    "@LOOP:\n"
+    "  add_u32 $s0, $s0, 1;\n"
+    "  st_global_u32 $s0, [$d1];\n"
+    "  brn @LOOP;\n"
+    "};\n"
+    );
+  unsetenv("SIMYIELD");
+
+  EXPECT_TRUE(BP);
+  if (!BP) return;
+
+  uint32_t out = 0;
+  uint32_t *outPtr = &out;
+  void *args[] = { &outPtr };
+  hsa::brig::BrigEngine BE(BP);
+  CancelInfo info = { &BE, &out };
+  pthread_t tid;
+  pthread_create(&tid, NULL, CancelOnceStarted, &info);
+  EXPECT_FALSE(BE.launch(BP->getFunction("spin"), args, 4, 8));
+  pthread_join(tid, NULL);
+
+  EXPECT_NE(0U, out);
+  EXPECT_EQ(0U, __brigYieldFlag);
+
+  // The engine stays cancelled until it is resumed.
+  EXPECT_FALSE(BE.launch(BP->getFunction("spin"), args, 4, 8));
+  BE.resume();
+}
+
 TEST(BrigKernelTest, Fib) {
   hsa::brig::BrigProgram BP = TestHSAIL(
     "version 0:96:$full:$small;\n"
@@ -5373,6 +5549,62 @@ TEST(BrigInstTest, Barrier) {
       BE.launch(fun, args, blocks, threads);
 }
 
+TEST(BrigInstTest, GroupSegment) {
+  hsa::brig::BrigProgram BP = TestHSAIL(
+    "version 0:96:$full:$large;\n"
+    "\n"
+    "group_u32 &total;\n"
+    "\n"
+    "kernel &GroupTest(kernarg_u64 %out)\n"
+    "{\n"
+    "        group_u32 %loc[16];\n"
+    "        workitemabsid_u32 $s0, 0;\n"
+    "        workgroupsize_u32 $s1, 0;\n"
+    "        rem_u32 $s2, $s0, $s1;\n"
+    "        shl_u32 $s3, $s2, 2;\n"
+    "        st_group_u32 $s0, [%loc][$s3];\n"
+    "        barrier;\n"
+    "        mov_b32 $s4, 0;\n"
+    "        mov_b32 $s5, 0;\n"
+    "        shl_u32 $s6, $s1, 2;\n"
+    "@loop:\n"
+    "        ld_group_u32 $s7, [%loc][$s5];\n"
+    "        add_u32 $s4, $s4, $s7;\n"
+    "        add_u32 $s5, $s5, 4;\n"
+    "        cmp_lt_b1_u32 $c0, $s5, $s6;\n"
+    "        cbr $c0, @loop;\n"
+    "        st_group_u32 $s4, [&total];\n"
+    "        barrier;\n"
+    "        ld_group_u32 $s4, [&total];\n"
+    "        cvt_u64_u32 $d0, $s0;\n"
+    "        shl_u64 $d0, $d0, 2;\n"
+    "        ld_kernarg_u64 $d1, [%out];\n"
+    "        add_u64 $d1, $d1, $d0;\n"
+    "        st_global_u32 $s4, [$d1];\n"
+    "        ret;\n"
+    "};\n");
+  EXPECT_TRUE(BP);
+  if (!BP) return;
+
+  EXPECT_EQ(4 + 16 * 4U, hsa::brig::GenLLVM::getGroupSegmentSize(BP.M.get()));
+
+  hsa::brig::BrigEngine BE(BP);
+  llvm::Function *fun = BP->getFunction("GroupTest");
+  const unsigned blocks = 5, threads = 16;
+  unsigned *out = new unsigned[blocks * threads];
+  void *args[] = { &out };
+  EXPECT_TRUE(BE.launch(fun, args, blocks, threads));
+  for (unsigned i = 0; i < blocks * threads; ++i) {
+    unsigned first = i / threads * threads;
+    EXPECT_EQ(threads * first + threads * (threads - 1) / 2, out[i]);
+  }
+
+  // Group variables and dynamic group memory must fit the segment.
+  EXPECT_FALSE(BE.launch(fun, args, blocks, threads,
+                         hsa::brig::BrigEngine::MaxGroupMemorySize));
+  delete[] out;
+}
+
 TEST(BrigInstTest, Sync) {
   hsa::brig::BrigProgram BP = TestHSAIL(
     "version 0:96:$full:$large;\n"
@@ -7094,3 +7326,517 @@ TEST(DebugTest, Square) {
   delete in;
   delete out;
 }
+
+TEST(ValidationTest, Levels) {
+  const char filename[] = XSTR(BIN_PATH) "/square.o";
+  BrigReader *reader = BrigReader::createBrigReader(filename);
+  EXPECT_TRUE(reader);
+  if (!reader) return;
+  EXPECT_FALSE(reader->hasValidationStamp());
+
+  typedef hsa::brig::BrigModule BrigModule;
+  BrigModule none(*reader, &llvm::errs(), BrigModule::NoValidation);
+  EXPECT_TRUE(none.isValid());
+  EXPECT_EQ(BrigModule::NoValidation, none.getValidationLevel());
+
+  BrigModule structural(*reader, &llvm::errs(),
+                        BrigModule::StructuralValidation);
+  EXPECT_TRUE(structural.isValid());
+  EXPECT_EQ(BrigModule::StructuralValidation,
+            structural.getValidationLevel());
+
+  BrigModule full(*reader, &llvm::errs(), BrigModule::FullValidation);
+  EXPECT_TRUE(full.isValid());
+  EXPECT_EQ(BrigModule::FullValidation, full.getValidationLevel());
+
+  hsa::brig::BrigProgram BP = hsa::brig::GenLLVM::getLLVMModule(structural);
+  EXPECT_TRUE(BP);
+
+  delete reader;
+}
+
+// Copies square.o into buffer, so that tests can corrupt the sections of a
+// reader created over it.
+static bool ReadSquare(std::vector<char> &buffer) {
+  const char filename[] = XSTR(BIN_PATH) "/square.o";
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  EXPECT_FALSE(llvm::MemoryBuffer::getFile(filename, file));
+  if (!file) return false;
+  buffer.assign(file->getBufferStart(), file->getBufferEnd());
+  return true;
+}
+
+// Compresses a section the way brig_pack -z does.
+static std::string CompressSection(llvm::StringRef section) {
+  uLongf size = compressBound(section.size());
+  std::vector<Bytef> buffer(size);
+  EXPECT_EQ(Z_OK, compress2(&buffer[0], &size, (const Bytef *) section.data(),
+                            section.size(), Z_BEST_COMPRESSION));
+
+  std::string result("ZLIB");
+  for (int shift = 56; shift >= 0; shift -= 8)
+    result += char(uint64_t(section.size()) >> shift);
+  result.append((const char *) &buffer[0], size);
+  return result;
+}
+
+// Writes the BRIG sections of reader as a minimal ELF64 object, optionally
+// compressed as .zbrig_* sections and optionally stamped with an
+// uncompressed .brig_validated section.
+static std::string WriteBrigObject(const BrigReader &reader,
+                                   const uint32_t *stamp,
+                                   bool compress = false) {
+  const char *names[] = {
+    ".brig_directives", ".brig_code", ".brig_operands", ".brig_strtab",
+    ".brig_validated"
+  };
+  llvm::StringRef sections[] = {
+    reader.getDirectives(), reader.getCode(), reader.getOperands(),
+    reader.getStrings(),
+    llvm::StringRef((const char *) stamp, stamp ? sizeof(*stamp) : 0)
+  };
+  const unsigned numSections = sizeof(names) / sizeof(names[0]);
+
+  std::string shstrtab(1, '\0');
+  std::vector<Elf64_Shdr> headers(1);
+  memset(&headers[0], 0, sizeof(Elf64_Shdr));
+
+  std::string result(sizeof(Elf64_Ehdr), '\0');
+  for (unsigned i = 0; i <= numSections; ++i) {
+    bool isStrtab = i == numSections;
+    bool isStamp = i == numSections - 1;
+    if (!isStrtab && sections[i].empty()) continue;
+
+    std::string compressed;
+    Elf64_Shdr header;
+    memset(&header, 0, sizeof(header));
+    header.sh_name = shstrtab.size();
+    if (compress && !isStrtab && !isStamp) {
+      compressed = CompressSection(sections[i]);
+      shstrtab += std::string(".zbrig_") + (names[i] + strlen(".brig_"));
+    } else {
+      shstrtab += isStrtab ? ".shstrtab" : names[i];
+    }
+    shstrtab += '\0';
+    llvm::StringRef contents = isStrtab ? llvm::StringRef(shstrtab) :
+      !compressed.empty() ? llvm::StringRef(compressed) : sections[i];
+
+    header.sh_type = isStrtab ? SHT_STRTAB : SHT_PROGBITS;
+    header.sh_offset = (result.size() + 15) / 16 * 16;
+    header.sh_size = contents.size();
+    header.sh_addralign = 1;
+    headers.push_back(header);
+    result.resize(header.sh_offset, '\0');
+    result += contents;
+  }
+
+  Elf64_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_REL;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = headers.size();
+  ehdr.e_shstrndx = headers.size() - 1;
+  ehdr.e_shoff = (result.size() + 15) / 16 * 16;
+  memcpy(&result[0], &ehdr, sizeof(ehdr));
+
+  result.resize(ehdr.e_shoff, '\0');
+  result.append((const char *) &headers[0],
+                headers.size() * sizeof(Elf64_Shdr));
+  return result;
+}
+
+TEST(ValidationTest, UnknownKind) {
+  std::vector<char> buffer;
+  if (!ReadSquare(buffer)) return;
+  BrigReader *reader = BrigReader::createBrigReader(&buffer[0],
+                                                    buffer.size());
+  EXPECT_TRUE(reader);
+  if (!reader) return;
+
+  typedef hsa::brig::BrigModule BrigModule;
+  char *directives = const_cast<char *>(reader->getDirectives().data());
+  BrigDirectiveBase *dir =
+    (BrigDirectiveBase *) (directives + hsa::brig::BrigSections::HeaderSize);
+  dir->kind = 21;  // Not assigned to any directive
+
+  BrigModule structural(*reader, NULL, BrigModule::StructuralValidation);
+  EXPECT_FALSE(structural.isValid());
+  BrigModule full(*reader, NULL, BrigModule::FullValidation);
+  EXPECT_FALSE(full.isValid());
+
+  char *code = const_cast<char *>(reader->getCode().data());
+  BrigInstBase *inst =
+    (BrigInstBase *) (code + hsa::brig::BrigSections::HeaderSize);
+  dir->kind = BRIG_DIRECTIVE_VERSION;
+  inst->kind = BRIG_INST_SOURCE_TYPE + 1;
+
+  BrigModule badInst(*reader, NULL, BrigModule::StructuralValidation);
+  EXPECT_FALSE(badInst.isValid());
+
+  delete reader;
+}
+
+TEST(ValidationTest, Truncated) {
+  std::vector<char> buffer;
+  if (!ReadSquare(buffer)) return;
+  BrigReader *reader = BrigReader::createBrigReader(&buffer[0],
+                                                    buffer.size());
+  EXPECT_TRUE(reader);
+  if (!reader) return;
+
+  typedef hsa::brig::BrigModule BrigModule;
+  char *directives = const_cast<char *>(reader->getDirectives().data());
+  BrigDirectiveBase *dir =
+    (BrigDirectiveBase *) (directives + hsa::brig::BrigSections::HeaderSize);
+  const uint16_t size = dir->size;
+
+  // Smaller than a BrigDirectiveVersion.
+  dir->size = sizeof(BrigDirectiveBase);
+  BrigModule small(*reader, NULL, BrigModule::StructuralValidation);
+  EXPECT_FALSE(small.isValid());
+
+  // Runs past the end of the section.
+  dir->size = reader->getDirectives().size();
+  BrigModule spans(*reader, NULL, BrigModule::StructuralValidation);
+  EXPECT_FALSE(spans.isValid());
+
+  // Operand offsets must start an operand.
+  dir->size = size;
+  char *code = const_cast<char *>(reader->getCode().data());
+  BrigInstBase *inst =
+    (BrigInstBase *) (code + hsa::brig::BrigSections::HeaderSize);
+  ASSERT_TRUE(inst->operands[0]);
+  inst->operands[0] += 2;
+  BrigModule misaligned(*reader, NULL, BrigModule::StructuralValidation);
+  EXPECT_FALSE(misaligned.isValid());
+
+  inst->operands[0] -= 2;
+  BrigModule restored(*reader, NULL, BrigModule::StructuralValidation);
+  EXPECT_TRUE(restored.isValid());
+
+  delete reader;
+}
+
+TEST(ValidationTest, Stamp) {
+  const char filename[] = XSTR(BIN_PATH) "/square.o";
+  BrigReader *reader = BrigReader::createBrigReader(filename);
+  EXPECT_TRUE(reader);
+  if (!reader) return;
+
+  const uint32_t checksum = reader->getChecksum();
+  std::string object = WriteBrigObject(*reader, &checksum);
+  delete reader;
+
+  reader = BrigReader::createBrigReader(object.data(), object.size());
+  EXPECT_TRUE(reader);
+  if (!reader) return;
+  EXPECT_TRUE(reader->hasValidationStamp());
+
+  // The stamp only lowers the default level. Explicit full validation
+  // always runs.
+  typedef hsa::brig::BrigModule BrigModule;
+  BrigModule stamped(*reader, &llvm::errs());
+  EXPECT_TRUE(stamped.isValid());
+  EXPECT_EQ(BrigModule::StructuralValidation, stamped.getValidationLevel());
+
+  BrigModule full(*reader, &llvm::errs(), BrigModule::FullValidation);
+  EXPECT_TRUE(full.isValid());
+  EXPECT_EQ(BrigModule::FullValidation, full.getValidationLevel());
+
+  // A stamp that no longer matches the module is ignored.
+  char *strings = const_cast<char *>(reader->getStrings().data());
+  strings[reader->getStrings().size() - 1] ^= 1;
+  EXPECT_FALSE(reader->hasValidationStamp());
+  BrigModule stale(*reader, NULL);
+  EXPECT_EQ(BrigModule::FullValidation, stale.getValidationLevel());
+
+  delete reader;
+}
+
+// The section index answers lookups and iterator arithmetic the same way
+// as the linear walks used for unvalidated modules.
+TEST(ValidationTest, SectionIndex) {
+  BrigReader *reader = AssembleHSAIL(
+    "version 0:96:$full:$small;\n"
+    "function &f(arg_u32 %r)(arg_u32 %x)\n"
+    "{\n"
+    "  ld_arg_u32 $s0, [%x];\n"
+    "@DONE:\n"
+    "  st_arg_u32 $s0, [%r];\n"
+    "  ret;\n"
+    "};\n"
+    "kernel &k(kernarg_u32 %out)\n"
+    "{\n"
+    "  ld_kernarg_u32 $s1, [%out];\n"
+    "  mov_b32 $s0, 0;\n"
+    "@LOOP:\n"
+    "  add_u32 $s0, $s0, 1;\n"
+    "  cmp_lt_b1_u32 $c0, $s0, 10;\n"
+    "  cbr $c0, @LOOP;\n"
+    "@DONE:\n"
+    "  st_global_u32 $s0, [$s1];\n"
+    "  ret;\n"
+    "};\n");
+  EXPECT_TRUE(reader);
+  if (!reader) return;
+
+  typedef hsa::brig::BrigModule BrigModule;
+  using hsa::brig::BrigControlBlock;
+  using hsa::brig::BrigFunction;
+  using hsa::brig::inst_iterator;
+
+  BrigModule none(*reader, &llvm::errs(), BrigModule::NoValidation);
+  BrigModule indexed(*reader, &llvm::errs(),
+                     BrigModule::StructuralValidation);
+  EXPECT_TRUE(indexed.isValid());
+
+  const BrigModule *modules[] = { &none, &indexed };
+  uint32_t loop[2], fDone[2], kDone[2];
+  for (unsigned m = 0; m < 2; ++m) {
+    const BrigModule &mod = *modules[m];
+    EXPECT_FALSE(mod.findFunction("&missing") != mod.end());
+
+    BrigFunction f = mod.findFunction("&f");
+    BrigFunction k = mod.findFunction("&k");
+    EXPECT_TRUE(f != mod.end());
+    EXPECT_TRUE(k != mod.end());
+    EXPECT_TRUE(f.isFunction());
+    EXPECT_TRUE(k.isKernel());
+
+    // Labels are scoped to their function.
+    EXPECT_FALSE(f.findLabel("@LOOP") != f.end());
+    loop[m] = k.findLabel("@LOOP").getOffset();
+    fDone[m] = f.findLabel("@DONE").getOffset();
+    kDone[m] = k.findLabel("@DONE").getOffset();
+    EXPECT_LT(f.getOffset(), fDone[m]);
+    EXPECT_LT(k.getOffset(), loop[m]);
+    EXPECT_LT(loop[m], kDone[m]);
+
+    unsigned count = 0;
+    for (BrigControlBlock cb = k.begin(), E = k.end(); cb != E; ++cb) {
+      inst_iterator it = cb.begin();
+      for (unsigned i = 0; it != cb.end(); ++i, ++it)
+        EXPECT_TRUE(cb.begin() + i == it);
+      EXPECT_TRUE(cb.begin() + 0 == cb.begin());
+      ++count;
+    }
+    EXPECT_EQ(3U, count);
+  }
+
+  EXPECT_EQ(loop[0], loop[1]);
+  EXPECT_EQ(fDone[0], fDone[1]);
+  EXPECT_EQ(kDone[0], kDone[1]);
+
+  delete reader;
+}
+
+TEST(BrigReaderTest, Compressed) {
+  const char filename[] = XSTR(BIN_PATH) "/square.o";
+  BrigReader *plain = BrigReader::createBrigReader(filename);
+  EXPECT_TRUE(plain);
+  if (!plain) return;
+
+  const uint32_t checksum = plain->getChecksum();
+  std::string object = WriteBrigObject(*plain, &checksum, true);
+  BrigReader *reader =
+    BrigReader::createBrigReader(object.data(), object.size());
+  EXPECT_TRUE(reader);
+  if (!reader) {
+    delete plain;
+    return;
+  }
+
+  EXPECT_TRUE(reader->getDirectives() == plain->getDirectives());
+  EXPECT_TRUE(reader->getCode() == plain->getCode());
+  EXPECT_TRUE(reader->getOperands() == plain->getOperands());
+  EXPECT_TRUE(reader->getStrings() == plain->getStrings());
+  EXPECT_NE(plain->getDirectives().data(), reader->getDirectives().data());
+
+  // The stamp describes the decompressed sections, so it still applies.
+  EXPECT_TRUE(reader->hasValidationStamp());
+  hsa::brig::BrigModule mod(*reader, &llvm::errs());
+  EXPECT_TRUE(mod.isValid());
+  EXPECT_EQ(hsa::brig::BrigModule::StructuralValidation,
+            mod.getValidationLevel());
+
+  delete reader;
+  delete plain;
+}
+
+TEST(BrigReaderTest, CorruptCompressed) {
+  const char filename[] = XSTR(BIN_PATH) "/square.o";
+  BrigReader *plain = BrigReader::createBrigReader(filename);
+  EXPECT_TRUE(plain);
+  if (!plain) return;
+  const std::string object = WriteBrigObject(*plain, NULL, true);
+  delete plain;
+
+  size_t header = object.find("ZLIB");
+  ASSERT_NE(std::string::npos, header);
+
+  // Sizes no zlib stream of this length could inflate to are rejected
+  // before anything is allocated.
+  std::string oversized = object;
+  oversized[header + 6] = 1;  // 1 << 40 bytes
+  EXPECT_FALSE(BrigReader::createBrigReader(oversized.data(),
+                                            oversized.size()));
+
+  // So are sizes that do not match the stream.
+  std::string mismatched = object;
+  ++mismatched[header + 11];
+  EXPECT_FALSE(BrigReader::createBrigReader(mismatched.data(),
+                                            mismatched.size()));
+
+  std::string badMagic = object;
+  badMagic[header] = 'X';
+  EXPECT_FALSE(BrigReader::createBrigReader(badMagic.data(),
+                                            badMagic.size()));
+
+  std::string badStream = object;
+  badStream[header + 12] ^= 0xff;
+  EXPECT_FALSE(BrigReader::createBrigReader(badStream.data(),
+                                            badStream.size()));
+}
+
+TEST(BrigArchiveTest, KernelIndex) {
+  const char filename[] = XSTR(BIN_PATH) "/square.o";
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  EXPECT_FALSE(llvm::MemoryBuffer::getFile(filename, file));
+  if (!file) return;
+
+  using hsa::brig::BrigArchiveHeader;
+  using hsa::brig::BrigArchiveMember;
+  using hsa::brig::BrigArchiveKernel;
+
+  const char names[] = "\0square.o\0run";
+  const size_t tables = sizeof(BrigArchiveHeader) +
+    sizeof(BrigArchiveMember) + sizeof(BrigArchiveKernel);
+  const size_t memberOffset = (tables + sizeof(names) + 15) / 16 * 16;
+  std::vector<char> buffer(memberOffset + file->getBufferSize());
+
+  BrigArchiveHeader *header = (BrigArchiveHeader *) &buffer[0];
+  memcpy(header->magic, hsa::brig::BrigArchiveMagic, sizeof(header->magic));
+  header->version = BrigArchiveHeader::Version;
+  header->memberCount = 1;
+  header->kernelCount = 1;
+  header->namesOffset = tables;
+  header->namesSize = sizeof(names);
+
+  BrigArchiveMember *member = (BrigArchiveMember *) (header + 1);
+  member->offset = memberOffset;
+  member->size = file->getBufferSize();
+  member->name = 1;
+
+  BrigArchiveKernel *kernel = (BrigArchiveKernel *) (member + 1);
+  kernel->name = 10;
+  kernel->member = 0;
+
+  memcpy(&buffer[tables], names, sizeof(names));
+  memcpy(&buffer[memberOffset], file->getBufferStart(),
+         file->getBufferSize());
+
+  hsa::brig::BrigArchive *archive =
+    hsa::brig::BrigArchive::open(&buffer[0], buffer.size());
+  EXPECT_TRUE(archive);
+  if (!archive) return;
+
+  EXPECT_EQ(1U, archive->getNumMembers());
+  EXPECT_STREQ("square.o", archive->getMemberName(0));
+  EXPECT_EQ(0, archive->findKernel("&run"));
+  EXPECT_EQ(0, archive->findKernel("run"));
+  EXPECT_EQ(-1, archive->findKernel("square"));
+
+  BrigReader *reader = archive->createBrigKernelReader("run");
+  EXPECT_TRUE(reader);
+  if (reader) {
+    // The reader views the member in place.
+    const char *directives = reader->getDirectives().data();
+    EXPECT_TRUE(directives > &buffer[memberOffset]);
+    EXPECT_TRUE(directives < &buffer[0] + buffer.size());
+    hsa::brig::BrigModule mod(*reader, &llvm::errs());
+    EXPECT_TRUE(mod.isValid());
+    delete reader;
+  }
+
+  delete archive;
+}
+
+TEST(BrigLinkTest, ExternFunction) {
+  BrigReader *library = AssembleHSAIL(
+    "version 0:96:$full:$small;\n"
+    "function &addOne(arg_u32 %r)(arg_u32 %x)\n"
+    "{\n"
+    "  ld_arg_u32 $s0, [%x];\n"
+    "  add_u32 $s0, $s0, 1;\n"
+    "  st_arg_u32 $s0, [%r];\n"
+    "  ret;\n"
+    "};\n");
+  BrigReader *app = AssembleHSAIL(
+    "version 0:96:$full:$small;\n"
+    "extern function &addOne(arg_u32 %r)(arg_u32 %x);\n"
+    "kernel &run(kernarg_u64 %out, kernarg_u32 %in)\n"
+    "{\n"
+    "  {\n"
+    "    arg_u32 %r;\n"
+    "    arg_u32 %x;\n"
+    "    ld_kernarg_u32 $s0, [%in];\n"
+    "    st_arg_u32 $s0, [%x];\n"
+    "    call &addOne(%r)(%x);\n"
+    "    ld_arg_u32 $s0, [%r];\n"
+    "  }\n"
+    "  ld_kernarg_u64 $d0, [%out];\n"
+    "  st_global_u32 $s0, [$d0];\n"
+    "  ret;\n"
+    "};\n");
+  EXPECT_TRUE(library && app);
+  if (!library || !app) return;
+
+  hsa::brig::BrigModule libMod(*library, &llvm::errs());
+  hsa::brig::BrigModule appMod(*app, &llvm::errs());
+  std::vector<const hsa::brig::BrigModule *> modules;
+  modules.push_back(&appMod);
+  modules.push_back(&libMod);
+
+  std::string errMsg;
+  hsa::brig::BrigProgram BP =
+    hsa::brig::GenLLVM::linkLLVMModules(modules, &errMsg);
+  EXPECT_TRUE(BP);
+  if (!BP) {
+    llvm::errs() << "Link failed: " << errMsg << "\n";
+    return;
+  }
+
+  // Linking the same modules again hits the cache, but returns a copy the
+  // caller owns.
+  hsa::brig::BrigProgram cached =
+    hsa::brig::GenLLVM::linkLLVMModules(modules);
+  EXPECT_TRUE(cached);
+  if (!cached) return;
+  EXPECT_NE(BP.M.get(), cached.M.get());
+  EXPECT_NE(&BP->getContext(), &cached->getContext());
+  EXPECT_TRUE(cached->getFunction("run"));
+
+  uint32_t *out = new uint32_t(0);
+  uint32_t in = 41;
+  void *args[] = { &out, &in };
+  llvm::Function *fun = BP->getFunction("run");
+  {
+    hsa::brig::BrigEngine BE(BP);
+    BE.launch(fun, args);
+  }
+  EXPECT_EQ(42U, *out);
+
+  // Linking without the library leaves addOne unresolved.
+  modules.pop_back();
+  EXPECT_FALSE(hsa::brig::GenLLVM::linkLLVMModules(modules, &errMsg));
+
+  delete out;
+  delete app;
+  delete library;
+}
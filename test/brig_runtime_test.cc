@@ -7,11 +7,21 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "brig_allocator.h"
+#include "brig_barrier.h"
+#include "brig_image.h"
+#include "brig_scheduler.h"
+#include "brig_topology.h"
+#include "brig_wavefront.h"
 #include "brig_runtime_test_internal.h"
 #include "gtest/gtest.h"
 
+#include <sched.h>
+#include <unistd.h>
+
 using hsa::brig::cmpResult;
 using hsa::brig::ForEach;
+using hsa::brig::fpClassify;
 using hsa::brig::getMax;
 using hsa::brig::getMin;
 using hsa::brig::Int;
@@ -49,7 +59,7 @@ TestAll(FloatVectorInst,  Abs, Unary)
 template<class T> static void NegLogic(T result, T a) {
   if (isNan(a)) {
     EXPECT_PRED1(isNan<T>, result);
-    EXPECT_NE(std::signbit(result), std::signbit(a));
+    EXPECT_NE(std::signbit(f64(result)), std::signbit(f64(a)));
   } else {
     EXPECT_EQ(T(-result), a);
   }
@@ -568,6 +578,45 @@ template<class T> static void LastBit_u32Logic(T result, T a) {
 TestAll(SignedInst, LastBit_u32, Unary)
 TestAll(UnsignedInst, LastBit_u32, Unary)
 
+template<class T> static void BitMaskLogic(T result, b32 a, b32 b) {
+  unsigned offset = Int<T>::ShiftMask & a;
+  unsigned width  = Int<T>::ShiftMask & b;
+  T expected = 0;
+  for (unsigned i = offset; i < offset + width && i < Int<T>::Bits; ++i)
+    expected |= T(1) << i;
+  EXPECT_EQ(expected, result);
+}
+extern "C" b32 BitMask_b32(b32, b32);
+extern "C" b64 BitMask_b64(b32, b32);
+MakeTest(BitMask_b32, BitMaskLogic)
+MakeTest(BitMask_b64, BitMaskLogic)
+
+// The high half of the full product, by shift and add on two words.
+template<class T> static void MulHiLogic(T result, T a, T b) {
+  typedef typename Int<T>::Unsigned Unsigned;
+  const unsigned bits = Int<T>::Bits;
+  Unsigned x = a, y = b;
+  Unsigned hi = 0, lo = 0;
+  for (unsigned i = 0; i < bits; ++i) {
+    if (!(y >> i & 1)) continue;
+    Unsigned addLo = i ? Unsigned(x << i) : x;
+    Unsigned addHi = i ? Unsigned(x >> (bits - i)) : 0;
+    lo += addLo;
+    hi += addHi + (lo < addLo);
+  }
+  if (Int<T>::isNeg(a)) hi -= y;
+  if (Int<T>::isNeg(b)) hi -= x;
+  EXPECT_EQ(T(hi), result);
+}
+declareBinary(MulHi, s32)
+declareBinary(MulHi, u32)
+declareBinary(MulHi, s64)
+declareBinary(MulHi, u64)
+MakeTest(MulHi_s32, MulHiLogic)
+MakeTest(MulHi_u32, MulHiLogic)
+MakeTest(MulHi_s64, MulHiLogic)
+MakeTest(MulHi_u64, MulHiLogic)
+
 template<class T> static void ShuffleLogic(T result, T a, T b, b32 c) {
 
   typedef typename T::Base Base;
@@ -637,6 +686,20 @@ template<class T> static void FractLogic(T result, T a) {
   else
     EXPECT_FLOAT_EQ(1.0f, result);
 }
+// Below half epsilon, a - floor(a) rounds up to 1.0 and is clamped.
+template<> void FractLogic(f16 result, f16 a) {
+  if (isNan(a) || isInf(a)) {
+    EXPECT_PRED1(isNan<f16>, result);
+    return;
+  }
+
+  EXPECT_GT(1, result);
+  EXPECT_LE(0, result);
+  if (a >= 0 || a <= -std::ldexp(1.0, -11))
+    EXPECT_EQ(f16(a - std::floor(f64(a))).getBits(), result.getBits());
+  else
+    EXPECT_EQ(0x3BFF, result.getBits());
+}
 TestAll(FloatInst, Fract, Unary)
 
 template<class T> static void SqrtLogic(T result, T a) {
@@ -646,6 +709,14 @@ template<class T> static void SqrtLogic(T result, T a) {
     EXPECT_FLOAT_EQ(a, result * result);
   }
 }
+// The square root of a half computed in f32 rounds correctly to half.
+template<> void SqrtLogic(f16 result, f16 a) {
+  if (isNan(a)) {
+    EXPECT_PRED1(isNan<f16>, a);
+  } else if (a >= 0.0) {
+    EXPECT_EQ(f16(std::sqrt(f64(a))).getBits(), result.getBits());
+  }
+}
 TestAll(FloatInst, Sqrt, Unary)
 
 template<class T> static void FmaLogic(T result, T a, T b, T c) {
@@ -667,6 +738,15 @@ template<class T> static void FmaLogic(T result, T a, T b, T c) {
     EXPECT_FLOAT_EQ((double ) a * b + c, result);
   }
 }
+// A product of halves is exact as a double.
+template<> void FmaLogic(f16 result, f16 a, f16 b, f16 c) {
+  f16 expected = f64(a) * f64(b) + f64(c);
+  if (isNan(expected)) {
+    EXPECT_PRED1(isNan<f16>, result);
+  } else {
+    EXPECT_EQ(expected.getBits(), result.getBits());
+  }
+}
 TestAll(FloatInst, Fma, Ternary)
 
 template<class T> static void CopySignLogic(T result, T a, T b);
@@ -688,6 +768,11 @@ template<> void CopySignLogic(f32 result, f32 a, f32 b) {
   EXPECT_EQ(resultConv.b &  mask, aConv.b &  mask);
   EXPECT_EQ(resultConv.b & ~mask, bConv.b & ~mask);
 }
+template<> void CopySignLogic(f16 result, f16 a, f16 b) {
+  b16 mask = (1U << 15) - 1;
+  EXPECT_EQ(result.getBits() &  mask, a.getBits() &  mask);
+  EXPECT_EQ(result.getBits() & ~mask, b.getBits() & ~mask);
+}
 TestAll(FloatInst, CopySign, Binary)
 
 template<class T> static void ClassLogic(b1 result, T a, b32 b) {
@@ -803,7 +888,7 @@ extern "C" f32 Nexp2_f32(f32);
 MakeTest(Nexp2_f32, Nexp2_f32_Logic)
 
 template<class T> static void NrsqrtLogic(T result, T a) {
-  int fpclass = std::fpclassify(a);
+  int fpclass = fpClassify(a);
   if (isNan(a) || isNegInf(a)) {
     EXPECT_PRED1(isNan<T>, result);
   } else if (fpclass == FP_NORMAL && a < 0.0) {
@@ -822,10 +907,27 @@ template<class T> static void NrsqrtLogic(T result, T a) {
     EXPECT_FLOAT_EQ(a, (1.0 / result) * (1.0 / result));
   }
 }
+// Denormal halves are flushed. Otherwise the result is within an ulp of
+// the exact one, allowing for the separate f32 square root and division.
+static void NativeHalfLogic(f16 result, f16 a, f64 expected) {
+  f16 rounded = expected;
+  if (fpClassify(a) == FP_SUBNORMAL) {
+    EXPECT_EQ(a > 0 ? 0x7C00 : 0xFC00, result.getBits());
+  } else if (isNan(rounded)) {
+    EXPECT_PRED1(isNan<f16>, result);
+  } else if (isInf(rounded) || rounded == 0) {
+    EXPECT_EQ(rounded.getBits(), result.getBits());
+  } else {
+    EXPECT_NEAR(expected, result, std::ldexp(std::fabs(expected), -10));
+  }
+}
+template<> void NrsqrtLogic(f16 result, f16 a) {
+  NativeHalfLogic(result, a, 1.0 / std::sqrt(f64(a)));
+}
 TestAll(FloatInst, Nrsqrt, Unary)
 
 template<class T> static void NrcpLogic(T result, T a) {
-  int fpclass = std::fpclassify(a);
+  int fpclass = fpClassify(a);
   if (isNan(a)) {
     EXPECT_PRED1(isNan<T>, result);
   } else if (isNegInf(a)) {
@@ -844,8 +946,53 @@ template<class T> static void NrcpLogic(T result, T a) {
     EXPECT_FLOAT_EQ(a, 1.0 / result);
   }
 }
+template<> void NrcpLogic(f16 result, f16 a) {
+  NativeHalfLogic(result, a, 1.0 / f64(a));
+}
 TestAll(FloatInst, Nrcp, Unary)
 
+// The fast native math kernels take the exact path for special values, and
+// are accurate to 2^-20 elsewhere.
+static void NativeFastLogic(f32 result, f32 expected) {
+  if (isNan(expected)) {
+    EXPECT_PRED1(isNan<f32>, result);
+  } else if (isInf(expected) || expected == 0.0) {
+    EXPECT_EQ(expected, result);
+  } else {
+    EXPECT_NEAR(expected, result, std::fabs(expected) / (1 << 20));
+  }
+}
+static void NcosFast_f32_Logic(f32 result, f32 a) {
+  NativeFastLogic(result, Ncos_f32(a));
+}
+static void NsinFast_f32_Logic(f32 result, f32 a) {
+  NativeFastLogic(result, Nsin_f32(a));
+}
+static void Nlog2Fast_f32_Logic(f32 result, f32 a) {
+  NativeFastLogic(result, Nlog2_f32(a));
+}
+static void Nexp2Fast_f32_Logic(f32 result, f32 a) {
+  NativeFastLogic(result, Nexp2_f32(a));
+}
+static void NrsqrtFast_f32_Logic(f32 result, f32 a) {
+  NativeFastLogic(result, Nrsqrt_f32(a));
+}
+static void NrcpFast_f32_Logic(f32 result, f32 a) {
+  NativeFastLogic(result, Nrcp_f32(a));
+}
+extern "C" f32 NcosFast_f32(f32);
+extern "C" f32 NsinFast_f32(f32);
+extern "C" f32 Nlog2Fast_f32(f32);
+extern "C" f32 Nexp2Fast_f32(f32);
+extern "C" f32 NrsqrtFast_f32(f32);
+extern "C" f32 NrcpFast_f32(f32);
+MakeTest(NcosFast_f32, NcosFast_f32_Logic)
+MakeTest(NsinFast_f32, NsinFast_f32_Logic)
+MakeTest(Nlog2Fast_f32, Nlog2Fast_f32_Logic)
+MakeTest(Nexp2Fast_f32, Nexp2Fast_f32_Logic)
+MakeTest(NrsqrtFast_f32, NrsqrtFast_f32_Logic)
+MakeTest(NrcpFast_f32, NrcpFast_f32_Logic)
+
 static void BitAlign_b32_Logic(b32 result, b32 a, b32 b, b32 c ) {
   if (c == 0 || c == 8 || c == 16 || c == 24 || c == 32) {
     unsigned tag = (32 - c) / 8;
@@ -946,16 +1093,16 @@ template<class R, class T> static void Cmp_numLogic(R result, T a, T b) {
 template<class R, class T> static void Cmp_nanLogic(R result, T a, T b) {
   EXPECT_EQ(cmpResult<R>(isNan(a) || isNan(b)), result);
 }
-// Cmp(declare, num, f16)
+Cmp(declare, num,  f16)
 Cmp(declare, num,  f32)
 Cmp(declare, num,  f64)
-// Cmp(declare, nan, f16)
+Cmp(declare, nan,  f16)
 Cmp(declare, nan,  f32)
 Cmp(declare, nan,  f64)
-// MakeCmpTest(num, f16)
+MakeCmpTest(num, f16)
 MakeCmpTest(num, f32)
 MakeCmpTest(num, f64)
-// MakeCmpTest(nan, f16)
+MakeCmpTest(nan, f16)
 MakeCmpTest(nan, f32)
 MakeCmpTest(nan, f64)
 
@@ -1191,3 +1338,630 @@ template<class T> static void AtomicCasLogic(T result, T a, T b, T c) {
   }
 }
 TestAll(AtomicInst, Cas, Ternary)
+
+template<class T> static void AtomicMaxLogic(T result, T a, T b) {
+  EXPECT_EQ(std::max(a, b), result);
+}
+TestAll(AtomicInst, Max, Binary)
+
+template<class T> static void AtomicMinLogic(T result, T a, T b) {
+  EXPECT_EQ(std::min(a, b), result);
+}
+TestAll(AtomicInst, Min, Binary)
+
+// The scalar fallback for CPUs without SSE4.1, checked against nearbyint in
+// each rounding mode whatever the host supports.
+template<class T> static void RoundIntegralLogic() {
+  const T values[] = {
+    0.0, -0.0, 0.25, 0.5, 0.75, 1.5, 2.5, -0.5, -1.5, -2.5, -2.75,
+    T(4503599627370495.5), T(-4503599627370495.5), 8388607.5, -8388607.5,
+    1e20, -1e20, std::numeric_limits<T>::denorm_min(),
+    -std::numeric_limits<T>::denorm_min(), INFINITY, -INFINITY
+  };
+  const int modes[] = { FE_TONEAREST, FE_UPWARD, FE_DOWNWARD, FE_TOWARDZERO };
+  int oldMode = fegetround();
+  for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    for (unsigned v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+      fesetround(modes[m]);
+      T expected = nearbyint(values[v]);
+      fesetround(oldMode);
+      T result = hsa::brig::roundIntegral(values[v], modes[m]);
+      EXPECT_EQ(expected, result);
+      EXPECT_EQ(std::signbit(expected), std::signbit(result));
+    }
+  }
+  T nan = hsa::brig::roundIntegral(T(NAN), FE_UPWARD);
+  EXPECT_PRED1(isNan<T>, nan);
+}
+
+TEST(BrigRuntimeTest, RoundIntegral) {
+  RoundIntegralLogic<f32>();
+  RoundIntegralLogic<f64>();
+}
+
+TEST(BrigRuntimeTest, AtomicOrders) {
+  s32 x = -5;
+  EXPECT_EQ(-5, AtomicAdd_rlx_s32(&x, 7));
+  EXPECT_EQ(2, AtomicExch_acq_s32(&x, 9));
+  EXPECT_EQ(9, AtomicMax_rel_s32(&x, 3));
+  EXPECT_EQ(9, x);
+  EXPECT_EQ(9, AtomicMax_s32(&x, 12));
+  EXPECT_EQ(12, AtomicMin_rlx_s32(&x, -1));
+  EXPECT_EQ(-1, AtomicCas_rel_s32(&x, 0, 4));
+  EXPECT_EQ(-1, AtomicCas_acq_s32(&x, -1, 4));
+  EXPECT_EQ(4, x);
+
+  u64 y = 1;
+  AtomicNoRetSub_rel_u64(&y, 2);
+  EXPECT_EQ(~0ULL, y);
+  AtomicNoRetAnd_acq_u64(&y, 0xF0);
+  EXPECT_EQ(0xF0ULL, y);
+}
+
+struct BarrierTestInfo {
+  hsa::brig::WorkGroupBarrier *barrier;
+  volatile u32 *arrived;
+  u32 threads;
+  u32 generations;
+  bool ok;
+};
+
+static void *BarrierTestThread(void *arg) {
+  BarrierTestInfo *info = (BarrierTestInfo *) arg;
+  info->ok = true;
+  for (u32 i = 0; i < info->generations; ++i) {
+    __atomic_add_fetch(&info->arrived[i], 1, __ATOMIC_RELAXED);
+    info->barrier->wait();
+    info->ok &= info->arrived[i] == info->threads;
+  }
+  return NULL;
+}
+
+static void TestWorkGroupBarrier(u32 spins) {
+  const u32 threads = 8;
+  const u32 generations = 500;
+  hsa::brig::WorkGroupBarrier barrier;
+  barrier.init(threads, spins);
+  std::vector<u32> arrived(generations);
+
+  pthread_t tids[threads];
+  BarrierTestInfo infos[threads];
+  for (u32 i = 0; i < threads; ++i) {
+    BarrierTestInfo info = { &barrier, &arrived[0], threads, generations };
+    infos[i] = info;
+    pthread_create(&tids[i], NULL, BarrierTestThread, &infos[i]);
+  }
+  for (u32 i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+    EXPECT_TRUE(infos[i].ok);
+  }
+}
+
+TEST(BrigRuntimeTest, WorkGroupBarrierSpin) {
+  TestWorkGroupBarrier(hsa::brig::WorkGroupBarrier::DefaultSpins);
+}
+
+TEST(BrigRuntimeTest, WorkGroupBarrierSleep) {
+  TestWorkGroupBarrier(0);
+}
+
+struct BarrierDropTestInfo {
+  hsa::brig::WorkGroupBarrier *barrier;
+  volatile u32 *arrived;
+  const u32 *expected;
+  u32 dropAt;
+  bool ok;
+};
+
+static void *BarrierDropTestThread(void *arg) {
+  BarrierDropTestInfo *info = (BarrierDropTestInfo *) arg;
+  info->ok = true;
+  for (u32 i = 0; i < info->dropAt; ++i) {
+    __atomic_add_fetch(&info->arrived[i], 1, __ATOMIC_RELAXED);
+    info->barrier->wait();
+    info->ok &= info->arrived[i] == info->expected[i];
+  }
+  info->barrier->drop();
+  return NULL;
+}
+
+// Threads that drop out no longer hold up the generations after.
+TEST(BrigRuntimeTest, WorkGroupBarrierDrop) {
+  const u32 threads = 8;
+  const u32 generations = 400;
+  hsa::brig::WorkGroupBarrier barrier;
+  barrier.init(threads, 0);
+  std::vector<u32> arrived(generations);
+  std::vector<u32> expected(generations);
+
+  pthread_t tids[threads];
+  BarrierDropTestInfo infos[threads];
+  for (u32 i = 0; i < threads; ++i) {
+    u32 dropAt = i < 6 ? i * 50 : generations;
+    for (u32 j = 0; j < dropAt; ++j) ++expected[j];
+    BarrierDropTestInfo info = { &barrier, &arrived[0], &expected[0], dropAt };
+    infos[i] = info;
+  }
+  for (u32 i = 0; i < threads; ++i)
+    pthread_create(&tids[i], NULL, BarrierDropTestThread, &infos[i]);
+  for (u32 i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+    EXPECT_TRUE(infos[i].ok);
+  }
+}
+
+struct WavefrontTestInfo {
+  hsa::brig::Wavefront *wavefront;
+  u32 lane;
+  u32 rounds;
+  bool ok;
+};
+
+static void *WavefrontTestThread(void *arg) {
+  WavefrontTestInfo *info = (WavefrontTestInfo *) arg;
+  hsa::brig::Wavefront *wavefront = info->wavefront;
+  const u32 lane = info->lane;
+  const u32 lanes = wavefront->getLanes();
+  u32 phase = 0;
+  info->ok = true;
+  for (u32 i = 0; i < info->rounds; ++i) {
+    // Odd lanes in odd rounds.
+    u64 mask = wavefront->mask(lane, phase++, (lane ^ i) & 1);
+    u64 expect = 0;
+    for (u32 j = 0; j < lanes; ++j) expect |= u64((j ^ i) & 1) << j;
+    info->ok &= mask == expect;
+
+    // Rotate values down by i lanes.
+    u32 source = (lane + i) % 64;
+    u32 value = wavefront->receive(lane, phase++, lane * 1000 + i, source);
+    info->ok &= value == (source < lanes ? source * 1000 + i : 0);
+
+    // Every lane sends to lane i % lanes; the highest sender wins.
+    value = wavefront->send(lane, phase++, lane + i, i % lanes);
+    info->ok &= value == (lane == i % lanes ? lanes - 1 + i : 0);
+  }
+  return NULL;
+}
+
+static void TestWavefront(u32 lanes, u32 spins) {
+  const u32 rounds = 200;
+  hsa::brig::Wavefront wavefront;
+  wavefront.init(lanes, spins);
+
+  std::vector<pthread_t> tids(lanes);
+  std::vector<WavefrontTestInfo> infos(lanes);
+  for (u32 i = 0; i < lanes; ++i) {
+    WavefrontTestInfo info = { &wavefront, i, rounds, false };
+    infos[i] = info;
+    pthread_create(&tids[i], NULL, WavefrontTestThread, &infos[i]);
+  }
+  for (u32 i = 0; i < lanes; ++i) {
+    pthread_join(tids[i], NULL);
+    EXPECT_TRUE(infos[i].ok);
+  }
+}
+
+TEST(BrigRuntimeTest, WavefrontCrossLane) {
+  TestWavefront(1, 0);
+  TestWavefront(8, 0);
+  // A partial wavefront at the end of a work-group.
+  TestWavefront(5, hsa::brig::WorkGroupBarrier::DefaultSpins);
+}
+
+using hsa::brig::BrigImage;
+using hsa::brig::BrigSampler;
+
+extern "C" void RdImage_f32_f32(b32 *, b32 *, b32 *, b32 *, b64, b64,
+                                f32, f32, f32);
+extern "C" void RdImage_u32_s32(b32 *, b32 *, b32 *, b32 *, b64, b64,
+                                s32, s32, s32);
+extern "C" void LdImage_u32_s32(b32 *, b32 *, b32 *, b32 *, b64,
+                                s32, s32, s32);
+extern "C" void StImage_f32_s32(b32, b32, b32, b32, b64, s32, s32, s32);
+extern "C" u32 QueryImageWidth_u32_ROImg(b64);
+extern "C" u32 QueryImageHeight_u32_ROImg(b64);
+extern "C" u32 QueryImageDepth_u32_RWImg(b64);
+extern "C" u32 QueryImageArray_u32_ROImg(b64);
+extern "C" u32 QueryImageFormat_u32_ROImg(b64);
+extern "C" u32 QueryImageOrder_u32_ROImg(b64);
+extern "C" u32 QuerySamplerCoord_u32_Samp(b64);
+extern "C" u32 QuerySamplerFilter_u32_Samp(b64);
+
+static f32 asFloat(b32 b) {
+  f32 f;
+  memcpy(&f, &b, sizeof(f));
+  return f;
+}
+
+static b32 asBits(f32 f) {
+  b32 b;
+  memcpy(&b, &f, sizeof(b));
+  return b;
+}
+
+TEST(BrigRuntimeTest, ImageTiledRoundTrip) {
+  // Sizes that are not multiples of the tiles exercise partial tiles.
+  const u32 width = 13, height = 11, depth = 6;
+  u32 linear[width * height * depth];
+  for (u32 i = 0; i < width * height * depth; ++i) linear[i] = i * 2654435761U;
+
+  hsa::brig::ImageGeometry geometries[] = {
+    hsa::brig::Image2D, hsa::brig::Image3D, hsa::brig::Image2DArray
+  };
+  for (unsigned g = 0; g < 3; ++g) {
+    u32 d = geometries[g] == hsa::brig::Image2D ? 1 : depth;
+    BrigImage *image =
+      BrigImage::create(geometries[g], hsa::brig::ChannelR,
+                        hsa::brig::UnsignedInt32, width, height, d, linear);
+    ASSERT_TRUE(image);
+
+    u32 out[width * height * depth];
+    image->read(out);
+    for (u32 i = 0; i < width * height * d; ++i) EXPECT_EQ(linear[i], out[i]);
+
+    for (u32 z = 0; z < d; ++z) {
+      for (u32 y = 0; y < height; ++y) {
+        for (u32 x = 0; x < width; ++x) {
+          b32 texel[4];
+          image->load(x, y, z, texel);
+          EXPECT_EQ(linear[(z * height + y) * width + x], texel[0]);
+          EXPECT_EQ(0U, texel[1]);
+          EXPECT_EQ(1U, texel[3]);
+        }
+      }
+    }
+    delete image;
+  }
+
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image1D, hsa::brig::ChannelR,
+                                 hsa::brig::Float, 4, 2, 1));
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image2D, hsa::brig::ChannelR,
+                                 hsa::brig::Float, 0, 2, 1));
+}
+
+TEST(BrigRuntimeTest, ImageLoadStore) {
+  BrigImage *image =
+    BrigImage::create(hsa::brig::Image2D, hsa::brig::ChannelRGBA,
+                      hsa::brig::UnormInt8, 9, 9, 1);
+  ASSERT_TRUE(image);
+  b64 handle = image->getHandle();
+
+  StImage_f32_s32(asBits(0.5f), asBits(-1.0f), asBits(2.0f), asBits(1.0f),
+                  handle, 8, 3, 0);
+  // Out of bounds stores are dropped.
+  StImage_f32_s32(asBits(1.0f), 0, 0, 0, handle, 9, 3, 0);
+
+  u8 linear[9 * 9 * 4];
+  image->read(linear);
+  const u8 *texel = linear + (3 * 9 + 8) * 4;
+  EXPECT_EQ(128, texel[0]);
+  EXPECT_EQ(0, texel[1]);
+  EXPECT_EQ(255, texel[2]);
+  EXPECT_EQ(255, texel[3]);
+
+  b32 r, g, b, a;
+  LdImage_u32_s32(&r, &g, &b, &a, handle, 8, 3, 0);
+  EXPECT_EQ(128.0f / 255.0f, asFloat(r));
+  EXPECT_EQ(0.0f, asFloat(g));
+  EXPECT_EQ(1.0f, asFloat(b));
+  LdImage_u32_s32(&r, &g, &b, &a, handle, -1, 3, 0);
+  EXPECT_EQ(0U, r | g | b | a);
+  // Unused destinations may be NULL.
+  LdImage_u32_s32(&r, NULL, NULL, NULL, handle, 8, 3, 0);
+  EXPECT_EQ(128.0f / 255.0f, asFloat(r));
+
+  delete image;
+}
+
+TEST(BrigRuntimeTest, ImageSampleFilter) {
+  const f32 linear[] = { 0.0f, 1.0f, 2.0f, 3.0f,
+                         4.0f, 5.0f, 6.0f, 7.0f };
+  BrigImage *image =
+    BrigImage::create(hsa::brig::Image2D, hsa::brig::ChannelR,
+                      hsa::brig::Float, 4, 2, 1, linear);
+  ASSERT_TRUE(image);
+  b64 handle = image->getHandle();
+
+  BrigSampler nearest(false, hsa::brig::FilterNearest,
+                      hsa::brig::AddressClampToEdge);
+  BrigSampler bilinear(false, hsa::brig::FilterLinear,
+                       hsa::brig::AddressClampToEdge);
+  BrigSampler normalized(true, hsa::brig::FilterNearest,
+                         hsa::brig::AddressClampToEdge);
+
+  b32 r, g, b, a;
+  RdImage_f32_f32(&r, &g, &b, &a, handle, nearest.getHandle(),
+                  2.9f, 1.2f, 0.0f);
+  EXPECT_EQ(6.0f, asFloat(r));
+  EXPECT_EQ(0.0f, asFloat(g));
+  EXPECT_EQ(1.0f, asFloat(a));
+
+  RdImage_f32_f32(&r, &g, &b, &a, handle, normalized.getHandle(),
+                  0.3f, 0.75f, 0.0f);
+  EXPECT_EQ(5.0f, asFloat(r));
+
+  // Texel centers are at half coordinates.
+  RdImage_f32_f32(&r, &g, &b, &a, handle, bilinear.getHandle(),
+                  1.5f, 0.5f, 0.0f);
+  EXPECT_EQ(1.0f, asFloat(r));
+  RdImage_f32_f32(&r, &g, &b, &a, handle, bilinear.getHandle(),
+                  2.0f, 1.0f, 0.0f);
+  EXPECT_FLOAT_EQ(3.5f, asFloat(r));
+  RdImage_f32_f32(&r, &g, &b, &a, handle, bilinear.getHandle(),
+                  1.75f, 0.5f, 0.0f);
+  EXPECT_FLOAT_EQ(1.25f, asFloat(r));
+  RdImage_f32_f32(&r, &g, &b, &a, handle, bilinear.getHandle(),
+                  1.0f / 0.0f, 0.0f / 0.0f, 0.0f);
+  EXPECT_FALSE(isNan(asFloat(r)));
+
+  delete image;
+}
+
+TEST(BrigRuntimeTest, ImageSampleAddressing) {
+  const u32 linear[] = { 10, 11, 12, 13 };
+  BrigImage *image =
+    BrigImage::create(hsa::brig::Image1D, hsa::brig::ChannelR,
+                      hsa::brig::UnsignedInt32, 4, 1, 1, linear);
+  ASSERT_TRUE(image);
+  b64 handle = image->getHandle();
+
+  const s32 coords[] = { -5, -1, 0, 3, 4, 9 };
+  struct {
+    hsa::brig::SamplerAddressing mode;
+    u32 expect[6];
+  } modes[] = {
+    { hsa::brig::AddressClampToEdge,    { 10, 10, 10, 13, 13, 13 } },
+    { hsa::brig::AddressClampToBorder,  {  0,  0, 10, 13,  0,  0 } },
+    { hsa::brig::AddressRepeat,         { 13, 13, 10, 13, 10, 11 } },
+    { hsa::brig::AddressMirroredRepeat, { 13, 10, 10, 13, 13, 11 } }
+  };
+
+  for (unsigned m = 0; m < 4; ++m) {
+    BrigSampler sampler(false, hsa::brig::FilterLinear, modes[m].mode);
+    for (unsigned i = 0; i < 6; ++i) {
+      b32 r, g, b, a;
+      RdImage_u32_s32(&r, &g, &b, &a, handle, sampler.getHandle(),
+                      coords[i], 0, 0);
+      EXPECT_EQ(modes[m].expect[i], r);
+      // Integer formats are never filtered.
+      RdImage_f32_f32(&r, &g, &b, &a, handle, sampler.getHandle(),
+                      coords[i] + 0.75f, 0.0f, 0.0f);
+      EXPECT_EQ(modes[m].expect[i], r);
+    }
+  }
+
+  delete image;
+}
+
+TEST(BrigRuntimeTest, ImageSample3D) {
+  u16 linear[4 * 4 * 4 * 2];
+  for (unsigned i = 0; i < 4 * 4 * 4; ++i) {
+    linear[2 * i] = i * 1000;
+    linear[2 * i + 1] = 65535;
+  }
+  BrigImage *image =
+    BrigImage::create(hsa::brig::Image3D, hsa::brig::ChannelRG,
+                      hsa::brig::UnormInt16, 4, 4, 4, linear);
+  ASSERT_TRUE(image);
+
+  BrigSampler trilinear(false, hsa::brig::FilterLinear,
+                        hsa::brig::AddressClampToEdge);
+  b32 texel[4];
+  image->sample(trilinear, 2.0f, 2.0f, 2.0f, texel);
+  // The mean of the eight texels around (1.5, 1.5, 1.5).
+  EXPECT_NEAR(((1 + 2) * 1 + (1 + 2) * 4 + (1 + 2) * 16) * 1000 / 2 / 65535.0,
+              asFloat(texel[0]), 1e-6);
+  EXPECT_FLOAT_EQ(1.0f, asFloat(texel[1]));
+  EXPECT_EQ(0.0f, asFloat(texel[2]));
+  EXPECT_EQ(1.0f, asFloat(texel[3]));
+
+  delete image;
+}
+
+TEST(BrigRuntimeTest, ImageQuery) {
+  BrigImage *array =
+    BrigImage::create(hsa::brig::Image2DArray, hsa::brig::ChannelRGBA,
+                      hsa::brig::HalfFloat, 7, 5, 3);
+  BrigImage *volume =
+    BrigImage::create(hsa::brig::Image3D, hsa::brig::ChannelR,
+                      hsa::brig::SignedInt8, 2, 3, 4);
+  ASSERT_TRUE(array);
+  ASSERT_TRUE(volume);
+
+  EXPECT_EQ(7U, QueryImageWidth_u32_ROImg(array->getHandle()));
+  EXPECT_EQ(5U, QueryImageHeight_u32_ROImg(array->getHandle()));
+  EXPECT_EQ(3U, QueryImageArray_u32_ROImg(array->getHandle()));
+  EXPECT_EQ(0U, QueryImageArray_u32_ROImg(volume->getHandle()));
+  EXPECT_EQ(4U, QueryImageDepth_u32_RWImg(volume->getHandle()));
+  EXPECT_EQ(u32(hsa::brig::HalfFloat),
+            QueryImageFormat_u32_ROImg(array->getHandle()));
+  EXPECT_EQ(u32(hsa::brig::ChannelRGBA),
+            QueryImageOrder_u32_ROImg(array->getHandle()));
+
+  BrigSampler sampler(true, hsa::brig::FilterLinear,
+                      hsa::brig::AddressRepeat);
+  EXPECT_EQ(1U, QuerySamplerCoord_u32_Samp(sampler.getHandle()));
+  EXPECT_EQ(u32(hsa::brig::FilterLinear),
+            QuerySamplerFilter_u32_Samp(sampler.getHandle()));
+
+  delete array;
+  delete volume;
+}
+
+TEST(BrigRuntimeTest, ImageTooLarge) {
+  // 2^90 texels overflow any 64-bit size.
+  const u32 edge = 1U << 30;
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image3D, hsa::brig::ChannelRGBA,
+                                 hsa::brig::Float, edge, edge, edge));
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image2DArray,
+                                 hsa::brig::ChannelRGBA, hsa::brig::Float,
+                                 edge, edge, edge));
+  // 2^60 texels of 16 bytes wrap a 64-bit size.
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image2D, hsa::brig::ChannelRGBA,
+                                 hsa::brig::Float, edge, edge, 1));
+  // 2^60 bytes fit in 64 bits, but not in memory.
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image2D, hsa::brig::ChannelR,
+                                 hsa::brig::UnsignedInt8, edge, edge, 1));
+  // Past the coordinate range.
+  EXPECT_FALSE(BrigImage::create(hsa::brig::Image1D, hsa::brig::ChannelR,
+                                 hsa::brig::UnsignedInt8, edge + 1, 1, 1));
+
+  BrigImage *image =
+    BrigImage::create(hsa::brig::Image3D, hsa::brig::ChannelRGBA,
+                      hsa::brig::Float, 5, 3, 2);
+  EXPECT_TRUE(image);
+  delete image;
+}
+
+TEST(BrigRuntimeTest, AllocatorRecycles) {
+  hsa::brig::BrigAllocator &allocator = hsa::brig::BrigAllocator::get();
+  EXPECT_FALSE(allocator.allocate(0));
+
+  const size_t sizes[] = { 1, 24, 100, 4096, 70000, 1 << 20, 5 << 20 };
+  const unsigned count = sizeof(sizes) / sizeof(sizes[0]);
+  void *blocks[count];
+  for (unsigned i = 0; i < count; ++i) {
+    blocks[i] = allocator.allocate(sizes[i], 64);
+    EXPECT_TRUE(blocks[i]);
+    if (!blocks[i]) return;
+    EXPECT_EQ(0U, uintptr_t(blocks[i]) % 64);
+    EXPECT_LE(sizes[i], allocator.getSize(blocks[i]));
+    memset(blocks[i], 0xA5, sizes[i]);
+  }
+
+  void *page = allocator.allocate(8, 4096);
+  EXPECT_EQ(0U, uintptr_t(page) % 4096);
+  allocator.free(page);
+
+  for (unsigned i = 0; i < count; ++i)
+    allocator.free(blocks[i]);
+  allocator.free(NULL);
+
+  // The same sizes again come back from freed memory.
+  hsa::brig::BrigAllocator::Stats before = allocator.getStats();
+  for (unsigned i = 0; i < count; ++i)
+    blocks[i] = allocator.allocate(sizes[i], 64);
+  hsa::brig::BrigAllocator::Stats after = allocator.getStats();
+  EXPECT_EQ(before.bytesMapped, after.bytesMapped);
+  EXPECT_EQ(before.recycled + count, after.recycled);
+  EXPECT_EQ(before.allocations + count, after.allocations);
+  EXPECT_LT(before.bytesInUse, after.bytesInUse);
+
+  for (unsigned i = 0; i < count; ++i)
+    allocator.free(blocks[i]);
+  EXPECT_EQ(before.bytesInUse, allocator.getStats().bytesInUse);
+}
+
+TEST(BrigRuntimeTest, Topology) {
+  std::vector<unsigned> cpus;
+  EXPECT_TRUE(hsa::brig::Topology::parseCpuList("0-2,8,10-11\n", cpus));
+  const unsigned expected[] = { 0, 1, 2, 8, 10, 11 };
+  EXPECT_EQ(std::vector<unsigned>(expected, expected + 6), cpus);
+  EXPECT_FALSE(hsa::brig::Topology::parseCpuList("3-1", cpus));
+  EXPECT_FALSE(hsa::brig::Topology::parseCpuList("1,x", cpus));
+
+  const hsa::brig::Topology &topology = hsa::brig::Topology::get();
+  EXPECT_LE(1U, topology.getNodeCount());
+  size_t nodeCpus = 0;
+  for (unsigned i = 0; i < topology.getNodeCount(); ++i)
+    nodeCpus += topology.getNode(i).cpus.size();
+  EXPECT_EQ(nodeCpus, topology.getCpus().size());
+  EXPECT_LE(1U, topology.getCpus().size());
+  for (unsigned i = 0; i < topology.getNodeCount(); ++i)
+    for (unsigned j = 0; j < topology.getNode(i).cpus.size(); ++j)
+      EXPECT_EQ(i, topology.getNodeIndex(topology.getNode(i).cpus[j]));
+  EXPECT_EQ(topology.getNodeCount(), topology.getNodeIndex(~0U));
+
+  // Small blocks share pages, so only large ones can be placed.
+  hsa::brig::BrigAllocator &allocator = hsa::brig::BrigAllocator::get();
+  void *small = allocator.allocate(64);
+  EXPECT_FALSE(allocator.place(small, hsa::brig::BrigAllocator::PlaceLocal,
+                               topology.getNode(0).id));
+  EXPECT_FALSE(allocator.partition(small, topology.getCpus()));
+  allocator.free(small);
+  void *large = allocator.allocate(1 << 20);
+  EXPECT_TRUE(allocator.place(large,
+                              hsa::brig::BrigAllocator::PlaceFirstTouch));
+
+  // Partitioning moves pages without touching their contents.
+  EXPECT_FALSE(allocator.partition(large, std::vector<unsigned>()));
+  EXPECT_FALSE(allocator.partition(large, std::vector<unsigned>(1, ~0U)));
+  memset(large, 0x5a, 1 << 20);
+  allocator.partition(large, topology.getCpus());
+  allocator.place(large, hsa::brig::BrigAllocator::PlacePartitioned);
+  for (unsigned i = 0; i < 1 << 20; i += 4096)
+    EXPECT_EQ(0x5a, ((unsigned char *) large)[i]);
+  allocator.free(large);
+}
+
+struct SchedulerTestInfo {
+  hsa::brig::BrigScheduler *scheduler;
+  hsa::brig::BrigScheduler::Client *client;
+  u32 id;
+  u32 *grants;
+  u32 *granted;
+  bool *stop;
+};
+
+// Asks for the only processor over and over, and records each grant. The
+// test gives the processor back, so it decides when the next grant happens.
+static void *SchedulerTestThread(void *arg) {
+  SchedulerTestInfo *info = (SchedulerTestInfo *) arg;
+  for (;;) {
+    u32 taken = info->scheduler->acquire(info->client, 1);
+    if (__atomic_load_n(info->stop, __ATOMIC_ACQUIRE)) {
+      info->scheduler->release(taken);
+      return NULL;
+    }
+    u32 turn = __atomic_load_n(info->granted, __ATOMIC_RELAXED);
+    info->grants[turn] = info->id;
+    __atomic_store_n(info->granted, turn + 1, __ATOMIC_RELEASE);
+  }
+}
+
+TEST(BrigRuntimeTest, SchedulerFairShare) {
+  hsa::brig::BrigScheduler scheduler(1);
+  EXPECT_EQ(1U, scheduler.getCapacity());
+
+  // A work-group larger than the device takes all of it.
+  hsa::brig::BrigScheduler::Client *light = scheduler.join(1);
+  EXPECT_EQ(1U, scheduler.acquire(light, 8));
+  scheduler.release(1);
+
+  // The test holds the processor until both clients are waiting for it, so
+  // every grant picks between the two, and the order is fixed.
+  hsa::brig::BrigScheduler::Client *heavy = scheduler.join(4);
+  hsa::brig::BrigScheduler::Client *holder = scheduler.join(1);
+  EXPECT_EQ(1U, scheduler.acquire(holder, 1));
+
+  enum { Turns = 40 };
+  u32 grants[Turns];
+  u32 granted = 0;
+  bool stop = false;
+  SchedulerTestInfo infos[] = {
+    { &scheduler, light, 0, grants, &granted, &stop },
+    { &scheduler, heavy, 1, grants, &granted, &stop }
+  };
+  pthread_t tids[2];
+  for (u32 i = 0; i < 2; ++i)
+    pthread_create(&tids[i], NULL, SchedulerTestThread, &infos[i]);
+  for (u32 turn = 0; turn < Turns; ++turn) {
+    while (scheduler.getWaiting() < 2) sched_yield();
+    scheduler.release(1);
+    while (__atomic_load_n(&granted, __ATOMIC_ACQUIRE) == turn)
+      sched_yield();
+  }
+  while (scheduler.getWaiting() < 2) sched_yield();
+  __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+  scheduler.release(1);
+  for (u32 i = 0; i < 2; ++i)
+    pthread_join(tids[i], NULL);
+  scheduler.leave(holder);
+  scheduler.leave(heavy);
+  scheduler.leave(light);
+
+  // Both start at the same pass, and ties go to the client that joined
+  // first, so the light client gets one of every five grants.
+  for (u32 turn = 0; turn < Turns; ++turn)
+    EXPECT_EQ(turn % 5 ? 1U : 0U, grants[turn]);
+}
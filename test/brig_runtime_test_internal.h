@@ -56,7 +56,7 @@
   MakeTest(INST ## _u64, INST ## Logic)
 
 #define TestFloatInst(INST,NARY)                \
-  /* MakeTest(INST ## _f16, INST ## Logic) */   \
+  MakeTest(INST ## _f16, INST ## Logic)         \
   MakeTest(INST ## _f32, INST ## Logic)         \
   MakeTest(INST ## _f64, INST ## Logic)
 
@@ -81,8 +81,8 @@
   MakeVectorTest(INST ## _u16x2,  INST ## Logic)        \
   MakeVectorTest(INST ## _u16x4,  INST ## Logic)        \
   MakeVectorTest(INST ## _u32x2,  INST ## Logic)        \
-  /* MakeVectorTest(INST ## _f16x2,  INST ## Logic )*/  \
-  /* MakeVectorTest(INST ## _f16x4,  INST ## Logic) */  \
+  MakeVectorTest(INST ## _f16x2,  INST ## Logic)        \
+  MakeVectorTest(INST ## _f16x4,  INST ## Logic)        \
   MakeVectorTest(INST ## _f32x2,  INST ## Logic)
 
 #define TestAtomicInst(INST,NARY)                                   \
@@ -117,7 +117,7 @@
 
 
 #define TestUnaryFloatVectorInst(INST)                  \
-  /* MakeVectorTest(INST ## _P_f16x2, INST ## Logic) */ \
+  MakeVectorTest(INST ## _P_f16x2, INST ## VectorLogic) \
   MakeVectorTest(INST ## _P_f32x2, INST ## VectorLogic)
 
 
@@ -143,11 +143,12 @@
   MakeVectorTest(INST ## _u32x2, INST ## VectorLogic)
 
 #define TestBinaryFloatVectorInst(INST)                   \
-  /* MakeVectorTest(INST ## _PP_f16x2, INST ## Logic) */  \
+  MakeVectorTest(INST ## _PP_f16x2, INST ## VectorLogic)  \
+  MakeVectorTest(INST ## _PP_f16x4, INST ## VectorLogic)  \
   MakeVectorTest(INST ## _PP_f32x2, INST ## VectorLogic)
 
 #define TestTernaryFloatVectorInst(INST)                  \
-  /* MakeVectorTest(INST ## _PP_f16x2, INST ## Logic) */  \
+  MakeVectorTest(INST ## _f16x2, INST ## VectorLogic)     \
   MakeVectorTest(INST ## _f32x2, INST ## VectorLogic)
 
 #define TestShuffleVectorInst(INST,NARY)              \
@@ -157,7 +158,7 @@
   MakeVectorTest(INST ## _u8x4,  INST ## Logic)       \
   MakeVectorTest(INST ## _u16x2, INST ## Logic)       \
   MakeVectorTest(INST ## _u32x2, INST ## Logic)       \
-  /* MakeVectorTest(INST ## _f16x2, INST ## Logic) */ \
+  MakeVectorTest(INST ## _f16x2, INST ## Logic)       \
   MakeVectorTest(INST ## _f32x2, INST ## Logic)
 
 #define MakeCmpTest(FUNC,TYPE)                                          \
@@ -165,7 +166,7 @@
   MakeTest(Cmp_ ## FUNC ## _b32_ ## TYPE, Cmp_ ## FUNC ## Logic)        \
   MakeTest(Cmp_ ## FUNC ## _s32_ ## TYPE, Cmp_ ## FUNC ## Logic)        \
   MakeTest(Cmp_ ## FUNC ## _u32_ ## TYPE, Cmp_ ## FUNC ## Logic)        \
-  /* MakeTest(Cmp_ ## FUNC ## _f16_ ## TYPE, Cmp_ ## FUNC ## Logic) */  \
+  MakeTest(Cmp_ ## FUNC ## _f16_ ## TYPE, Cmp_ ## FUNC ## Logic)        \
   MakeTest(Cmp_ ## FUNC ## _f32_ ## TYPE, Cmp_ ## FUNC ## Logic)
 
 #define MakePackedCmpTest(FUNC,RET,TYPE)                    \
@@ -203,7 +204,7 @@
   Cmp(declare, FUNC, s64)                                   \
   Cmp(declare, FUNC, u32)                                   \
   Cmp(declare, FUNC, u64)                                   \
-  /* Cmp(declare, Cmp_ ## FUNC, f16) */                     \
+  FCmp(declare, FUNC, f16)                                  \
   FCmp(declare, FUNC, f32)                                  \
   FCmp(declare, FUNC, f64)                                  \
   PackedCmp(declare, FUNC, u8x4, u8x4)                      \
@@ -224,9 +225,9 @@
   PackedCmp(declare, FUNC, u32x2, s32x2)                    \
   PackedCmp(declare, FUNC, u32x4, s32x4)                    \
   PackedCmp(declare, FUNC, u64x2, s64x2)                    \
-  /*FPackedCmp(declare, FUNC, u16x2, f16x2) */              \
-  /*FPackedCmp(declare, FUNC, u16x4 f16x4) */               \
-  /*FPackedCmp(declare, FUNC, u16x8, f16x8) */              \
+  FPackedCmp(declare, FUNC, u16x2, f16x2)                   \
+  FPackedCmp(declare, FUNC, u16x4, f16x4)                   \
+  FPackedCmp(declare, FUNC, u16x8, f16x8)                   \
   FPackedCmp(declare, FUNC, u32x2, f32x2)                   \
   FPackedCmp(declare, FUNC, u32x4, f32x4)                   \
   FPackedCmp(declare, FUNC, u64x2, f64x2)                   \
@@ -236,7 +237,8 @@
   MakeCmpTest(FUNC, s64)                                    \
   MakeCmpTest(FUNC, u32)                                    \
   MakeCmpTest(FUNC, u64)                                    \
-  /* MakeCmpTest(FUNC, f16) */                              \
+  MakeCmpTest(FUNC, f16)                                    \
+  MakeCmpTest(FUNC ## u, f16)                               \
   MakeCmpTest(FUNC, f32)                                    \
   MakeCmpTest(FUNC ## u, f32)                               \
   MakeCmpTest(FUNC, f64)                                    \
@@ -259,15 +261,15 @@
   MakePackedCmpTest(FUNC, u32x2, s32x2)                     \
   MakePackedCmpTest(FUNC, u32x4, s32x4)                     \
   MakePackedCmpTest(FUNC, u64x2, s64x2)                     \
-  /* MakePackedCmpTest(FUNC, u16x2, f16x2) */               \
-  /* MakePackedCmpTest(FUNC, u16x4, f16x4) */               \
-  /* MakePackedCmpTest(FUNC, u16x2, f16x2) */               \
+  MakePackedCmpTest(FUNC, u16x2, f16x2)                     \
+  MakePackedCmpTest(FUNC, u16x4, f16x4)                     \
+  MakePackedCmpTest(FUNC, u16x8, f16x8)                     \
   MakePackedCmpTest(FUNC, u32x2, f32x2)                     \
   MakePackedCmpTest(FUNC, u32x4, f32x4)                     \
   MakePackedCmpTest(FUNC, u64x2, f64x2)                     \
-  /* MakePackedCmpTest(FUNC ## u, f16x2) */                 \
-  /* MakePackedCmpTest(FUNC ## u, f16x4) */                 \
-  /* MakePackedCmpTest(FUNC ## u, f16x2) */                 \
+  MakePackedCmpTest(FUNC ## u, u16x2, f16x2)               \
+  MakePackedCmpTest(FUNC ## u, u16x4, f16x4)                \
+  MakePackedCmpTest(FUNC ## u, u16x8, f16x8)                \
   MakePackedCmpTest(FUNC ## u, u32x2, f32x2)                \
   MakePackedCmpTest(FUNC ## u, u32x4, f32x4)                \
   MakePackedCmpTest(FUNC ## u, u64x2, f64x2)
@@ -429,6 +431,33 @@ template<> void initTestVector(std::vector<double> &testVector) {
     testVector.push_back(copysign(testVector[i], -1.0));
 }
 
+template<> void initTestVector(std::vector<f16> &testVector) {
+  testVector.push_back(0.0);
+  testVector.push_back(f16::fromBits(0x7BFF));  // Largest half
+  testVector.push_back(f16::fromBits(0x1400));  // Epsilon
+  testVector.push_back(f16::fromBits(0x0400));  // Smallest normal half
+  testVector.push_back(M_E);
+  testVector.push_back(M_LOG2E);
+  testVector.push_back(M_LN2);
+  testVector.push_back(M_LN10);
+  testVector.push_back(M_PI);
+  testVector.push_back(M_2_SQRTPI);
+  testVector.push_back(M_SQRT2);
+  testVector.push_back(M_SQRT1_2);
+  testVector.push_back(INFINITY);
+  testVector.push_back(NAN);
+  testVector.push_back(f16::fromBits(0x7E00));
+
+  for(f16 h = 1.0; !hsa::brig::isInf(h); h = f32(h) * 2)
+    testVector.push_back(h);
+
+  for(f16 h = 1.0; h != 0; h = f32(h) / 2)
+    testVector.push_back(h);
+
+  for(unsigned i = 0, E = testVector.size(); i != E; ++i)
+    testVector.push_back(copysignf(testVector[i], -1.0f));
+}
+
 template<class T> static const std::vector<T> &getTestVector() {
   static std::vector<T> testVector;
   if(!testVector.size()) initTestVector(testVector);
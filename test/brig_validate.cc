@@ -12,26 +12,77 @@
 #include "brig_module.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <cstring>
 #include <iostream>
 
+using hsa::brig::BrigModule;
+
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog
+            << " [-level=none|structural|full|default] [-time] [-checksum]"
+            << " <input>\n";
+}
+
 int main(int argc, char **argv) {
 
-  if (argc < 2) {
+  BrigModule::ValidationLevel level = BrigModule::DefaultValidation;
+  bool printTime = false;
+  bool printChecksum = false;
+  const char *input = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-level=none")) {
+      level = BrigModule::NoValidation;
+    } else if (!strcmp(argv[i], "-level=structural")) {
+      level = BrigModule::StructuralValidation;
+    } else if (!strcmp(argv[i], "-level=full")) {
+      level = BrigModule::FullValidation;
+    } else if (!strcmp(argv[i], "-level=default")) {
+      level = BrigModule::DefaultValidation;
+    } else if (!strcmp(argv[i], "-time")) {
+      printTime = true;
+    } else if (!strcmp(argv[i], "-checksum")) {
+      printChecksum = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[i];
+    }
+  }
+
+  if (!input) {
     std::cerr << argv[0] << ": Missing input!\n";
+    usage(argv[0]);
     return 1;
   }
 
   hsa::brig::BrigReader *reader =
-    hsa::brig::BrigReader::createBrigReader(argv[1]);
+    hsa::brig::BrigReader::createBrigReader(input);
   if (!reader) {
-    std::cerr << argv[0] << ": File not found: " << argv[1] << "\n";
+    std::cerr << argv[0] << ": File not found: " << input << "\n";
     return 0;
   }
 
-  hsa::brig::BrigModule mod(*reader, &llvm::errs());
+  BrigModule mod(*reader, &llvm::errs(), level);
   if (!mod.isValid())
     std::cerr << argv[0] << ": Input is invalid!\n";
 
+  if (printTime)
+    std::cerr << BrigModule::getValidationLevelName(mod.getValidationLevel())
+              << " validation: " << mod.getValidationTime() << " us\n";
+
+  // The checksum of a fully validated module can be embedded in the input
+  // as a validation stamp, e.g.
+  //   objcopy --add-section .brig_validated=stamp.bin input.brig
+  // so that later loads only need structural validation.
+  if (printChecksum && mod.isValid() &&
+      mod.getValidationLevel() == BrigModule::FullValidation) {
+    uint32_t checksum = reader->getChecksum();
+    std::cout.write(reinterpret_cast<const char *>(&checksum),
+                    sizeof(checksum));
+  }
+
   delete reader;
 
   return 0;
@@ -0,0 +1,154 @@
+//===- hsa_queue_test.cc --------------------------------------------------===//
+//
+//                     The HSA Simulator
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "hsa_queue.h"
+#include "hsacore.h"
+
+#include <vector>
+
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+
+TEST(HSAQueueTest, FullQueue) {
+  EXPECT_FALSE(hsa::createUserModeQueue(0));
+  EXPECT_FALSE(hsa::createUserModeQueue(6));
+
+  hsacore::Queue *queue = hsa::createUserModeQueue(4);
+  EXPECT_TRUE(queue);
+  if (!queue) return;
+  EXPECT_TRUE(queue->isEmpty());
+  EXPECT_FALSE(queue->acquireWriteAddr(hsa::AqlPacketWords - 1));
+
+  // Reserved slots stay in the queue until they are published.
+  uint32_t done[4] = { 0, 0, 0, 0 };
+  uint32_t *slots[4];
+  for (unsigned i = 0; i < 4; ++i) {
+    slots[i] = queue->acquireWriteAddr(hsa::AqlPacketWords);
+    EXPECT_TRUE(slots[i]);
+    if (!slots[i]) return;
+  }
+  EXPECT_FALSE(queue->acquireWriteAddr(hsa::AqlPacketWords));
+  EXPECT_FALSE(queue->getWriteAddr());
+  EXPECT_FALSE(queue->isEmpty());
+
+  // Publish out of order; the packets still complete in slot order.
+  for (unsigned i = 4; i-- > 0; ) {
+    hsa::AqlPacket *packet = (hsa::AqlPacket *) slots[i];
+    packet->type = hsacore::NULL_EVENT;
+    packet->completion = uintptr_t(&done[i]);
+    queue->releaseWriteAddr(slots[i], hsa::AqlPacketWords);
+    if (i) EXPECT_EQ(0U, __atomic_load_n(&done[i], __ATOMIC_ACQUIRE));
+  }
+  queue->waitEmpty();
+  EXPECT_TRUE(queue->isEmpty());
+  for (unsigned i = 0; i < 4; ++i)
+    EXPECT_EQ(uint32_t(hsa::AqlCompleted), done[i]);
+
+  delete queue;
+}
+
+namespace {
+
+enum { Producers = 4, PacketsPerProducer = 1000 };
+
+struct ProducerArgs {
+  hsacore::Queue *queue;
+  uint32_t done[PacketsPerProducer];
+};
+
+void *produce(void *arg) {
+  ProducerArgs *args = static_cast<ProducerArgs *>(arg);
+  hsa::AqlPacket packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.type = hsacore::SYNC;
+  for (unsigned i = 0; i < PacketsPerProducer; ++i) {
+    packet.completion = uintptr_t(&args->done[i]);
+    args->queue->execCommand((uint32_t *) &packet, hsa::AqlPacketWords);
+  }
+  return NULL;
+}
+
+} // namespace
+
+TEST(HSAQueueTest, ConcurrentProducers) {
+  hsacore::Queue *queue = hsa::createUserModeQueue(16);
+  EXPECT_TRUE(queue);
+  if (!queue) return;
+
+  ProducerArgs args[Producers];
+  pthread_t threads[Producers];
+  for (unsigned i = 0; i < Producers; ++i) {
+    args[i].queue = queue;
+    memset(args[i].done, 0, sizeof(args[i].done));
+    pthread_create(&threads[i], NULL, produce, &args[i]);
+  }
+  for (unsigned i = 0; i < Producers; ++i)
+    pthread_join(threads[i], NULL);
+
+  queue->waitEmpty();
+  for (unsigned i = 0; i < Producers; ++i)
+    for (unsigned j = 0; j < PacketsPerProducer; ++j)
+      EXPECT_EQ(uint32_t(hsa::AqlCompleted), args[i].done[j]);
+
+  queue->destroy();
+  EXPECT_FALSE(queue->isValid());
+  delete queue;
+}
+
+TEST(HSAQueueTest, DetachReattach) {
+  hsacore::Queue *queue = hsa::createUserModeQueue(4);
+  EXPECT_TRUE(queue);
+  if (!queue) return;
+  EXPECT_EQ(uint32_t(hsa::MaxUserModeQueues), queue->getMaxQueues());
+  EXPECT_EQ(0U, queue->getVmId());
+
+  hsa::AqlPacket packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.type = hsacore::NULL_EVENT;
+
+  // A detached queue takes packets but does not run them.
+  uint32_t done[2] = { 0, 0 };
+  queue->detach();
+  packet.completion = uintptr_t(&done[0]);
+  queue->execCommand((uint32_t *) &packet, hsa::AqlPacketWords);
+  EXPECT_EQ(0U, __atomic_load_n(&done[0], __ATOMIC_ACQUIRE));
+  EXPECT_FALSE(queue->isEmpty());
+  queue->reattach();
+  queue->waitEmpty();
+  EXPECT_EQ(uint32_t(hsa::AqlCompleted), done[0]);
+
+  // Destroying a detached queue still runs what was published.
+  queue->alter(NULL, 0, 100, 2);
+  queue->detach();
+  packet.completion = uintptr_t(&done[1]);
+  queue->execCommand((uint32_t *) &packet, hsa::AqlPacketWords);
+  queue->destroy();
+  EXPECT_EQ(uint32_t(hsa::AqlCompleted), done[1]);
+  delete queue;
+}
+
+TEST(HSAQueueTest, MaxQueues) {
+  std::vector<hsacore::Queue *> queues;
+  while (hsacore::Queue *queue = hsa::createUserModeQueue(1)) {
+    queues.push_back(queue);
+    if (queues.size() > size_t(hsa::MaxUserModeQueues)) break;
+  }
+  EXPECT_EQ(size_t(hsa::MaxUserModeQueues), queues.size());
+  delete queues.back();
+  queues.pop_back();
+  queues.push_back(hsa::createUserModeQueue(1));
+  EXPECT_TRUE(queues.back());
+  for (unsigned i = 0; i < queues.size(); ++i)
+    delete queues[i];
+}
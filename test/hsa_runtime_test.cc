@@ -91,7 +91,10 @@ TEST(HSARuntimeTest, VectorCopy) {
     hsacommon::vector<hsa::Event *> deps;
     hsa::DispatchEvent* event =
       queue->dispatch(kernel, la, deps, 3, argA, argB, argLength);
-    (void) event;
+    EXPECT_TRUE(event);
+    if (!event) return;
+    EXPECT_EQ(hsa::RSTATUS_SUCCESS, event->wait());
+    EXPECT_EQ(hsa::STATE_COMPLETED, event->getState());
 
 		EXPECT_EQ(a[i], b[i]);
 
@@ -99,3 +102,715 @@ TEST(HSARuntimeTest, VectorCopy) {
     hsaRT->freeGlobalMemory(b);
   }
 }
+
+TEST(HSARuntimeTest, DispatchDependencies) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  llvm::error_code ec =
+    llvm::MemoryBuffer::getFile(XSTR(BIN_PATH) "/VectorCopy.o", file);
+  EXPECT_TRUE(!ec);
+  if (ec) return;
+
+  hsa::Program *program =
+    hsaRT->createProgram(const_cast<char *>(file->getBufferStart()),
+                         file->getBufferSize(),
+                         &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  hsa::Queue *first = devices[0]->createQueue(1);
+  hsa::Queue *second = devices[0]->createQueue(1);
+
+  const int32_t length = 16;
+  float *a = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                   sizeof(float));
+  float *b = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                   sizeof(float));
+  float *c = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                   sizeof(float));
+  for (int32_t j = 0; j < length; ++j) {
+    a[j] = (float) (M_PI * (j + 1));
+    b[j] = 0;
+    c[j] = 0;
+  }
+
+  hsa::KernelArg argA = { a };
+  hsa::KernelArg argB = { b };
+  hsa::KernelArg argC = { c };
+  hsa::KernelArg argLength;
+  argLength.s32value = length;
+
+  hsa::LaunchAttributes la;
+  la.group[0] = length;
+
+  // The second queue copies b to c only after the first copies a to b.
+  hsacommon::vector<hsa::Event *> deps;
+  hsa::DispatchEvent *copyAB =
+    first->dispatch(kernel, la, deps, 3, argA, argB, argLength);
+  deps.push_back(copyAB);
+  hsa::DispatchEvent *copyBC =
+    second->dispatch(kernel, la, deps, 3, argB, argC, argLength);
+  EXPECT_TRUE(copyAB && copyBC);
+  if (!copyAB || !copyBC) return;
+  EXPECT_NE(copyAB->getDispatchId(), copyBC->getDispatchId());
+  EXPECT_EQ(1U, copyBC->getDependencies().size());
+
+  EXPECT_EQ(hsa::RSTATUS_SUCCESS, copyBC->wait(0xFFFFFFFF));
+  EXPECT_EQ(hsa::STATE_COMPLETED, copyAB->getState());
+  EXPECT_EQ(hsa::RSTATUS_SUCCESS, copyAB->wait(0));
+  EXPECT_LE(copyAB->getTimestamp(hsa::STATE_COMPLETED),
+            copyBC->getTimestamp(hsa::STATE_STARTED));
+
+  for (int32_t j = 0; j < length; ++j)
+    EXPECT_EQ(a[j], c[j]);
+
+  second->flush();
+  delete copyBC;
+  delete copyAB;
+  delete second;
+  delete first;
+
+  hsaRT->freeGlobalMemory(a);
+  hsaRT->freeGlobalMemory(b);
+  hsaRT->freeGlobalMemory(c);
+}
+
+TEST(HSARuntimeTest, DispatchGroupSegmentTooLarge) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  llvm::error_code ec =
+    llvm::MemoryBuffer::getFile(XSTR(BIN_PATH) "/VectorCopy.o", file);
+  EXPECT_TRUE(!ec);
+  if (ec) return;
+
+  hsa::Program *program =
+    hsaRT->createProgram(const_cast<char *>(file->getBufferStart()),
+                         file->getBufferSize(),
+                         &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  hsa::Queue *queue = devices[0]->createQueue(1);
+
+  const int32_t length = 16;
+  float a[length], b[length];
+  for (int32_t j = 0; j < length; ++j) {
+    a[j] = (float) (M_PI * (j + 1));
+    b[j] = 0;
+  }
+  hsa::KernelArg argA = { a };
+  hsa::KernelArg argB = { b };
+  hsa::KernelArg argLength;
+  argLength.s32value = length;
+
+  // The dispatch completes without running the kernel.
+  hsa::LaunchAttributes la;
+  la.group[0] = length;
+  la.groupMemorySize = devices[0]->getMaxGroupMemorySize() + 1;
+  hsacommon::vector<hsa::Event *> deps;
+  hsa::DispatchEvent *event =
+    queue->dispatch(kernel, la, deps, 3, argA, argB, argLength);
+  EXPECT_TRUE(event);
+  if (!event) return;
+  EXPECT_EQ(hsa::STATUS_OUT_OF_RESOURCES, event->wait(0xFFFFFFFF));
+  EXPECT_EQ(hsa::STATE_COMPLETED, event->getState());
+  for (int32_t j = 0; j < length; ++j)
+    EXPECT_EQ(0.0f, b[j]);
+
+  delete event;
+  delete queue;
+}
+
+TEST(HSARuntimeTest, DispatchInvalidArguments) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  hsa::Program *copyProgram =
+    hsaRT->createProgramFromFile(XSTR(BIN_PATH) "/VectorCopy.o", &devices);
+  hsa::Program *wideProgram =
+    hsaRT->createProgramFromFile(XSTR(BIN_PATH) "/WideKernarg.o", &devices);
+  EXPECT_TRUE(copyProgram && wideProgram);
+  if (!copyProgram || !wideProgram) return;
+
+  hsa::Kernel *copy =
+    copyProgram->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  hsa::Kernel *wide = wideProgram->compileKernel("&wide", "");
+  EXPECT_TRUE(copy && wide);
+  if (!copy || !wide) return;
+
+  hsa::Queue *queue = devices[0]->createQueue(1);
+
+  const int32_t length = 16;
+  float a[length], b[length];
+  for (int32_t j = 0; j < length; ++j) {
+    a[j] = (float) (M_PI * (j + 1));
+    b[j] = 0;
+  }
+  hsa::KernelArg argA = { a };
+  hsa::KernelArg argB = { b };
+  hsa::LaunchAttributes la;
+  la.group[0] = length;
+  hsacommon::vector<hsa::Event *> deps;
+
+  // The copy kernel has a third parameter, the length.
+  hsa::DispatchEvent *shortList =
+    queue->dispatch(copy, la, deps, 2, argA, argB);
+  // A b128 parameter does not fit in a KernelArg.
+  hsa::DispatchEvent *tooWide =
+    queue->dispatch(wide, la, deps, 2, argA, argB);
+  EXPECT_TRUE(shortList && tooWide);
+  if (!shortList || !tooWide) return;
+  EXPECT_EQ(hsa::STATUS_INVALID_ARGUMENT, shortList->wait(0xFFFFFFFF));
+  EXPECT_EQ(hsa::STATUS_INVALID_ARGUMENT, tooWide->wait(0xFFFFFFFF));
+
+  // A batch runs none of its kernels if any has bad arguments.
+  hsa::KernelArg args[2][3] = { { argA, argB }, { argA, argB } };
+  args[0][2].s32value = length;
+  hsa::BatchEntry entries[2];
+  for (unsigned i = 0; i < 2; ++i) {
+    entries[i].kernel = i ? wide : copy;
+    entries[i].launchAttr.group[0] = length;
+    entries[i].args = args[i];
+    entries[i].numArgs = i ? 2 : 3;
+  }
+  hsa::Event *batch = queue->dispatchBatch(entries, 2, deps);
+  EXPECT_TRUE(batch);
+  if (batch) {
+    EXPECT_EQ(hsa::STATUS_INVALID_ARGUMENT, batch->wait(0xFFFFFFFF));
+    delete batch;
+  }
+  for (int32_t j = 0; j < length; ++j)
+    EXPECT_EQ(0.0f, b[j]);
+
+  delete tooWide;
+  delete shortList;
+  delete queue;
+}
+
+TEST(HSARuntimeTest, GroupMemoryAllocation) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  hsa::Program *program =
+    hsaRT->createProgramFromFile(XSTR(BIN_PATH) "/VectorCopy.o", &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  // The kernel has no group variables, so the first allocation is at
+  // offset 0 of the segment, and still not NULL.
+  const char *base = (const char *) kernel->getGroupMemoryBase();
+  EXPECT_TRUE(base);
+  char *first = (char *) kernel->allocateGroupMemory(64, 16);
+  EXPECT_EQ(base, first);
+  char *second = (char *) kernel->allocateGroupMemory(32, 64);
+  EXPECT_EQ(base + 64, second);
+
+  // A freed allocation's space is reused, and gaps are filled first fit.
+  kernel->freeGroupMemory(first);
+  kernel->freeGroupMemory(NULL);
+  char *third = (char *) kernel->allocateGroupMemory(48, 16);
+  EXPECT_EQ(base, third);
+  const size_t max = devices[0]->getMaxGroupMemorySize();
+  char *rest = (char *) kernel->allocateGroupMemory(max - 96, 1);
+  EXPECT_EQ(base + 96, rest);
+  char *gap = (char *) kernel->allocateGroupMemory(16, 16);
+  EXPECT_EQ(base + 48, gap);
+
+  // Nothing fits past the end of the segment.
+  EXPECT_FALSE(kernel->allocateGroupMemory(1, 1));
+  kernel->freeGroupMemory(rest);
+  EXPECT_FALSE(kernel->allocateGroupMemory(max - 95, 1));
+  kernel->freeGroupMemory(gap);
+  kernel->freeGroupMemory(second);
+  kernel->freeGroupMemory(third);
+  EXPECT_FALSE(kernel->allocateGroupMemory(max + 1, 1));
+  char *whole = (char *) kernel->allocateGroupMemory(max, 1);
+  EXPECT_EQ(base, whole);
+  kernel->freeGroupMemory(whole);
+}
+
+TEST(HSARuntimeTest, DevicesPartitionProcessors) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+  EXPECT_EQ(devices.size(), hsaRT->getDeviceCount());
+
+  for (unsigned i = 0; i < devices.size(); ++i) {
+    EXPECT_LT(0U, devices[i]->getComputeUnitsCount());
+    EXPECT_LT(0U, devices[i]->getMemoryDescriptors().size());
+
+    float *buffer = (float *)
+      devices[i]->allocateGlobalMemory(4 << 20, sizeof(float),
+                                       hsacommon::HEAP_TYPE_SYSTEM, 0);
+    EXPECT_TRUE(buffer);
+    if (!buffer) continue;
+    buffer[0] = 1.0f;
+    devices[i]->freeGlobalMemory(buffer);
+  }
+}
+
+TEST(HSARuntimeTest, DispatchBatch) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  llvm::error_code ec =
+    llvm::MemoryBuffer::getFile(XSTR(BIN_PATH) "/VectorCopy.o", file);
+  EXPECT_TRUE(!ec);
+  if (ec) return;
+
+  hsa::Program *program =
+    hsaRT->createProgram(const_cast<char *>(file->getBufferStart()),
+                         file->getBufferSize(),
+                         &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  hsa::Queue *queue = devices[0]->createQueue(1);
+
+  // A pipeline that copies the first buffer down a chain of buffers, and a
+  // kernel that copies the first buffer to the last one alongside it.
+  enum { Stages = 8 };
+  const int32_t length = 64;
+  float *buffers[Stages + 2];
+  for (unsigned i = 0; i < Stages + 2; ++i) {
+    buffers[i] = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                       sizeof(float));
+    for (int32_t j = 0; j < length; ++j)
+      buffers[i][j] = i ? 0 : (float) (M_PI * (j + 1));
+  }
+
+  hsa::KernelArg args[Stages + 1][3];
+  hsa::BatchEntry entries[Stages + 1];
+  for (unsigned i = 0; i <= Stages; ++i) {
+    args[i][0].addr = buffers[i < Stages ? i : 0];
+    args[i][1].addr = buffers[i + 1];
+    args[i][2].s32value = length;
+    entries[i].kernel = kernel;
+    entries[i].launchAttr.grid[0] = 4;
+    entries[i].launchAttr.group[0] = length / 4;
+    entries[i].args = args[i];
+    entries[i].numArgs = 3;
+  }
+  entries[Stages].barrier = false;
+
+  hsacommon::vector<hsa::Event *> deps;
+  hsa::Event *batch = queue->dispatchBatch(entries, Stages + 1, deps);
+  EXPECT_TRUE(batch);
+  if (!batch) return;
+  EXPECT_EQ(hsa::RSTATUS_SUCCESS, batch->wait(0xFFFFFFFF));
+
+  for (int32_t j = 0; j < length; ++j) {
+    EXPECT_EQ(buffers[0][j], buffers[Stages][j]);
+    EXPECT_EQ(buffers[0][j], buffers[Stages + 1][j]);
+  }
+
+  // A kernel whose group segment is too large fails the batch, and stops
+  // it before the kernels after it.
+  for (int32_t j = 0; j < length; ++j)
+    buffers[Stages][j] = 0;
+  entries[Stages - 1].launchAttr.groupMemorySize =
+    devices[0]->getMaxGroupMemorySize() + 1;
+  hsa::Event *failed = queue->dispatchBatch(entries, Stages, deps);
+  EXPECT_TRUE(failed);
+  if (!failed) return;
+  EXPECT_EQ(hsa::STATUS_OUT_OF_RESOURCES, failed->wait(0xFFFFFFFF));
+  for (int32_t j = 0; j < length; ++j)
+    EXPECT_EQ(0.0f, buffers[Stages][j]);
+
+  delete failed;
+  delete batch;
+  delete queue;
+  for (unsigned i = 0; i < Stages + 2; ++i)
+    hsaRT->freeGlobalMemory(buffers[i]);
+}
+
+TEST(HSARuntimeTest, DispatchBatchFusion) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  llvm::error_code ec =
+    llvm::MemoryBuffer::getFile(XSTR(BIN_PATH) "/VectorCopy.o", file);
+  EXPECT_TRUE(!ec);
+  if (ec) return;
+
+  hsa::Program *program =
+    hsaRT->createProgram(const_cast<char *>(file->getBufferStart()),
+                         file->getBufferSize(),
+                         &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  hsa::Queue *queue = devices[0]->createQueue(1);
+  setenv("SIMFUSE", "1", 1);
+
+  // Copies the first buffer down a chain of buffers. With a shift, the
+  // third stage writes one element further on, so that each work-item of
+  // the last stage reads what another work-item wrote, and the stages must
+  // not be fused.
+  enum { Stages = 4 };
+  const int32_t length = 64;
+  for (unsigned shift = 0; shift < 2; ++shift) {
+    float *buffers[Stages + 1];
+    for (unsigned i = 0; i <= Stages; ++i) {
+      buffers[i] =
+        (float *) hsaRT->allocateGlobalMemory(sizeof(float[length + 1]),
+                                              sizeof(float));
+      for (int32_t j = 0; j <= length; ++j)
+        buffers[i][j] = i ? 0 : (float) (M_PI * (j + 1));
+    }
+
+    hsa::KernelArg args[Stages][3];
+    hsa::BatchEntry entries[Stages];
+    for (unsigned i = 0; i < Stages; ++i) {
+      args[i][0].addr = buffers[i];
+      args[i][1].addr = buffers[i + 1] + (i == 2 ? shift : 0);
+      args[i][2].s32value = length;
+      entries[i].kernel = kernel;
+      entries[i].launchAttr.grid[0] = 4;
+      entries[i].launchAttr.group[0] = length / 4;
+      entries[i].args = args[i];
+      entries[i].numArgs = 3;
+    }
+
+    hsacommon::vector<hsa::Event *> deps;
+    hsa::Event *batch = queue->dispatchBatch(entries, Stages, deps);
+    EXPECT_TRUE(batch);
+    if (!batch) break;
+    EXPECT_EQ(hsa::RSTATUS_SUCCESS, batch->wait(0xFFFFFFFF));
+
+    EXPECT_EQ(shift ? 0 : buffers[0][0], buffers[Stages][0]);
+    for (int32_t j = 1; j < length; ++j)
+      EXPECT_EQ(buffers[0][j - shift], buffers[Stages][j]);
+
+    delete batch;
+    for (unsigned i = 0; i <= Stages; ++i)
+      hsaRT->freeGlobalMemory(buffers[i]);
+  }
+
+  unsetenv("SIMFUSE");
+  delete queue;
+}
+
+TEST(HSARuntimeTest, DispatchBatchFusionBarrier) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  llvm::error_code ec =
+    llvm::MemoryBuffer::getFile(XSTR(BIN_PATH) "/VectorCopy.o", file);
+  EXPECT_TRUE(!ec);
+  if (ec) return;
+
+  hsa::Program *program =
+    hsaRT->createProgram(const_cast<char *>(file->getBufferStart()),
+                         file->getBufferSize(),
+                         &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  hsa::Queue *queue = devices[0]->createQueue(1);
+  setenv("SIMFUSE", "1", 1);
+
+  // The first kernel copies a to b over a grid of its own. The second
+  // copies c to e and may start before the first is done. The third has a
+  // barrier and copies b to d. The last two share a grid, so they may be
+  // fused, but the fused kernel must still wait for the first.
+  const int32_t length = 256;
+  float *buffers[5];
+  for (unsigned i = 0; i < 5; ++i) {
+    buffers[i] = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                       sizeof(float));
+    for (int32_t j = 0; j < length; ++j)
+      buffers[i][j] = i < 2 ? (float) (M_PI * (i + 1) * (j + 1)) : 0;
+  }
+  float *a = buffers[0], *c = buffers[1];
+  float *b = buffers[2], *d = buffers[3], *e = buffers[4];
+
+  hsa::KernelArg args[3][3];
+  hsa::BatchEntry entries[3];
+  float *copies[3][2] = { { a, b }, { c, e }, { b, d } };
+  for (unsigned i = 0; i < 3; ++i) {
+    args[i][0].addr = copies[i][0];
+    args[i][1].addr = copies[i][1];
+    args[i][2].s32value = length;
+    entries[i].kernel = kernel;
+    entries[i].launchAttr.grid[0] = i ? length / 16 : 1;
+    entries[i].launchAttr.group[0] = i ? 16 : length;
+    entries[i].args = args[i];
+    entries[i].numArgs = 3;
+  }
+  entries[1].barrier = false;
+
+  hsacommon::vector<hsa::Event *> deps;
+  hsa::Event *batch = queue->dispatchBatch(entries, 3, deps);
+  EXPECT_TRUE(batch);
+  if (batch) {
+    EXPECT_EQ(hsa::RSTATUS_SUCCESS, batch->wait(0xFFFFFFFF));
+    for (int32_t j = 0; j < length; ++j) {
+      EXPECT_EQ(a[j], d[j]);
+      EXPECT_EQ(c[j], e[j]);
+    }
+    delete batch;
+  }
+
+  unsetenv("SIMFUSE");
+  delete queue;
+  for (unsigned i = 0; i < 5; ++i)
+    hsaRT->freeGlobalMemory(buffers[i]);
+}
+
+// Copies length floats from src to dst in work-groups of 16.
+static hsa::DispatchEvent *dispatchCopy(hsa::Queue *queue, hsa::Kernel *kernel,
+                                        float *src, float *dst,
+                                        int32_t length) {
+  hsa::KernelArg argSrc = { src };
+  hsa::KernelArg argDst = { dst };
+  hsa::KernelArg argLength;
+  argLength.s32value = length;
+  hsa::LaunchAttributes la;
+  la.grid[0] = length / 16;
+  la.group[0] = 16;
+  hsacommon::vector<hsa::Event *> deps;
+  return queue->dispatch(kernel, la, deps, 3, argSrc, argDst, argLength);
+}
+
+TEST(HSARuntimeTest, ConcurrentQueues) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  // A long batch on one queue shares the device with a copy on a light
+  // queue and a copy on a heavy one. Each queue runs its own program, so
+  // each has an engine of its own, compiled by a first dispatch before the
+  // queues compete.
+  enum { BatchQueue, LightQueue, HeavyQueue, Queues };
+  const uint32_t weights[Queues] = { 1, 1, 8 };
+  hsa::Queue *queues[Queues];
+  hsa::Kernel *kernels[Queues];
+  const int32_t length = 1 << 16;
+  float *src = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                     sizeof(float));
+  float *dsts[Queues];
+  for (unsigned q = 0; q < Queues; ++q) {
+    dsts[q] = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                    sizeof(float));
+    memset(dsts[q], 0, sizeof(float[length]));
+  }
+  for (int32_t j = 0; j < length; ++j)
+    src[j] = (float) (M_PI * (j + 1));
+
+  for (unsigned q = 0; q < Queues; ++q) {
+    hsa::Program *program =
+      hsaRT->createProgramFromFile(XSTR(BIN_PATH) "/VectorCopy.o", &devices);
+    EXPECT_TRUE(program);
+    if (!program) return;
+
+    kernels[q] = program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+    EXPECT_TRUE(kernels[q]);
+    if (!kernels[q]) return;
+
+    queues[q] = devices[0]->createQueue(1);
+    queues[q]->setWeight(weights[q]);
+    hsa::DispatchEvent *warm =
+      dispatchCopy(queues[q], kernels[q], src, dsts[q], 16);
+    EXPECT_TRUE(warm);
+    if (!warm) return;
+    EXPECT_EQ(hsa::RSTATUS_SUCCESS, warm->wait(0xFFFFFFFF));
+    delete warm;
+  }
+
+  // The batch copies back and forth between two buffers, in work-groups
+  // of 4, many times over what each copy runs.
+  enum { Stages = 64 };
+  float *buffers[2] = { dsts[BatchQueue], src };
+  hsa::KernelArg args[Stages][3];
+  hsa::BatchEntry entries[Stages];
+  for (unsigned i = 0; i < Stages; ++i) {
+    args[i][0].addr = buffers[(i + 1) % 2];
+    args[i][1].addr = buffers[i % 2];
+    args[i][2].s32value = length;
+    entries[i].kernel = kernels[BatchQueue];
+    entries[i].launchAttr.grid[0] = length / 4;
+    entries[i].launchAttr.group[0] = 4;
+    entries[i].args = args[i];
+    entries[i].numArgs = 3;
+  }
+
+  hsacommon::vector<hsa::Event *> deps;
+  hsa::Event *batch = queues[BatchQueue]->dispatchBatch(entries, Stages, deps);
+  float *copySrc = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                         sizeof(float));
+  for (int32_t j = 0; j < length; ++j)
+    copySrc[j] = (float) (j + 1);
+
+  // The light copy is dispatched first; the heavy one still finishes
+  // first, since it gets eight grants of the device for each of the
+  // light one's.
+  hsa::DispatchEvent *light =
+    dispatchCopy(queues[LightQueue], kernels[LightQueue], copySrc,
+                 dsts[LightQueue], length);
+  hsa::DispatchEvent *heavy =
+    dispatchCopy(queues[HeavyQueue], kernels[HeavyQueue], copySrc,
+                 dsts[HeavyQueue], length);
+  EXPECT_TRUE(batch && light && heavy);
+  if (!batch || !light || !heavy) return;
+
+  EXPECT_EQ(hsa::RSTATUS_SUCCESS, heavy->wait(0xFFFFFFFF));
+  EXPECT_EQ(hsa::RSTATUS_SUCCESS, light->wait(0xFFFFFFFF));
+  // Both copies ran while the batch did.
+  EXPECT_EQ(hsa::RSTATUS_TIMEOUT, batch->wait(0));
+  EXPECT_LT(heavy->getTimestamp(hsa::STATE_COMPLETED),
+            light->getTimestamp(hsa::STATE_COMPLETED));
+  EXPECT_EQ(hsa::RSTATUS_SUCCESS, batch->wait(0xFFFFFFFF));
+
+  // An even number of stages leaves the batch's data where it started.
+  for (int32_t j = 0; j < length; ++j) {
+    EXPECT_EQ((float) (M_PI * (j + 1)), src[j]);
+    EXPECT_EQ(copySrc[j], dsts[LightQueue][j]);
+    EXPECT_EQ(copySrc[j], dsts[HeavyQueue][j]);
+  }
+
+  delete heavy;
+  delete light;
+  delete batch;
+  for (unsigned q = 0; q < Queues; ++q) {
+    delete queues[q];
+    hsaRT->freeGlobalMemory(dsts[q]);
+  }
+  hsaRT->freeGlobalMemory(copySrc);
+  hsaRT->freeGlobalMemory(src);
+}
+
+TEST(HSARuntimeTest, DispatchCancel) {
+  hsa::RuntimeApi *hsaRT = hsa::getRuntime();
+  hsa::vector<hsa::Device *> devices = hsaRT->getDevices();
+
+  llvm::OwningPtr<llvm::MemoryBuffer> file;
+  llvm::error_code ec =
+    llvm::MemoryBuffer::getFile(XSTR(BIN_PATH) "/VectorCopy.o", file);
+  EXPECT_TRUE(!ec);
+  if (ec) return;
+
+  hsa::Program *program =
+    hsaRT->createProgram(const_cast<char *>(file->getBufferStart()),
+                         file->getBufferSize(),
+                         &devices);
+  EXPECT_TRUE(program);
+  if (!program) return;
+
+  hsa::Kernel *kernel =
+    program->compileKernel("&__OpenCL_vec_copy_kernel", "");
+  EXPECT_TRUE(kernel);
+  if (!kernel) return;
+
+  hsa::Queue *first = devices[0]->createQueue(1);
+  hsa::Queue *second = devices[0]->createQueue(1);
+
+  const int32_t length = 1 << 16;
+  float *buffers[3];
+  for (unsigned i = 0; i < 3; ++i) {
+    buffers[i] = (float *) hsaRT->allocateGlobalMemory(sizeof(float[length]),
+                                                       sizeof(float));
+    for (int32_t j = 0; j < length; ++j)
+      buffers[i][j] = i ? 0 : (float) (M_PI * (j + 1));
+  }
+  float *a = buffers[0], *b = buffers[1], *c = buffers[2];
+
+  // A long batch copies back and forth between a and b on the first queue.
+  enum { Stages = 64 };
+  hsa::KernelArg args[Stages][3];
+  hsa::BatchEntry entries[Stages];
+  for (unsigned i = 0; i < Stages; ++i) {
+    args[i][0].addr = i % 2 ? b : a;
+    args[i][1].addr = i % 2 ? a : b;
+    args[i][2].s32value = length;
+    entries[i].kernel = kernel;
+    entries[i].launchAttr.grid[0] = length / 4;
+    entries[i].launchAttr.group[0] = 4;
+    entries[i].args = args[i];
+    entries[i].numArgs = 3;
+  }
+  hsacommon::vector<hsa::Event *> deps;
+  hsa::Event *batch = first->dispatchBatch(entries, Stages, deps);
+
+  // The second queue copies a to c once the batch is done, and again after
+  // that. Both are cancelled before they can start.
+  hsa::KernelArg argA = { a };
+  hsa::KernelArg argC = { c };
+  hsa::KernelArg argLength;
+  argLength.s32value = length;
+  hsa::LaunchAttributes la;
+  la.grid[0] = length / 16;
+  la.group[0] = 16;
+  deps.push_back(batch);
+  hsa::DispatchEvent *blocked =
+    second->dispatch(kernel, la, deps, 3, argA, argC, argLength);
+  deps.clear();
+  hsa::DispatchEvent *queued =
+    second->dispatch(kernel, la, deps, 3, argA, argC, argLength);
+  EXPECT_TRUE(batch && blocked && queued);
+  if (!batch || !blocked || !queued) return;
+  second->cancel();
+
+  // The batch is cancelled while it runs.
+  first->cancel();
+  EXPECT_EQ(hsa::STATUS_CANCELLED, batch->wait(0xFFFFFFFF));
+  EXPECT_EQ(hsa::STATUS_CANCELLED, blocked->wait(0xFFFFFFFF));
+  EXPECT_EQ(hsa::STATUS_CANCELLED, queued->wait(0xFFFFFFFF));
+  EXPECT_EQ(0U, blocked->getTimestamp(hsa::STATE_STARTED));
+  for (int32_t j = 0; j < length; ++j)
+    EXPECT_EQ(0, c[j]);
+
+  // Later dispatches run as usual.
+  hsa::DispatchEvent *copy =
+    first->dispatch(kernel, la, deps, 3, argA, argC, argLength);
+  EXPECT_TRUE(copy);
+  if (copy) {
+    EXPECT_EQ(hsa::RSTATUS_SUCCESS, copy->wait(0xFFFFFFFF));
+    for (int32_t j = 0; j < length; ++j)
+      EXPECT_EQ(a[j], c[j]);
+    delete copy;
+  }
+
+  delete queued;
+  delete blocked;
+  delete batch;
+  delete second;
+  delete first;
+  for (unsigned i = 0; i < 3; ++i)
+    hsaRT->freeGlobalMemory(buffers[i]);
+}